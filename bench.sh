@@ -0,0 +1,171 @@
+#!/usr/bin/env bash
+# End-to-end benchmark of the four echo servers
+# Usage: bench.sh [BIN_DIR] [RESULTS_FILE] (normally run by `make bench`, which builds BIN_DIR with optimizations)
+#
+# Every server is started in turn and driven by the load generator of a client:
+#   closed  stream servers, a new request as soon as a reply arrives (maximum throughput)
+#   unpaced UDP server and the Unix seqpacket/dgram types, messages sent as fast as the socket accepts them (maximum
+#           throughput, loss counted)
+#   rate    every server at the same offered load of BENCH_RATE messages per second (latency at equal load)
+# over every payload size and concurrency level. Concurrency is the number of connections for the multi-connection
+# server, the pipeline depth on the single connection of the single-connection servers and the sendmmsg() batch size
+# for UDP and the Unix message types. The UDP server echoes datagrams of up to 1 KB, larger payloads are skipped for
+# it. The Unix server runs once per socket type (transport unix-stream, unix-seqpacket, unix-dgram), the message types
+# with 64 KB message buffers so that every payload fits; their rate runs compare the three types at equal load.
+#
+# The results file has one line per run with these columns:
+#   transport, server, mode, payload, concurrency, target_rate  the run (target_rate 0 for closed and unpaced)
+#   requests, elapsed_s, throughput_rps, throughput_mbps         echoes received, duration, echoes per second, MB/s
+#   p50_us, p90_us, p99_us, p999_us, max_us                      round-trip latency percentiles in microseconds
+#   errors                                                       failed connections (stream) or lost datagrams (UDP)
+#
+# Settings (environment): BENCH_DURATION seconds per run (default 3), BENCH_PAYLOADS (default "64 512 16384"),
+# BENCH_CONCURRENCY (default "1 16 64"), BENCH_RATE (default 20000), BENCH_MULTI_ARGS server options of the
+# multi-connection server (default "-m epoll"), BENCH_UDP_ARGS server options of the UDP server (default "-b 64").
+
+set -u
+
+BIN_DIR=${1:-bin/bench}
+RESULTS=${2:-$BIN_DIR/results.csv}
+DURATION=${BENCH_DURATION:-3}
+PAYLOADS=${BENCH_PAYLOADS:-"64 512 16384"}
+CONCURRENCY=${BENCH_CONCURRENCY:-"1 16 64"}
+RATE=${BENCH_RATE:-20000}
+MULTI_ARGS=${BENCH_MULTI_ARGS:-"-m epoll"}
+UDP_ARGS=${BENCH_UDP_ARGS:-"-b 64"}
+UDP_MAX_PAYLOAD=1023          # The UDP server receives into a 1 KB buffer
+UNIX_SOCKET_FILE=/tmp/echo_server.sock
+MAX_THREADS=4                 # Load generator threads of the multi-connection runs
+
+TCP_SINGLE=single-connection-tcp-echo-server
+TCP_MULTI=multi-connection-tcp-echo-server
+UNIX_SINGLE=single-connection-unix-socket-echo-server
+UDP=udp-echo-server
+
+# Per-message logging would measure the terminal, not the transport. The metrics endpoint stays off as well.
+export LOG_LEVEL=error
+export METRICS_SOCKET=off
+
+server_pid=
+
+# Start a server and wait until it is ready
+start_server() {
+    local name=$1
+    shift
+    [ "$name" = "$UNIX_SINGLE" ] && rm -f "$UNIX_SOCKET_FILE"
+    "$BIN_DIR/$name-server" "$@" >/dev/null 2>&1 &
+    server_pid=$!
+    sleep 0.5
+    if ! kill -0 "$server_pid" 2>/dev/null; then
+        echo "error: $name-server did not start, aborting..." >&2
+        exit 1
+    fi
+}
+
+# Stop the running server, forcefully if it does not exit within 2 seconds
+stop_server() {
+    kill "$server_pid" 2>/dev/null
+    for _ in $(seq 20); do
+        kill -0 "$server_pid" 2>/dev/null || break
+        sleep 0.1
+    done
+    kill -9 "$server_pid" 2>/dev/null
+    wait "$server_pid" 2>/dev/null
+    rm -f "$UNIX_SOCKET_FILE"
+}
+
+# Run one client invocation and append its result line
+# run TRANSPORT SERVER MODE PAYLOAD CONCURRENCY TARGET_RATE CLIENT_ARGS...
+run() {
+    local prefix="$1,$2,$3,$4,$5,$6" client="$BIN_DIR/$2-client" line
+    # The single-connection TCP client has no load generator, the multi-connection one talks to the same port
+    [ "$2" = "$TCP_SINGLE" ] && client="$BIN_DIR/$TCP_MULTI-client"
+    shift 6
+    echo "  $prefix" >&2
+    if line=$("$client" "$@" --csv) && [ -n "$line" ]; then
+        echo "$prefix,$line" >>"$RESULTS"
+    else
+        echo "warning: run $prefix failed, no result recorded" >&2
+    fi
+}
+
+threads_for() {
+    [ "$1" -lt "$MAX_THREADS" ] && echo "$1" || echo "$MAX_THREADS"
+}
+
+for binary in $TCP_SINGLE $TCP_MULTI $UNIX_SINGLE $UDP; do
+    if [ ! -x "$BIN_DIR/$binary-server" ] || [ ! -x "$BIN_DIR/$binary-client" ]; then
+        echo "error: $BIN_DIR/$binary-server or -client not found, run 'make bench', aborting..." >&2
+        exit 1
+    fi
+done
+trap '[ -n "$server_pid" ] && stop_server' EXIT
+
+mkdir -p "$(dirname "$RESULTS")"
+echo "transport,server,mode,payload,concurrency,target_rate,requests,elapsed_s,throughput_rps,throughput_mbps,"\
+"p50_us,p90_us,p99_us,p999_us,max_us,errors" >"$RESULTS"
+
+echo "tcp: $TCP_SINGLE" >&2
+start_server $TCP_SINGLE
+for payload in $PAYLOADS; do
+    for concurrency in $CONCURRENCY; do
+        run tcp $TCP_SINGLE closed "$payload" "$concurrency" 0 -b -c 1 -p "$concurrency" -s "$payload" -d "$DURATION"
+        run tcp $TCP_SINGLE rate "$payload" "$concurrency" "$RATE" -b -c 1 -p "$concurrency" -s "$payload" -d "$DURATION" -r "$RATE"
+    done
+done
+stop_server
+
+echo "tcp: $TCP_MULTI $MULTI_ARGS" >&2
+# shellcheck disable=SC2086 # server options are a word list
+start_server $TCP_MULTI $MULTI_ARGS
+for payload in $PAYLOADS; do
+    for concurrency in $CONCURRENCY; do
+        threads=$(threads_for "$concurrency")
+        run tcp $TCP_MULTI closed "$payload" "$concurrency" 0 -b -c "$concurrency" -t "$threads" -s "$payload" -d "$DURATION"
+        run tcp $TCP_MULTI rate "$payload" "$concurrency" "$RATE" -b -c "$concurrency" -t "$threads" -s "$payload" -d "$DURATION" -r "$RATE"
+    done
+done
+stop_server
+
+echo "unix-stream: $UNIX_SINGLE" >&2
+start_server $UNIX_SINGLE
+for payload in $PAYLOADS; do
+    for concurrency in $CONCURRENCY; do
+        run unix-stream $UNIX_SINGLE closed "$payload" "$concurrency" 0 -b -p "$concurrency" -s "$payload" -d "$DURATION"
+        run unix-stream $UNIX_SINGLE rate "$payload" "$concurrency" "$RATE" -b -p "$concurrency" -s "$payload" -d "$DURATION" -r "$RATE"
+    done
+done
+stop_server
+
+# The message types keep the boundaries, the client drives them with the open-loop generator of the UDP client
+for type in seqpacket dgram; do
+    echo "unix-$type: $UNIX_SINGLE -t $type" >&2
+    start_server $UNIX_SINGLE -t "$type" -o buffer_size=64K
+    for payload in $PAYLOADS; do
+        for concurrency in $CONCURRENCY; do
+            run "unix-$type" $UNIX_SINGLE unpaced "$payload" "$concurrency" 0 -t "$type" -b -p "$concurrency" -s "$payload" -d "$DURATION"
+            run "unix-$type" $UNIX_SINGLE rate "$payload" "$concurrency" "$RATE" -t "$type" -b -p "$concurrency" -s "$payload" -d "$DURATION" \
+                -r "$RATE"
+        done
+    done
+    stop_server
+done
+
+echo "udp: $UDP $UDP_ARGS" >&2
+# shellcheck disable=SC2086
+start_server $UDP $UDP_ARGS
+for payload in $PAYLOADS; do
+    if [ "$payload" -gt "$UDP_MAX_PAYLOAD" ]; then
+        echo "  udp payload $payload skipped (larger than $UDP_MAX_PAYLOAD bytes)" >&2
+        continue
+    fi
+    for concurrency in $CONCURRENCY; do
+        run udp $UDP unpaced "$payload" "$concurrency" 0 -f -r 0 -B "$concurrency" -s "$payload" -d "$DURATION"
+        run udp $UDP rate "$payload" "$concurrency" "$RATE" -f -r "$RATE" -B "$concurrency" -s "$payload" -d "$DURATION"
+    done
+done
+stop_server
+server_pid=
+
+echo "results written to $RESULTS" >&2
+column -s, -t "$RESULTS" 2>/dev/null || cat "$RESULTS"
@@ -0,0 +1,74 @@
+#define _GNU_SOURCE
+
+#include "busypoll.h"
+#include "metrics.h"
+
+#include <errno.h>
+
+//* Receive from a blocking socket, spinning with MSG_DONTWAIT for budget nanoseconds first
+ssize_t busypoll_recvfrom(int fd, void* buffer, size_t len, struct sockaddr* addr, socklen_t* addr_len, uint64_t budget) {
+    uint64_t deadline;
+    ssize_t received;
+
+    if (budget == 0)
+        return recvfrom(fd, buffer, len, 0, addr, addr_len);
+
+    deadline = metrics_now() + budget;
+    do {
+        if ((received = recvfrom(fd, buffer, len, MSG_DONTWAIT, addr, addr_len)) >= 0) {
+            metrics_add(METRICS_BUSY_POLL_HITS, 1);
+            return received;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            return -1;
+    } while (metrics_now() < deadline);
+
+    metrics_add(METRICS_BUSY_POLL_SLEEPS, 1);
+    return recvfrom(fd, buffer, len, 0, addr, addr_len);
+}
+
+//* Receive a batch of datagrams, spinning with MSG_DONTWAIT for budget nanoseconds first
+//- The spinning call takes whatever is queued, like MSG_WAITFORONE does once the first datagram is there.
+int busypoll_recvmmsg(int fd, struct mmsghdr* msgs, unsigned count, uint64_t budget) {
+    uint64_t deadline;
+    int received;
+
+    if (budget == 0)
+        return recvmmsg(fd, msgs, count, MSG_WAITFORONE, NULL);
+
+    deadline = metrics_now() + budget;
+    do {
+        if ((received = recvmmsg(fd, msgs, count, MSG_DONTWAIT, NULL)) >= 0) {
+            metrics_add(METRICS_BUSY_POLL_HITS, 1);
+            return received;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            return -1;
+    } while (metrics_now() < deadline);
+
+    metrics_add(METRICS_BUSY_POLL_SLEEPS, 1);
+    return recvmmsg(fd, msgs, count, MSG_WAITFORONE, NULL);
+}
+
+//* Wait for events, polling the epoll instance without a timeout for budget nanoseconds first
+//- The polls use the same signal mask as the blocking wait, so a signal the caller only lets through while it waits
+//- interrupts the spin too. A wait that must not block does not spin either.
+int busypoll_epoll_wait(int epoll_fd, struct epoll_event* events, int max_events, int timeout, const sigset_t* mask, uint64_t budget) {
+    uint64_t deadline;
+    int ready;
+
+    if (budget == 0 || timeout == 0)
+        return epoll_pwait(epoll_fd, events, max_events, timeout, mask);
+
+    deadline = metrics_now() + budget;
+    do {
+        if ((ready = epoll_pwait(epoll_fd, events, max_events, 0, mask)) != 0) {
+            if (ready > 0)
+                metrics_add(METRICS_BUSY_POLL_HITS, 1);
+            return ready;
+        }
+    } while (metrics_now() < deadline);
+
+    metrics_add(METRICS_BUSY_POLL_SLEEPS, 1);
+    return epoll_pwait(epoll_fd, events, max_events, timeout, mask);
+}
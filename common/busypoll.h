@@ -0,0 +1,30 @@
+#ifndef COMMON_BUSYPOLL_H
+#define COMMON_BUSYPOLL_H
+
+#include <signal.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+struct mmsghdr;  //- Declared by <sys/socket.h> with _GNU_SOURCE only
+
+//* Busy-polling receive
+//- A blocking receive puts the thread to sleep when nothing is queued. Waking it up when data arrives costs a
+//- scheduler round trip and, on an idle core, the exit from a power-saving state: several microseconds that show up
+//- in the tail latency. A busy-polling receive retries a non-blocking call for up to budget nanoseconds first and only
+//- blocks once the budget is used up, so a message that arrives within the budget is taken by a running thread.
+//- Every wait that spins counts as a hit if it got data while spinning and as a sleep if it had to block (metrics
+//- echo_busy_poll_hits_total and echo_busy_poll_sleeps_total). A low hit ratio means the spinning burns CPU for
+//- nothing: the traffic is too sparse for the budget.
+//- The spin runs in user space and works on any socket. SO_BUSY_POLL and SO_PREFER_BUSY_POLL (see common/tuning.h)
+//- make the kernel poll the device queue of the NIC inside each of these calls as well, which needs a NAPI driver and
+//- does nothing on loopback.
+//- A budget of 0 turns spinning off, the calls block at once and count nothing.
+//? busypoll_recvfrom() returns like a blocking recvfrom(), busypoll_recvmmsg() like recvmmsg() with MSG_WAITFORONE,
+//? busypoll_epoll_wait() like epoll_pwait(), the timeout (milliseconds, -1 for none) starts once the spin is over.
+ssize_t busypoll_recvfrom(int fd, void* buffer, size_t len, struct sockaddr* addr, socklen_t* addr_len, uint64_t budget);
+int busypoll_recvmmsg(int fd, struct mmsghdr* msgs, unsigned count, uint64_t budget);
+int busypoll_epoll_wait(int epoll_fd, struct epoll_event* events, int max_events, int timeout, const sigset_t* mask, uint64_t budget);
+
+#endif
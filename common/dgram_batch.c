@@ -0,0 +1,196 @@
+#define _GNU_SOURCE
+
+#include "dgram_batch.h"
+
+#include "busypoll.h"
+#include "udp_gso.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+//* Allocate the batch arrays and wire every message to its buffer and address slot
+//? Returns -1 if the size is out of range or the allocation fails.
+int dgram_batch_init(struct dgram_batch* batch, unsigned size, size_t buffer_size) {
+    memset(batch, 0, sizeof *batch);
+    if (size == 0 || size > DGRAM_BATCH_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    batch->size = size;
+    batch->buffer_size = buffer_size;
+    batch->msgs = calloc(size, sizeof *batch->msgs);
+    batch->iovs = calloc(size, sizeof *batch->iovs);
+    batch->addrs = calloc(size, sizeof *batch->addrs);
+    batch->buffers = malloc(size * buffer_size);
+    if (batch->msgs == NULL || batch->iovs == NULL || batch->addrs == NULL || batch->buffers == NULL) {
+        dgram_batch_free(batch);
+        return -1;
+    }
+
+    for (unsigned i = 0; i < size; i++) {
+        batch->iovs[i].iov_base = batch->buffers + i * buffer_size;
+        batch->msgs[i].msg_hdr.msg_iov = &batch->iovs[i];
+        batch->msgs[i].msg_hdr.msg_iovlen = 1;
+        batch->msgs[i].msg_hdr.msg_name = &batch->addrs[i];
+    }
+    return 0;
+}
+
+//* Enable segmentation offload for the batch
+//- UDP_GRO is set on the socket and every message gets a control buffer. A received message may then be a
+//- super-buffer of several same-sized datagrams; its reply is sent back as one UDP_SEGMENT (GSO) send, so the client
+//- still receives the original datagram boundaries. The batch buffers should be UDP_GSO_BUFFER_SIZE bytes each.
+//? Returns -1 if the kernel does not support UDP_GRO or the allocation fails, UDP_GRO is left off then.
+int dgram_batch_enable_gro(struct dgram_batch* batch, int fd) {
+    if (udp_gro_enable(fd) == -1)
+        return -1;
+    batch->controls = calloc(batch->size, UDP_GSO_CONTROL_SIZE);
+    batch->segment_sizes = calloc(batch->size, sizeof *batch->segment_sizes);
+    if (batch->controls == NULL || batch->segment_sizes == NULL) {
+        //- The caller carries on without offload, so the socket must not hand it super-buffers.
+        udp_gro_disable(fd);
+        errno = ENOMEM;
+        return -1;
+    }
+    batch->gro = 1;
+    return 0;
+}
+
+//* Receive up to batch->size datagrams with one syscall
+//- MSG_WAITFORONE blocks until the first datagram arrives and then only takes what is already queued, so a single
+//- datagram is not delayed waiting for the batch to fill up. With a spin budget, non-blocking calls take whatever is
+//- queued until the first datagram arrives or the budget is used up (see common/busypoll.h).
+//? Returns the number of received datagrams, or -1 on failure.
+int dgram_batch_recv(struct dgram_batch* batch, int fd) {
+    int count, bucket = 0;
+
+    //- recvmmsg() overwrites the lengths, reset them to the full slot size.
+    for (unsigned i = 0; i < batch->size; i++) {
+        batch->iovs[i].iov_len = batch->buffer_size;
+        batch->msgs[i].msg_hdr.msg_namelen = sizeof batch->addrs[i];
+        if (batch->gro) {
+            batch->msgs[i].msg_hdr.msg_control = batch->controls + i * UDP_GSO_CONTROL_SIZE;
+            batch->msgs[i].msg_hdr.msg_controllen = UDP_GSO_CONTROL_SIZE;
+        }
+    }
+
+    while ((count = busypoll_recvmmsg(fd, batch->msgs, batch->size, batch->spin)) == -1) {
+        if (errno != EINTR)
+            return -1;
+    }
+
+    for (int fill = count; fill > 1 && bucket < DGRAM_BATCH_BUCKETS - 1; fill >>= 1) bucket++;
+    batch->stats.fill[bucket]++;
+    batch->stats.batches++;
+    batch->stats.messages += count;
+    if (!batch->gro) {
+        batch->stats.datagrams += count;
+        return count;
+    }
+
+    //- Count every datagram of a super-buffer, the last segment may be shorter than the segment size.
+    for (int i = 0; i < count; i++) {
+        unsigned len = batch->msgs[i].msg_len;
+        int segment_size = batch->segment_sizes[i] = udp_gro_segment_size(&batch->msgs[i].msg_hdr);
+
+        if (segment_size > 0 && len > (unsigned)segment_size) {
+            batch->stats.datagrams += (len + segment_size - 1) / segment_size;
+            batch->stats.super_buffers++;
+        } else {
+            batch->segment_sizes[i] = 0;
+            batch->stats.datagrams++;
+        }
+    }
+    return count;
+}
+
+//* Drop the received datagrams that keep rejects
+//- The kept messages move to the front in their order of arrival, a dropped one is swapped behind them with its
+//- iovec, address and control buffer, so nothing is copied and every slot stays wired to one message header. The
+//- GRO segment sizes move along. keep gets the number of datagrams a message holds, a GRO super-buffer is kept or
+//- dropped as a whole.
+//? Returns the number of kept datagrams, the first ones of the batch.
+int dgram_batch_filter(struct dgram_batch* batch, int count, int (*keep)(const struct mmsghdr* msg, unsigned datagrams, void* context),
+                       void* context) {
+    struct mmsghdr msg;
+    int kept = 0, segment_size;
+
+    for (int i = 0; i < count; i++) {
+        segment_size = batch->gro ? batch->segment_sizes[i] : 0;
+        if (!keep(&batch->msgs[i], segment_size > 0 ? (batch->msgs[i].msg_len + segment_size - 1) / segment_size : 1, context))
+            continue;
+        if (kept != i) {
+            msg = batch->msgs[kept];
+            batch->msgs[kept] = batch->msgs[i];
+            batch->msgs[i] = msg;
+            if (batch->gro) {
+                segment_size = batch->segment_sizes[kept];
+                batch->segment_sizes[kept] = batch->segment_sizes[i];
+                batch->segment_sizes[i] = segment_size;
+            }
+        }
+        kept++;
+    }
+    return kept;
+}
+
+//* Send the first count received datagrams back to their senders
+//- Each iovec is trimmed to the received length, the sender address is still in msg_name. A GRO super-buffer is sent
+//- with a UDP_SEGMENT control message of its original segment size. sendmmsg() may stop early
+//- (for example when the socket buffer is full), the remaining messages are sent with further calls.
+//? Returns -1 if sendmmsg() fails, 0 otherwise.
+int dgram_batch_echo(struct dgram_batch* batch, int fd, int count) {
+    int sent = 0, result;
+
+    for (int i = 0; i < count; i++) {
+        struct msghdr* hdr = &batch->msgs[i].msg_hdr;
+
+        hdr->msg_iov->iov_len = batch->msgs[i].msg_len;
+        if (batch->gro && batch->segment_sizes[i] > 0) {
+            udp_gso_set(hdr, batch->controls + i * UDP_GSO_CONTROL_SIZE, batch->segment_sizes[i]);
+        } else {
+            hdr->msg_control = NULL;
+            hdr->msg_controllen = 0;
+        }
+    }
+
+    while (sent < count) {
+        if ((result = sendmmsg(fd, batch->msgs + sent, count - sent, 0)) == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        batch->stats.send_calls++;
+        sent += result;
+    }
+    return 0;
+}
+
+//* Print the fill statistics
+void dgram_batch_report(const struct dgram_batch* batch, FILE* out) {
+    const struct dgram_batch_stats* stats = &batch->stats;
+    double average = stats->batches ? (double)stats->messages / stats->batches : 0;
+
+    fprintf(out, "batch stats: %lu messages in %lu batches (avg fill %.2f of %u, %.1f%%), %lu sendmmsg calls\n", stats->messages,
+            stats->batches, average, batch->size, batch->size ? 100.0 * average / batch->size : 0, stats->send_calls);
+    if (batch->gro)
+        fprintf(out, "  gro: %lu datagrams, %lu super-buffers\n", stats->datagrams, stats->super_buffers);
+    for (int k = 0; k < DGRAM_BATCH_BUCKETS; k++) {
+        if (stats->fill[k] == 0)
+            continue;
+        unsigned upper = (2u << k) - 1 < batch->size ? (2u << k) - 1 : batch->size;
+        fprintf(out, "  fill %4u-%-4u: %lu\n", 1u << k, upper, stats->fill[k]);
+    }
+}
+
+void dgram_batch_free(struct dgram_batch* batch) {
+    free(batch->msgs);
+    free(batch->iovs);
+    free(batch->addrs);
+    free(batch->buffers);
+    free(batch->controls);
+    free(batch->segment_sizes);
+    memset(batch, 0, sizeof *batch);
+}
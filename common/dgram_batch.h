@@ -0,0 +1,52 @@
+#ifndef COMMON_DGRAM_BATCH_H
+#define COMMON_DGRAM_BATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/socket.h>
+
+#define DGRAM_BATCH_MAX 1024    //- Upper limit of the configurable batch size (UIO_MAXIOV)
+#define DGRAM_BATCH_BUCKETS 11  //- Number of log2 fill histogram buckets (1, 2-3, 4-7, ..., 1024)
+
+//* Batch fill statistics
+//- fill[k] counts the recvmmsg() calls that returned between 2^k and 2^(k+1)-1 datagrams. A batch that is mostly
+//- full means the socket had a backlog and batching saved syscalls, a fill of 1 means the load is too light to batch.
+struct dgram_batch_stats {
+    unsigned long batches;                    //- Number of recvmmsg() calls that returned datagrams
+    unsigned long messages;                   //- Number of received messages (a GRO super-buffer counts once)
+    unsigned long datagrams;                  //- Number of received datagrams (GRO segments counted one by one)
+    unsigned long super_buffers;              //- Number of received GRO super-buffers holding more than one datagram
+    unsigned long send_calls;                 //- Number of sendmmsg() calls
+    unsigned long fill[DGRAM_BATCH_BUCKETS];  //- log2 histogram of datagrams per batch
+};
+
+//* Preallocated recvmmsg()/sendmmsg() batch
+//- dgram_batch_init() wires message i to iovs[i], addrs[i] and the i-th slot of buffers. Everything is allocated once,
+//- the receive loop does not touch the allocator. The sender address of every datagram is kept in its msg_name, so
+//- replies go back to it. dgram_batch_filter() reorders the message headers, so after it the buffer and address of a
+//- message must be taken from its header (msg_iov, msg_name) rather than by index.
+struct dgram_batch {
+    unsigned size;                   //- Maximum number of datagrams per batch
+    size_t buffer_size;              //- Size of one datagram buffer
+    struct mmsghdr* msgs;            //- Message headers
+    struct iovec* iovs;              //- One iovec per message, pointing at its buffer slot
+    struct sockaddr_storage* addrs;  //- Sender address of every message
+    char* buffers;                   //- size * buffer_size bytes of datagram storage
+    int gro;                         //- UDP_GRO/UDP_SEGMENT offload is enabled (see dgram_batch_enable_gro())
+    char* controls;                  //- One UDP_GSO_CONTROL_SIZE control buffer per message (GRO only)
+    int* segment_sizes;              //- GRO segment size of every message, 0 for a plain datagram (GRO only)
+    struct dgram_batch_stats stats;  //- Fill statistics
+    uint64_t spin;                   //- Busy-polling budget of a receive in nanoseconds (0: block at once)
+};
+
+int dgram_batch_init(struct dgram_batch* batch, unsigned size, size_t buffer_size);
+int dgram_batch_enable_gro(struct dgram_batch* batch, int fd);
+int dgram_batch_recv(struct dgram_batch* batch, int fd);
+int dgram_batch_filter(struct dgram_batch* batch, int count, int (*keep)(const struct mmsghdr* msg, unsigned datagrams, void* context),
+                       void* context);
+int dgram_batch_echo(struct dgram_batch* batch, int fd, int count);
+void dgram_batch_report(const struct dgram_batch* batch, FILE* out);
+void dgram_batch_free(struct dgram_batch* batch);
+
+#endif
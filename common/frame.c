@@ -0,0 +1,162 @@
+#include "frame.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+static int frame_writev(int fd, struct iovec* iov, int count);
+static int frame_read_full(int fd, void* buffer, size_t len);
+
+void frame_parser_init(struct frame_parser* parser) {
+    memset(parser, 0, sizeof *parser);
+}
+
+//* Take the next payload chunk out of a receive buffer
+//- *data and *len describe the unparsed part of the buffer and are advanced past everything consumed. Header bytes are
+//- collected in the parser (a header may be split over reads as well), payload bytes are returned in place.
+//- Call it in a loop until it returns 0, then read more data:
+//-
+//-     while ((status = frame_parse(&parser, &data, &len, &chunk)) == 1) handle(&chunk);
+//-
+//? Returns 1 if a chunk was produced, 0 if the buffer is used up, -1 (errno EMSGSIZE) if a header announces more than
+//? FRAME_MAX_PAYLOAD bytes. The stream cannot be resynchronized after an error, the connection should be closed.
+int frame_parse(struct frame_parser* parser, const char** data, size_t* len, struct frame_chunk* chunk) {
+    size_t take;
+
+    while (parser->header_len < FRAME_HEADER_SIZE) {
+        if (*len == 0)
+            return 0;
+        parser->header[parser->header_len++] = **data;
+        (*data)++;
+        (*len)--;
+        if (parser->header_len < FRAME_HEADER_SIZE)
+            continue;
+
+        parser->length = (uint32_t)parser->header[0] << 24 | (uint32_t)parser->header[1] << 16 | (uint32_t)parser->header[2] << 8 |
+                         parser->header[3];
+        if (parser->length > FRAME_MAX_PAYLOAD) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+        parser->remaining = parser->length;
+        if (parser->length == 0) {
+            parser->header_len = 0;  //- An empty message is complete with its header
+            *chunk = (struct frame_chunk){*data, 0, 0, 0};
+            return 1;
+        }
+    }
+    if (*len == 0)
+        return 0;
+
+    take = *len < parser->remaining ? *len : parser->remaining;
+    *chunk = (struct frame_chunk){*data, take, parser->length, parser->length - parser->remaining};
+    *data += take;
+    *len -= take;
+    if ((parser->remaining -= take) == 0)
+        parser->header_len = 0;  //- Frame complete, the next byte starts a new header
+    return 1;
+}
+
+void frame_header_encode(unsigned char* header, uint32_t length) {
+    header[0] = length >> 24;
+    header[1] = length >> 16;
+    header[2] = length >> 8;
+    header[3] = length;
+}
+
+//* Send one complete message
+//- Header and payload are passed to a single writev() call, so they leave in one syscall (and usually one segment)
+//- without copying the payload behind the header first.
+//? Returns -1 if the payload is larger than FRAME_MAX_PAYLOAD (errno EMSGSIZE) or the write fails.
+int frame_write(int fd, const void* payload, size_t len) {
+    unsigned char header[FRAME_HEADER_SIZE];
+    struct iovec iov[2] = {{header, FRAME_HEADER_SIZE}, {(void*)payload, len}};
+
+    if (len > FRAME_MAX_PAYLOAD) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    frame_header_encode(header, len);
+    return frame_writev(fd, iov, 2);
+}
+
+//* Echo one parsed chunk back as part of a frame of the same length
+//- The first chunk of a frame goes out together with the header in one writev(), the following chunks are appended.
+//? Returns -1 if the write fails.
+int frame_write_chunk(int fd, const struct frame_chunk* chunk) {
+    unsigned char header[FRAME_HEADER_SIZE];
+    struct iovec iov[2] = {{header, FRAME_HEADER_SIZE}, {(void*)chunk->data, chunk->len}};
+
+    if (chunk->offset > 0)
+        return frame_writev(fd, iov + 1, 1);
+    frame_header_encode(header, chunk->length);
+    return frame_writev(fd, iov, 2);
+}
+
+//* Read one complete message into a buffer (blocking)
+//? Returns 1 and the payload length in *len, 0 if the peer closed the connection between two messages, -1 if the read
+//? fails, the connection ends inside a message (errno ECONNRESET) or the payload is larger than size (errno EMSGSIZE).
+int frame_read(int fd, void* payload, size_t size, size_t* len) {
+    unsigned char header[FRAME_HEADER_SIZE];
+    int status;
+
+    if ((status = frame_read_full(fd, header, FRAME_HEADER_SIZE)) <= 0)
+        return status;
+    *len = (uint32_t)header[0] << 24 | (uint32_t)header[1] << 16 | (uint32_t)header[2] << 8 | header[3];
+    if (*len > size) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if ((status = frame_read_full(fd, payload, *len)) == 0 && *len > 0) {
+        errno = ECONNRESET;
+        return -1;
+    }
+    return status == -1 ? -1 : 1;
+}
+
+//* Write every byte of an iovec array, resuming after short writes
+static int frame_writev(int fd, struct iovec* iov, int count) {
+    ssize_t written;
+
+    while (count > 0) {
+        if ((written = writev(fd, iov, count)) == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        while (count > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+//* Read exactly len bytes
+//? Returns 1 on success, 0 if the peer closed the connection before the first byte, -1 on error or a partial read.
+static int frame_read_full(int fd, void* buffer, size_t len) {
+    size_t done = 0;
+    ssize_t bytes_read;
+
+    while (done < len) {
+        if ((bytes_read = read(fd, (char*)buffer + done, len - done)) == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (bytes_read == 0) {
+            if (done == 0)
+                return 0;
+            errno = ECONNRESET;
+            return -1;
+        }
+        done += bytes_read;
+    }
+    return 1;
+}
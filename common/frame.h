@@ -0,0 +1,44 @@
+#ifndef COMMON_FRAME_H
+#define COMMON_FRAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FRAME_HEADER_SIZE 4                   //- Size of the length prefix in front of every message
+#define FRAME_MAX_PAYLOAD (16 * 1024 * 1024)  //- Largest accepted payload, a bigger length is treated as a protocol error
+
+//* Length-prefixed message framing
+//- Every message on a stream socket is sent as a 4-byte big-endian payload length followed by the payload bytes:
+//-
+//-     | length (uint32, big-endian) | payload (length bytes) |
+//-
+//- The payload is opaque binary data, zero bytes included, and a zero length is a valid (empty) message.
+
+//* Incremental frame parser
+//- The parser only keeps the partial header and the number of payload bytes still expected, so it never copies
+//- payload bytes: it hands out slices of the caller's receive buffer. A frame split over several reads is delivered as
+//- several chunks, and a single read holding many frames yields one chunk per frame.
+struct frame_parser {
+    unsigned char header[FRAME_HEADER_SIZE];  //- Header bytes received so far
+    unsigned header_len;                      //- Number of valid bytes in header
+    uint32_t length;                          //- Payload length of the current frame
+    uint32_t remaining;                       //- Payload bytes of the current frame not seen yet
+};
+
+//* One slice of a frame payload
+//- offset == 0 marks the first chunk of a frame, offset + len == length the last one.
+struct frame_chunk {
+    const char* data;  //- Payload bytes, points into the buffer passed to frame_parse()
+    size_t len;        //- Number of payload bytes in this chunk
+    uint32_t length;   //- Payload length of the whole frame
+    uint32_t offset;   //- Offset of data within the frame payload
+};
+
+void frame_parser_init(struct frame_parser* parser);
+int frame_parse(struct frame_parser* parser, const char** data, size_t* len, struct frame_chunk* chunk);
+void frame_header_encode(unsigned char* header, uint32_t length);
+int frame_write(int fd, const void* payload, size_t len);
+int frame_write_chunk(int fd, const struct frame_chunk* chunk);
+int frame_read(int fd, void* payload, size_t size, size_t* len);
+
+#endif
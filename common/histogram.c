@@ -0,0 +1,97 @@
+#include "histogram.h"
+
+#include <string.h>
+
+//* Map a value to its bucket
+//- v < 64 maps to itself. Otherwise e = floor(log2(v)) selects the power of two and the 6 bits below the leading one
+//- select the sub-bucket, so bucket = 64 + (e - 6) * 64 + ((v >> (e - 6)) - 64).
+static unsigned histogram_index(uint64_t value) {
+    unsigned exponent, shift;
+
+    if (value < HISTOGRAM_SUB_COUNT)
+        return value;
+    exponent = 63 - __builtin_clzll(value);
+    shift = exponent - HISTOGRAM_SUB_BITS;
+    return HISTOGRAM_SUB_COUNT + shift * HISTOGRAM_SUB_COUNT + (unsigned)((value >> shift) - HISTOGRAM_SUB_COUNT);
+}
+
+//* Get the highest value that maps to a bucket
+//- Percentiles report the upper edge of the bucket, like HdrHistogram, so they never under-state a latency.
+static uint64_t histogram_bucket_value(unsigned index) {
+    unsigned shift;
+
+    if (index < HISTOGRAM_SUB_COUNT)
+        return index;
+    shift = (index - HISTOGRAM_SUB_COUNT) / HISTOGRAM_SUB_COUNT;
+    return (((uint64_t)HISTOGRAM_SUB_COUNT + (index - HISTOGRAM_SUB_COUNT) % HISTOGRAM_SUB_COUNT + 1) << shift) - 1;
+}
+
+void histogram_init(struct histogram* histogram) {
+    memset(histogram, 0, sizeof *histogram);
+    histogram->min = UINT64_MAX;
+}
+
+void histogram_record(struct histogram* histogram, uint64_t value) {
+    histogram->counts[histogram_index(value)]++;
+    histogram->count++;
+    histogram->sum += value;
+    if (value < histogram->min)
+        histogram->min = value;
+    if (value > histogram->max)
+        histogram->max = value;
+}
+
+void histogram_merge(struct histogram* into, const struct histogram* from) {
+    if (from->count == 0)
+        return;
+    for (unsigned i = 0; i < HISTOGRAM_BUCKETS; i++) into->counts[i] += from->counts[i];
+    into->count += from->count;
+    into->sum += from->sum;
+    if (from->min < into->min)
+        into->min = from->min;
+    if (from->max > into->max)
+        into->max = from->max;
+}
+
+//* Get the value at a percentile (0-100)
+//? Returns 0 for an empty histogram. The result is capped at the exact maximum.
+uint64_t histogram_percentile(const struct histogram* histogram, double percentile) {
+    uint64_t target, seen = 0;
+
+    if (histogram->count == 0)
+        return 0;
+    target = (uint64_t)(percentile / 100.0 * histogram->count + 0.5);
+    if (target < 1)
+        target = 1;
+
+    for (unsigned i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        if ((seen += histogram->counts[i]) >= target) {
+            uint64_t value = histogram_bucket_value(i);
+            return value < histogram->max ? value : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+double histogram_mean(const struct histogram* histogram) {
+    return histogram->count ? histogram->sum / histogram->count : 0;
+}
+
+//* Print a latency summary, values are nanoseconds and printed as microseconds
+void histogram_print_latency(const struct histogram* histogram, FILE* out) {
+    if (histogram->count == 0) {
+        fprintf(out, "latency: no samples\n");
+        return;
+    }
+    fprintf(out, "latency (us): min %.1f  p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  p99.99 %.1f  max %.1f  mean %.1f\n",
+            histogram->min / 1e3, histogram_percentile(histogram, 50) / 1e3, histogram_percentile(histogram, 90) / 1e3,
+            histogram_percentile(histogram, 99) / 1e3, histogram_percentile(histogram, 99.9) / 1e3,
+            histogram_percentile(histogram, 99.99) / 1e3, histogram->max / 1e3, histogram_mean(histogram) / 1e3);
+}
+
+//* Print p50, p90, p99, p99.9 and max in microseconds as comma-separated fields, without a line end
+//- Used by the machine-readable reports of the load generators, the columns are documented in bench.sh.
+void histogram_print_csv(const struct histogram* histogram, FILE* out) {
+    fprintf(out, "%.1f,%.1f,%.1f,%.1f,%.1f", histogram_percentile(histogram, 50) / 1e3, histogram_percentile(histogram, 90) / 1e3,
+            histogram_percentile(histogram, 99) / 1e3, histogram_percentile(histogram, 99.9) / 1e3, histogram->max / 1e3);
+}
@@ -0,0 +1,32 @@
+#ifndef COMMON_HISTOGRAM_H
+#define COMMON_HISTOGRAM_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define HISTOGRAM_SUB_BITS 6                                                     //- Linear sub-buckets per power of two (2^6 = 64, ~1.6% precision)
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)                            //- Number of sub-buckets per power of two
+#define HISTOGRAM_BUCKETS (HISTOGRAM_SUB_COUNT * (64 - HISTOGRAM_SUB_BITS + 1))  //- Buckets covering the full uint64_t range
+
+//* HDR-style log-bucketed histogram
+//- Values below 64 get an exact bucket each. Above that, every power of two is split into 64 linear sub-buckets, so
+//- the relative error of a reported value is below 1/64 over the whole uint64_t range with a fixed 30 KB of counters.
+//- Recording is a couple of shifts and one increment, no allocation and no locking: each thread records into its own
+//- histogram and the histograms are merged when a report is needed.
+struct histogram {
+    uint64_t count;                      //- Number of recorded values
+    uint64_t min;                        //- Smallest recorded value (exact)
+    uint64_t max;                        //- Largest recorded value (exact)
+    double sum;                          //- Sum of the recorded values, for the mean
+    uint64_t counts[HISTOGRAM_BUCKETS];  //- Number of values per bucket
+};
+
+void histogram_init(struct histogram* histogram);
+void histogram_record(struct histogram* histogram, uint64_t value);
+void histogram_merge(struct histogram* into, const struct histogram* from);
+uint64_t histogram_percentile(const struct histogram* histogram, double percentile);
+double histogram_mean(const struct histogram* histogram);
+void histogram_print_latency(const struct histogram* histogram, FILE* out);
+void histogram_print_csv(const struct histogram* histogram, FILE* out);
+
+#endif
@@ -0,0 +1,364 @@
+#define _GNU_SOURCE
+
+#include "loadgen.h"
+#include "frame.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOADGEN_MAX_EVENTS 256         //- Maximum number of events returned by a single epoll_wait() call
+#define LOADGEN_RECV_SIZE (64 * 1024)  //- Receive buffer size per thread
+#define LOADGEN_SEND_COPIES 16         //- Requests laid out back to back in the send buffer
+#define LOADGEN_SEND_IOVS 64           //- Send buffer passes per write, LOADGEN_SEND_COPIES requests each
+
+//* Per-connection state
+//- stamps is a ring of `depth` entries holding the (scheduled) send time of every request in flight, oldest first.
+//- Requests are identical, so the send side only has to count bytes: unsent bytes are taken from a buffer holding
+//- LOADGEN_SEND_COPIES framed requests back to back, starting at the offset the previous send stopped at.
+//- Starting a request only counts its bytes, the connection is flushed once the caller has started everything that
+//- is due: the replies of one recv(), a round of scheduled requests. A writev() that passes over the send buffer as
+//- often as needed then sends all of them together, instead of one send() per reply.
+struct loadgen_conn {
+    int fd;            //- Socket file descriptor, -1 once the connection failed
+    uint64_t* stamps;  //- Send time of every request in flight (nanoseconds)
+    int head;          //- Index of the oldest request in stamps
+    int count;         //- Number of requests in flight
+    size_t unsent;     //- Bytes of started requests not written yet
+    size_t offset;     //- Offset of the next byte to send within the send buffer
+    size_t received;   //- Bytes of the oldest reply received so far
+};
+
+//* Per-thread state, nothing in here is shared with another thread
+struct loadgen_thread {
+    pthread_t thread;                       //- Thread handle
+    const struct loadgen_options* options;  //- Shared, read-only settings
+    pthread_barrier_t* start;               //- Released once every thread is connected
+    struct loadgen_conn* conns;             //- Connections of this thread
+    int conn_count;                         //- Number of connections of this thread
+    int epoll_fd;                           //- epoll instance of this thread
+    char* send_buffer;                      //- LOADGEN_SEND_COPIES framed requests back to back
+    size_t frame_size;                      //- Size of one request on the wire, header included
+    size_t send_buffer_size;                //- Size of send_buffer
+    uint64_t interval;                      //- Nanoseconds between two scheduled requests (0 means closed-loop)
+    uint64_t next_send;                     //- Scheduled time of the next request
+    int next_conn;                          //- Round-robin cursor for scheduled requests
+    uint64_t requests;                      //- Completed requests
+    uint64_t errors;                        //- Failed connections
+    uint64_t writes;                        //- Write syscalls that sent requests
+    struct histogram latency;               //- Round-trip latency in nanoseconds
+};
+
+static void* loadgen_thread_main(void* arg);
+static int loadgen_connect(const struct loadgen_options* options);
+static void loadgen_start_request(struct loadgen_thread* thread, struct loadgen_conn* conn, uint64_t stamp);
+static void loadgen_flush(struct loadgen_thread* thread, struct loadgen_conn* conn);
+static void loadgen_read(struct loadgen_thread* thread, struct loadgen_conn* conn, char* buffer);
+static void loadgen_fail(struct loadgen_thread* thread, struct loadgen_conn* conn);
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//* Run the load test and merge the per-thread results
+//- Connections are spread round-robin over the threads. Every thread connects its share first, then all threads
+//- wait on a barrier so the measurement starts at the same time everywhere.
+//? Returns -1 if the settings are invalid or a thread could not be started.
+int loadgen_run(const struct loadgen_options* options, struct loadgen_result* result) {
+    struct loadgen_thread* threads;
+    pthread_barrier_t start;
+    uint64_t started, finished;
+
+    if (options->connections < 1 || options->threads < 1 || options->payload == 0 || options->payload > FRAME_MAX_PAYLOAD || options->depth < 1 ||
+        options->duration <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if ((threads = calloc(options->threads, sizeof *threads)) == NULL)
+        return -1;
+    pthread_barrier_init(&start, NULL, options->threads + 1);
+
+    for (int i = 0; i < options->threads; i++) {
+        threads[i].options = options;
+        threads[i].start = &start;
+        threads[i].conn_count = options->connections / options->threads + (i < options->connections % options->threads);
+        if (options->rate > 0)
+            threads[i].interval = (uint64_t)(1e9 * options->threads / options->rate);
+        histogram_init(&threads[i].latency);
+        if ((errno = pthread_create(&threads[i].thread, NULL, loadgen_thread_main, &threads[i])) != 0) {
+            perror("error: load generator thread creation failed, aborting...");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pthread_barrier_wait(&start);
+    started = now_ns();
+    for (int i = 0; i < options->threads; i++) pthread_join(threads[i].thread, NULL);
+    finished = now_ns();
+
+    memset(result, 0, sizeof *result);
+    histogram_init(&result->latency);
+    for (int i = 0; i < options->threads; i++) {
+        result->requests += threads[i].requests;
+        result->errors += threads[i].errors;
+        result->writes += threads[i].writes;
+        histogram_merge(&result->latency, &threads[i].latency);
+    }
+    result->bytes = result->requests * options->payload;
+    result->elapsed = (finished - started) / 1e9;
+
+    pthread_barrier_destroy(&start);
+    free(threads);
+    return 0;
+}
+
+void loadgen_report(const struct loadgen_options* options, const struct loadgen_result* result, FILE* out) {
+    fprintf(out, "load: %d connections, %d threads, %zu byte payload, depth %d, %.1f s, ", options->connections, options->threads,
+            options->payload, options->depth, options->duration);
+    if (options->rate > 0)
+        fprintf(out, "target %.0f req/s (latency from scheduled send time)\n", options->rate);
+    else
+        fprintf(out, "closed-loop\n");
+    fprintf(out, "requests: %lu (%.1f req/s), %.2f MB/s, %lu connection errors\n", (unsigned long)result->requests,
+            result->requests / result->elapsed, result->bytes / result->elapsed / 1e6, (unsigned long)result->errors);
+    fprintf(out, "writes: %lu (%.1f requests per write)\n", (unsigned long)result->writes,
+            result->writes > 0 ? (double)result->requests / result->writes : 0.0);
+    histogram_print_latency(&result->latency, out);
+}
+
+//* Print the results as one comma-separated line
+//- requests, elapsed seconds, requests per second, MB/s, p50/p90/p99/p99.9/max latency in microseconds, failed
+//- connections. The same columns as udpgen_report_csv(), so the results of both generators fit into one table.
+void loadgen_report_csv(const struct loadgen_result* result, FILE* out) {
+    fprintf(out, "%lu,%.3f,%.1f,%.3f,", (unsigned long)result->requests, result->elapsed, result->requests / result->elapsed,
+            result->bytes / result->elapsed / 1e6);
+    histogram_print_csv(&result->latency, out);
+    fprintf(out, ",%lu\n", (unsigned long)result->errors);
+}
+
+//* Thread entry point: connect, wait for the start signal, then drive the connections until the deadline
+static void* loadgen_thread_main(void* arg) {
+    struct loadgen_thread* thread = arg;
+    const struct loadgen_options* options = thread->options;
+    struct epoll_event events[LOADGEN_MAX_EVENTS];
+    char* recv_buffer = malloc(LOADGEN_RECV_SIZE);
+    uint64_t now, deadline;
+
+    thread->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    thread->conns = calloc(thread->conn_count, sizeof *thread->conns);
+    thread->frame_size = FRAME_HEADER_SIZE + options->payload;
+    thread->send_buffer_size = thread->frame_size * LOADGEN_SEND_COPIES;
+    thread->send_buffer = malloc(thread->send_buffer_size);
+    if (recv_buffer == NULL || thread->conns == NULL || thread->send_buffer == NULL || thread->epoll_fd == -1) {
+        perror("error: load generator initialization failed, aborting...");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < LOADGEN_SEND_COPIES; i++) {
+        char* frame = thread->send_buffer + i * thread->frame_size;
+        frame_header_encode((unsigned char*)frame, options->payload);
+        for (size_t j = 0; j < options->payload; j++) frame[FRAME_HEADER_SIZE + j] = 'a' + j % 26;
+    }
+
+    for (int i = 0; i < thread->conn_count; i++) {
+        struct loadgen_conn* conn = &thread->conns[i];
+        struct epoll_event event = {EPOLLIN | EPOLLOUT | EPOLLET, {.ptr = conn}};
+
+        conn->fd = -1;
+        conn->stamps = calloc(options->depth, sizeof *conn->stamps);
+        if (conn->stamps == NULL || (conn->fd = loadgen_connect(options)) == -1 ||
+            epoll_ctl(thread->epoll_fd, EPOLL_CTL_ADD, conn->fd, &event) == -1) {
+            perror("error: load generator connection failed");
+            if (conn->fd != -1)
+                close(conn->fd);
+            conn->fd = -1;
+            thread->errors++;
+        }
+    }
+
+    pthread_barrier_wait(thread->start);
+    now = thread->next_send = now_ns();
+    deadline = now + (uint64_t)(options->duration * 1e9);
+
+    //- Closed-loop: fill every connection up to the depth, replies trigger the following requests.
+    if (thread->interval == 0) {
+        for (int i = 0; i < thread->conn_count; i++) {
+            while (thread->conns[i].fd != -1 && thread->conns[i].count < options->depth) loadgen_start_request(thread, &thread->conns[i], now);
+            if (thread->conns[i].fd != -1)
+                loadgen_flush(thread, &thread->conns[i]);
+        }
+    }
+
+    while (now < deadline) {
+        uint64_t wait = deadline - now;
+        int ready;
+
+        //* Issue the scheduled requests that are due
+        //- A request whose time has come but finds every connection at full depth keeps its scheduled time and is sent
+        //- as soon as a slot frees up, so the queueing delay shows up in its latency.
+        if (thread->interval > 0) {
+            int started = 0;
+
+            while (thread->next_send <= now) {
+                struct loadgen_conn* conn = NULL;
+                for (int tries = 0; tries < thread->conn_count && conn == NULL; tries++) {
+                    struct loadgen_conn* candidate = &thread->conns[thread->next_conn];
+                    thread->next_conn = (thread->next_conn + 1) % thread->conn_count;
+                    if (candidate->fd != -1 && candidate->count < options->depth)
+                        conn = candidate;
+                }
+                if (conn == NULL)
+                    break;
+                loadgen_start_request(thread, conn, thread->next_send);
+                thread->next_send += thread->interval;
+                started = 1;
+            }
+            for (int i = 0; started && i < thread->conn_count; i++) {
+                if (thread->conns[i].fd != -1 && thread->conns[i].unsent > 0)
+                    loadgen_flush(thread, &thread->conns[i]);
+            }
+            if (thread->next_send > now && thread->next_send - now < wait)
+                wait = thread->next_send - now;
+        }
+
+        //- epoll_pwait2() takes a nanosecond timeout, epoll_wait() would round the schedule to milliseconds.
+        ready = epoll_pwait2(thread->epoll_fd, events, LOADGEN_MAX_EVENTS,
+                             &(struct timespec){(time_t)(wait / 1000000000ULL), (long)(wait % 1000000000ULL)}, NULL);
+        if (ready == -1 && errno != EINTR) {
+            perror("error: epoll_pwait2 failed, aborting...");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < ready; i++) {
+            struct loadgen_conn* conn = events[i].data.ptr;
+            if (conn->fd != -1 && (events[i].events & EPOLLOUT))
+                loadgen_flush(thread, conn);
+            if (conn->fd != -1 && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+                loadgen_read(thread, conn, recv_buffer);
+        }
+        now = now_ns();
+    }
+
+    for (int i = 0; i < thread->conn_count; i++) {
+        if (thread->conns[i].fd != -1)
+            close(thread->conns[i].fd);
+        free(thread->conns[i].stamps);
+    }
+    close(thread->epoll_fd);
+    free(thread->conns);
+    free(thread->send_buffer);
+    free(recv_buffer);
+    return NULL;
+}
+
+//* Open one blocking connection and switch it to non-blocking mode
+//- TCP_NODELAY keeps Nagle's algorithm from holding back a request while the previous one is unacknowledged.
+static int loadgen_connect(const struct loadgen_options* options) {
+    int fd;
+
+    if ((fd = socket(options->addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+        return -1;
+    if (connect(fd, (const struct sockaddr*)&options->addr, options->addr_len) == -1) {
+        close(fd);
+        return -1;
+    }
+    if (options->addr.ss_family == AF_INET)
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+    if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void loadgen_start_request(struct loadgen_thread* thread, struct loadgen_conn* conn, uint64_t stamp) {
+    conn->stamps[(conn->head + conn->count) % thread->options->depth] = stamp;
+    conn->count++;
+    conn->unsent += thread->frame_size;
+}
+
+//* Write as many unsent request bytes as the socket accepts
+//- The unsent bytes run from the offset to the end of the send buffer and then through the whole buffer again as
+//- often as needed, each pass is one iovec of the same write. More than LOADGEN_SEND_IOVS passes take another one.
+static void loadgen_flush(struct loadgen_thread* thread, struct loadgen_conn* conn) {
+    struct iovec iov[LOADGEN_SEND_IOVS];
+    ssize_t bytes_sent;
+
+    while (conn->unsent > 0) {
+        size_t offset = conn->offset, left = conn->unsent;
+        int count = 0;
+
+        while (left > 0 && count < LOADGEN_SEND_IOVS) {
+            size_t len = thread->send_buffer_size - offset < left ? thread->send_buffer_size - offset : left;
+            iov[count++] = (struct iovec){thread->send_buffer + offset, len};
+            left -= len;
+            offset = 0;
+        }
+        //- sendmsg() is the writev() that takes flags: MSG_NOSIGNAL turns a closed connection into EPIPE, not SIGPIPE.
+        if ((bytes_sent = sendmsg(conn->fd, &(struct msghdr){.msg_iov = iov, .msg_iovlen = count}, MSG_NOSIGNAL)) == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;  //- Resumed on the next EPOLLOUT
+            if (errno == EINTR)
+                continue;
+            loadgen_fail(thread, conn);
+            return;
+        }
+        thread->writes++;
+        conn->unsent -= bytes_sent;
+        conn->offset = (conn->offset + bytes_sent) % thread->send_buffer_size;
+    }
+}
+
+//* Read the echoed bytes and complete the requests they finish
+//- Replies come back in request order, so every frame_size bytes complete the oldest request in flight.
+static void loadgen_read(struct loadgen_thread* thread, struct loadgen_conn* conn, char* buffer) {
+    size_t frame_size = thread->frame_size;
+    ssize_t bytes_received;
+
+    while ((bytes_received = recv(conn->fd, buffer, LOADGEN_RECV_SIZE, 0)) != 0) {
+        uint64_t now;
+
+        if (bytes_received == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        now = now_ns();
+        conn->received += bytes_received;
+        while (conn->received >= frame_size && conn->count > 0) {
+            uint64_t stamp = conn->stamps[conn->head];
+
+            histogram_record(&thread->latency, now > stamp ? now - stamp : 0);
+            thread->requests++;
+            conn->received -= frame_size;
+            conn->head = (conn->head + 1) % thread->options->depth;
+            conn->count--;
+            if (thread->interval == 0)
+                loadgen_start_request(thread, conn, now);
+        }
+        if (conn->unsent > 0)
+            loadgen_flush(thread, conn);
+        if (conn->fd == -1)
+            return;
+    }
+    loadgen_fail(thread, conn);  //- The server closed the connection or the socket failed
+}
+
+static void loadgen_fail(struct loadgen_thread* thread, struct loadgen_conn* conn) {
+    close(conn->fd);
+    conn->fd = -1;
+    conn->count = 0;
+    conn->unsent = 0;
+    thread->errors++;
+}
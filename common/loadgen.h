@@ -0,0 +1,43 @@
+#ifndef COMMON_LOADGEN_H
+#define COMMON_LOADGEN_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/socket.h>
+
+#include "histogram.h"
+
+//* Load generator settings
+//- The generator opens `connections` stream connections to `addr`, spread over `threads` threads. Each connection
+//- keeps up to `depth` requests of `payload` bytes in flight and matches the echoed bytes to them in order. Requests
+//- are length-prefixed frames (see frame.h), so every server engine, including the frame-parsing ones, can echo them.
+//- With rate 0 the load is closed-loop: a new request is sent as soon as a reply arrives.
+//- With a target rate the requests are scheduled at fixed intervals and latency is measured from the scheduled send
+//- time, so a stalled server is charged for the requests it delayed (coordinated omission correction).
+struct loadgen_options {
+    struct sockaddr_storage addr;  //- Server address (AF_INET or AF_UNIX)
+    socklen_t addr_len;            //- Size of the server address
+    int connections;               //- Number of connections
+    int threads;                   //- Number of threads
+    size_t payload;                //- Request size in bytes
+    int depth;                     //- Requests in flight per connection
+    double duration;               //- Test duration in seconds
+    double rate;                   //- Target request rate per second over all connections (0 means closed-loop)
+};
+
+//* Load generator results, merged over all threads
+struct loadgen_result {
+    uint64_t requests;         //- Completed requests
+    uint64_t bytes;            //- Echoed payload bytes
+    uint64_t errors;           //- Connections that failed
+    uint64_t writes;           //- Write syscalls that sent requests
+    double elapsed;            //- Measured duration in seconds
+    struct histogram latency;  //- Round-trip latency in nanoseconds
+};
+
+int loadgen_run(const struct loadgen_options* options, struct loadgen_result* result);
+void loadgen_report(const struct loadgen_options* options, const struct loadgen_result* result, FILE* out);
+void loadgen_report_csv(const struct loadgen_result* result, FILE* out);
+
+#endif
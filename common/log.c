@@ -0,0 +1,262 @@
+#define _GNU_SOURCE
+
+#include "log.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#define LOG_FLUSH_INTERVAL 10  //- Milliseconds the log writer sleeps when every ring is empty
+#define LOG_LINE_SIZE 512      //- Maximum length of a formatted log line
+
+int log_level = LOG_LEVEL_INFO;
+
+//* One binary log record (112 bytes)
+struct log_entry {
+    const char* format;           //- Format string literal
+    uint64_t args[LOG_MAX_ARGS];  //- Integer arguments
+    uint8_t level;                //- Log level
+    uint8_t argc;                 //- Number of valid arguments
+    uint8_t data_len;             //- Number of valid bytes in data
+    char data[LOG_DATA_SIZE];     //- Inline data (message preview)
+};
+
+//* Per-thread single-producer, single-consumer ring
+//- The owning thread only writes tail, dropped and sampled, the log writer only writes head. The two sides live on
+//- separate cache lines so that logging does not bounce the consumer's line on every record.
+struct log_ring {
+    _Alignas(LOG_CACHE_LINE) uint64_t tail;   //- Next slot to write (producer)
+    uint64_t head_cache;                      //- Last head value seen by the producer
+    uint64_t dropped;                         //- Records dropped because the ring was full (producer)
+    uint64_t sample_count;                    //- Sampled records seen, for 1-in-N sampling (producer)
+    _Alignas(LOG_CACHE_LINE) uint64_t head;   //- Next slot to read (consumer)
+    uint64_t dropped_reported;                //- Dropped count already reported by the log writer (consumer)
+    struct log_ring* next;                    //- Next ring on the global list
+    struct log_entry entries[LOG_RING_SIZE];  //- Record storage
+};
+
+static struct {
+    pthread_t thread;        //- Log writer thread
+    pthread_mutex_t lock;    //- Protects the ring list
+    struct log_ring* rings;  //- Every ring ever created, one per logging thread
+    unsigned long sample;    //- Keep 1 in `sample` info/debug records
+    int running;             //- The log writer thread was started
+    int stop;                //- Set by log_shutdown() to stop the log writer
+} logger = {.lock = PTHREAD_MUTEX_INITIALIZER, .sample = 1};
+
+static __thread struct log_ring* thread_ring;  //- Ring of the calling thread (NULL until it logs for the first time)
+
+static void* log_writer_main(void* arg);
+static int log_start_writer(void);
+static void log_after_fork(void);
+static size_t log_drain(void);
+static void log_format(const struct log_entry* entry);
+static struct log_ring* log_ring_create(void);
+
+//* Read the configuration and start the log writer thread
+//- log_shutdown() is registered with atexit(), so the records still queued are written when the process exits.
+//- A child created with fork() gets a fresh log writer thread (threads do not survive fork()).
+//? Returns -1 if the log writer thread could not be started, errno is set.
+int log_init(void) {
+    static const char* names[] = {"off", "error", "warn", "info", "debug"};
+    const char* value;
+
+    if ((value = getenv("LOG_LEVEL")) != NULL) {
+        for (int i = 0; i < (int)(sizeof names / sizeof *names); i++) {
+            if (strcasecmp(value, names[i]) == 0)
+                log_level = i;
+        }
+    }
+    if ((value = getenv("LOG_SAMPLE")) != NULL && strtoul(value, NULL, 10) > 0)
+        logger.sample = strtoul(value, NULL, 10);
+
+    if (log_start_writer() == -1)
+        return -1;
+    pthread_atfork(NULL, NULL, log_after_fork);
+    atexit(log_shutdown);
+    return 0;
+}
+
+//* Append a record to the calling thread's ring
+//- Only the producer side of the ring is touched: the cached head is refreshed from the consumer only when the ring
+//- looks full, and the record becomes visible to the log writer with one release store of tail.
+void log_write(int level, const void* data, size_t len, const char* format, const uint64_t* args, size_t argc) {
+    struct log_ring* ring = thread_ring;
+    struct log_entry* entry;
+
+    if (ring == NULL && (ring = thread_ring = log_ring_create()) == NULL)
+        return;
+    if (level >= LOG_LEVEL_INFO && logger.sample > 1 && ring->sample_count++ % logger.sample != 0)
+        return;
+
+    if (ring->tail - ring->head_cache >= LOG_RING_SIZE) {
+        ring->head_cache = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (ring->tail - ring->head_cache >= LOG_RING_SIZE) {
+            __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+
+    entry = &ring->entries[ring->tail & (LOG_RING_SIZE - 1)];
+    entry->format = format;
+    entry->level = level;
+    entry->argc = argc < LOG_MAX_ARGS ? argc : LOG_MAX_ARGS;
+    memcpy(entry->args, args, entry->argc * sizeof *args);
+    entry->data_len = len < LOG_DATA_SIZE ? len : LOG_DATA_SIZE;
+    if (entry->data_len > 0)
+        memcpy(entry->data, data, entry->data_len);
+    __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+//* Stop the log writer after it wrote every queued record
+void log_shutdown(void) {
+    if (!logger.running)
+        return;
+    __atomic_store_n(&logger.stop, 1, __ATOMIC_RELEASE);
+    pthread_join(logger.thread, NULL);
+    logger.running = 0;
+}
+
+static int log_start_writer(void) {
+    logger.stop = 0;
+    if ((errno = pthread_create(&logger.thread, NULL, log_writer_main, NULL)) != 0)
+        return -1;
+    logger.running = 1;
+    return 0;
+}
+
+//* Log writer thread: drain the rings, flush once per pass, sleep when there is nothing to do
+static void* log_writer_main(void* arg) {
+    (void)arg;
+    while (!__atomic_load_n(&logger.stop, __ATOMIC_ACQUIRE)) {
+        if (log_drain() > 0) {
+            fflush(stdout);
+            fflush(stderr);
+        } else {
+            nanosleep(&(struct timespec){0, LOG_FLUSH_INTERVAL * 1000000L}, NULL);
+        }
+    }
+    log_drain();
+    fflush(stdout);
+    fflush(stderr);
+    return NULL;
+}
+
+//* Format every queued record and report new drops
+//? Returns the number of records written.
+static size_t log_drain(void) {
+    size_t written = 0;
+
+    pthread_mutex_lock(&logger.lock);
+    for (struct log_ring* ring = logger.rings; ring != NULL; ring = ring->next) {
+        uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+
+        for (uint64_t head = ring->head; head != tail; head++) {
+            log_format(&ring->entries[head & (LOG_RING_SIZE - 1)]);
+            written++;
+        }
+        __atomic_store_n(&ring->head, tail, __ATOMIC_RELEASE);
+
+        if (dropped != ring->dropped_reported) {
+            fprintf(stderr, "log: %lu records dropped, the log ring was full\n", (unsigned long)(dropped - ring->dropped_reported));
+            ring->dropped_reported = dropped;
+            written++;
+        }
+    }
+    pthread_mutex_unlock(&logger.lock);
+    return written;
+}
+
+//* Expand one record into a text line
+static void log_format(const struct log_entry* entry) {
+    char line[LOG_LINE_SIZE];
+    size_t pos = 0;
+    unsigned arg = 0;
+    int width;
+
+    for (const char* p = entry->format; *p != '\0' && pos < sizeof line - 1; p++) {
+        uint64_t value;
+
+        if (*p != '%' || p[1] == '\0') {
+            line[pos++] = *p;
+            continue;
+        }
+        p++;
+        if (*p == '%') {
+            line[pos++] = '%';
+            continue;
+        }
+        for (width = 0; *p >= '0' && *p <= '9'; p++) width = width * 10 + (*p - '0');
+        if (*p == '\0')
+            break;
+        if (*p == 's') {
+            for (unsigned i = 0; i < entry->data_len && pos < sizeof line - 1; i++)
+                line[pos++] = entry->data[i] >= 0x20 && entry->data[i] < 0x7f ? entry->data[i] : '.';
+            continue;
+        }
+
+        value = arg < entry->argc ? entry->args[arg++] : 0;
+        switch (*p) {
+            case 'd':
+                pos += snprintf(line + pos, sizeof line - pos, "%*lld", width, (long long)value);
+                break;
+            case 'u':
+                pos += snprintf(line + pos, sizeof line - pos, "%*llu", width, (unsigned long long)value);
+                break;
+            case 'x':
+                pos += snprintf(line + pos, sizeof line - pos, "%*llx", width, (unsigned long long)value);
+                break;
+            case 'a':
+                //- Near the end of the line the address does not fit (ENOSPC), the output is undefined then.
+                if (inet_ntop(AF_INET, &(struct in_addr){(in_addr_t)value}, line + pos, sizeof line - pos) != NULL)
+                    pos += strlen(line + pos);
+                else
+                    pos += snprintf(line + pos, sizeof line - pos, "?");
+                break;
+            case 'e':
+                pos += snprintf(line + pos, sizeof line - pos, "%s", strerror((int)value));
+                break;
+            default:
+                pos += snprintf(line + pos, sizeof line - pos, "%%%c", *p);
+                break;
+        }
+        if (pos > sizeof line - 1)
+            pos = sizeof line - 1;  //- snprintf() returns the untruncated length
+    }
+    line[pos++] = '\n';
+    fwrite(line, 1, pos, entry->level <= LOG_LEVEL_WARN ? stderr : stdout);
+}
+
+//* Allocate the calling thread's ring and publish it to the log writer
+static struct log_ring* log_ring_create(void) {
+    struct log_ring* ring;
+
+    if (posix_memalign((void**)&ring, LOG_CACHE_LINE, sizeof *ring) != 0)
+        return NULL;
+    memset(ring, 0, sizeof *ring);
+    pthread_mutex_lock(&logger.lock);
+    ring->next = logger.rings;
+    logger.rings = ring;
+    pthread_mutex_unlock(&logger.lock);
+    return ring;
+}
+
+//* Restart the logger in a forked child
+//- Only the forking thread exists in the child. The records already queued belong to the parent, which writes them
+//- itself, so the child drops its copies and starts its own log writer.
+static void log_after_fork(void) {
+    pthread_mutex_init(&logger.lock, NULL);
+    for (struct log_ring* ring = logger.rings; ring != NULL; ring = ring->next) {
+        ring->head = ring->head_cache = ring->tail;
+        ring->dropped_reported = ring->dropped;
+    }
+    if (logger.running && log_start_writer() == -1)
+        logger.running = 0;
+}
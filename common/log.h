@@ -0,0 +1,54 @@
+#ifndef COMMON_LOG_H
+#define COMMON_LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LOG_RING_SIZE 4096  //- Records per thread ring (must be a power of 2)
+#define LOG_MAX_ARGS 6      //- Maximum number of integer arguments of a record
+#define LOG_DATA_SIZE 48    //- Bytes of inline data (message preview) a record can carry
+#define LOG_CACHE_LINE 64   //- Alignment that keeps the producer and consumer ring indexes on separate cache lines
+
+//* Log levels, a record is kept if its level is at most the configured one
+enum log_level { LOG_LEVEL_OFF, LOG_LEVEL_ERROR, LOG_LEVEL_WARN, LOG_LEVEL_INFO, LOG_LEVEL_DEBUG };
+
+//* Asynchronous logger
+//- A thread that logs does not format anything: it copies the format string pointer, up to LOG_MAX_ARGS integers and
+//- up to LOG_DATA_SIZE bytes of data into a binary record in its own single-producer ring and returns. No lock, no
+//- stdio, no syscall. A background thread drains every ring, formats the records and writes them out in batches.
+//- If a ring is full the record is dropped and counted, the hot path never waits for the log writer.
+//-
+//- The format must be a string literal (only the pointer is stored) and knows these conversions, all arguments are
+//- passed as integers (a field width such as %4u is supported for the integer conversions):
+//-     %d  signed integer          %u  unsigned integer     %x  hexadecimal
+//-     %a  IPv4 address (s_addr, network byte order)       %e  errno value, printed with strerror()
+//-     %s  the inline data, non-printable bytes shown as '.'
+//-
+//-     log_info("client %a:%u disconnected", addr.sin_addr.s_addr, ntohs(addr.sin_port));
+//-
+//- Records at LOG_LEVEL_INFO and LOG_LEVEL_DEBUG can be sampled: with a sample rate of N only every Nth such record of
+//- a thread is kept. Errors and warnings are never sampled.
+//- The level and sample rate are read from the LOG_LEVEL (off, error, warn, info, debug) and LOG_SAMPLE environment
+//- variables by log_init(). Records of a thread stay in order, records of different threads may interleave.
+extern int log_level;
+
+#define log_error(...) log_record(LOG_LEVEL_ERROR, NULL, 0, __VA_ARGS__)
+#define log_warn(...) log_record(LOG_LEVEL_WARN, NULL, 0, __VA_ARGS__)
+#define log_info(...) log_record(LOG_LEVEL_INFO, NULL, 0, __VA_ARGS__)
+#define log_debug(...) log_record(LOG_LEVEL_DEBUG, NULL, 0, __VA_ARGS__)
+#define log_info_data(data, len, ...) log_record(LOG_LEVEL_INFO, data, len, __VA_ARGS__)
+
+//- The arguments are collected in a uint64_t compound literal, so every record needs at least one of them and a
+//- pointer argument is a compile error instead of a silently truncated value.
+#define log_record(level, data, len, format, ...)                                                                       \
+    do {                                                                                                                \
+        if ((level) <= log_level)                                                                                       \
+            log_write((level), (data), (len), (format), (const uint64_t[]){__VA_ARGS__},                                \
+                      sizeof((const uint64_t[]){__VA_ARGS__}) / sizeof(uint64_t));                                      \
+    } while (0)
+
+int log_init(void);
+void log_write(int level, const void* data, size_t len, const char* format, const uint64_t* args, size_t argc);
+void log_shutdown(void);
+
+#endif
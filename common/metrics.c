@@ -0,0 +1,259 @@
+#define _GNU_SOURCE
+
+#include "metrics.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define METRICS_REQUEST_TIMEOUT 100  //- Milliseconds the endpoint waits for a request before answering in plain text
+#define METRICS_REQUEST_SIZE 1024    //- Bytes of a request the endpoint reads (only the method is looked at)
+
+//* Shard table, shared with forked children
+//- The mapping is reserved for METRICS_MAX_SHARDS shards but pages are only allocated when a shard is first used.
+struct metrics_region {
+    unsigned shards;                                 //- Number of shards handed out so far (high-water mark)
+    struct metrics_shard shard[METRICS_MAX_SHARDS];  //- Shard storage
+};
+
+__thread struct metrics_shard* metrics_thread_shard;  //- Shard of the calling thread (NULL until it records)
+
+static struct metrics_region* region;                                   //- Shared shard table (NULL before metrics_init())
+static struct metrics_shard sink;                                       //- Shard of threads that found no free one, never reported
+static char socket_file[sizeof ((struct sockaddr_un*)NULL)->sun_path];  //- Path of the endpoint socket, unlinked at exit
+static int listen_fd = -1;                                              //- Endpoint listening socket
+static pid_t owner_pid;                                                 //- Process that created the endpoint
+static ino_t socket_inode;                                              //- Inode of the socket file, to recognize it at exit
+
+//* Name, type and description of every counter, in enum metrics_counter order
+static const struct {
+    const char* name;
+    const char* type;
+    const char* help;
+} counter_info[METRICS_COUNTERS] = {
+    {"echo_connections_accepted_total", "counter", "Connections accepted."},
+    {"echo_connections_closed_total", "counter", "Connections closed."},
+    {"echo_received_bytes_total", "counter", "Bytes received, framing headers included."},
+    {"echo_sent_bytes_total", "counter", "Bytes sent."},
+    {"echo_received_messages_total", "counter", "Messages received (frames on stream sockets, datagrams on UDP)."},
+    {"echo_errors_total", "counter", "Failed socket calls and invalid input."},
+    {"echo_zerocopy_sends_total", "counter", "Sends made with MSG_ZEROCOPY."},
+    {"echo_zerocopy_copied_total", "counter", "MSG_ZEROCOPY sends the kernel copied anyway."},
+    {"echo_steals_total", "counter", "Connection turns a worker stole from another worker's run queue."},
+    {"echo_busy_poll_hits_total", "counter", "Busy-polling waits that got data while spinning."},
+    {"echo_busy_poll_sleeps_total", "counter", "Busy-polling waits that used up the spin budget and blocked."},
+    {"echo_idle_timeouts_total", "counter", "Connections closed after the idle timeout."},
+    {"echo_read_timeouts_total", "counter", "Connections closed because a started message did not complete in time."},
+    {"echo_write_timeouts_total", "counter", "Connections closed because the peer did not read its echoes in time."},
+    {"echo_rate_limited_total", "counter", "Datagrams or connections dropped over the per-source rate limit."},
+    {"echo_rate_limit_evictions_total", "counter", "Sources evicted from a full rate limiter table."},
+    {"echo_rejected_connections_total", "counter", "Connections reset because the connection limit was reached."},
+    {"echo_reply_batches_total", "counter", "Writes that sent the echoes of one read together."},
+    {"echo_pool_in_use_bytes", "gauge", "Bytes of pool blocks held by connections (state and buffers)."},
+    {"echo_pool_reserved_bytes", "gauge", "Bytes the buffer pools took from malloc(), free blocks included."},
+};
+
+static void* metrics_main(void* arg);
+static void metrics_respond(int fd);
+static void metrics_report(FILE* out);
+static void metrics_release(void);
+static void metrics_after_fork(void);
+static void metrics_shutdown(void);
+
+//* Map the shard table and start the metrics endpoint
+//- Must run before any thread records, a thread that records earlier is bound to the sink shard.
+int metrics_init(const char* socket_path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    const char* path = getenv("METRICS_SOCKET");
+    struct stat st;
+    pthread_t thread;
+
+    if (region == NULL) {
+        region = mmap(NULL, sizeof *region, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (region == MAP_FAILED) {
+            region = NULL;
+            return -1;
+        }
+        pthread_atfork(NULL, NULL, metrics_after_fork);
+    }
+
+    if (path == NULL)
+        path = socket_path;
+    if (path == NULL || *path == '\0' || strcmp(path, "off") == 0)
+        return 0;
+    if (strlen(path) >= sizeof addr.sun_path) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    if ((listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+        return -1;
+    unlink(path);  //- A socket file left behind by a previous run would make bind() fail
+    if (bind(listen_fd, (struct sockaddr*)&addr, sizeof addr) == -1 || listen(listen_fd, SOMAXCONN) == -1 ||
+        (errno = pthread_create(&thread, NULL, metrics_main, NULL)) != 0) {
+        close(listen_fd);
+        listen_fd = -1;
+        return -1;
+    }
+    pthread_detach(thread);
+    strcpy(socket_file, path);
+    owner_pid = getpid();
+    socket_inode = stat(path, &st) == 0 ? st.st_ino : 0;
+    atexit(metrics_shutdown);
+    return 0;
+}
+
+//* Bind the calling thread to a shard
+//- A shard given up by an exited child is reused first, a new one is only taken from the table when none is free.
+//? Returns the sink shard if the table is full or was never mapped.
+struct metrics_shard* metrics_claim(void) {
+    struct metrics_shard* shard = NULL;
+    unsigned used, index;
+
+    if (region != NULL) {
+        used = __atomic_load_n(&region->shards, __ATOMIC_ACQUIRE);
+        for (unsigned i = 0; i < used && i < METRICS_MAX_SHARDS && shard == NULL; i++) {
+            int free_owner = 0;
+            if (__atomic_load_n(&region->shard[i].initialized, __ATOMIC_ACQUIRE) &&
+                __atomic_compare_exchange_n(&region->shard[i].owner, &free_owner, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+                shard = &region->shard[i];
+        }
+        if (shard == NULL && (index = __atomic_fetch_add(&region->shards, 1, __ATOMIC_ACQ_REL)) < METRICS_MAX_SHARDS) {
+            shard = &region->shard[index];
+            shard->owner = 1;
+            histogram_init(&shard->service_time);
+            __atomic_store_n(&shard->initialized, 1, __ATOMIC_RELEASE);
+        }
+    }
+    return metrics_thread_shard = shard != NULL ? shard : &sink;
+}
+
+//* Endpoint thread: answer every connection with one report
+static void* metrics_main(void* arg) {
+    int fd;
+
+    (void)arg;
+    while (1) {
+        if ((fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC)) == -1) {
+            if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE)
+                continue;
+            return NULL;
+        }
+        metrics_respond(fd);
+        close(fd);
+    }
+}
+
+//* Send a report, wrapped in an HTTP response if the client sent an HTTP request
+static void metrics_respond(int fd) {
+    char request[METRICS_REQUEST_SIZE];
+    char* report = NULL;
+    size_t report_len = 0;
+    ssize_t bytes_sent;
+    int http = 0;
+    FILE* out;
+
+    if (poll(&(struct pollfd){.fd = fd, .events = POLLIN}, 1, METRICS_REQUEST_TIMEOUT) == 1)
+        http = recv(fd, request, sizeof request, 0) >= 4 && memcmp(request, "GET ", 4) == 0;
+
+    if ((out = open_memstream(&report, &report_len)) == NULL)
+        return;
+    if (http)
+        fprintf(out, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n");
+    metrics_report(out);
+    fclose(out);
+
+    //- MSG_NOSIGNAL: a scraper that went away must not kill the server with SIGPIPE.
+    for (size_t off = 0; off < report_len; off += bytes_sent) {
+        if ((bytes_sent = send(fd, report + off, report_len - off, MSG_NOSIGNAL)) == -1) {
+            if (errno != EINTR)
+                break;
+            bytes_sent = 0;
+        }
+    }
+    shutdown(fd, SHUT_WR);
+    free(report);
+}
+
+//* Sum up every shard and print the totals in the Prometheus text format
+//- The shards are read while their owners keep recording, so the histogram of a report may lag its counters by the
+//- samples recorded during the scrape. Every value is cumulative, the next scrape catches up.
+static void metrics_report(FILE* out) {
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    struct histogram service;
+    uint64_t counters[METRICS_COUNTERS] = {0};
+    uint64_t open_connections;
+    uint64_t busy_polls;
+    unsigned used, threads = 0;
+
+    histogram_init(&service);
+    used = __atomic_load_n(&region->shards, __ATOMIC_ACQUIRE);
+    for (unsigned i = 0; i < used && i < METRICS_MAX_SHARDS; i++) {
+        struct metrics_shard* shard = &region->shard[i];
+        if (!__atomic_load_n(&shard->initialized, __ATOMIC_ACQUIRE))
+            continue;
+        for (int c = 0; c < METRICS_COUNTERS; c++) counters[c] += __atomic_load_n(&shard->counters[c], __ATOMIC_RELAXED);
+        histogram_merge(&service, &shard->service_time);
+        threads += __atomic_load_n(&shard->owner, __ATOMIC_RELAXED);
+    }
+
+    for (int c = 0; c < METRICS_COUNTERS; c++) {
+        fprintf(out, "# HELP %s %s\n# TYPE %s %s\n%s %llu\n", counter_info[c].name, counter_info[c].help, counter_info[c].name,
+                counter_info[c].type, counter_info[c].name, (unsigned long long)counters[c]);
+    }
+    open_connections = counters[METRICS_ACCEPTED] - counters[METRICS_CLOSED];
+    fprintf(out, "# HELP echo_connections_open Connections currently open.\n# TYPE echo_connections_open gauge\n");
+    fprintf(out, "echo_connections_open %llu\n", (unsigned long long)open_connections);
+    fprintf(out, "# HELP echo_connection_memory_bytes Pool bytes held per open connection (echo_pool_in_use_bytes / open).\n");
+    fprintf(out, "# TYPE echo_connection_memory_bytes gauge\necho_connection_memory_bytes %llu\n",
+            (unsigned long long)(open_connections > 0 ? counters[METRICS_POOL_IN_USE] / open_connections : 0));
+    busy_polls = counters[METRICS_BUSY_POLL_HITS] + counters[METRICS_BUSY_POLL_SLEEPS];
+    fprintf(out, "# HELP echo_busy_poll_hit_ratio Share of the busy-polling waits that got data while spinning.\n");
+    fprintf(out, "# TYPE echo_busy_poll_hit_ratio gauge\necho_busy_poll_hit_ratio %.4f\n",
+            busy_polls > 0 ? (double)counters[METRICS_BUSY_POLL_HITS] / busy_polls : 0.0);
+    fprintf(out, "# HELP echo_recording_threads Threads and processes currently recording metrics.\n");
+    fprintf(out, "# TYPE echo_recording_threads gauge\necho_recording_threads %u\n", threads);
+
+    fprintf(out, "# HELP echo_service_seconds Time from a receive call returning data until its echo was sent.\n");
+    fprintf(out, "# TYPE echo_service_seconds summary\n");
+    for (size_t i = 0; i < sizeof quantiles / sizeof *quantiles; i++)
+        fprintf(out, "echo_service_seconds{quantile=\"%g\"} %.9f\n", quantiles[i], histogram_percentile(&service, quantiles[i] * 100) / 1e9);
+    fprintf(out, "echo_service_seconds_sum %.9f\n", service.sum / 1e9);
+    fprintf(out, "echo_service_seconds_count %llu\n", (unsigned long long)service.count);
+}
+
+//* Give up the calling thread's shard, its values stay in the report
+static void metrics_release(void) {
+    if (metrics_thread_shard != NULL && metrics_thread_shard != &sink)
+        __atomic_store_n(&metrics_thread_shard->owner, 0, __ATOMIC_RELEASE);
+    metrics_thread_shard = NULL;
+}
+
+//* Let a forked child record into a shard of its own
+//- The forking thread's shard stays with the parent. The child releases its shard when it exits.
+static void metrics_after_fork(void) {
+    metrics_thread_shard = NULL;
+    if (listen_fd != -1) {
+        close(listen_fd);
+        listen_fd = -1;
+    }
+    atexit(metrics_release);
+}
+
+//* Remove the endpoint socket file (only in the process that created it)
+//- A process started later with the same path (a hot restart) replaced the file with its own, that one stays.
+static void metrics_shutdown(void) {
+    struct stat st;
+
+    if (getpid() == owner_pid && stat(socket_file, &st) == 0 && st.st_ino == socket_inode)
+        unlink(socket_file);
+}
@@ -0,0 +1,94 @@
+#ifndef COMMON_METRICS_H
+#define COMMON_METRICS_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "histogram.h"
+
+#define METRICS_MAX_SHARDS 1024  //- Maximum number of threads/processes recording at the same time
+#define METRICS_CACHE_LINE 64    //- Alignment of a shard, so that two recording threads never share a cache line
+
+//* Counters every server maintains
+enum metrics_counter {
+    METRICS_ACCEPTED,          //- Connections accepted (stream servers)
+    METRICS_CLOSED,            //- Connections closed (stream servers)
+    METRICS_BYTES_RECEIVED,    //- Payload bytes received, framing headers included
+    METRICS_BYTES_SENT,        //- Bytes sent back
+    METRICS_MESSAGES,          //- Messages received (frames for stream servers, datagrams for UDP)
+    METRICS_ERRORS,            //- Failed socket calls and invalid input that closed a connection
+    METRICS_ZEROCOPY_SENDS,    //- Sends made with MSG_ZEROCOPY (see common/zerocopy.h)
+    METRICS_ZEROCOPY_COPIED,   //- MSG_ZEROCOPY sends the kernel copied anyway
+    METRICS_STEALS,            //- Connection turns a worker took from another worker's run queue (see common/workpool.h)
+    METRICS_BUSY_POLL_HITS,    //- Busy-polling waits that got data while spinning (see common/busypoll.h)
+    METRICS_BUSY_POLL_SLEEPS,  //- Busy-polling waits that used up the spin budget and blocked
+    METRICS_IDLE_TIMEOUTS,     //- Connections closed after the idle timeout without a message (see common/timerwheel.h)
+    METRICS_READ_TIMEOUTS,     //- Connections closed because a started message did not complete within the read timeout
+    METRICS_WRITE_TIMEOUTS,    //- Connections closed because the peer did not take pending output within the write timeout
+    METRICS_RATE_LIMITED,      //- Datagrams or connections dropped over the per-source rate limit (see common/ratelimit.h)
+    METRICS_RATE_EVICTIONS,    //- Sources evicted from a full rate limiter table
+    METRICS_REJECTED,          //- Connections reset because the connection limit was reached
+    METRICS_REPLY_BATCHES,     //- Writes that sent the echoes of one read together (see common/replybatch.h)
+    METRICS_POOL_IN_USE,       //- Gauge: bytes of pool blocks held by connections (see common/pool.h)
+    METRICS_POOL_RESERVED,     //- Gauge: bytes the pools took from malloc() and have not given back
+    METRICS_COUNTERS,          //- Number of counters
+};
+
+//* Per-thread metrics shard
+//- Every recording thread owns one shard and is its only writer, so recording is a plain add without atomics or
+//- locks. The shards are only read, and summed up, when the metrics endpoint is scraped.
+struct metrics_shard {
+    _Alignas(METRICS_CACHE_LINE) int owner;  //- Set while a thread (or a forked child) records into this shard
+    int initialized;                         //- Set once the histogram was initialized, the shard is part of the report
+    uint64_t counters[METRICS_COUNTERS];     //- Counter values, indexed by enum metrics_counter
+    struct histogram service_time;           //- Nanoseconds from a receive call returning data until its echo was sent
+};
+
+//* Metrics collection and endpoint
+//- The shards live in one shared anonymous mapping created by metrics_init(), so the children of a forking server
+//- record into memory the parent can still read. A shard that is given up (a forked child exits) keeps its values and
+//- is handed to the next thread that needs one: counters are cumulative, so reusing a shard loses nothing.
+//- metrics_init() also starts a background thread that serves the aggregated values in the Prometheus text format on
+//- a Unix socket. Every connection gets one report, a request starting with "GET " (curl --unix-socket) gets an HTTP
+//- response, anything else (socat, nc -U) the plain text.
+//- The socket path is socket_path unless the METRICS_SOCKET environment variable overrides it, "off" disables the
+//- endpoint (recording stays on).
+//? Returns -1 if the shards cannot be mapped or the endpoint cannot be started, errno is set. Recording is still safe
+//? after a failure, the values just go nowhere.
+int metrics_init(const char* socket_path);
+struct metrics_shard* metrics_claim(void);
+
+extern __thread struct metrics_shard* metrics_thread_shard;
+
+//* Get the calling thread's shard, claiming one on first use
+static inline struct metrics_shard* metrics_shard(void) {
+    struct metrics_shard* shard = metrics_thread_shard;
+    return shard != NULL ? shard : metrics_claim();
+}
+
+//* Add to a counter of the calling thread
+//- The relaxed store keeps the endpoint thread from reading a torn value, it compiles to a plain add and store.
+static inline void metrics_add(enum metrics_counter counter, uint64_t value) {
+    struct metrics_shard* shard = metrics_shard();
+    __atomic_store_n(&shard->counters[counter], shard->counters[counter] + value, __ATOMIC_RELAXED);
+}
+
+//* Subtract from a gauge of the calling thread
+//- The shard values wrap around, a gauge may go below 0 in one shard as long as the sum over all shards does not.
+static inline void metrics_sub(enum metrics_counter counter, uint64_t value) {
+    metrics_add(counter, -value);
+}
+
+//* Monotonic timestamp in nanoseconds, the start value for metrics_record_service()
+static inline uint64_t metrics_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+//* Record the service time of one receive call that started at start (see metrics_now())
+static inline void metrics_record_service(uint64_t start) {
+    histogram_record(&metrics_shard()->service_time, metrics_now() - start);
+}
+
+#endif
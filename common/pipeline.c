@@ -0,0 +1,228 @@
+#include "pipeline.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+static int pipeline_read_input(struct pipeline* pipeline, int in_fd);
+static void pipeline_queue(struct pipeline* pipeline);
+static int pipeline_flush(struct pipeline* pipeline);
+static int pipeline_receive(struct pipeline* pipeline, FILE* out);
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int pipeline_init(struct pipeline* pipeline, int fd, unsigned window) {
+    int flags;
+
+    if (window < 1 || window > PIPELINE_WINDOW_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+    memset(pipeline, 0, sizeof *pipeline);
+    if ((pipeline->ring = calloc(window, sizeof *pipeline->ring)) == NULL)
+        return -1;
+    if ((flags = fcntl(fd, F_GETFL)) == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        free(pipeline->ring);
+        pipeline->ring = NULL;
+        return -1;
+    }
+    pipeline->fd = fd;
+    pipeline->window = window;
+    frame_parser_init(&pipeline->parser);
+    return 0;
+}
+
+//* Send the input and collect the echoes
+//- Each round queues what the input holds (as far as the window allows), writes everything queued in one writev() and
+//- then sleeps in poll() until there is more input, an echo or room in the send buffer. The input is only read while
+//- the read-ahead buffer has room, so a full window stops the reading and the sender waits for the echoes.
+int pipeline_run(struct pipeline* pipeline, int in_fd, FILE* out) {
+    struct pollfd fds[2];
+    int status;
+
+    pipeline->started = pipeline->finished = now_ns();
+    while (1) {
+        pipeline_queue(pipeline);
+        if (pipeline->unsent > 0 && pipeline_flush(pipeline) == -1)
+            return -1;
+        if (pipeline->input_eof && pipeline->input_start == pipeline->input_len && pipeline->count == 0)
+            return 1;
+
+        fds[0].fd = !pipeline->input_eof && pipeline->input_len - pipeline->input_start < PIPELINE_INPUT_SIZE ? in_fd : -1;
+        fds[0].events = POLLIN;
+        fds[1].fd = pipeline->fd;
+        fds[1].events = POLLIN | (pipeline->unsent > 0 ? POLLOUT : 0);
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        if (fds[0].revents != 0 && pipeline_read_input(pipeline, in_fd) == -1)
+            return -1;
+        if (fds[1].revents & (POLLIN | POLLERR | POLLHUP)) {
+            if ((status = pipeline_receive(pipeline, out)) <= 0)
+                return status;
+        }
+    }
+}
+
+void pipeline_report(const struct pipeline* pipeline, FILE* out) {
+    double elapsed = (pipeline->finished - pipeline->started) / 1e9;
+
+    fprintf(out, "pipelined %llu messages in %.3f s (%.0f msg/s), %llu writev calls (%.1f messages per call), window %u\n",
+            (unsigned long long)pipeline->messages, elapsed, elapsed > 0 ? pipeline->messages / elapsed : 0.0,
+            (unsigned long long)pipeline->writes, pipeline->writes > 0 ? (double)pipeline->messages / pipeline->writes : 0.0,
+            pipeline->window);
+    if (pipeline->mismatches > 0)
+        fprintf(out, "%llu echoes differed from their message\n", (unsigned long long)pipeline->mismatches);
+}
+
+void pipeline_free(struct pipeline* pipeline) {
+    free(pipeline->ring);
+    pipeline->ring = NULL;
+}
+
+//* Read more input behind the bytes that are not queued yet
+//- The queued bytes at the front are dropped first, so the whole buffer is available again.
+static int pipeline_read_input(struct pipeline* pipeline, int in_fd) {
+    ssize_t n;
+
+    if (pipeline->input_start > 0) {
+        memmove(pipeline->input, pipeline->input + pipeline->input_start, pipeline->input_len - pipeline->input_start);
+        pipeline->input_len -= pipeline->input_start;
+        pipeline->input_start = 0;
+    }
+    if ((n = read(in_fd, pipeline->input + pipeline->input_len, PIPELINE_INPUT_SIZE - pipeline->input_len)) == -1)
+        return errno == EINTR || errno == EAGAIN ? 0 : -1;
+    if (n == 0)
+        pipeline->input_eof = 1;
+    pipeline->input_len += n;
+    return 0;
+}
+
+//* Turn complete input lines into messages while the window has room
+//- A line longer than PIPELINE_MESSAGE_MAX becomes several messages. An unterminated last line is sent once the
+//- input is exhausted.
+static void pipeline_queue(struct pipeline* pipeline) {
+    struct pipeline_message* message;
+    const char* line;
+    const char* newline;
+    size_t available, len, consumed;
+
+    while (pipeline->count < pipeline->window && pipeline->input_start < pipeline->input_len) {
+        line = pipeline->input + pipeline->input_start;
+        available = pipeline->input_len - pipeline->input_start;
+        if ((newline = memchr(line, '\n', available < PIPELINE_MESSAGE_MAX ? available : PIPELINE_MESSAGE_MAX)) != NULL) {
+            len = newline - line;
+            consumed = len + 1;
+        } else if (available >= PIPELINE_MESSAGE_MAX || pipeline->input_eof) {
+            len = consumed = available < PIPELINE_MESSAGE_MAX ? available : PIPELINE_MESSAGE_MAX;
+        } else {
+            return;  //- The rest of the line is not read yet
+        }
+        pipeline->input_start += consumed;
+        if (len == 0)
+            continue;  //- Skip empty messages
+
+        message = &pipeline->ring[(pipeline->head + pipeline->count) % pipeline->window];
+        frame_header_encode(message->header, (uint32_t)len);
+        memcpy(message->data, line, len);
+        message->len = (uint32_t)len;
+        pipeline->count++;
+        pipeline->unsent++;
+    }
+}
+
+//* Write every unsent message with one writev()
+//- The first unsent message may be partly written already, its iovecs start behind the written bytes. What the send
+//- buffer does not take stays unsent, poll() reports when there is room again.
+static int pipeline_flush(struct pipeline* pipeline) {
+    struct iovec iov[PIPELINE_WINDOW_MAX * 2];
+    struct pipeline_message* message;
+    unsigned index = (pipeline->head + pipeline->count - pipeline->unsent) % pipeline->window;
+    size_t skip = pipeline->written, size;
+    ssize_t n;
+    int count = 0;
+
+    for (unsigned i = 0; i < pipeline->unsent; i++) {
+        message = &pipeline->ring[(index + i) % pipeline->window];
+        if (skip < FRAME_HEADER_SIZE)
+            iov[count++] = (struct iovec){message->header + skip, FRAME_HEADER_SIZE - skip};
+        iov[count++] = (struct iovec){message->data + (skip > FRAME_HEADER_SIZE ? skip - FRAME_HEADER_SIZE : 0),
+                                      message->len - (skip > FRAME_HEADER_SIZE ? skip - FRAME_HEADER_SIZE : 0)};
+        skip = 0;
+    }
+
+    while ((n = writev(pipeline->fd, iov, count)) == -1 && errno == EINTR)
+        ;
+    if (n == -1)
+        return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    pipeline->writes++;
+
+    //- Advance over the messages the write completed
+    while (n > 0) {
+        message = &pipeline->ring[index];
+        size = FRAME_HEADER_SIZE + message->len - pipeline->written;
+        if ((size_t)n < size) {
+            pipeline->written += n;
+            break;
+        }
+        n -= size;
+        pipeline->written = 0;
+        pipeline->unsent--;
+        index = (index + 1) % pipeline->window;
+    }
+    return 0;
+}
+
+//* Match the received echoes to the oldest messages
+//? Returns 1 to go on, 0 if the server closed the connection and -1 on errors.
+static int pipeline_receive(struct pipeline* pipeline, FILE* out) {
+    struct pipeline_message* message;
+    struct frame_chunk chunk;
+    const char* data = pipeline->received;
+    size_t len;
+    ssize_t n;
+    int status;
+
+    if ((n = recv(pipeline->fd, pipeline->received, sizeof pipeline->received, 0)) == -1)
+        return errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK ? 1 : -1;
+    if (n == 0)
+        return 0;
+
+    len = n;
+    while ((status = frame_parse(&pipeline->parser, &data, &len, &chunk)) == 1) {
+        if (pipeline->count == pipeline->unsent) {
+            errno = EPROTO;  //- An echo of a message that was never (completely) sent
+            return -1;
+        }
+        message = &pipeline->ring[pipeline->head];
+        if (chunk.length != message->len || memcmp(message->data + chunk.offset, chunk.data, chunk.len) != 0)
+            pipeline->differs = 1;
+        if (chunk.offset == 0)
+            fputs("server> ", out);
+        fwrite(chunk.data, 1, chunk.len, out);
+        if (chunk.offset + chunk.len < chunk.length)
+            continue;
+
+        fputc('\n', out);
+        pipeline->mismatches += pipeline->differs;
+        pipeline->differs = 0;
+        pipeline->head = (pipeline->head + 1) % pipeline->window;
+        pipeline->count--;
+        pipeline->messages++;
+    }
+    pipeline->finished = now_ns();
+    return status == -1 ? -1 : 1;
+}
@@ -0,0 +1,70 @@
+#ifndef COMMON_PIPELINE_H
+#define COMMON_PIPELINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "frame.h"
+
+#define PIPELINE_WINDOW_MAX 512          //- Largest window, two iovecs per message must fit one writev() (IOV_MAX)
+#define PIPELINE_MESSAGE_MAX 1024        //- Longest message, a longer input line is split like fgets() splits it
+#define PIPELINE_INPUT_SIZE (64 * 1024)  //- Input bytes read ahead of the window
+#define PIPELINE_RECV_SIZE (64 * 1024)   //- Receive buffer for the echoes
+
+//* Message of the window, kept until its echo arrived
+struct pipeline_message {
+    unsigned char header[FRAME_HEADER_SIZE];  //- Encoded length prefix
+    uint32_t len;                             //- Payload length
+    char data[PIPELINE_MESSAGE_MAX];          //- Payload
+};
+
+//* Pipelined client connection
+//- The interactive clients send a line and wait for its echo, so a connection carries one message per round trip. A
+//- pipeline keeps up to window messages in flight instead: input lines are queued as soon as they are read, every
+//- message that is queued but not written yet goes out in one writev() with two iovecs per message (header and
+//- payload), and the echoes are matched to the messages in order as they come back.
+//-
+//- The socket is non-blocking and one poll() waits for input, echoes and send buffer space at the same time. That
+//- matters once the window holds more bytes than the socket buffers: a blocking writev() would wait for the server to
+//- read, while the server waits for the client to read its echoes.
+//-
+//- The messages live in a ring of window entries. From the oldest: messages written and waiting for their echo, then
+//- messages not (completely) written yet. An echo is parsed incrementally (see common/frame.h) and compared chunk by
+//- chunk with its message, a reply that differs is reported and counted.
+struct pipeline {
+    int fd;                                //- Connected stream socket
+    unsigned window;                       //- Messages in flight at most
+    struct pipeline_message* ring;         //- window messages
+    unsigned head;                         //- Oldest message, the next echo belongs to it
+    unsigned count;                        //- Messages in the ring
+    unsigned unsent;                       //- Messages at the end of the ring that are not completely written
+    size_t written;                        //- Bytes of the first unsent message already written, header included
+    struct frame_parser parser;            //- Parser of the echo stream
+    int differs;                           //- The echo of the oldest message differs from it so far
+    char input[PIPELINE_INPUT_SIZE];       //- Input read ahead, not queued yet
+    size_t input_start;                    //- First byte of input not queued yet
+    size_t input_len;                      //- End of the valid bytes in input
+    int input_eof;                         //- The input is exhausted
+    char received[PIPELINE_RECV_SIZE];     //- Echo bytes of one recv()
+    uint64_t messages;                     //- Echoes received
+    uint64_t writes;                       //- writev() calls that sent data
+    uint64_t mismatches;                   //- Echoes that differ from their message
+    uint64_t started;                      //- Start time (nanoseconds, CLOCK_MONOTONIC)
+    uint64_t finished;                     //- Time the last echo arrived
+};
+
+//* Pipeline interface
+//- pipeline_init() sets up a window for the connected socket fd, pipeline_free() releases it.
+//- pipeline_run() sends every line of in_fd (newline removed, empty lines skipped) and prints each echo to out as
+//- "server> <message>", until the input is exhausted and every echo arrived. pipeline_report() prints the message
+//- rate and how many messages every writev() carried on average.
+//? pipeline_init() returns -1 for a window outside 1 to PIPELINE_WINDOW_MAX (errno EINVAL) or if the ring cannot be
+//? allocated. pipeline_run() returns 1 once everything was echoed, 0 if the server closed the connection early and -1
+//? if a read, write or poll() failed or the echo stream is invalid (errno EMSGSIZE or EPROTO).
+int pipeline_init(struct pipeline* pipeline, int fd, unsigned window);
+int pipeline_run(struct pipeline* pipeline, int in_fd, FILE* out);
+void pipeline_report(const struct pipeline* pipeline, FILE* out);
+void pipeline_free(struct pipeline* pipeline);
+
+#endif
@@ -0,0 +1,131 @@
+#include "pool.h"
+#include "metrics.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static int pool_class(size_t size);
+static void* pool_carve(struct pool* pool, size_t size);
+
+void pool_init(struct pool* pool) {
+    memset(pool, 0, sizeof *pool);
+}
+
+//* Take a block from the free list of its class, or allocate a new one
+void* pool_alloc(struct pool* pool, size_t size, size_t* capacity) {
+    int class = pool_class(size);
+    size_t block_size;
+    void* block;
+
+    //- Blocks bigger than the largest class are not pooled.
+    if (class == -1) {
+        if ((block = malloc(size)) != NULL) {
+            metrics_add(METRICS_POOL_IN_USE, size);
+            metrics_add(METRICS_POOL_RESERVED, size);
+        }
+        if (capacity != NULL)
+            *capacity = size;
+        return block;
+    }
+
+    block_size = (size_t)1 << (class + POOL_MIN_SHIFT);
+    if ((block = pool->free[class]) != NULL) {
+        pool->free[class] = *(void**)block;
+        pool->cached[class] -= block_size;
+    } else if ((block = block_size <= POOL_SLAB_BLOCK ? pool_carve(pool, block_size) : malloc(block_size)) == NULL) {
+        return NULL;
+    } else if (block_size > POOL_SLAB_BLOCK) {
+        metrics_add(METRICS_POOL_RESERVED, block_size);
+    }
+    metrics_add(METRICS_POOL_IN_USE, block_size);
+    if (capacity != NULL)
+        *capacity = block_size;
+    return block;
+}
+
+//* Put a block back on the free list of its class
+//- Slab blocks always stay in the pool, large blocks go back to malloc() once the class cache is full.
+void pool_free(struct pool* pool, void* block, size_t size) {
+    int class = pool_class(size);
+    size_t block_size;
+
+    if (block == NULL)
+        return;
+    if (class == -1) {
+        metrics_sub(METRICS_POOL_IN_USE, size);
+        metrics_sub(METRICS_POOL_RESERVED, size);
+        free(block);
+        return;
+    }
+
+    block_size = (size_t)1 << (class + POOL_MIN_SHIFT);
+    metrics_sub(METRICS_POOL_IN_USE, block_size);
+    if (block_size > POOL_SLAB_BLOCK && pool->cached[class] + block_size > POOL_CACHE_LIMIT) {
+        metrics_sub(METRICS_POOL_RESERVED, block_size);
+        free(block);
+        return;
+    }
+    *(void**)block = pool->free[class];
+    pool->free[class] = block;
+    pool->cached[class] += block_size;
+}
+
+//* Release every slab and cached block
+//- Blocks still handed out must not be used afterwards, the slabs they live in are gone.
+void pool_destroy(struct pool* pool) {
+    void* next;
+
+    for (int class = 0; class < POOL_CLASSES; class++) {
+        if (((size_t)1 << (class + POOL_MIN_SHIFT)) <= POOL_SLAB_BLOCK)
+            continue;
+        for (void* block = pool->free[class]; block != NULL; block = next) {
+            next = *(void**)block;
+            free(block);
+        }
+        metrics_sub(METRICS_POOL_RESERVED, pool->cached[class]);
+    }
+    for (void* slab = pool->slabs; slab != NULL; slab = next) {
+        next = *(void**)slab;
+        free(slab);
+        metrics_sub(METRICS_POOL_RESERVED, POOL_SLAB_SIZE);
+    }
+    pool_init(pool);
+}
+
+//* Usable size of the block pool_alloc() returns for size bytes
+size_t pool_capacity(size_t size) {
+    int class = pool_class(size);
+    return class == -1 ? size : (size_t)1 << (class + POOL_MIN_SHIFT);
+}
+
+//* Size class of a request, -1 if it is bigger than the largest class
+static int pool_class(size_t size) {
+    int class = 0;
+
+    if (size > ((size_t)1 << POOL_MAX_SHIFT))
+        return -1;
+    while (((size_t)1 << (class + POOL_MIN_SHIFT)) < size) class++;
+    return class;
+}
+
+//* Cut a small block off the current slab, starting a new slab when it is used up
+//- The first 128 bytes of every slab hold the slab list link. Every block size is a multiple of 128, so all blocks keep
+//- the alignment of malloc(). The rest of a slab that is too small for the requested class is left unused.
+static void* pool_carve(struct pool* pool, size_t size) {
+    char* slab;
+    void* block;
+
+    if (pool->slab_left < size) {
+        if ((slab = malloc(POOL_SLAB_SIZE)) == NULL)
+            return NULL;
+        metrics_add(METRICS_POOL_RESERVED, POOL_SLAB_SIZE);
+        *(void**)slab = pool->slabs;
+        pool->slabs = slab;
+        pool->slab_next = slab + ((size_t)1 << POOL_MIN_SHIFT);
+        pool->slab_left = POOL_SLAB_SIZE - ((size_t)1 << POOL_MIN_SHIFT);
+    }
+    block = pool->slab_next;
+    pool->slab_next += size;
+    pool->slab_left -= size;
+    return block;
+}
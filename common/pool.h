@@ -0,0 +1,40 @@
+#ifndef COMMON_POOL_H
+#define COMMON_POOL_H
+
+#include <stddef.h>
+
+#define POOL_MIN_SHIFT 7                    //- Smallest size class, 128 bytes
+#define POOL_MAX_SHIFT 19                   //- Largest size class, 512 KB (bigger blocks bypass the pool)
+#define POOL_CLASSES (POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1)
+#define POOL_SLAB_SIZE (64 * 1024)          //- Blocks up to POOL_SLAB_BLOCK bytes are carved out of slabs of this size
+#define POOL_SLAB_BLOCK 4096                //- Largest block size served from slabs
+#define POOL_CACHE_LIMIT (1024 * 1024)      //- Bytes of free blocks a class above POOL_SLAB_BLOCK keeps for reuse
+
+//* Size-class memory pool
+//- Hands out blocks in power-of-two size classes from 128 bytes to 512 KB, so a buffer that has to grow moves up one
+//- class instead of being realloc()ed byte by byte, and a freed block is reused by the next request of its class
+//- without a malloc() call. Small blocks (connection state, small buffers) are carved out of 64 KB slabs, which keeps
+//- the per-block malloc() overhead away from the many small allocations. Large blocks are allocated one by one, and
+//- only up to POOL_CACHE_LIMIT bytes of them are kept once freed, so a burst does not pin its peak memory forever.
+//-
+//- A pool belongs to one thread (one reactor) and takes no locks. Every block is accounted in the metrics: the bytes
+//- handed out (METRICS_POOL_IN_USE) and the bytes taken from malloc() (METRICS_POOL_RESERVED).
+struct pool {
+    void* free[POOL_CLASSES];     //- Free list of every class, a free block stores the pointer to the next one
+    size_t cached[POOL_CLASSES];  //- Bytes on the free list of every class
+    void* slabs;                  //- Every slab of the pool, linked through their first bytes
+    char* slab_next;              //- Next uncarved byte of the current slab
+    size_t slab_left;             //- Uncarved bytes left in the current slab
+};
+
+//* Pool interface
+//- pool_alloc() returns a block of at least size bytes and stores its usable size in *capacity (may be NULL).
+//- pool_free() takes the size that was requested or the capacity, both round to the same class.
+//? pool_alloc() returns NULL if malloc() fails, errno is set.
+void pool_init(struct pool* pool);
+void* pool_alloc(struct pool* pool, size_t size, size_t* capacity);
+void pool_free(struct pool* pool, void* block, size_t size);
+void pool_destroy(struct pool* pool);
+size_t pool_capacity(size_t size);
+
+#endif
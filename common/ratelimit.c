@@ -0,0 +1,205 @@
+#define _GNU_SOURCE
+
+#include "ratelimit.h"
+#include "metrics.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RATELIMIT_MASK (RATELIMIT_SLOTS - 1)
+#define RATELIMIT_SHIFT (64 - __builtin_ctz(RATELIMIT_SLOTS))  //- Hash bits dropped to get a slot index
+#define RATELIMIT_LOAD (RATELIMIT_SLOTS / 4 * 3)               //- Sources the table holds before it evicts
+#define RATELIMIT_MULTIPLIER 0x9e3779b97f4a7c15ULL             //- 2^64 / golden ratio, spreads the bits over the top
+
+static _Atomic long* admission_open;  //- Open connections, in a shared mapping (NULL: no limit)
+static long admission_max;            //- Connection limit
+
+static uint32_t ratelimit_hash(const struct ratelimit* limit, uint32_t addr);
+static void ratelimit_remove(struct ratelimit* limit, uint32_t index);
+static void ratelimit_lru_unlink(struct ratelimit* limit, uint32_t index);
+static void ratelimit_lru_push(struct ratelimit* limit, uint32_t index);
+static int ratelimit_take(const struct ratelimit* limit, struct ratelimit_entry* entry, unsigned tokens);
+
+//* Allocate the table and pick the hash seed
+//- calloc() of the 2 MB table gets fresh zero pages from mmap(), only the slots that are touched are ever backed.
+int ratelimit_init(struct ratelimit* limit, unsigned rate, unsigned burst) {
+    if ((limit->slots = calloc(RATELIMIT_SLOTS, sizeof *limit->slots)) == NULL)
+        return -1;
+    if (getrandom(&limit->seed, sizeof limit->seed, GRND_NONBLOCK) != sizeof limit->seed)
+        limit->seed = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32) ^ (uintptr_t)limit->slots;
+    rate = rate > 0 ? rate : 1;
+    limit->cost = 1000000000 / rate;
+    limit->capacity = (uint64_t)(burst > 0 ? burst : rate) * limit->cost;
+    limit->count = 0;
+    limit->newest = limit->oldest = RATELIMIT_NONE;
+    return 0;
+}
+
+//* Take tokens from the bucket of a source
+//- The bucket refills by the nanoseconds that passed since its last message, so an idle source has its full burst
+//- again after burst / rate seconds. Every lookup makes the source the most recently seen one. The messages pass or
+//- are dropped together, a refused batch takes nothing from the bucket.
+int ratelimit_allow(struct ratelimit* limit, uint32_t addr, uint64_t now, unsigned tokens) {
+    struct ratelimit_entry* entry;
+    uint32_t index;
+
+    for (index = ratelimit_hash(limit, addr); limit->slots[index].used; index = (index + 1) & RATELIMIT_MASK) {
+        entry = &limit->slots[index];
+        if (entry->addr != addr)
+            continue;
+        if (now > entry->last) {
+            entry->credit = now - entry->last >= limit->capacity - entry->credit ? limit->capacity : entry->credit + (now - entry->last);
+            entry->last = now;
+        }
+        if (index != limit->newest) {
+            ratelimit_lru_unlink(limit, index);
+            ratelimit_lru_push(limit, index);
+        }
+        return ratelimit_take(limit, entry, tokens);
+    }
+
+    //- A new source. If the table is full the oldest one makes room, the deletion may have moved the free slot
+    //- the probe ended on, so it probes again.
+    if (limit->count >= RATELIMIT_LOAD) {
+        ratelimit_remove(limit, limit->oldest);
+        metrics_add(METRICS_RATE_EVICTIONS, 1);
+        for (index = ratelimit_hash(limit, addr); limit->slots[index].used; index = (index + 1) & RATELIMIT_MASK)
+            ;
+    }
+    entry = &limit->slots[index];
+    entry->addr = addr;
+    entry->used = 1;
+    entry->credit = limit->capacity;
+    entry->last = now;
+    ratelimit_lru_push(limit, index);
+    limit->count++;
+    return ratelimit_take(limit, entry, tokens);
+}
+
+void ratelimit_destroy(struct ratelimit* limit) {
+    free(limit->slots);
+    limit->slots = NULL;
+}
+
+//* Map the shared connection count
+int admission_init(long max_connections) {
+    if (max_connections <= 0)
+        return 0;
+    admission_open = mmap(NULL, sizeof *admission_open, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (admission_open == MAP_FAILED) {
+        admission_open = NULL;
+        return -1;
+    }
+    admission_max = max_connections;
+    return 0;
+}
+
+//* Reserve a connection slot
+//- The increment is taken back if it went over the limit, so the count may briefly exceed it by the number of
+//- concurrent acceptors but no connection over the limit is ever admitted.
+int admission_enter(void) {
+    if (admission_open == NULL)
+        return 1;
+    if (atomic_fetch_add_explicit(admission_open, 1, memory_order_relaxed) >= admission_max) {
+        atomic_fetch_sub_explicit(admission_open, 1, memory_order_relaxed);
+        metrics_add(METRICS_REJECTED, 1);
+        return 0;
+    }
+    return 1;
+}
+
+void admission_leave(void) {
+    if (admission_open != NULL)
+        atomic_fetch_sub_explicit(admission_open, 1, memory_order_relaxed);
+}
+
+//* Reset a connection that is not served
+void admission_refuse(int fd) {
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &(struct linger){.l_onoff = 1, .l_linger = 0}, sizeof(struct linger));
+    close(fd);
+}
+
+//* Admit an accepted connection or reset it
+//- The rate is checked first: a source over its rate does not take a slot of the connection limit, not even briefly.
+int admission_accept(struct ratelimit* limit, int fd, uint32_t addr) {
+    if ((limit != NULL && !ratelimit_allow(limit, addr, metrics_now(), 1)) || !admission_enter()) {
+        admission_refuse(fd);
+        return 0;
+    }
+    return 1;
+}
+
+//* Multiplicative hash of the seeded address, the top bits are the best mixed ones
+static uint32_t ratelimit_hash(const struct ratelimit* limit, uint32_t addr) {
+    return ((addr ^ limit->seed) * RATELIMIT_MULTIPLIER) >> RATELIMIT_SHIFT;
+}
+
+//* Delete the entry of a slot by backward shifting
+//- Every following entry of the probe run whose home slot does not lie between the hole and itself would become
+//- unreachable behind the hole, so it moves into the hole and leaves a new one. The LRU neighbours of a moved entry
+//- are pointed to its new slot. The run ends at the first free slot.
+static void ratelimit_remove(struct ratelimit* limit, uint32_t index) {
+    struct ratelimit_entry* entry;
+    uint32_t hole = index, next = index;
+
+    ratelimit_lru_unlink(limit, index);
+    limit->slots[index].used = 0;
+    limit->count--;
+
+    while (limit->slots[next = (next + 1) & RATELIMIT_MASK].used) {
+        if (((next - ratelimit_hash(limit, limit->slots[next].addr)) & RATELIMIT_MASK) < ((next - hole) & RATELIMIT_MASK))
+            continue;
+        entry = &limit->slots[hole];
+        *entry = limit->slots[next];
+        limit->slots[next].used = 0;
+        if (entry->lru_prev != RATELIMIT_NONE)
+            limit->slots[entry->lru_prev].lru_next = hole;
+        else
+            limit->newest = hole;
+        if (entry->lru_next != RATELIMIT_NONE)
+            limit->slots[entry->lru_next].lru_prev = hole;
+        else
+            limit->oldest = hole;
+        hole = next;
+    }
+}
+
+static void ratelimit_lru_unlink(struct ratelimit* limit, uint32_t index) {
+    struct ratelimit_entry* entry = &limit->slots[index];
+
+    if (entry->lru_prev != RATELIMIT_NONE)
+        limit->slots[entry->lru_prev].lru_next = entry->lru_next;
+    else
+        limit->newest = entry->lru_next;
+    if (entry->lru_next != RATELIMIT_NONE)
+        limit->slots[entry->lru_next].lru_prev = entry->lru_prev;
+    else
+        limit->oldest = entry->lru_prev;
+}
+
+static void ratelimit_lru_push(struct ratelimit* limit, uint32_t index) {
+    struct ratelimit_entry* entry = &limit->slots[index];
+
+    entry->lru_prev = RATELIMIT_NONE;
+    entry->lru_next = limit->newest;
+    if (limit->newest != RATELIMIT_NONE)
+        limit->slots[limit->newest].lru_prev = index;
+    else
+        limit->oldest = index;
+    limit->newest = index;
+}
+
+//* Take the credit of tokens messages from a bucket, or count them as dropped if it holds less
+static int ratelimit_take(const struct ratelimit* limit, struct ratelimit_entry* entry, unsigned tokens) {
+    if (entry->credit < tokens * limit->cost) {
+        metrics_add(METRICS_RATE_LIMITED, tokens);
+        return 0;
+    }
+    entry->credit -= tokens * limit->cost;
+    return 1;
+}
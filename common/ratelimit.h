@@ -0,0 +1,72 @@
+#ifndef COMMON_RATELIMIT_H
+#define COMMON_RATELIMIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define RATELIMIT_SLOTS 65536      //- Hash table slots of a limiter, a power of two (2 MB of entries)
+#define RATELIMIT_NONE UINT32_MAX  //- Empty LRU link
+
+//* Token bucket of one source address
+//- The tokens are kept as nanoseconds of credit: one message costs 1e9 / rate of them and the bucket refills by the
+//- time that passed, up to burst messages worth. That needs no division on the receive path and no timer.
+struct ratelimit_entry {
+    uint32_t addr;      //- IPv4 source address (network byte order)
+    uint32_t used;      //- Set while the slot holds a source
+    uint32_t lru_prev;  //- Slot of the next more recently seen source (RATELIMIT_NONE: this one is the newest)
+    uint32_t lru_next;  //- Slot of the next less recently seen source (RATELIMIT_NONE: this one is the oldest)
+    uint64_t credit;    //- Tokens left, in nanoseconds of credit
+    uint64_t last;      //- Time of the last refill in nanoseconds (see metrics_now())
+};
+
+//* Per-source rate limiter
+//- The buckets live in an open-addressing hash table with linear probing, keyed by the source address. A lookup is a
+//- multiply, a shift and usually one cache line, nothing is allocated per source. The table holds at most 3/4 of
+//- RATELIMIT_SLOTS sources so the probe sequences stay short. When it is full, the least recently seen source is
+//- evicted: every lookup moves its source to the front of an LRU list threaded through the slots, the back of the
+//- list goes first. Deletion shifts the following entries of the probe sequence back, so no tombstones pile up.
+//- An evicted source comes back with a full bucket, which only matters for a table that is too small for the number
+//- of active sources (echo_rate_limit_evictions_total).
+//-
+//- The hash is seeded at random per limiter, so the probe sequences a flood of spoofed source addresses lands on
+//- cannot be planned in advance. A limiter belongs to one thread and takes no locks.
+struct ratelimit {
+    struct ratelimit_entry* slots;  //- RATELIMIT_SLOTS entries
+    uint64_t seed;                  //- Random hash seed
+    uint64_t cost;                  //- Credit one message costs (1e9 / rate)
+    uint64_t capacity;              //- Credit of a full bucket (burst * cost)
+    uint32_t count;                 //- Sources in the table
+    uint32_t newest;                //- Front of the LRU list
+    uint32_t oldest;                //- Back of the LRU list, evicted first
+};
+
+//* Rate limiter interface
+//- ratelimit_init() sets up a limiter of rate messages per second and source, with bursts of up to burst messages
+//- (0: rate, one second worth). ratelimit_allow() takes tokens from the bucket of addr at time now (nanoseconds, see metrics_now()),
+//- one per message the caller lets through at once; a source seen for the first time starts with a full bucket. Drops
+//- and evictions are counted in the metrics.
+//? ratelimit_init() returns -1 if the table cannot be allocated. ratelimit_allow() returns 1 if the messages may pass,
+//? 0 if the bucket does not hold all tokens and they should be dropped, which is always the case for more than burst.
+int ratelimit_init(struct ratelimit* limit, unsigned rate, unsigned burst);
+int ratelimit_allow(struct ratelimit* limit, uint32_t addr, uint64_t now, unsigned tokens);
+void ratelimit_destroy(struct ratelimit* limit);
+
+//* Connection admission
+//- A global limit on the connections that are open at the same time, over every thread and process of a server. The
+//- count lives in a shared anonymous mapping, so the forked children and prefork workers created after
+//- admission_init() count against the same limit. admission_enter() reserves a slot for an accepted connection,
+//- admission_leave() gives it back when the connection closes. A refused connection is reset with
+//- admission_refuse(): an RST costs the server no TIME_WAIT state, and the client learns at once instead of waiting.
+//- With a limit of 0 (or before admission_init()) every connection is admitted and nothing is counted.
+//- admission_accept() is the check of an accept loop: the per-source rate of limit (NULL: none), then the connection
+//- limit, and the reset of a connection that fails either.
+//? admission_init() returns -1 if the mapping fails. admission_enter() returns 1 if the connection is admitted, 0 if
+//? the limit is reached (counted in echo_rejected_connections_total). admission_accept() returns 1 if the connection
+//? is admitted and must call admission_leave() when it closes, 0 if it was reset.
+int admission_init(long max_connections);
+int admission_enter(void);
+void admission_leave(void);
+void admission_refuse(int fd);
+int admission_accept(struct ratelimit* limit, int fd, uint32_t addr);
+
+#endif
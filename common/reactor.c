@@ -0,0 +1,649 @@
+#define _GNU_SOURCE
+
+#include "reactor.h"
+#include "busypoll.h"
+#include "log.h"
+#include "metrics.h"
+#include "trace.h"
+#include "tuning.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static void reactor_accept(struct reactor* reactor);
+static void reactor_read(struct reactor* reactor, struct reactor_conn* conn);
+static int reactor_flush(struct reactor* reactor, struct reactor_conn* conn);
+static int reactor_queue(struct reactor* reactor, struct reactor_conn* conn, const char* data, size_t len);
+static int reactor_queue_zerocopy(struct reactor* reactor, struct reactor_conn* conn, struct zerocopy_buffer* buffer, size_t len);
+static struct zerocopy_buffer* reactor_zerocopy_buffer(struct reactor* reactor);
+static void reactor_zerocopy_reap(struct reactor* reactor, struct reactor_conn* conn);
+static void reactor_zerocopy_release(void* context, uint32_t lo, uint32_t hi);
+static void reactor_half_close(struct reactor* reactor, struct reactor_conn* conn);
+static void reactor_close_conn(struct reactor* reactor, struct reactor_conn* conn);
+static void reactor_linger_expired(struct reactor* reactor, struct reactor_conn* conn);
+static void reactor_free_conn(struct reactor* reactor, struct reactor_conn* conn);
+static void reactor_arm(struct reactor* reactor, struct reactor_conn* conn, int progress);
+static void reactor_expired(struct timerwheel_timer* timer, void* context);
+
+//* Argument of reactor_zerocopy_release()
+struct reactor_zerocopy_context {
+    struct reactor* reactor;    //- Reactor that owns the buffer pool
+    struct reactor_conn* conn;  //- Connection whose error queue is read
+};
+
+//* Switch a file descriptor to non-blocking mode
+//? Returns -1 if the fcntl() syscall fails.
+int set_nonblocking(int fd) {
+    int flags;
+    if ((flags = fcntl(fd, F_GETFL, 0)) == -1)
+        return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+//* Raise the open file limit to the hard limit
+//- The default soft limit (usually 1024) caps the number of concurrent connections of a single process.
+void raise_fd_limit(void) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+//* Create the epoll instance and register the listening socket
+//- The listening socket is switched to non-blocking mode so that reactor_accept() can drain the accept queue.
+//- The listening socket is registered with a NULL data pointer, client sockets carry their struct reactor_conn.
+//- Nothing is allocated up front: read buffers come from the pool when a connection becomes readable.
+//- With REACTOR_EXCLUSIVE the listener is registered with EPOLLEXCLUSIVE: when several processes wait on the same
+//- listening socket, a new connection wakes one of them instead of all (no thundering herd).
+//? Returns -1 on failure, errno is set by the failing syscall.
+int reactor_init(struct reactor* reactor, int listen_fd, size_t read_size, int flags) {
+    struct epoll_event event;
+
+    memset(reactor, 0, sizeof *reactor);
+    reactor->listen_fd = listen_fd;
+    reactor->read_size = read_size < REACTOR_READ_MAX ? read_size : REACTOR_READ_MAX;
+    pool_init(&reactor->pool);
+    reactor->now = timerwheel_now();
+    timerwheel_init(&reactor->timers, reactor->now);
+
+    if (set_nonblocking(listen_fd) == -1 || (reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+        return -1;
+
+    event.events = EPOLLIN | EPOLLET | (flags & REACTOR_EXCLUSIVE ? EPOLLEXCLUSIVE : 0);
+    event.data.ptr = NULL;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) == -1) {
+        close(reactor->epoll_fd);
+        return -1;
+    }
+    return 0;
+}
+
+//* Switch the reactor to zerocopy mode
+//- Allocates the REACTOR_ZEROCOPY_BUFFERS receive buffers. Connections accepted from now on get SO_ZEROCOPY.
+//? Returns -1 if the buffers cannot be allocated.
+int reactor_enable_zerocopy(struct reactor* reactor, size_t threshold) {
+    if ((reactor->zerocopy_buffers = calloc(REACTOR_ZEROCOPY_BUFFERS, sizeof *reactor->zerocopy_buffers)) == NULL)
+        return -1;
+    for (size_t i = 0; i < REACTOR_ZEROCOPY_BUFFERS; i++) {
+        if ((reactor->zerocopy_buffers[i].data = malloc(ZEROCOPY_BUFFER_SIZE)) == NULL) {
+            while (i-- > 0) free(reactor->zerocopy_buffers[i].data);
+            free(reactor->zerocopy_buffers);
+            reactor->zerocopy_buffers = NULL;
+            return -1;
+        }
+    }
+    reactor->zerocopy_threshold = threshold;
+    return 0;
+}
+
+//* Limit the connections every source address may open per second
+//- Each reactor keeps its own table: a reactor only sees the connections it accepts, no lock is needed, and with
+//- reuseport a source is usually hashed to the same worker anyway.
+//? Returns -1 if the table cannot be allocated.
+int reactor_limit_rate(struct reactor* reactor, unsigned rate, unsigned burst) {
+    if ((reactor->limit = malloc(sizeof *reactor->limit)) == NULL)
+        return -1;
+    if (ratelimit_init(reactor->limit, rate, burst) == -1) {
+        free(reactor->limit);
+        reactor->limit = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+//* Run the event loop
+//- epoll_wait() blocks until at least one registered socket changes state or the next timeout is due, then each event
+//- is dispatched: the listening socket accepts new clients, client sockets flush pending output and echo everything
+//- they can read. The connections whose timeout passed are closed last.
+//? Returns 0 once a drain is complete, -1 if epoll_wait() fails with something other than EINTR.
+int reactor_run(struct reactor* reactor) {
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    int ready;
+
+    while (1) {
+        //- A draining reactor accepts nothing more, the connections still queued on the listener go to the other
+        //- processes sharing it.
+        if (reactor->draining) {
+            if (reactor->listen_fd != -1) {
+                epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, reactor->listen_fd, NULL);
+                reactor->listen_fd = -1;
+            }
+            if (reactor->connections == 0)
+                return 0;
+        }
+
+        ready = busypoll_epoll_wait(reactor->epoll_fd, events, REACTOR_MAX_EVENTS, timerwheel_timeout(&reactor->timers, timerwheel_now()),
+                                    reactor->wait_mask, reactor->spin);
+        if (ready == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("error: epoll_wait failed, aborting...");
+            return -1;
+        }
+        reactor->now = timerwheel_now();
+
+        for (int i = 0; i < ready; i++) {
+            struct reactor_conn* conn = events[i].data.ptr;
+
+            if (conn == NULL) {
+                reactor_accept(reactor);
+                continue;
+            }
+
+            //- EPOLLERR is also raised when zerocopy notifications are waiting on the error queue.
+            if ((events[i].events & EPOLLERR) && conn->zerocopy_buffers > 0)
+                reactor_zerocopy_reap(reactor, conn);
+
+            //- A closed connection that still pins zerocopy buffers only waits for its notifications.
+            if (conn->timeout == REACTOR_TIMEOUT_LINGER) {
+                if (conn->zerocopy_buffers == 0)
+                    reactor_free_conn(reactor, conn);
+                continue;
+            }
+
+            //- A hangup or an error is only final once the receive queue is drained, the read handler detects it. A
+            //- half-closed connection reads nothing anymore, its pending output is flushed to find out instead.
+            if ((events[i].events & EPOLLOUT) || (conn->eof && (events[i].events & (EPOLLHUP | EPOLLERR)))) {
+                size_t pending = conn->out_len - conn->out_off;
+                if (reactor_flush(reactor, conn) == -1) {
+                    metrics_add(METRICS_ERRORS, 1);
+                    reactor_close_conn(reactor, conn);
+                    continue;
+                }
+                reactor_arm(reactor, conn, conn->out_len - conn->out_off < pending);
+                //- The peer caught up, resume reading if the connection was throttled.
+                if (conn->read_paused && conn->out_len - conn->out_off < REACTOR_OUTPUT_LIMIT) {
+                    conn->read_paused = 0;
+                    events[i].events |= EPOLLIN;
+                }
+            }
+            if (conn->eof) {
+                if (conn->out_off == conn->out_len && conn->zerocopy_buffers == 0)
+                    reactor_close_conn(reactor, conn);
+                continue;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                reactor_read(reactor, conn);
+        }
+        timerwheel_expire(&reactor->timers, reactor->now, reactor_expired, reactor);
+    }
+}
+
+//* Close the epoll instance and release the pool
+//- Client connections are owned by the process, they are closed by the kernel on exit. Their state lives in the pool,
+//- so the reactor must not run anymore.
+//- The zerocopy buffers are released too, the sends that may still pin them belong to connections that die with the
+//- process.
+void reactor_destroy(struct reactor* reactor) {
+    close(reactor->epoll_fd);
+    pool_destroy(&reactor->pool);
+    if (reactor->zerocopy_buffers != NULL) {
+        for (size_t i = 0; i < REACTOR_ZEROCOPY_BUFFERS; i++) free(reactor->zerocopy_buffers[i].data);
+        free(reactor->zerocopy_buffers);
+    }
+    if (reactor->limit != NULL) {
+        ratelimit_destroy(reactor->limit);
+        free(reactor->limit);
+    }
+}
+
+//* Accept every pending connection
+//- With EPOLLET the listening socket is reported once per burst, so accept4() is called until EAGAIN.
+//- accept4() with SOCK_NONBLOCK saves the extra fcntl() syscall for every client socket.
+//- Client sockets are registered for both directions once. EPOLLOUT is edge-triggered too, so it is only reported when
+//- the send buffer goes from full to writable and does not need an epoll_ctl() call per short write.
+static void reactor_accept(struct reactor* reactor) {
+    struct sockaddr_in client_addr;
+    struct epoll_event event;
+    struct reactor_conn* conn;
+    int client_fd;
+
+    while (1) {
+        if ((client_fd = accept4(reactor->listen_fd, (struct sockaddr*)&client_addr, &(socklen_t){sizeof client_addr}, SOCK_NONBLOCK)) == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_error("error: socket accepting failed: %e", errno);  //- EMFILE/ENFILE/ENOBUFS: keep serving the open connections
+                metrics_add(METRICS_ERRORS, 1);
+            }
+            return;
+        }
+        if (!admission_accept(reactor->limit, client_fd, client_addr.sin_addr.s_addr))
+            continue;
+
+        if ((conn = pool_alloc(&reactor->pool, sizeof *conn, NULL)) == NULL) {
+            log_error("error: connection allocation failed: %e", errno);
+            metrics_add(METRICS_ERRORS, 1);
+            close(client_fd);
+            admission_leave();
+            continue;
+        }
+        memset(conn, 0, sizeof *conn);
+        conn->fd = client_fd;
+        conn->addr = client_addr;
+        conn->read_size = reactor->read_size;
+        conn->zerocopy = reactor->zerocopy_threshold > 0 && zerocopy_enable(client_fd) == 0;
+        frame_parser_init(&conn->parser);
+
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = conn;
+        if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, client_fd, &event) == -1) {
+            log_error("error: epoll registration failed: %e", errno);
+            metrics_add(METRICS_ERRORS, 1);
+            close(client_fd);
+            pool_free(&reactor->pool, conn, sizeof *conn);
+            admission_leave();
+            continue;
+        }
+        conn->trace = trace_open();
+        reactor->connections++;
+        reactor_arm(reactor, conn, 1);
+        metrics_add(METRICS_ACCEPTED, 1);
+        log_info("  new connection from %a:%u", conn->addr.sin_addr.s_addr, ntohs(conn->addr.sin_port));
+    }
+}
+
+//* Read and echo until the socket is drained
+//- Every chunk is sent straight back. Whatever the kernel does not accept is kept in the connection output buffer
+//- and flushed on the next EPOLLOUT. Reading stops once REACTOR_OUTPUT_LIMIT bytes are pending, so a client that
+//- sends without reading cannot make the server buffer an unbounded amount of data.
+//- The input is run through the frame parser to validate and log the messages. The echo of a message is
+//- byte-identical to the message, so the received bytes are queued unchanged: one send() covers every message of the
+//- read, headers included, and nothing has to be re-encoded. A connection that sends an invalid header is closed.
+//- The read buffer is taken from the pool for this event only and goes back once the socket is drained, so idle
+//- connections hold no buffer. Its size adapts to the traffic: a read that fills it moves the connection one size
+//- class up (up to REACTOR_READ_MAX), an event whose reads all used a quarter of it or less moves it one class down.
+//- In zerocopy mode the read goes into a free zerocopy buffer if there is one, so that it can be echoed from there.
+//- The end of the input does not close the connection by itself, see reactor_half_close().
+static void reactor_read(struct reactor* reactor, struct reactor_conn* conn) {
+    char* read_buffer = NULL;
+    size_t read_capacity = 0, largest_read = 0;
+    ssize_t bytes_received;
+    unsigned started = 0;
+    int closed = 0;
+
+    while (!conn->read_paused && !closed) {
+        struct zerocopy_buffer* zerocopy_buffer = conn->zerocopy ? reactor_zerocopy_buffer(reactor) : NULL;
+        char* buffer;
+        size_t buffer_size;
+
+        if (zerocopy_buffer == NULL && read_buffer == NULL &&
+            (read_buffer = pool_alloc(&reactor->pool, conn->read_size, &read_capacity)) == NULL) {
+            log_error("error: read buffer allocation failed: %e", errno);
+            metrics_add(METRICS_ERRORS, 1);
+            closed = 1;
+            break;
+        }
+        buffer = zerocopy_buffer != NULL ? zerocopy_buffer->data : read_buffer;
+        buffer_size = zerocopy_buffer != NULL ? ZEROCOPY_BUFFER_SIZE : read_capacity;
+
+        if ((bytes_received = recv(conn->fd, buffer, buffer_size, 0)) > 0) {
+            uint64_t start = metrics_now();
+            const char* data = buffer;
+            size_t len = bytes_received;
+            struct frame_chunk chunk;
+            unsigned messages = 0;
+            int status;
+
+            if (reactor->quickack)
+                tuning_quickack(conn->fd);
+            while ((status = frame_parse(&conn->parser, &data, &len, &chunk)) == 1) {
+                if (chunk.offset > 0)
+                    continue;
+                messages++;
+                log_info_data(chunk.data, chunk.len, "received message from %a:%u (%4u byte): %s", conn->addr.sin_addr.s_addr,
+                              ntohs(conn->addr.sin_port), chunk.length);
+            }
+            metrics_add(METRICS_BYTES_RECEIVED, bytes_received);
+            metrics_add(METRICS_MESSAGES, messages);
+            trace_record(conn->trace, TRACE_IN, buffer, bytes_received);
+            started += messages;
+            if (status == -1) {
+                log_error("error: invalid message header from %a:%u, closing the connection", conn->addr.sin_addr.s_addr,
+                          ntohs(conn->addr.sin_port));
+                metrics_add(METRICS_ERRORS, 1);
+                closed = 1;
+                break;
+            }
+
+            //- Only a read that starts a new output stream can go out zerocopy, pending output is sent first.
+            if ((zerocopy_buffer != NULL && (size_t)bytes_received >= reactor->zerocopy_threshold && conn->out_off == conn->out_len
+                     ? reactor_queue_zerocopy(reactor, conn, zerocopy_buffer, bytes_received)
+                     : reactor_queue(reactor, conn, buffer, bytes_received)) == -1) {
+                log_error("error: socket sending failed: %e", errno);
+                metrics_add(METRICS_ERRORS, 1);
+                closed = 1;
+                break;
+            }
+            metrics_record_service(start);
+            log_info("          reply to %a:%u (%4u byte, %u new messages)", conn->addr.sin_addr.s_addr, ntohs(conn->addr.sin_port),
+                     bytes_received, messages);
+            if (conn->out_len - conn->out_off >= REACTOR_OUTPUT_LIMIT)
+                conn->read_paused = 1;
+
+            if (zerocopy_buffer == NULL) {
+                if ((size_t)bytes_received > largest_read)
+                    largest_read = bytes_received;
+                //- A full read means more is waiting: continue with a buffer of the next class.
+                if ((size_t)bytes_received == read_capacity && conn->read_size < REACTOR_READ_MAX) {
+                    conn->read_size = read_capacity * 2 < REACTOR_READ_MAX ? read_capacity * 2 : REACTOR_READ_MAX;
+                    pool_free(&reactor->pool, read_buffer, read_capacity);
+                    read_buffer = NULL;
+                }
+            }
+        } else if (bytes_received == 0) {
+            log_info("client %a:%u disconnected", conn->addr.sin_addr.s_addr, ntohs(conn->addr.sin_port));
+            conn->eof = 1;
+            break;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        } else if (errno != EINTR) {
+            log_error("error: socket receiving failed: %e", errno);
+            metrics_add(METRICS_ERRORS, 1);
+            closed = 1;
+        }
+    }
+
+    if (read_buffer != NULL) {
+        if (largest_read > 0 && largest_read <= read_capacity / 4 && conn->read_size > reactor->read_size)
+            conn->read_size = conn->read_size / 2 > reactor->read_size ? conn->read_size / 2 : reactor->read_size;
+        pool_free(&reactor->pool, read_buffer, read_capacity);
+    }
+    if (closed)
+        reactor_close_conn(reactor, conn);
+    else if (conn->eof)
+        reactor_half_close(reactor, conn);
+    else
+        reactor_arm(reactor, conn, started > 0);
+}
+
+//* Finish a connection whose client shut down its side
+//- The echoes of the input before the end are still owed. The socket stops watching for input, EPOLLOUT and the
+//- zerocopy notifications on EPOLLERR are all that is left, and the event loop closes the connection once both are done.
+static void reactor_half_close(struct reactor* reactor, struct reactor_conn* conn) {
+    if (conn->out_off == conn->out_len && conn->zerocopy_buffers == 0) {
+        reactor_close_conn(reactor, conn);
+        return;
+    }
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_MOD, conn->fd, &(struct epoll_event){.events = EPOLLOUT | EPOLLET, .data.ptr = conn}) == -1) {
+        log_error("error: epoll registration failed: %e", errno);
+        metrics_add(METRICS_ERRORS, 1);
+        reactor_close_conn(reactor, conn);
+        return;
+    }
+    reactor_arm(reactor, conn, 1);
+}
+
+//* Send as much pending output as the socket accepts
+//- Once everything is sent the output buffer goes back to the pool.
+//? Returns -1 if the connection failed, 0 otherwise (even if output is still pending).
+static int reactor_flush(struct reactor* reactor, struct reactor_conn* conn) {
+    ssize_t bytes_sent;
+
+    while (conn->out_off < conn->out_len) {
+        if ((bytes_sent = send(conn->fd, conn->out_buf + conn->out_off, conn->out_len - conn->out_off, MSG_NOSIGNAL)) == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        metrics_add(METRICS_BYTES_SENT, bytes_sent);
+        trace_record(conn->trace, TRACE_OUT, conn->out_buf + conn->out_off, bytes_sent);
+        conn->out_off += bytes_sent;
+    }
+    pool_free(&reactor->pool, conn->out_buf, conn->out_cap);
+    conn->out_buf = NULL;
+    conn->out_off = conn->out_len = conn->out_cap = 0;
+    return 0;
+}
+
+//* Send data or append it to the output buffer
+//- If nothing is pending the data is sent directly, only the part the kernel refused is copied.
+//- Otherwise it is appended behind the pending bytes to keep the stream in order. The buffer grows by moving to a
+//- bigger pool size class.
+//? Returns -1 if the connection failed or the buffer could not grow.
+static int reactor_queue(struct reactor* reactor, struct reactor_conn* conn, const char* data, size_t len) {
+    ssize_t bytes_sent;
+
+    if (conn->out_off == conn->out_len) {
+        while (len > 0) {
+            if ((bytes_sent = send(conn->fd, data, len, MSG_NOSIGNAL)) == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    break;
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            }
+            metrics_add(METRICS_BYTES_SENT, bytes_sent);
+            trace_record(conn->trace, TRACE_OUT, data, bytes_sent);
+            data += bytes_sent;
+            len -= bytes_sent;
+        }
+        if (len == 0)
+            return 0;
+    }
+
+    //- Compact the already sent prefix away before growing the buffer.
+    if (conn->out_off > 0) {
+        memmove(conn->out_buf, conn->out_buf + conn->out_off, conn->out_len - conn->out_off);
+        conn->out_len -= conn->out_off;
+        conn->out_off = 0;
+    }
+    if (conn->out_len + len > conn->out_cap) {
+        size_t new_cap;
+        char* new_buf;
+        if ((new_buf = pool_alloc(&reactor->pool, conn->out_len + len, &new_cap)) == NULL)
+            return -1;
+        if (conn->out_len > 0)
+            memcpy(new_buf, conn->out_buf, conn->out_len);
+        pool_free(&reactor->pool, conn->out_buf, conn->out_cap);
+        conn->out_buf = new_buf;
+        conn->out_cap = new_cap;
+    }
+    memcpy(conn->out_buf + conn->out_len, data, len);
+    conn->out_len += len;
+    return 0;
+}
+
+//* Send a zerocopy buffer and queue what the kernel refused
+//- Only the first send goes out zerocopy, the rest is copied into the output buffer like any short write: the copy is
+//- needed anyway once the kernel refuses data, and it keeps the buffer pinned by at most one send.
+//? Returns -1 if the connection failed or the output buffer could not grow.
+static int reactor_queue_zerocopy(struct reactor* reactor, struct reactor_conn* conn, struct zerocopy_buffer* buffer, size_t len) {
+    ssize_t bytes_sent;
+    int zerocopy;
+
+    while ((bytes_sent = zerocopy_send(conn->fd, buffer->data, len, MSG_NOSIGNAL, &zerocopy)) == -1 && errno == EINTR) continue;
+    if (bytes_sent == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            return -1;
+        bytes_sent = 0;
+    }
+    if (zerocopy) {
+        buffer->owner = conn;
+        buffer->first_id = buffer->last_id = conn->zerocopy_next_id++;
+        buffer->pending = 1;
+        conn->zerocopy_buffers++;
+    }
+    metrics_add(METRICS_BYTES_SENT, bytes_sent);
+    trace_record(conn->trace, TRACE_OUT, buffer->data, bytes_sent);
+    return (size_t)bytes_sent == len ? 0 : reactor_queue(reactor, conn, buffer->data + bytes_sent, len - bytes_sent);
+}
+
+//* Find a zerocopy buffer that no send pins
+//? Returns NULL if every buffer is pinned.
+static struct zerocopy_buffer* reactor_zerocopy_buffer(struct reactor* reactor) {
+    for (size_t i = 0; i < REACTOR_ZEROCOPY_BUFFERS; i++) {
+        struct zerocopy_buffer* buffer = &reactor->zerocopy_buffers[(reactor->zerocopy_next + i) % REACTOR_ZEROCOPY_BUFFERS];
+        if (buffer->pending == 0) {
+            reactor->zerocopy_next = (reactor->zerocopy_next + i + 1) % REACTOR_ZEROCOPY_BUFFERS;
+            return buffer;
+        }
+    }
+    return NULL;
+}
+
+//* Read the zerocopy notifications of a connection and free the buffers they release
+static void reactor_zerocopy_reap(struct reactor* reactor, struct reactor_conn* conn) {
+    struct reactor_zerocopy_context context = {.reactor = reactor, .conn = conn};
+
+    if (zerocopy_reap(conn->fd, reactor_zerocopy_release, &context) == -1) {
+        log_error("error: reading the zerocopy notifications failed: %e", errno);
+        metrics_add(METRICS_ERRORS, 1);
+    }
+}
+
+static void reactor_zerocopy_release(void* context, uint32_t lo, uint32_t hi) {
+    struct reactor_zerocopy_context* ctx = context;
+
+    for (size_t i = 0; i < REACTOR_ZEROCOPY_BUFFERS && ctx->conn->zerocopy_buffers > 0; i++) {
+        struct zerocopy_buffer* buffer = &ctx->reactor->zerocopy_buffers[i];
+        if (buffer->owner != ctx->conn)
+            continue;
+        zerocopy_buffer_release(buffer, lo, hi);
+        if (buffer->pending == 0)
+            ctx->conn->zerocopy_buffers--;
+    }
+}
+
+//* Close a client connection and release its state
+//- close() also removes the socket from the epoll interest list.
+//- A zerocopy buffer must not be reused until the kernel released it, and the notifications that do so arrive on the
+//- error queue of the socket. If sends are still pinned after the last notifications were read, the connection is
+//- closed for the client (its pending output dropped, its slot returned) but the socket is kept: it is shut down and
+//- lingers in the event loop until the notifications arrived, for at most REACTOR_LINGER_TIMEOUT.
+static void reactor_close_conn(struct reactor* reactor, struct reactor_conn* conn) {
+    if (conn->zerocopy_buffers > 0)
+        reactor_zerocopy_reap(reactor, conn);
+    trace_close(conn->trace);
+    pool_free(&reactor->pool, conn->out_buf, conn->out_cap);
+    conn->out_buf = NULL;
+    conn->out_off = conn->out_len = conn->out_cap = 0;
+    admission_leave();
+    metrics_add(METRICS_CLOSED, 1);
+    if (conn->zerocopy_buffers == 0) {
+        reactor_free_conn(reactor, conn);
+        return;
+    }
+    shutdown(conn->fd, SHUT_RDWR);
+    conn->timeout = REACTOR_TIMEOUT_LINGER;
+    timerwheel_arm(&reactor->timers, &conn->timer, reactor->now + REACTOR_LINGER_TIMEOUT);
+}
+
+//* End the linger of a connection whose peer does not take the pinned data
+//- Disconnecting the socket (connect() with AF_UNSPEC) resets the connection and purges its send queue, which releases
+//- the pages and queues the last notifications, while the socket and its error queue stay open to read them. A buffer
+//- the kernel still has not released after that is retired: its memory is abandoned rather than reused, and the pool
+//- gets a fresh one in its place.
+static void reactor_linger_expired(struct reactor* reactor, struct reactor_conn* conn) {
+    connect(conn->fd, &(struct sockaddr){.sa_family = AF_UNSPEC}, sizeof(struct sockaddr));
+    reactor_zerocopy_reap(reactor, conn);
+    for (size_t i = 0; i < REACTOR_ZEROCOPY_BUFFERS && conn->zerocopy_buffers > 0; i++) {
+        struct zerocopy_buffer* buffer = &reactor->zerocopy_buffers[i];
+        char* data;
+
+        if (buffer->owner != conn)
+            continue;
+        log_error("error: zerocopy buffer still pinned by %a:%u after the reset, retiring it", conn->addr.sin_addr.s_addr,
+                  ntohs(conn->addr.sin_port));
+        metrics_add(METRICS_ERRORS, 1);
+        conn->zerocopy_buffers--;
+        if ((data = malloc(ZEROCOPY_BUFFER_SIZE)) == NULL) {
+            buffer->owner = reactor;  //- Matches no connection: the buffer stays pending and is never picked again
+            continue;
+        }
+        buffer->data = data;
+        buffer->owner = NULL;
+        buffer->pending = 0;
+    }
+    reactor_free_conn(reactor, conn);
+}
+
+static void reactor_free_conn(struct reactor* reactor, struct reactor_conn* conn) {
+    timerwheel_cancel(&reactor->timers, &conn->timer);
+    close(conn->fd);
+    pool_free(&reactor->pool, conn, sizeof *conn);
+    reactor->connections--;
+}
+
+//* Arm the timeout that matches the state of a connection
+//- The deadline of a timeout only moves on progress: a new message (the previous one is complete then), or output the
+//- kernel took. A client that trickles one message byte by byte cannot keep its connection alive that way, the read
+//- timeout bounds the whole message. A change of state starts the timeout of the new state. Rearming is an unlink and
+//- an insert in the wheel.
+static void reactor_arm(struct reactor* reactor, struct reactor_conn* conn, int progress) {
+    enum reactor_timeout timeout = REACTOR_TIMEOUT_IDLE;
+    uint64_t duration = reactor->idle_timeout;
+
+    if (conn->out_off < conn->out_len || (conn->eof && conn->zerocopy_buffers > 0)) {
+        timeout = REACTOR_TIMEOUT_WRITE;
+        duration = reactor->write_timeout;
+    } else if (conn->parser.header_len > 0 || conn->parser.remaining > 0) {
+        timeout = REACTOR_TIMEOUT_READ;
+        duration = reactor->read_timeout;
+    }
+    if (timeout == conn->timeout && !progress)
+        return;
+    conn->timeout = timeout;
+    if (duration == 0)
+        timerwheel_cancel(&reactor->timers, &conn->timer);
+    else
+        timerwheel_arm(&reactor->timers, &conn->timer, reactor->now + duration);
+}
+
+//* Close a connection whose timeout passed
+static void reactor_expired(struct timerwheel_timer* timer, void* context) {
+    struct reactor_conn* conn = (struct reactor_conn*)((char*)timer - offsetof(struct reactor_conn, timer));
+    struct reactor* reactor = context;
+
+    switch (conn->timeout) {
+        case REACTOR_TIMEOUT_LINGER:
+            reactor_linger_expired(reactor, conn);
+            return;
+        case REACTOR_TIMEOUT_READ:
+            log_info("client %a:%u did not complete its message in time, closing the connection", conn->addr.sin_addr.s_addr,
+                     ntohs(conn->addr.sin_port));
+            metrics_add(METRICS_READ_TIMEOUTS, 1);
+            break;
+        case REACTOR_TIMEOUT_WRITE:
+            log_info("client %a:%u did not read its echoes in time, closing the connection", conn->addr.sin_addr.s_addr,
+                     ntohs(conn->addr.sin_port));
+            metrics_add(METRICS_WRITE_TIMEOUTS, 1);
+            break;
+        default:
+            log_info("client %a:%u idle for too long, closing the connection", conn->addr.sin_addr.s_addr, ntohs(conn->addr.sin_port));
+            metrics_add(METRICS_IDLE_TIMEOUTS, 1);
+            break;
+    }
+    reactor_close_conn(reactor, conn);
+}
@@ -0,0 +1,115 @@
+#ifndef COMMON_REACTOR_H
+#define COMMON_REACTOR_H
+
+#include <netinet/in.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "frame.h"
+#include "pool.h"
+#include "ratelimit.h"
+#include "timerwheel.h"
+#include "zerocopy.h"
+
+#define REACTOR_MAX_EVENTS 1024            //- Maximum number of events returned by a single epoll_wait() call
+#define REACTOR_OUTPUT_LIMIT (256 * 1024)  //- Pending output size at which the reactor stops reading from a connection
+#define REACTOR_READ_MAX (64 * 1024)       //- Largest read buffer a connection grows to
+#define REACTOR_ZEROCOPY_BUFFERS 64        //- Receive buffers of a reactor in zerocopy mode (ZEROCOPY_BUFFER_SIZE each)
+#define REACTOR_LINGER_TIMEOUT 1000        //- Milliseconds a closed connection waits for its zerocopy notifications
+
+#define REACTOR_EXCLUSIVE 1  //- reactor_init() flag: the listener is shared with other processes, register it with EPOLLEXCLUSIVE
+
+//* Timeout a connection is armed with, it follows the state of the connection
+enum reactor_timeout {
+    REACTOR_TIMEOUT_NONE,    //- Not armed yet
+    REACTOR_TIMEOUT_IDLE,    //- Nothing pending, waiting for the next message
+    REACTOR_TIMEOUT_READ,    //- Part of a message received, waiting for the rest
+    REACTOR_TIMEOUT_WRITE,   //- Echo bytes or zerocopy notifications of a half-closed connection pending
+    REACTOR_TIMEOUT_LINGER,  //- Closed, but zerocopy sends still pin reactor buffers: waiting for their notifications
+};
+
+//* Per-connection state of the reactor
+//- Every accepted socket owns one of these, taken from the reactor pool (128-byte class). An idle connection holds
+//- nothing else: a read buffer is only taken from the pool while the socket is readable and goes back once it is
+//- drained, and the output buffer only exists while the kernel has not accepted all bytes yet. The timer is embedded,
+//- arming it allocates nothing and keeps the state in the 128-byte class.
+struct reactor_conn {
+    int fd;                         //- Client socket file descriptor (non-blocking)
+    uint8_t read_paused;            //- Set when the output buffer hit REACTOR_OUTPUT_LIMIT and reading was suspended
+    uint8_t eof;                    //- Set when the client shut down its side, the connection only sends its echoes
+    uint16_t zerocopy;              //- Set if SO_ZEROCOPY is enabled on the socket
+    uint32_t read_size;             //- Read buffer size the next readable event takes from the pool
+    struct sockaddr_in addr;        //- Client address, used for logging
+    struct frame_parser parser;     //- Message framing state of the input stream
+    char* out_buf;                  //- Pending output bytes (NULL until the first short write)
+    size_t out_off;                 //- Offset of the first unsent byte in out_buf
+    size_t out_len;                 //- Number of valid bytes in out_buf
+    size_t out_cap;                 //- Capacity of out_buf (a pool size class)
+    uint32_t trace;                 //- Capture trace id (0: not captured, see common/trace.h)
+    uint32_t zerocopy_next_id;      //- Notification id of the next MSG_ZEROCOPY send
+    unsigned zerocopy_buffers;      //- Reactor zerocopy buffers pinned by sends of this connection
+    enum reactor_timeout timeout;   //- Armed timeout
+    struct timerwheel_timer timer;  //- Deadline of the armed timeout in the reactor timing wheel
+};
+
+//* Single-threaded, edge-triggered epoll event loop
+//- The listening socket and every client socket are registered with EPOLLET, so each readiness change is reported once
+//- and the handlers must drain the socket until EAGAIN.
+//-
+//- In zerocopy mode (reactor_enable_zerocopy()) reads go into a set of 64 KB zerocopy buffers instead of a pool buffer,
+//- and a read of at least zerocopy_threshold bytes is echoed with MSG_ZEROCOPY straight from its buffer. That buffer
+//- stays pinned until the kernel releases it, the following reads take the next free one. Reads fall back to a pool
+//- buffer and copying sends while every zerocopy buffer is pinned, so a slow peer never blocks the loop.
+//-
+//- Setting draining (from a signal handler) makes the loop remove the listener from its epoll instance and return
+//- once the last open connection is closed. With wait_mask, the signal can be kept blocked everywhere except inside
+//- epoll_pwait(), so it cannot slip in between the check of the flag and the wait.
+//-
+//- With a spin budget the loop polls its epoll instance without blocking for up to spin nanoseconds before every
+//- blocking wait (see common/busypoll.h). A loop that is busy then never sleeps between two events.
+//-
+//- Every connection is armed with one of three timeouts, picked from its state after each event: the write timeout
+//- while echo bytes are pending, the read timeout while a message is only partly received, the idle timeout
+//- otherwise. The deadlines live in a timing wheel (see common/timerwheel.h): epoll_pwait() sleeps until the next one
+//- is due and the loop expires the wheel after dispatching the events, so a connection that just got data is never
+//- closed for being late. A draining reactor keeps enforcing them, a silent connection cannot hold up a restart.
+//-
+//- A client that shuts down its side still gets the echoes of everything it sent before: the connection stops watching
+//- for input and stays open until its pending output is sent and its zerocopy sends are released, under the write
+//- timeout.
+//-
+//- With a rate limit (reactor_limit_rate()) every accepted connection takes a token of its source address, and with a
+//- connection limit (see admission_init()) a slot of the server: a connection that gets neither is reset before any
+//- state is allocated for it (see common/ratelimit.h).
+struct reactor {
+    int epoll_fd;                              //- epoll instance file descriptor
+    int listen_fd;                             //- Listening socket file descriptor (non-blocking)
+    struct pool pool;                          //- Connection state, read and output buffers of this reactor
+    size_t read_size;                          //- Read buffer size of a new connection (smallest read size class)
+    size_t connections;                        //- Number of currently open connections
+    const sigset_t* wait_mask;                 //- Signal mask while blocked in epoll_pwait() (NULL: keep the current one)
+    volatile sig_atomic_t draining;            //- Set by a signal handler: stop accepting, finish the open connections
+    uint64_t spin;                             //- Busy-polling budget of a wait in nanoseconds (0: block at once)
+    int quickack;                              //- Re-arm TCP_QUICKACK after every read (see tuning_quickack())
+    size_t zerocopy_threshold;                 //- Minimum read size echoed with MSG_ZEROCOPY (0: zerocopy mode is off)
+    struct zerocopy_buffer* zerocopy_buffers;  //- Receive buffers of the zerocopy mode (REACTOR_ZEROCOPY_BUFFERS)
+    size_t zerocopy_next;                      //- Pool index where the search for a free buffer starts
+    struct timerwheel timers;                  //- Timeouts of the connections
+    uint64_t now;                              //- Wheel time of the current loop iteration in milliseconds
+    uint64_t idle_timeout;                     //- Milliseconds a connection may stay silent between messages (0: forever)
+    uint64_t read_timeout;                     //- Milliseconds a started message may take to complete (0: forever)
+    uint64_t write_timeout;                    //- Milliseconds the peer may leave pending output unread (0: forever)
+    struct ratelimit* limit;                   //- Connection rate limit per source address (NULL: none)
+};
+
+int reactor_init(struct reactor* reactor, int listen_fd, size_t read_size, int flags);
+int reactor_enable_zerocopy(struct reactor* reactor, size_t threshold);
+int reactor_limit_rate(struct reactor* reactor, unsigned rate, unsigned burst);
+int reactor_run(struct reactor* reactor);
+void reactor_destroy(struct reactor* reactor);
+
+int set_nonblocking(int fd);
+void raise_fd_limit(void);
+
+#endif
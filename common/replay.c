@@ -0,0 +1,325 @@
+#define _GNU_SOURCE
+
+#include "replay.h"
+#include "trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <unistd.h>
+
+//* Connection state
+enum replay_state {
+    REPLAY_IDLE,     //- Not opened yet
+    REPLAY_OPEN,     //- Connected, sending the captured input
+    REPLAY_CLOSING,  //- Captured close reached, shut down once the pending bytes are sent
+    REPLAY_DONE,     //- Closed, or failed
+};
+
+//* Per-connection state, indexed by the captured connection id
+struct replay_conn {
+    int fd;                   //- Socket file descriptor (-1 unless open)
+    enum replay_state state;  //- Where the connection is in its life
+    int shut;                 //- The write side is shut down
+    char* pending;            //- Captured bytes the socket did not take yet
+    size_t pending_off;       //- Offset of the first unsent byte in pending
+    size_t pending_len;       //- Number of valid bytes in pending
+    size_t pending_cap;       //- Capacity of pending
+};
+
+//* Replay state
+struct replay {
+    const struct replay_options* options;  //- Settings
+    struct replay_result* result;          //- Counters
+    struct replay_conn* conns;             //- Connections by captured id
+    uint32_t conn_count;                   //- Captured connections (ids 1 to conn_count)
+    uint64_t open;                         //- Connections open right now
+    int epoll_fd;                          //- epoll instance of the connections
+};
+
+static void replay_dispatch(struct replay* replay, const struct trace_record* record, uint64_t due, uint64_t now);
+static int replay_connect(const struct replay_options* options);
+static int replay_send(struct replay* replay, struct replay_conn* conn, const char* data, size_t len);
+static void replay_finish(struct replay_conn* conn);
+static void replay_read(struct replay* replay, struct replay_conn* conn, char* buffer);
+static void replay_close(struct replay* replay, struct replay_conn* conn, int failed);
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//* Stream the trace to the server on its original timeline
+//- The loop sends every record that is due, then waits in epoll until the next one is, or for echoes and send buffer
+//- space. A record is due at start + time / speed; it is only held back further while its connection has
+//- REPLAY_PENDING_LIMIT bytes waiting. Once the trace is exhausted the remaining connections are shut down and the
+//- loop runs until the server closed them all.
+int replay_run(const struct replay_options* options, struct replay_result* result) {
+    struct replay replay = {.options = options, .result = result};
+    struct epoll_event events[REPLAY_MAX_EVENTS];
+    struct trace_reader reader;
+    const struct trace_record* record;
+    char* buffer;
+    uint64_t started, now;
+
+    if (options->speed <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (trace_reader_open(&reader, options->path) == -1)
+        return -1;
+    memset(result, 0, sizeof *result);
+    result->dropped = reader.header->dropped;
+    replay.conn_count = reader.header->connections;
+    replay.conns = calloc(replay.conn_count + 1, sizeof *replay.conns);
+    buffer = malloc(REPLAY_RECV_SIZE);
+    if (replay.conns == NULL || buffer == NULL || (replay.epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        free(replay.conns);
+        free(buffer);
+        trace_reader_close(&reader);
+        return -1;
+    }
+    for (uint32_t i = 0; i <= replay.conn_count; i++) replay.conns[i].fd = -1;
+
+    record = trace_reader_next(&reader);
+    started = now = now_ns();
+    while (record != NULL || replay.open > 0) {
+        uint64_t wait = UINT64_MAX;
+        int ready;
+
+        //* Send what is due
+        //- A record whose connection is backed up waits, and so does the rest of the timeline behind it.
+        while (record != NULL) {
+            uint64_t due = started + (uint64_t)(record->time / options->speed);
+            struct replay_conn* conn = record->connection <= replay.conn_count ? &replay.conns[record->connection] : NULL;
+
+            if (due > now) {
+                wait = due - now;
+                break;
+            }
+            if (conn != NULL && conn->pending_len - conn->pending_off >= REPLAY_PENDING_LIMIT)
+                break;
+            if (conn != NULL)
+                replay_dispatch(&replay, record, due, now);
+            result->duration = record->time / 1e9;
+            if ((record = trace_reader_next(&reader)) == NULL) {
+                //- The capture may have stopped with connections still open, they end with the trace.
+                for (uint32_t i = 1; i <= replay.conn_count; i++) {
+                    if (replay.conns[i].state == REPLAY_OPEN) {
+                        replay.conns[i].state = REPLAY_CLOSING;
+                        replay_finish(&replay.conns[i]);
+                    }
+                }
+            }
+        }
+
+        //- epoll_pwait2() takes a nanosecond timeout, epoll_wait() would round the schedule to milliseconds.
+        ready = epoll_pwait2(replay.epoll_fd, events, REPLAY_MAX_EVENTS,
+                             wait == UINT64_MAX ? NULL : &(struct timespec){(time_t)(wait / 1000000000ULL), (long)(wait % 1000000000ULL)},
+                             NULL);
+        if (ready == -1 && errno != EINTR) {
+            perror("error: epoll_pwait2 failed, aborting...");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < ready; i++) {
+            struct replay_conn* conn = events[i].data.ptr;
+
+            if (conn->fd != -1 && (events[i].events & EPOLLOUT) && conn->pending_off < conn->pending_len)
+                replay_send(&replay, conn, NULL, 0);
+            if (conn->fd != -1 && (events[i].events & EPOLLOUT))
+                replay_finish(conn);
+            if (conn->fd != -1 && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+                replay_read(&replay, conn, buffer);
+        }
+        now = now_ns();
+    }
+    result->elapsed = (now - started) / 1e9;
+
+    for (uint32_t i = 0; i <= replay.conn_count; i++) free(replay.conns[i].pending);
+    close(replay.epoll_fd);
+    free(replay.conns);
+    free(buffer);
+    trace_reader_close(&reader);
+    return 0;
+}
+
+void replay_report(const struct replay_options* options, const struct replay_result* result, FILE* out) {
+    fprintf(out, "replay: %s, %.2fx speed, %.3f s captured, replayed in %.3f s\n", options->path, options->speed, result->duration,
+            result->elapsed);
+    fprintf(out, "connections: %lu (peak %lu open), %lu errors\n", (unsigned long)result->connections, (unsigned long)result->peak,
+            (unsigned long)result->errors);
+    fprintf(out, "sent: %lu records, %lu bytes, echoed %lu bytes, max lag %.3f ms\n", (unsigned long)result->records,
+            (unsigned long)result->sent, (unsigned long)result->received, result->max_lag / 1e6);
+    if (result->received != result->sent)
+        fprintf(out, "%ld echo bytes missing\n", (long)(result->sent - result->received));
+    if (result->dropped > 0)
+        fprintf(out, "the capture dropped %lu records, the trace is incomplete\n", (unsigned long)result->dropped);
+}
+
+//* Apply one record to its connection
+//- TRACE_OUT records are the server's side of the capture, the replay gets its own echoes.
+static void replay_dispatch(struct replay* replay, const struct trace_record* record, uint64_t due, uint64_t now) {
+    struct replay_conn* conn = &replay->conns[record->connection];
+    struct epoll_event event = {EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, {.ptr = conn}};
+
+    if (now - due > replay->result->max_lag)
+        replay->result->max_lag = now - due;
+    switch (record->event) {
+        case TRACE_OPEN:
+            if (conn->state != REPLAY_IDLE)
+                break;
+            replay->result->connections++;
+            if ((conn->fd = replay_connect(replay->options)) == -1 || epoll_ctl(replay->epoll_fd, EPOLL_CTL_ADD, conn->fd, &event) == -1) {
+                perror("error: replay connection failed");
+                replay_close(replay, conn, 1);
+                break;
+            }
+            conn->state = REPLAY_OPEN;
+            if (++replay->open > replay->result->peak)
+                replay->result->peak = replay->open;
+            break;
+        case TRACE_IN:
+            if (conn->state != REPLAY_OPEN)
+                break;
+            replay->result->records++;
+            replay_send(replay, conn, trace_payload(record), record->length);
+            break;
+        case TRACE_CLOSE:
+            if (conn->state != REPLAY_OPEN)
+                break;
+            conn->state = REPLAY_CLOSING;
+            replay_finish(conn);
+            break;
+        default:
+            break;
+    }
+}
+
+//* Open one blocking connection and switch it to non-blocking mode
+//- TCP_NODELAY keeps the captured segmentation: Nagle's algorithm would merge the small writes of a timeline.
+static int replay_connect(const struct replay_options* options) {
+    int fd;
+
+    if ((fd = socket(options->addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+        return -1;
+    if (connect(fd, (const struct sockaddr*)&options->addr, options->addr_len) == -1) {
+        close(fd);
+        return -1;
+    }
+    if (options->addr.ss_family == AF_INET)
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+    if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+//* Send the pending bytes and then data, keep what the socket refuses
+//- With data NULL only the pending bytes are flushed.
+//? Returns -1 if the connection failed (and was closed), 0 otherwise.
+static int replay_send(struct replay* replay, struct replay_conn* conn, const char* data, size_t len) {
+    ssize_t bytes_sent;
+
+    while (conn->pending_off < conn->pending_len) {
+        if ((bytes_sent = send(conn->fd, conn->pending + conn->pending_off, conn->pending_len - conn->pending_off, MSG_NOSIGNAL)) == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                replay_close(replay, conn, 1);
+                return -1;
+            }
+            break;
+        }
+        replay->result->sent += bytes_sent;
+        conn->pending_off += bytes_sent;
+    }
+    if (conn->pending_off == conn->pending_len) {
+        conn->pending_off = conn->pending_len = 0;
+        while (len > 0) {
+            if ((bytes_sent = send(conn->fd, data, len, MSG_NOSIGNAL)) == -1) {
+                if (errno == EINTR)
+                    continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    replay_close(replay, conn, 1);
+                    return -1;
+                }
+                break;
+            }
+            replay->result->sent += bytes_sent;
+            data += bytes_sent;
+            len -= bytes_sent;
+        }
+    }
+    if (len == 0)
+        return 0;
+
+    //- Compact the sent prefix away before growing the buffer.
+    if (conn->pending_off > 0) {
+        memmove(conn->pending, conn->pending + conn->pending_off, conn->pending_len - conn->pending_off);
+        conn->pending_len -= conn->pending_off;
+        conn->pending_off = 0;
+    }
+    if (conn->pending_len + len > conn->pending_cap) {
+        size_t cap = conn->pending_cap ? conn->pending_cap : 4096;
+        char* pending;
+
+        while (cap < conn->pending_len + len) cap *= 2;
+        if ((pending = realloc(conn->pending, cap)) == NULL) {
+            replay_close(replay, conn, 1);
+            return -1;
+        }
+        conn->pending = pending;
+        conn->pending_cap = cap;
+    }
+    memcpy(conn->pending + conn->pending_len, data, len);
+    conn->pending_len += len;
+    return 0;
+}
+
+//* Shut down the write side of a closing connection once everything was sent
+//- The server sees the end of the input, sends the echoes it still holds and closes, which ends the connection here.
+static void replay_finish(struct replay_conn* conn) {
+    if (conn->state == REPLAY_CLOSING && !conn->shut && conn->pending_off == conn->pending_len) {
+        shutdown(conn->fd, SHUT_WR);
+        conn->shut = 1;
+    }
+}
+
+//* Count and drop the echoes until the socket is drained
+static void replay_read(struct replay* replay, struct replay_conn* conn, char* buffer) {
+    ssize_t bytes_received;
+
+    while ((bytes_received = recv(conn->fd, buffer, REPLAY_RECV_SIZE, 0)) != 0) {
+        if (bytes_received == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            if (errno == EINTR)
+                continue;
+            replay_close(replay, conn, 1);
+            return;
+        }
+        replay->result->received += bytes_received;
+    }
+    //- A close before the captured one is a failure, the server dropped the connection.
+    replay_close(replay, conn, conn->state != REPLAY_CLOSING);
+}
+
+static void replay_close(struct replay* replay, struct replay_conn* conn, int failed) {
+    if (conn->fd != -1) {
+        close(conn->fd);
+        conn->fd = -1;
+        if (conn->state != REPLAY_IDLE)
+            replay->open--;
+    }
+    if (failed)
+        replay->result->errors++;
+    conn->state = REPLAY_DONE;
+    conn->pending_off = conn->pending_len = 0;
+}
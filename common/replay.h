@@ -0,0 +1,50 @@
+#ifndef COMMON_REPLAY_H
+#define COMMON_REPLAY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/socket.h>
+
+#define REPLAY_MAX_EVENTS 256           //- Maximum number of events returned by a single epoll_wait() call
+#define REPLAY_RECV_SIZE (64 * 1024)    //- Receive buffer for the echoes
+#define REPLAY_PENDING_LIMIT (1 << 20)  //- Unsent bytes of a connection at which the schedule waits for the server
+
+//* Replay settings
+//- The trace (see trace.h) is streamed back to addr: every captured connection is opened at the time it was
+//- accepted, gets the bytes of its TRACE_IN records at the times they were received and is shut down at the time it
+//- was closed, so the replay runs on the same number of connections with the same overlap. speed scales the
+//- timeline: 2 replays twice as fast, 0.5 at half the rate.
+struct replay_options {
+    struct sockaddr_storage addr;  //- Server address (AF_INET or AF_UNIX)
+    socklen_t addr_len;            //- Size of the server address
+    const char* path;              //- Trace file
+    double speed;                  //- Timeline scale (1: original rate)
+};
+
+//* Replay results
+struct replay_result {
+    uint64_t records;      //- TRACE_IN records sent
+    uint64_t connections;  //- Connections opened
+    uint64_t peak;         //- Connections open at the same time at most
+    uint64_t sent;         //- Bytes sent
+    uint64_t received;     //- Echo bytes received
+    uint64_t errors;       //- Connections that failed
+    uint64_t dropped;      //- Records the capture dropped (from the trace header)
+    uint64_t max_lag;      //- Largest delay of a send behind its schedule in nanoseconds
+    double duration;       //- Captured duration in seconds (time of the last record)
+    double elapsed;        //- Replay duration in seconds
+};
+
+//* Replay interface
+//- replay_run() replays the trace from one thread with non-blocking sockets and one epoll instance. A send the socket
+//- does not take completely is buffered and finished on EPOLLOUT; once a connection has REPLAY_PENDING_LIMIT bytes
+//- waiting, the schedule stops until the server reads them, and the delay shows up as lag. Echoes are counted and
+//- dropped. A connection is shut down for writing at its TRACE_CLOSE (or the end of the trace) once everything was
+//- sent, and closed when the server closes it after its last echo. replay_report() prints the results, a received byte
+//- count that differs from the sent one means echoes were lost.
+//? replay_run() returns -1 if the trace cannot be read or the replay cannot be set up (errno set).
+int replay_run(const struct replay_options* options, struct replay_result* result);
+void replay_report(const struct replay_options* options, const struct replay_result* result, FILE* out);
+
+#endif
@@ -0,0 +1,105 @@
+#include "replybatch.h"
+#include "metrics.h"
+#include "trace.h"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+static int reply_batch_send(struct reply_batch* batch, int flags);
+
+void reply_batch_init(struct reply_batch* batch, int fd, int cork, uint32_t connection) {
+    batch->fd = fd;
+    batch->connection = connection;
+    batch->count = batch->headers_used = 0;
+    batch->bytes = 0;
+    batch->cork = cork < REPLY_BATCH_CORK_MAX ? cork : REPLY_BATCH_CORK_MAX;
+    batch->corked = 0;
+    batch->deadline = 0;
+}
+
+//* Append the echo of a chunk
+//- A batch without room for two more iovecs or another header goes out first, with MSG_MORE: the rest of the read
+//- follows at once. An empty message takes a header but no payload iovec, so the headers can run out first.
+int reply_batch_add(struct reply_batch* batch, const struct frame_chunk* chunk) {
+    if ((batch->count > REPLY_BATCH_IOVS - 2 || batch->headers_used == REPLY_BATCH_IOVS / 2) && reply_batch_send(batch, MSG_MORE) == -1)
+        return -1;
+    if (chunk->offset == 0) {
+        unsigned char* header = batch->headers[batch->headers_used++];
+
+        frame_header_encode(header, chunk->length);
+        batch->iov[batch->count++] = (struct iovec){header, FRAME_HEADER_SIZE};
+        batch->bytes += FRAME_HEADER_SIZE;
+    }
+    if (chunk->len > 0) {
+        batch->iov[batch->count++] = (struct iovec){(void*)chunk->data, chunk->len};
+        batch->bytes += chunk->len;
+    }
+    return 0;
+}
+
+int reply_batch_flush(struct reply_batch* batch) {
+    return reply_batch_send(batch, 0);
+}
+
+//* Keep the tail of the replies corked while more input is waiting
+//- The check does not block: waiting for input that only comes once the client got its echoes would stall it.
+int reply_batch_hold(struct reply_batch* batch) {
+    struct pollfd input = {.fd = batch->fd, .events = POLLIN};
+    int ready;
+
+    if (!batch->corked)
+        return 0;
+    while ((ready = poll(&input, 1, 0)) == -1 && errno == EINTR)
+        ;
+    if (ready > 0 && metrics_now() < batch->deadline)
+        return 1;
+    //- Clearing TCP_CORK sends the held partial segment at once
+    setsockopt(batch->fd, IPPROTO_TCP, TCP_CORK, &(int){0}, sizeof(int));
+    batch->corked = 0;
+    return ready > 0;
+}
+
+//* Send the collected iovecs, resuming after short writes
+//- A blocking send only returns early when a signal or the send timeout interrupts it. The batch is empty afterwards,
+//- also after a failure.
+static int reply_batch_send(struct reply_batch* batch, int flags) {
+    struct iovec* iov = batch->iov;
+    int count = batch->count;
+    ssize_t sent;
+
+    batch->count = batch->headers_used = 0;
+    batch->bytes = 0;
+    if (count == 0)
+        return 0;
+    if (batch->cork > 0 && !batch->corked) {
+        if (setsockopt(batch->fd, IPPROTO_TCP, TCP_CORK, &(int){1}, sizeof(int)) == 0) {
+            batch->corked = 1;
+            batch->deadline = metrics_now() + (uint64_t)batch->cork * 1000;
+        } else
+            batch->cork = 0;  //- Not a TCP socket, batch per read only
+    }
+
+    metrics_add(METRICS_REPLY_BATCHES, 1);
+    while (count > 0) {
+        if ((sent = sendmsg(batch->fd, &(struct msghdr){.msg_iov = iov, .msg_iovlen = count}, flags | MSG_NOSIGNAL)) == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        metrics_add(METRICS_BYTES_SENT, sent);
+        trace_recordv(batch->connection, TRACE_OUT, iov, count, sent);
+        while (count > 0 && (size_t)sent >= iov->iov_len) {
+            sent -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*)iov->iov_base + sent;
+            iov->iov_len -= sent;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,56 @@
+#ifndef COMMON_REPLYBATCH_H
+#define COMMON_REPLYBATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "frame.h"
+
+#define REPLY_BATCH_IOVS 1024        //- iovecs per sendmsg() (IOV_MAX), a reply takes two: header and payload
+#define REPLY_BATCH_CORK_MAX 200000  //- Longest cork delay in microseconds, the kernel sends a corked segment after 200 ms anyway
+
+//* Replies of one read, sent together
+//- A read of a pipelining client holds many messages. Echoing each with its own writev() costs a syscall and, with
+//- TCP_NODELAY, a segment per message. The batch collects the echoes of a read instead: the header of every message
+//- is encoded into the batch, the payload stays in the receive buffer and is referenced by an iovec. reply_batch_flush()
+//- sends everything with one sendmsg() once the read is parsed. A batch that runs out of iovecs or headers is sent early
+//- with MSG_MORE, so the kernel does not push a partial segment at that point.
+//-
+//- With a cork delay the batch also merges the replies of consecutive reads on a TCP connection. The socket is
+//- corked (TCP_CORK) before the first send: full segments leave at once, the partial tail is held. Before the next
+//- blocking receive reply_batch_hold() checks whether more input is already waiting. If so, its replies extend the
+//- held tail; otherwise the socket is uncorked and the tail goes out. The hold never waits for input: a client that
+//- waits for its echoes before it sends more would stall until the delay passed. The delay only bounds how long a
+//- tail stays corked while input keeps arriving, counted from the time the socket was corked. A socket that rejects
+//- TCP_CORK (a Unix socket) is batched per read only.
+//-
+//- The batch must be flushed before the receive buffer is reused, the iovecs point into it.
+struct reply_batch {
+    int fd;                                                          //- Connected socket
+    int count;                                                       //- iovecs collected
+    int headers_used;                                                //- Headers encoded into headers
+    int cork;                                                        //- Cork delay in microseconds (0: no cork)
+    int corked;                                                      //- TCP_CORK is set on the socket
+    uint32_t connection;                                             //- Capture trace id of the connection (0: not captured)
+    uint64_t deadline;                                               //- Time the held tail must go out (see metrics_now())
+    size_t bytes;                                                    //- Bytes collected
+    struct iovec iov[REPLY_BATCH_IOVS];                              //- Headers and payload slices, in stream order
+    unsigned char headers[REPLY_BATCH_IOVS / 2][FRAME_HEADER_SIZE];  //- Encoded headers of the collected replies
+};
+
+//* Reply batch interface
+//- reply_batch_init() sets up an empty batch for fd, cork is the delay in microseconds (0: no cork). Every send is
+//- captured as a TRACE_OUT record of connection (see common/trace.h).
+//- reply_batch_add() appends the echo of a parsed chunk, the header with the first chunk of a message.
+//- reply_batch_flush() sends what was collected and counts the write in echo_reply_batches_total.
+//- reply_batch_hold() is called before a blocking receive: it uncorks a held tail unless input is waiting and the
+//- cork delay has not passed yet.
+//? reply_batch_add() and reply_batch_flush() return -1 if the send fails (errno set, EAGAIN when a send timeout
+//? expired), the connection should be closed. reply_batch_hold() returns 1 if input is waiting, 0 otherwise.
+void reply_batch_init(struct reply_batch* batch, int fd, int cork, uint32_t connection);
+int reply_batch_add(struct reply_batch* batch, const struct frame_chunk* chunk);
+int reply_batch_flush(struct reply_batch* batch);
+int reply_batch_hold(struct reply_batch* batch);
+
+#endif
@@ -0,0 +1,48 @@
+#include "runqueue.h"
+
+#include <stdlib.h>
+
+int runqueue_init(struct runqueue* queue, size_t capacity) {
+    queue->head = queue->tail = 0;
+    queue->mask = capacity - 1;
+    return (queue->items = calloc(capacity, sizeof *queue->items)) == NULL ? -1 : 0;
+}
+
+//* Queue an item at the tail (owner only)
+int runqueue_push(struct runqueue* queue, void* item) {
+    uint64_t tail = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+
+    if (tail - __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) > queue->mask)
+        return -1;
+    __atomic_store_n(&queue->items[tail & queue->mask], item, __ATOMIC_RELAXED);
+    __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+//* Take the oldest item (any thread)
+//- The item is read before the compare-and-swap claims it. The owner cannot overwrite the slot while head still
+//- points to it, so a successful compare-and-swap also proves that the item read was the right one.
+void* runqueue_take(struct runqueue* queue) {
+    uint64_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+    void* item;
+
+    while (head < __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE)) {
+        item = __atomic_load_n(&queue->items[head & queue->mask], __ATOMIC_RELAXED);
+        //- A failed compare-and-swap reloads head: another consumer took the item, try the next one.
+        if (__atomic_compare_exchange_n(&queue->head, &head, head + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return item;
+    }
+    return NULL;
+}
+
+//* Number of queued items, a snapshot that may be outdated as soon as it is returned
+size_t runqueue_size(struct runqueue* queue) {
+    uint64_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+    return tail > head ? tail - head : 0;
+}
+
+void runqueue_destroy(struct runqueue* queue) {
+    free(queue->items);
+    queue->items = NULL;
+}
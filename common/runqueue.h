@@ -0,0 +1,34 @@
+#ifndef COMMON_RUNQUEUE_H
+#define COMMON_RUNQUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define RUNQUEUE_CACHE_LINE 64  //- Alignment that keeps the producer and consumer indexes on separate cache lines
+
+//* Stealable run queue
+//- A fixed-size ring of pointers with one producer, the owner thread, and any number of consumers. Only the owner
+//- queues items, at the tail. The owner and idle threads that steal work all take items from the head with a
+//- compare-and-swap, so the items come out in the order they were queued, whoever takes them. A LIFO owner end
+//- (Chase-Lev) would serve the most recent item first, and an item that is queued again after each turn would
+//- starve the older ones.
+//- The producer side needs no atomic read-modify-write. The release store of the tail publishes the item.
+//- runqueue_push() must only be called by the owner thread, runqueue_take() and runqueue_size() by any thread.
+//- The capacity is fixed (a power of 2). A full queue refuses the push and the caller keeps the item.
+struct runqueue {
+    _Alignas(RUNQUEUE_CACHE_LINE) uint64_t head;  //- Index of the oldest item, advanced by the consumers
+    _Alignas(RUNQUEUE_CACHE_LINE) uint64_t tail;  //- Index of the next free slot, only written by the owner
+    void** items;                                 //- Ring of items, indexes are taken modulo the capacity
+    uint64_t mask;                                //- Capacity - 1
+};
+
+//* Run queue interface
+//? runqueue_init() returns -1 if the ring cannot be allocated (errno set).
+//? runqueue_push() returns -1 if the queue is full. runqueue_take() returns NULL if the queue is empty.
+int runqueue_init(struct runqueue* queue, size_t capacity);
+int runqueue_push(struct runqueue* queue, void* item);
+void* runqueue_take(struct runqueue* queue);
+size_t runqueue_size(struct runqueue* queue);
+void runqueue_destroy(struct runqueue* queue);
+
+#endif
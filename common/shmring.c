@@ -0,0 +1,360 @@
+#define _GNU_SOURCE
+
+#include "shmring.h"
+#include "frame.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SHMRING_PAD UINT32_MAX  //- Length of a padding record: the rest of the ring up to the end is unused
+#define SHMRING_FDS 3           //- File descriptors of an offer: the memfd, the server's and the client's eventfd
+
+static uint64_t shmring_record(size_t len);
+static int shmring_map(struct shmring_channel* channel, int memfd, int server);
+static int shmring_wait(struct shmring_channel* channel, _Atomic int* waiting, size_t need);
+static int shmring_ready(const struct shmring_channel* channel, size_t need);
+static void shmring_wake(struct shmring_channel* channel, _Atomic int* waiting);
+static int shmring_send_offer(int sock_fd, const int fds[SHMRING_FDS]);
+static uint64_t shmring_now(void);
+
+//* Create the region and the eventfds, send the offer and wait for the answer
+int shmring_connect(struct shmring_channel* channel, int sock_fd, uint64_t spin) {
+    struct shmring_region header = {.magic = SHMRING_MAGIC, .capacity = SHMRING_CAPACITY};
+    int fds[SHMRING_FDS] = {-1, -1, -1};
+    char reply[sizeof SHMRING_OFFER];
+    size_t reply_len;
+    int status;
+
+    memset(channel, 0, sizeof *channel);
+    if ((fds[0] = memfd_create("shmring", MFD_CLOEXEC | MFD_ALLOW_SEALING)) == -1 ||
+        ftruncate(fds[0], SHMRING_HEADER_SIZE + 2 * (off_t)SHMRING_CAPACITY) == -1 ||
+        fcntl(fds[0], F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == -1 ||
+        (fds[1] = eventfd(0, EFD_CLOEXEC)) == -1 || (fds[2] = eventfd(0, EFD_CLOEXEC)) == -1)
+        goto fail;
+
+    //- The header is written before the offer is sent, the server validates it when the offer arrives.
+    if (pwrite(fds[0], &header, sizeof header, 0) != (ssize_t)sizeof header || shmring_map(channel, fds[0], 0) == -1)
+        goto fail;
+
+    if (shmring_send_offer(sock_fd, fds) == -1)
+        goto fail;
+    if ((status = frame_read(sock_fd, reply, sizeof reply, &reply_len)) <= 0) {
+        if (status == 0)
+            errno = ECONNRESET;
+        goto fail;
+    }
+    if (reply_len != strlen(SHMRING_ACCEPT) || memcmp(reply, SHMRING_ACCEPT, reply_len) != 0) {
+        errno = ENOTSUP;
+        goto fail;
+    }
+
+    close(fds[0]);
+    channel->wake_fd = fds[2];
+    channel->peer_fd = fds[1];
+    channel->sock_fd = sock_fd;
+    channel->spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? spin : 0;
+    return 0;
+
+fail:
+    status = errno;
+    if (channel->region != NULL)
+        munmap(channel->region, channel->size);
+    for (int i = 0; i < SHMRING_FDS; i++) {
+        if (fds[i] != -1)
+            close(fds[i]);
+    }
+    memset(channel, 0, sizeof *channel);
+    errno = status;
+    return -1;
+}
+
+//* Make the first receive of a connection and take an offer if it holds one
+int shmring_accept(struct shmring_channel* channel, int sock_fd, void* buffer, size_t size, ssize_t* received, uint64_t spin) {
+    char control[CMSG_SPACE(SHMRING_FDS * sizeof(int))];
+    struct iovec iov = {.iov_base = buffer, .iov_len = size};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof control};
+    unsigned char offer[FRAME_HEADER_SIZE + sizeof SHMRING_OFFER - 1];
+    struct cmsghdr* cmsg;
+    int fds[SHMRING_FDS];
+    int count = 0;
+    int status;
+
+    memset(channel, 0, sizeof *channel);
+    while ((*received = recvmsg(sock_fd, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR)
+        ;
+    if (*received == -1)
+        return 0;  //- The control buffer holds nothing, the caller sees the failed receive
+
+    //- The control buffer is padded beyond SHMRING_FDS descriptors, and a client may send several SCM_RIGHTS
+    //- messages: only the first SHMRING_FDS descriptors are kept, every other one is closed right away.
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+            for (int i = 0; i < n; i++) {
+                int fd;
+
+                memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof fd);
+                if (count < SHMRING_FDS)
+                    fds[count] = fd;
+                else
+                    close(fd);
+                count++;
+            }
+        }
+    }
+    if (count == 0)
+        return 0;
+
+    //- Descriptors attached to anything but a complete offer are dropped, the bytes are echoed as usual. With
+    //- MSG_CTRUNC the kernel discarded descriptors that did not fit, so the offer is incomplete.
+    frame_header_encode(offer, sizeof SHMRING_OFFER - 1);
+    memcpy(offer + FRAME_HEADER_SIZE, SHMRING_OFFER, sizeof SHMRING_OFFER - 1);
+    if (count != SHMRING_FDS || (msg.msg_flags & MSG_CTRUNC) || *received != (ssize_t)sizeof offer ||
+        memcmp(buffer, offer, sizeof offer) != 0) {
+        for (int i = 0; i < count && i < SHMRING_FDS; i++)
+            close(fds[i]);
+        return 0;
+    }
+
+    if (shmring_map(channel, fds[0], 1) == -1 || frame_write(sock_fd, SHMRING_ACCEPT, strlen(SHMRING_ACCEPT)) == -1) {
+        status = errno;
+        if (channel->region != NULL)
+            munmap(channel->region, channel->size);
+        for (int i = 0; i < SHMRING_FDS; i++)
+            close(fds[i]);
+        memset(channel, 0, sizeof *channel);
+        errno = status;
+        return -1;
+    }
+    close(fds[0]);
+    channel->wake_fd = fds[1];
+    channel->peer_fd = fds[2];
+    channel->sock_fd = sock_fd;
+    channel->spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? spin : 0;
+    return 1;
+}
+
+//* Unmap the region and close the eventfds, the socket stays open
+void shmring_close(struct shmring_channel* channel) {
+    if (channel->region == NULL)
+        return;
+    munmap(channel->region, channel->size);
+    close(channel->wake_fd);
+    close(channel->peer_fd);
+    memset(channel, 0, sizeof *channel);
+}
+
+//* Copy a message into the tx ring and publish it
+int shmring_send(struct shmring_channel* channel, const void* data, size_t len) {
+    uint64_t record = shmring_record(len);
+    uint64_t offset = channel->tx_head & (channel->capacity - 1);
+    uint64_t pad = channel->capacity - offset < record ? channel->capacity - offset : 0;
+    uint32_t length = len;
+    int status;
+
+    if (len > shmring_max_message(channel)) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if ((status = shmring_wait(channel, &channel->tx->producer_waiting, pad + record)) <= 0) {
+        if (status == 0)
+            errno = EPIPE;
+        return -1;
+    }
+
+    if (pad > 0) {
+        memcpy(channel->tx_data + offset, &(uint32_t){SHMRING_PAD}, sizeof(uint32_t));
+        channel->tx_head += pad;
+        offset = 0;
+    }
+    memcpy(channel->tx_data + offset, &length, sizeof length);
+    memcpy(channel->tx_data + offset + sizeof length, data, len);
+    channel->tx_head += record;
+    atomic_store_explicit(&channel->tx->head, channel->tx_head, memory_order_release);
+    shmring_wake(channel, &channel->tx->consumer_waiting);
+    return 0;
+}
+
+//* Wait for the next message of the rx ring and return it in place
+int shmring_recv(struct shmring_channel* channel, const void** data, size_t* len) {
+    uint64_t head, offset;
+    uint32_t length;
+    int status;
+
+    while (1) {
+        if ((status = shmring_wait(channel, &channel->rx->consumer_waiting, 0)) <= 0)
+            return status;
+        head = atomic_load_explicit(&channel->rx->head, memory_order_acquire);
+        offset = channel->rx_tail & (channel->capacity - 1);
+        if (head - channel->rx_tail > channel->capacity || head - channel->rx_tail < sizeof length)
+            break;
+        memcpy(&length, channel->rx_data + offset, sizeof length);
+        if (length != SHMRING_PAD) {
+            if (length > shmring_max_message(channel) || head - channel->rx_tail < shmring_record(length) ||
+                channel->capacity - offset < shmring_record(length))
+                break;
+            *data = channel->rx_data + offset + sizeof length;
+            *len = length;
+            channel->rx_next = channel->rx_tail + shmring_record(length);
+            return 1;
+        }
+
+        //- A padding record is freed at once, the message behind it starts at the beginning of the ring.
+        channel->rx_tail += channel->capacity - offset;
+        atomic_store_explicit(&channel->rx->tail, channel->rx_tail, memory_order_release);
+    }
+    errno = EPROTO;
+    return -1;
+}
+
+//* Free the message shmring_recv() returned
+void shmring_release(struct shmring_channel* channel) {
+    channel->rx_tail = channel->rx_next;
+    atomic_store_explicit(&channel->rx->tail, channel->rx_tail, memory_order_release);
+    shmring_wake(channel, &channel->rx->producer_waiting);
+}
+
+//* Largest message a ring takes
+//- A message never wraps, so the padding in front of it may waste up to its own size: half the ring always fits.
+size_t shmring_max_message(const struct shmring_channel* channel) {
+    return channel->capacity / 2 - sizeof(uint32_t);
+}
+
+//* Size of the record of a len byte message: the length and the payload, padded to 8 bytes
+static uint64_t shmring_record(size_t len) {
+    return (sizeof(uint32_t) + len + 7) & ~(uint64_t)7;
+}
+
+//* Map a region and set up the ring pointers of one side
+//- The server does not trust the region: the memfd must be sealed against shrinking and match the capacity in its
+//- header before the rings are used.
+static int shmring_map(struct shmring_channel* channel, int memfd, int server) {
+    struct shmring_region header;
+    struct stat st;
+    int seals;
+
+    if (server) {
+        if ((seals = fcntl(memfd, F_GET_SEALS)) == -1 || !(seals & F_SEAL_SHRINK) || fstat(memfd, &st) == -1 ||
+            pread(memfd, &header, sizeof header, 0) != (ssize_t)sizeof header)
+            goto invalid;
+        if (header.magic != SHMRING_MAGIC || header.capacity < SHMRING_CAPACITY_MIN || header.capacity > SHMRING_CAPACITY_MAX ||
+            (header.capacity & (header.capacity - 1)) != 0 || (uint64_t)st.st_size != SHMRING_HEADER_SIZE + 2 * header.capacity)
+            goto invalid;
+        channel->capacity = header.capacity;
+    } else {
+        channel->capacity = SHMRING_CAPACITY;
+    }
+
+    channel->size = SHMRING_HEADER_SIZE + 2 * channel->capacity;
+    if ((channel->region = mmap(NULL, channel->size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0)) == MAP_FAILED) {
+        channel->region = NULL;
+        return -1;
+    }
+    channel->rx = &channel->region->rings[server ? 0 : 1];
+    channel->tx = &channel->region->rings[server ? 1 : 0];
+    channel->rx_data = (char*)channel->region + SHMRING_HEADER_SIZE + (server ? 0 : channel->capacity);
+    channel->tx_data = (char*)channel->region + SHMRING_HEADER_SIZE + (server ? channel->capacity : 0);
+    channel->rx_tail = atomic_load_explicit(&channel->rx->tail, memory_order_relaxed);
+    channel->tx_head = atomic_load_explicit(&channel->tx->head, memory_order_relaxed);
+    return 0;
+
+invalid:
+    errno = EPROTO;
+    return -1;
+}
+
+//* Wait until the rx ring has a record (need == 0) or the tx ring has need free bytes
+//? Returns 1 when ready, 0 if the peer hung up, -1 on failure (errno set, EINTR included).
+static int shmring_wait(struct shmring_channel* channel, _Atomic int* waiting, size_t need) {
+    struct pollfd fds[2] = {{.fd = channel->wake_fd, .events = POLLIN}, {.fd = channel->sock_fd, .events = POLLIN}};
+    uint64_t deadline, count;
+
+    if (shmring_ready(channel, need))
+        return 1;
+    if (channel->spin > 0) {
+        deadline = shmring_now() + channel->spin;
+        do {
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+#endif
+            if (shmring_ready(channel, need)) {
+                channel->spin_hits++;
+                return 1;
+            }
+        } while (shmring_now() < deadline);
+        channel->spin_sleeps++;
+    }
+
+    while (1) {
+        atomic_store_explicit(waiting, 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (shmring_ready(channel, need)) {
+            atomic_store_explicit(waiting, 0, memory_order_relaxed);
+            return 1;
+        }
+        if (poll(fds, 2, -1) == -1) {
+            atomic_store_explicit(waiting, 0, memory_order_relaxed);
+            return -1;
+        }
+        if (fds[0].revents & POLLIN) {
+            if (read(channel->wake_fd, &count, sizeof count) == -1 && errno != EAGAIN) {
+                atomic_store_explicit(waiting, 0, memory_order_relaxed);
+                return -1;
+            }
+        } else if (fds[1].revents) {
+            //- Nothing is sent on the socket after the negotiation, so it only becomes readable at a hang-up. A message
+            //- published right before it is still taken.
+            atomic_store_explicit(waiting, 0, memory_order_relaxed);
+            return shmring_ready(channel, need) ? 1 : 0;
+        }
+    }
+}
+
+static int shmring_ready(const struct shmring_channel* channel, size_t need) {
+    if (need == 0)
+        return atomic_load_explicit(&channel->rx->head, memory_order_acquire) != channel->rx_tail;
+    return channel->tx_head + need - atomic_load_explicit(&channel->tx->tail, memory_order_acquire) <= channel->capacity;
+}
+
+//* Signal the peer if it sleeps on the flag
+//- The fence orders the position published before it with the flag read after it, against the fence of
+//- shmring_wait() between setting the flag and checking the position.
+static void shmring_wake(struct shmring_channel* channel, _Atomic int* waiting) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(waiting, memory_order_relaxed) && atomic_exchange_explicit(waiting, 0, memory_order_relaxed))
+        while (write(channel->peer_fd, &(uint64_t){1}, sizeof(uint64_t)) == -1 && errno == EINTR)
+            ;
+}
+
+//* Send the offer frame with the memfd and both eventfds attached
+static int shmring_send_offer(int sock_fd, const int fds[SHMRING_FDS]) {
+    char control[CMSG_SPACE(SHMRING_FDS * sizeof(int))];
+    unsigned char header[FRAME_HEADER_SIZE];
+    struct iovec iov[2] = {{.iov_base = header, .iov_len = sizeof header}, {.iov_base = SHMRING_OFFER, .iov_len = strlen(SHMRING_OFFER)}};
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = 2, .msg_control = control, .msg_controllen = sizeof control};
+    struct cmsghdr* cmsg;
+
+    memset(control, 0, sizeof control);
+    frame_header_encode(header, strlen(SHMRING_OFFER));
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(SHMRING_FDS * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, SHMRING_FDS * sizeof(int));
+    return sendmsg(sock_fd, &msg, MSG_NOSIGNAL) == -1 ? -1 : 0;
+}
+
+static uint64_t shmring_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
@@ -0,0 +1,98 @@
+#ifndef COMMON_SHMRING_H
+#define COMMON_SHMRING_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define SHMRING_CAPACITY (1024 * 1024)           //- Bytes of each ring, a power of two
+#define SHMRING_CAPACITY_MIN 4096                //- Smallest ring the server accepts
+#define SHMRING_CAPACITY_MAX (64 * 1024 * 1024)  //- Largest ring the server accepts
+#define SHMRING_HEADER_SIZE 4096                 //- Bytes in front of the rings: the region header and the ring positions
+#define SHMRING_MAGIC 0x31474e49524d4853ULL      //- "SHMRING1", first word of a region
+#define SHMRING_OFFER "shmring offer"            //- Frame payload the client sends with the file descriptors
+#define SHMRING_ACCEPT "shmring ok"              //- Frame payload the server answers with when it moved to the rings
+#define SHMRING_CACHE_LINE 64                    //- Alignment of the ring positions, so producer and consumer do not share a line
+
+//* Shared memory transport over a Unix socket
+//- A message over a Unix stream socket costs a write() and a read() on each side, and the kernel copies the bytes
+//- into a socket buffer and out again. The shared memory transport replaces both with two single-producer,
+//- single-consumer rings in a memfd that client and server map: a message is copied into the ring once, read in place
+//- and no syscall is made while both sides are awake.
+//-
+//- Negotiation: the client creates the memfd and two eventfds and sends them over the connected socket (SCM_RIGHTS),
+//- attached to a SHMRING_OFFER frame. A server that takes the offer answers with a SHMRING_ACCEPT frame, from then on
+//- the messages go through the rings and the socket only signals a hang-up. A server without the transport echoes the
+//- offer like any message, which the client reports as a refusal. The memfd is sealed against shrinking, so the
+//- server cannot fault on a region the client truncates, and every length and position read from the shared memory is
+//- checked before it is used.
+//-
+//- Messages: every message is a 4-byte length followed by the payload, padded to 8 bytes, and never wraps around the
+//- end of a ring (a padding record skips the rest). The producer publishes a message by advancing the head with a
+//- release store, the consumer frees it by advancing the tail, so neither side takes a lock.
+//-
+//- Wakeups: a side that finds its ring empty (or full) spins for the spin budget, then sets its waiting flag, checks
+//- again and sleeps in poll() on its eventfd and the socket. The other side only writes the eventfd if it sees the flag
+//- after publishing (both sides fence between the flag and the position), so an awake peer is never signalled and a
+//- sleeping one is never missed. Spinning waits are counted as hits or sleeps like the busy-polling receives (see
+//- common/busypoll.h). The peer can only fill the ring while it runs on another CPU, so on a single CPU nothing spins.
+struct shmring {
+    _Alignas(SHMRING_CACHE_LINE) _Atomic uint64_t head;  //- Bytes ever written, advanced by the producer
+    _Atomic int consumer_waiting;                        //- Set while the consumer sleeps on an empty ring
+    _Alignas(SHMRING_CACHE_LINE) _Atomic uint64_t tail;  //- Bytes ever freed, advanced by the consumer
+    _Atomic int producer_waiting;                        //- Set while the producer sleeps on a full ring
+};
+
+//* Start of the shared memory region, the ring data follows at SHMRING_HEADER_SIZE
+//- rings[0] carries the messages from the client to the server, rings[1] the replies.
+struct shmring_region {
+    uint64_t magic;           //- SHMRING_MAGIC
+    uint64_t capacity;        //- Bytes of each ring
+    struct shmring rings[2];  //- Ring positions
+};
+
+//* One side of a connection
+struct shmring_channel {
+    struct shmring_region* region;  //- Mapped region
+    size_t size;                    //- Size of the mapping
+    uint64_t capacity;              //- Bytes of each ring
+    struct shmring* rx;             //- Ring this side consumes
+    struct shmring* tx;             //- Ring this side produces
+    char* rx_data;                  //- Data of the rx ring
+    char* tx_data;                  //- Data of the tx ring
+    uint64_t rx_tail;               //- Local copy of the rx tail
+    uint64_t rx_next;               //- Tail after the message shmring_recv() returned
+    uint64_t tx_head;               //- Local copy of the tx head
+    int wake_fd;                    //- eventfd this side sleeps on
+    int peer_fd;                    //- eventfd of the peer
+    int sock_fd;                    //- Connected Unix socket, readable once the peer hangs up
+    uint64_t spin;                  //- Spin budget of a wait in nanoseconds (0: sleep at once)
+    uint64_t spin_hits;             //- Spinning waits that ended ready
+    uint64_t spin_sleeps;           //- Spinning waits that had to sleep
+};
+
+//* Negotiation
+//- shmring_connect() (client) sends the offer over sock_fd and waits for the answer.
+//- shmring_accept() (server) makes the first receive of a connection with recvmsg() so that it sees the file
+//- descriptors of an offer. If the offer is valid it answers it and returns 1. Otherwise the received bytes are in
+//- buffer and *received is what read() would have returned; any file descriptors that came with them are closed.
+//? shmring_connect() returns 0, or -1 (errno ENOTSUP if the server echoed the offer).
+//? shmring_accept() returns 1 if the connection moved to the rings, 0 if it stays on the socket, -1 if an offer was
+//? invalid (errno set).
+int shmring_connect(struct shmring_channel* channel, int sock_fd, uint64_t spin);
+int shmring_accept(struct shmring_channel* channel, int sock_fd, void* buffer, size_t size, ssize_t* received, uint64_t spin);
+void shmring_close(struct shmring_channel* channel);
+
+//* Messages
+//- shmring_send() copies a message into the tx ring, waiting while the ring is full. shmring_recv() waits for the next
+//- message and returns it in place, it stays valid until shmring_release() frees it, so an echo copies once.
+//? shmring_send() returns 0, or -1 (errno EMSGSIZE above shmring_max_message(), EPIPE if the peer hung up).
+//? shmring_recv() returns 1 with a message, 0 if the peer hung up and -1 on failure (errno EPROTO if the peer wrote
+//? an invalid record).
+int shmring_send(struct shmring_channel* channel, const void* data, size_t len);
+int shmring_recv(struct shmring_channel* channel, const void** data, size_t* len);
+void shmring_release(struct shmring_channel* channel);
+size_t shmring_max_message(const struct shmring_channel* channel);
+
+#endif
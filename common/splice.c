@@ -0,0 +1,70 @@
+#define _GNU_SOURCE
+
+#include "splice.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+static uint64_t clock_ns(clockid_t clock);
+
+//* Create the pipe of a streaming connection
+ssize_t splice_pipe(int pipe_fds[2]) {
+    int size;
+
+    if (pipe2(pipe_fds, O_CLOEXEC) == -1)
+        return -1;
+    if ((size = fcntl(pipe_fds[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE)) == -1)
+        size = fcntl(pipe_fds[1], F_GETPIPE_SZ);
+    if (size == -1) {
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        return -1;
+    }
+    return size;
+}
+
+//* Echo one pipe-full of received data back to the same socket
+//- The pipe is always empty when the function returns, so the next call can fill it up to pipe_size again.
+//- SPLICE_F_MOVE asks the kernel to move the pages instead of copying them where it can.
+ssize_t splice_echo(int fd, const int pipe_fds[2], size_t pipe_size) {
+    ssize_t received, sent;
+
+    while ((received = splice(fd, NULL, pipe_fds[1], NULL, pipe_size, SPLICE_F_MOVE)) == -1) {
+        if (errno != EINTR)
+            return -1;
+    }
+
+    for (ssize_t left = received; left > 0; left -= sent) {
+        if ((sent = splice(pipe_fds[0], NULL, fd, NULL, left, SPLICE_F_MOVE)) == -1) {
+            if (errno != EINTR)
+                return -1;
+            sent = 0;
+        }
+    }
+    return received;
+}
+
+//* Take the start time and thread CPU time of a transfer
+void transfer_start(struct transfer_stats* stats) {
+    stats->bytes = 0;
+    stats->start = clock_ns(CLOCK_MONOTONIC);
+    stats->cpu_start = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+}
+
+//* Compute throughput and CPU time per GB of a transfer that ends now
+void transfer_finish(const struct transfer_stats* stats, struct transfer_result* result) {
+    uint64_t elapsed = clock_ns(CLOCK_MONOTONIC) - stats->start;
+    uint64_t cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID) - stats->cpu_start;
+
+    result->elapsed_ms = elapsed / 1000000;
+    result->mb_per_s = elapsed > 0 ? (uint64_t)(stats->bytes * 1e3 / elapsed) : 0;
+    result->cpu_ms_per_gb = stats->bytes > 0 ? (uint64_t)(cpu * 1e3 / stats->bytes) : 0;
+}
+
+static uint64_t clock_ns(clockid_t clock) {
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
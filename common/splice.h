@@ -0,0 +1,41 @@
+#ifndef COMMON_SPLICE_H
+#define COMMON_SPLICE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define SPLICE_PIPE_SIZE (1024 * 1024)  //- Requested pipe capacity, the kernel caps it at /proc/sys/fs/pipe-max-size
+
+//* Kernel-side echo with splice()
+//- splice() moves data between a file descriptor and a pipe without copying it to user space: the pipe only holds
+//- references to the socket buffer pages. splice_echo() moves whatever the socket has received into the pipe, then
+//- from the pipe back into the same socket, so an echo costs two syscalls per pipe-full of data, however large the
+//- transfer, and the bytes never pass through a user buffer.
+//- Nothing looks at the data on the way, so a streaming echo cannot parse frames: it is a byte pipe.
+//- splice_pipe() creates the pipe and grows it to SPLICE_PIPE_SIZE (it keeps the default 64 KB if that fails).
+//? splice_pipe() returns the pipe capacity or -1 (errno set). splice_echo() returns the number of bytes echoed, 0 at
+//? end of stream and -1 if a splice() call fails (errno set); it blocks like recv()/send() on a blocking socket.
+ssize_t splice_pipe(int pipe_fds[2]);
+ssize_t splice_echo(int fd, const int pipe_fds[2], size_t pipe_size);
+
+//* Transfer statistics of a connection
+//- Throughput and the CPU time the serving thread spent per GB, to compare the splice() echo with the copy path.
+//- The CPU time is the thread's own (CLOCK_THREAD_CPUTIME_ID), user and system time of its syscalls included, so the
+//- log writer and the metrics endpoint threads do not count.
+struct transfer_stats {
+    uint64_t bytes;      //- Bytes echoed
+    uint64_t start;      //- Monotonic start time in nanoseconds
+    uint64_t cpu_start;  //- CPU time of the thread at the start in nanoseconds
+};
+
+struct transfer_result {
+    uint64_t elapsed_ms;     //- Duration of the transfer
+    uint64_t mb_per_s;       //- Echo throughput in MB/s (10^6 bytes)
+    uint64_t cpu_ms_per_gb;  //- CPU time per GB (10^9 bytes) echoed, 0 if nothing was echoed
+};
+
+void transfer_start(struct transfer_stats* stats);
+void transfer_finish(const struct transfer_stats* stats, struct transfer_result* result);
+
+#endif
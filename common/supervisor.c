@@ -0,0 +1,366 @@
+#define _GNU_SOURCE
+
+#include "supervisor.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SUPERVISOR_TICK 100  //- Milliseconds between two checks of the timers when no signal arrives
+
+//* One worker slot, pid 0 while the slot waits for its respawn
+struct supervisor_worker {
+    pid_t pid;            //- Worker process
+    uint64_t started;     //- Start time (milliseconds, monotonic)
+    uint64_t respawn_at;  //- Time the slot gets a new worker if pid is 0
+};
+
+//* Process-wide supervisor state, set up by supervisor_init()
+static struct {
+    char** argv;         //- Command line, the new binary of a hot restart gets the same one
+    char exe[PATH_MAX];  //- Path of the binary, resolved at start so that a hot restart runs the file now at that path
+    sigset_t old_mask;   //- Signal mask before supervisor_init(), restored for the new binary
+    int handoff_fd;      //- Hot restart socket to the previous supervisor (-1 if not started by a hot restart)
+} supervisor = {.handoff_fd = -1};
+
+static void supervisor_signals(sigset_t* set);
+static pid_t supervisor_spawn(int listen_fd, supervisor_worker_fn worker, void* arg);
+static pid_t supervisor_restart(int listen_fd, int* handoff_fd);
+static int supervisor_send_fd(int sock, int fd);
+static int supervisor_receive_fd(int sock);
+static void supervisor_signal_all(struct supervisor_worker* workers, unsigned count, int sig);
+static uint64_t supervisor_now(void);
+
+//* Block the supervisor signals and take over the listener of a hot restart
+int supervisor_init(char* argv[], int* listen_fd) {
+    sigset_t set;
+    const char* handoff;
+    ssize_t len;
+
+    supervisor.argv = argv;
+    if ((len = readlink("/proc/self/exe", supervisor.exe, sizeof supervisor.exe - 1)) == -1)
+        return -1;
+    supervisor.exe[len] = '\0';
+
+    supervisor_signals(&set);
+    if (sigprocmask(SIG_BLOCK, &set, &supervisor.old_mask) == -1)
+        return -1;
+
+    if ((handoff = getenv(SUPERVISOR_HANDOFF_ENV)) == NULL)
+        return 0;
+    supervisor.handoff_fd = atoi(handoff);
+    unsetenv(SUPERVISOR_HANDOFF_ENV);
+    if ((*listen_fd = supervisor_receive_fd(supervisor.handoff_fd)) == -1) {
+        close(supervisor.handoff_fd);
+        supervisor.handoff_fd = -1;
+        return -1;
+    }
+    return 1;
+}
+
+//* Start the workers and supervise them until a stop or a completed hot restart
+//- The signals are taken synchronously with sigtimedwait(), so the loop needs no handler and no async-signal-safe
+//- subset: every event is handled in one place, in order. The timeout drives the respawn, handoff and drain timers.
+int supervisor_run(int listen_fd, unsigned count, supervisor_worker_fn worker, void* arg) {
+    struct supervisor_worker* workers;                                            //- Worker slots
+    sigset_t set;                                                                 //- Signals of the loop
+    siginfo_t info;                                                               //- Last signal taken
+    struct timespec tick = {.tv_sec = 0, .tv_nsec = SUPERVISOR_TICK * 1000000L};  //- sigtimedwait() timeout
+    pid_t successor = 0;                                                          //- New binary of a hot restart, until it reported ready
+    int successor_fd = -1;                                                        //- Hot restart socket to the successor
+    uint64_t successor_deadline = 0;                                              //- Time the successor must be ready by
+    int retiring = 0;                                                             //- Set once the workers were asked to drain
+    uint64_t drain_deadline = 0;                                                  //- Time the draining workers get killed
+    unsigned alive;                                                               //- Number of running workers
+    int sig;                                                                      //- Signal number, -1 on timeout
+
+    if ((workers = calloc(count, sizeof *workers)) == NULL)
+        return -1;
+
+    //- The listener must not leak into the new binary through exec(), it is passed explicitly. Its backlog is the
+    //- caller's: connections that arrive while the workers change wait in the accept queue, so it should be large.
+    if (fcntl(listen_fd, F_SETFD, FD_CLOEXEC) == -1) {
+        free(workers);
+        return -1;
+    }
+
+    for (unsigned i = 0; i < count; i++) {
+        if ((workers[i].pid = supervisor_spawn(listen_fd, worker, arg)) == -1) {
+            supervisor_signal_all(workers, i, SIGTERM);
+            free(workers);
+            return -1;
+        }
+        workers[i].started = supervisor_now();
+    }
+    printf("supervisor %d: %u workers started\n", getpid(), count);
+
+    //- The workers accept now: tell the previous supervisor that its workers can go.
+    if (supervisor.handoff_fd != -1) {
+        while (write(supervisor.handoff_fd, "R", 1) == -1 && errno == EINTR) continue;
+        close(supervisor.handoff_fd);
+        supervisor.handoff_fd = -1;
+    }
+
+    supervisor_signals(&set);
+    while (1) {
+        uint64_t now;
+
+        fflush(stdout);
+        if ((sig = sigtimedwait(&set, &info, &tick)) == -1 && errno != EAGAIN && errno != EINTR) {
+            perror("error: waiting for signals failed, aborting...");
+            supervisor_signal_all(workers, count, SIGTERM);
+            free(workers);
+            return -1;
+        }
+        now = supervisor_now();
+
+        switch (sig) {
+            case SIGCHLD: {
+                pid_t pid;
+                int status;
+
+                //- Several exits may be merged into one SIGCHLD, so every exited child is collected.
+                while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+                    if (pid == successor) {
+                        printf("supervisor %d: new binary %d exited before it was ready, keeping the current workers\n", getpid(), pid);
+                        close(successor_fd);
+                        successor = 0;
+                        successor_fd = -1;
+                        continue;
+                    }
+                    for (unsigned i = 0; i < count; i++) {
+                        if (workers[i].pid != pid)
+                            continue;
+                        if (!retiring) {
+                            if (WIFSIGNALED(status))
+                                printf("supervisor %d: worker %d killed by signal %d, respawning\n", getpid(), pid, WTERMSIG(status));
+                            else
+                                printf("supervisor %d: worker %d exited with status %d, respawning\n", getpid(), pid, WEXITSTATUS(status));
+                        }
+                        workers[i].pid = 0;
+                        workers[i].respawn_at = workers[i].started + SUPERVISOR_RESPAWN_DELAY;
+                    }
+                }
+                break;
+            }
+            case SIGHUP:
+                if (retiring || successor != 0) {
+                    printf("supervisor %d: hot restart already in progress\n", getpid());
+                    break;
+                }
+                if ((successor = supervisor_restart(listen_fd, &successor_fd)) == -1) {
+                    perror("error: hot restart failed, keeping the current workers");
+                    successor = 0;
+                    break;
+                }
+                successor_deadline = now + SUPERVISOR_HANDOFF_TIMEOUT;
+                printf("supervisor %d: hot restart, new binary %d started\n", getpid(), successor);
+                break;
+            case SIGQUIT:
+                if (!retiring) {
+                    retiring = 1;
+                    drain_deadline = now + SUPERVISOR_DRAIN_TIMEOUT;
+                    supervisor_signal_all(workers, count, SIGQUIT);
+                }
+                break;
+            case SIGINT:
+            case SIGTERM:
+                printf("signal %d received, stopping the workers...\n", sig);
+                supervisor_signal_all(workers, count, SIGTERM);
+                if (successor != 0)
+                    kill(successor, SIGTERM);
+                //- Only the signalled children are waited for: a successor that already reported ready is the new
+                //- server, it keeps running and is no child to wait for.
+                for (unsigned i = 0; i < count; i++) {
+                    while (workers[i].pid > 0 && waitpid(workers[i].pid, NULL, 0) == -1 && errno == EINTR) continue;
+                }
+                while (successor > 0 && waitpid(successor, NULL, 0) == -1 && errno == EINTR) continue;
+                free(workers);
+                return 0;
+            default:
+                break;
+        }
+
+        //* Hot restart progress
+        //- The successor writes one byte once its workers run. Only then are the old workers told to drain, so there
+        //- is no moment in which nobody accepts.
+        if (successor != 0) {
+            struct pollfd pfd = {.fd = successor_fd, .events = POLLIN};
+            char ready = 0;
+
+            if (poll(&pfd, 1, 0) == 1 && read(successor_fd, &ready, 1) == 1 && ready == 'R') {
+                printf("supervisor %d: new binary %d is ready, draining the old workers\n", getpid(), successor);
+                close(successor_fd);
+                successor = 0;
+                successor_fd = -1;
+                retiring = 1;
+                drain_deadline = now + SUPERVISOR_DRAIN_TIMEOUT;
+                supervisor_signal_all(workers, count, SIGQUIT);
+            } else if (pfd.revents & (POLLHUP | POLLERR) || now >= successor_deadline) {
+                printf("supervisor %d: new binary %d did not get ready, keeping the current workers\n", getpid(), successor);
+                kill(successor, SIGTERM);
+                close(successor_fd);
+                successor_fd = -1;
+                //- successor stays set until its SIGCHLD, so that its exit is not taken for a worker's.
+                successor_deadline = UINT64_MAX;
+            }
+        }
+
+        //* Respawn and drain timers
+        alive = 0;
+        for (unsigned i = 0; i < count; i++) {
+            if (workers[i].pid == 0 && !retiring && now >= workers[i].respawn_at) {
+                if ((workers[i].pid = supervisor_spawn(listen_fd, worker, arg)) == -1) {
+                    perror("error: worker respawn failed, retrying...");
+                    workers[i].pid = 0;
+                    workers[i].respawn_at = now + SUPERVISOR_RESPAWN_DELAY;
+                } else {
+                    workers[i].started = now;
+                }
+            }
+            alive += workers[i].pid != 0;
+        }
+        if (retiring) {
+            if (alive == 0) {
+                printf("supervisor %d: every worker is gone, exiting\n", getpid());
+                free(workers);
+                return 0;
+            }
+            if (now >= drain_deadline) {
+                printf("supervisor %d: %u workers still busy after %d ms, killing them\n", getpid(), alive, SUPERVISOR_DRAIN_TIMEOUT);
+                supervisor_signal_all(workers, count, SIGKILL);
+                drain_deadline = UINT64_MAX;
+            }
+        }
+    }
+}
+
+//* Signals handled by the supervisor loop
+static void supervisor_signals(sigset_t* set) {
+    sigemptyset(set);
+    sigaddset(set, SIGCHLD);
+    sigaddset(set, SIGHUP);
+    sigaddset(set, SIGQUIT);
+    sigaddset(set, SIGINT);
+    sigaddset(set, SIGTERM);
+}
+
+//* Fork one worker
+//- The child restores the signal mask of the program except for SIGQUIT, see supervisor.h. Buffered output is flushed
+//- first, otherwise the child would print it a second time.
+static pid_t supervisor_spawn(int listen_fd, supervisor_worker_fn worker, void* arg) {
+    sigset_t mask = supervisor.old_mask;
+    pid_t pid;
+
+    fflush(NULL);
+    if ((pid = fork()) != 0)
+        return pid;
+
+    if (supervisor.handoff_fd != -1)
+        close(supervisor.handoff_fd);
+    sigaddset(&mask, SIGQUIT);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+    exit(worker(listen_fd, arg));
+}
+
+//* Start the new binary of a hot restart and pass it the listening socket
+//- The new binary finds its end of the socket pair in SUPERVISOR_HANDOFF_ENV. The listener is sent before exec(), the
+//- message waits in the socket until the new binary reads it.
+//? Returns the pid of the new binary, -1 on failure (errno set).
+static pid_t supervisor_restart(int listen_fd, int* handoff_fd) {
+    int sv[2];
+    pid_t pid;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1)
+        return -1;
+    if (supervisor_send_fd(sv[0], listen_fd) == -1) {
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+
+    fflush(NULL);
+    if ((pid = fork()) == -1) {
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        char fd[16];
+
+        snprintf(fd, sizeof fd, "%d", sv[1]);
+        setenv(SUPERVISOR_HANDOFF_ENV, fd, 1);
+        fcntl(sv[1], F_SETFD, 0);
+        sigprocmask(SIG_SETMASK, &supervisor.old_mask, NULL);
+        execv(supervisor.exe, supervisor.argv);
+        perror("error: executing the new binary failed");
+        _exit(EXIT_FAILURE);
+    }
+
+    close(sv[1]);
+    *handoff_fd = sv[0];
+    return pid;
+}
+
+//* Send a file descriptor over a Unix socket
+//- The kernel installs a duplicate of the descriptor in the receiving process, it refers to the same open socket:
+//- same accept queue, same pending connections.
+static int supervisor_send_fd(int sock, int fd) {
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {.iov_base = (char[]){'L'}, .iov_len = 1};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof control};
+    struct cmsghdr* cmsg;
+
+    memset(control, 0, sizeof control);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof fd);
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == -1 ? -1 : 0;
+}
+
+//* Receive a file descriptor sent with supervisor_send_fd()
+//? Returns the descriptor (close-on-exec), -1 on failure.
+static int supervisor_receive_fd(int sock) {
+    char control[CMSG_SPACE(sizeof(int))];
+    char byte;
+    struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof control};
+    struct cmsghdr* cmsg;
+    int fd;
+
+    while (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) == -1) {
+        if (errno != EINTR)
+            return -1;
+    }
+    if ((cmsg = CMSG_FIRSTHDR(&msg)) == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        errno = EPROTO;
+        return -1;
+    }
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof fd);
+    return fd;
+}
+
+static void supervisor_signal_all(struct supervisor_worker* workers, unsigned count, int sig) {
+    for (unsigned i = 0; i < count; i++) {
+        if (workers[i].pid > 0)
+            kill(workers[i].pid, sig);
+    }
+}
+
+static uint64_t supervisor_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
@@ -0,0 +1,35 @@
+#ifndef COMMON_SUPERVISOR_H
+#define COMMON_SUPERVISOR_H
+
+#define SUPERVISOR_RESPAWN_DELAY 1000     //- Milliseconds a worker must have lived to be respawned at once (crash loop brake)
+#define SUPERVISOR_HANDOFF_TIMEOUT 10000  //- Milliseconds the new binary of a hot restart gets to report that it is ready
+#define SUPERVISOR_DRAIN_TIMEOUT 30000    //- Milliseconds a retiring worker gets to finish its connections before SIGKILL
+#define SUPERVISOR_HANDOFF_ENV "ECHO_HANDOFF_FD"  //- Environment variable naming the hot restart socket of a new binary
+
+//* Worker process entry point, returns the exit status of the worker
+typedef int (*supervisor_worker_fn)(int listen_fd, void* arg);
+
+//* Prefork supervisor
+//- The supervisor process forks a fixed set of workers that all serve the same listening socket. It serves no client
+//- itself: it waits for signals and keeps the set complete.
+//-   SIGCHLD          a worker exited: it is reaped with waitpid() and replaced (after SUPERVISOR_RESPAWN_DELAY if
+//-                    it died young, so a worker that crashes on startup does not turn into a fork loop)
+//-   SIGHUP           hot restart: the binary is started again and the listening socket is passed to it over a Unix
+//-                    socket (SCM_RIGHTS). Once the new binary reports that its workers run, the old workers get
+//-                    SIGQUIT and the old supervisor exits when they are gone.
+//-   SIGQUIT          graceful stop: the workers get SIGQUIT, the supervisor returns when they are gone
+//-   SIGINT, SIGTERM  stop: the workers get SIGTERM, the supervisor returns when they are gone
+//- The listening socket is never closed during a hot restart. Connections that arrive while the old workers drain
+//- wait in the accept queue and are taken by the new workers, so a deploy drops no connection attempt.
+//- Workers start with SIGQUIT blocked. A worker unblocks it where it can handle it: SIGQUIT means stop accepting,
+//- finish the open connections and exit.
+//-
+//- supervisor_init() must run before the process starts any thread: it blocks the supervisor signals, which every
+//- thread created afterwards inherits, so only supervisor_run() ever sees them. It also takes over the listening
+//- socket if the process is the new binary of a hot restart.
+//? supervisor_init() returns 1 if *listen_fd was inherited, 0 if the caller has to create it, -1 on failure.
+//? supervisor_run() returns 0 after a stop or a completed hot restart, -1 if the workers cannot be started (errno set).
+int supervisor_init(char* argv[], int* listen_fd);
+int supervisor_run(int listen_fd, unsigned workers, supervisor_worker_fn worker, void* arg);
+
+#endif
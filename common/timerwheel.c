@@ -0,0 +1,154 @@
+#include "timerwheel.h"
+
+#include <limits.h>
+#include <string.h>
+
+#define TIMERWHEEL_MASK (TIMERWHEEL_SLOTS - 1)
+
+static void timerwheel_link(struct timerwheel* wheel, struct timerwheel_timer* timer, uint64_t base);
+static void timerwheel_unlink(struct timerwheel* wheel, struct timerwheel_timer* timer);
+static struct timerwheel_timer* timerwheel_detach(struct timerwheel* wheel, unsigned level, unsigned index);
+static uint64_t timerwheel_next(const struct timerwheel* wheel);
+
+void timerwheel_init(struct timerwheel* wheel, uint64_t now) {
+    memset(wheel, 0, sizeof *wheel);
+    wheel->current = now;
+}
+
+//* Arm a timer, moving it if it is armed already
+//- The wheel has expired every tick up to current, so the earliest deadline a new timer can get is the next one.
+void timerwheel_arm(struct timerwheel* wheel, struct timerwheel_timer* timer, uint64_t expires) {
+    if (timer->pprev != NULL)
+        timerwheel_unlink(wheel, timer);
+    timer->expires = expires > wheel->current ? expires : wheel->current + 1;
+    timerwheel_link(wheel, timer, wheel->current + 1);
+    wheel->armed++;
+}
+
+void timerwheel_cancel(struct timerwheel* wheel, struct timerwheel_timer* timer) {
+    if (timer->pprev != NULL)
+        timerwheel_unlink(wheel, timer);
+}
+
+//* Advance the wheel to now
+//- The loop only stops at the ticks where something happens (see timerwheel_next()): a tick that starts the span of
+//- an occupied higher level slot first cascades that slot, top level first, then the level 0 slot of the tick expires.
+//- Cascaded timers are placed relative to the tick itself, so a timer that is due on it lands in the slot that
+//- expires next. The slot is detached before the callbacks run: a callback that arms a timer 64 ticks ahead reuses
+//- the slot index, that timer must wait for the next round.
+size_t timerwheel_expire(struct timerwheel* wheel, uint64_t now, void (*expired)(struct timerwheel_timer* timer, void* context),
+                         void* context) {
+    struct timerwheel_timer *list, *timer;
+    uint64_t tick;
+    size_t count = 0;
+
+    while (wheel->armed > 0 && (tick = timerwheel_next(wheel)) <= now) {
+        for (unsigned level = TIMERWHEEL_LEVELS - 1; level > 0; level--) {
+            unsigned shift = TIMERWHEEL_BITS * level;
+            if ((tick & ((1ULL << shift) - 1)) != 0)
+                continue;
+            for (list = timerwheel_detach(wheel, level, (tick >> shift) & TIMERWHEEL_MASK); list != NULL;) {
+                timer = list;
+                list = timer->next;
+                timerwheel_link(wheel, timer, tick);
+            }
+        }
+        wheel->current = tick;
+
+        //- The detached list keeps valid back links, so a callback may still cancel any timer of it.
+        if ((list = timerwheel_detach(wheel, 0, tick & TIMERWHEEL_MASK)) == NULL)
+            continue;
+        list->pprev = &list;
+        while ((timer = list) != NULL) {
+            *timer->pprev = timer->next;
+            if (timer->next != NULL)
+                timer->next->pprev = timer->pprev;
+            timer->pprev = NULL;
+            wheel->armed--;
+            count++;
+            expired(timer, context);
+        }
+    }
+    if (now > wheel->current)
+        wheel->current = now;
+    return count;
+}
+
+int timerwheel_timeout(const struct timerwheel* wheel, uint64_t now) {
+    uint64_t next;
+
+    if (wheel->armed == 0)
+        return -1;
+    next = timerwheel_next(wheel);
+    if (next <= now)
+        return 0;
+    return next - now < INT_MAX ? (int)(next - now) : INT_MAX;
+}
+
+//* Put a timer into the slot of its deadline, seen from base
+//- The level is the lowest one on which the deadline is less than 64 slots ahead of base. Its slot index then differs
+//- from the index of base on that level (a smaller difference would have fit one level down), so the slot is reached
+//- exactly when the deadline enters its span. A deadline beyond the top level goes to the top slot base reaches last.
+static void timerwheel_link(struct timerwheel* wheel, struct timerwheel_timer* timer, uint64_t base) {
+    unsigned level = 0, index;
+
+    while (level < TIMERWHEEL_LEVELS &&
+           (timer->expires >> (TIMERWHEEL_BITS * level)) - (base >> (TIMERWHEEL_BITS * level)) >= TIMERWHEEL_SLOTS)
+        level++;
+    if (level == TIMERWHEEL_LEVELS) {
+        level = TIMERWHEEL_LEVELS - 1;
+        index = ((base >> (TIMERWHEEL_BITS * level)) + TIMERWHEEL_MASK) & TIMERWHEEL_MASK;
+    } else {
+        index = (timer->expires >> (TIMERWHEEL_BITS * level)) & TIMERWHEEL_MASK;
+    }
+
+    timer->slot = level * TIMERWHEEL_SLOTS + index;
+    if ((timer->next = wheel->slots[timer->slot]) != NULL)
+        timer->next->pprev = &timer->next;
+    timer->pprev = &wheel->slots[timer->slot];
+    wheel->slots[timer->slot] = timer;
+    wheel->occupied[level] |= 1ULL << index;
+}
+
+static void timerwheel_unlink(struct timerwheel* wheel, struct timerwheel_timer* timer) {
+    if ((*timer->pprev = timer->next) != NULL)
+        timer->next->pprev = timer->pprev;
+    if (wheel->slots[timer->slot] == NULL)
+        wheel->occupied[timer->slot / TIMERWHEEL_SLOTS] &= ~(1ULL << (timer->slot & TIMERWHEEL_MASK));
+    timer->pprev = NULL;
+    wheel->armed--;
+}
+
+//* Take the whole list of a slot out of the wheel, the timers stay counted as armed
+static struct timerwheel_timer* timerwheel_detach(struct timerwheel* wheel, unsigned level, unsigned index) {
+    struct timerwheel_timer** slot = &wheel->slots[level * TIMERWHEEL_SLOTS + index];
+    struct timerwheel_timer* list = *slot;
+
+    *slot = NULL;
+    wheel->occupied[level] &= ~(1ULL << index);
+    return list;
+}
+
+//* Earliest tick after current on which a level 0 slot expires or a higher slot cascades
+//- On every level the bitmap is rotated so that bit 0 is the first slot whose span starts after current, the count of
+//- trailing zeros is then the number of slot spans until the next occupied one. Level 0 entries that wrapped around
+//- (deadlines in the next 64-tick block) come out behind the ones of the current block that way.
+static uint64_t timerwheel_next(const struct timerwheel* wheel) {
+    uint64_t next = UINT64_MAX;
+
+    for (unsigned level = 0; level < TIMERWHEEL_LEVELS; level++) {
+        unsigned shift = TIMERWHEEL_BITS * level;
+        uint64_t occupied = wheel->occupied[level], first, tick;
+        unsigned index;
+
+        if (occupied == 0)
+            continue;
+        first = (wheel->current >> shift) + 1;
+        index = first & TIMERWHEEL_MASK;
+        if (index != 0)
+            occupied = (occupied >> index) | (occupied << (TIMERWHEEL_SLOTS - index));
+        if ((tick = (first + __builtin_ctzll(occupied)) << shift) < next)
+            next = tick;
+    }
+    return next;
+}
@@ -0,0 +1,63 @@
+#ifndef COMMON_TIMERWHEEL_H
+#define COMMON_TIMERWHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define TIMERWHEEL_BITS 6                        //- log2 of the slots per level
+#define TIMERWHEEL_SLOTS (1 << TIMERWHEEL_BITS)  //- Slots per level, one bit each in an occupancy word
+#define TIMERWHEEL_LEVELS 4                      //- Levels, the top one spans 64^4 ms (4.6 hours)
+
+//* Timer, embedded in the object it times out
+//- The wheel links it into a slot list, so arming allocates nothing. A timer that is not armed has pprev NULL.
+struct timerwheel_timer {
+    struct timerwheel_timer* next;    //- Next timer of the slot
+    struct timerwheel_timer** pprev;  //- Link that points to this timer (NULL: not armed)
+    uint64_t expires;                 //- Deadline in milliseconds (see timerwheel_now())
+    uint32_t slot;                    //- Index of the slot the timer is linked into
+};
+
+//* Hierarchical timing wheel
+//- One tick is a millisecond. Level 0 has a slot for each of the next 64 ticks, each slot of level 1 covers 64 ticks,
+//- of level 2 4096 ticks and of level 3 262144 ticks. A timer goes to the lowest level whose slot can tell its
+//- deadline apart from the current tick (the highest 6-bit group in which the two differ), so arming and cancelling
+//- is a list insert or unlink: O(1), no allocation and no syscall. When the current tick enters the span of a higher
+//- level slot, its timers cascade one level down, each timer moves at most three times before it expires. Deadlines
+//- beyond the top level wait in the top slot that cascades last and are placed again from there.
+//-
+//- Every level keeps a bitmap of its occupied slots, so timerwheel_timeout() finds the next level 0 deadline with one
+//- count-trailing-zeros, and timerwheel_expire() skips empty stretches instead of visiting every tick of a long sleep.
+//- An event loop sleeps until that deadline and expires the wheel after each wakeup: 100k connections cost one timer
+//- each and no timer file descriptor or syscall at all.
+struct timerwheel {
+    uint64_t current;                                                      //- Last tick that was expired
+    uint64_t occupied[TIMERWHEEL_LEVELS];                                  //- Bitmap of the non-empty slots of every level
+    struct timerwheel_timer* slots[TIMERWHEEL_LEVELS * TIMERWHEEL_SLOTS];  //- Slot lists, level by level
+    size_t armed;                                                          //- Number of armed timers
+};
+
+//* Timing wheel interface
+//- timerwheel_arm() moves a timer (armed or not) to a new deadline, a deadline in the past expires on the next tick.
+//- timerwheel_cancel() does nothing for a timer that is not armed.
+//- timerwheel_expire() advances the wheel to now and calls expired for every timer whose deadline is reached, in
+//- deadline order. The timer is unlinked before the call, so the callback may arm it again or free it.
+//? timerwheel_expire() returns the number of expired timers. timerwheel_timeout() returns the milliseconds until the
+//? next expiry can be due (0 if it already is), or -1 if no timer is armed: the timeout of an epoll_wait().
+void timerwheel_init(struct timerwheel* wheel, uint64_t now);
+void timerwheel_arm(struct timerwheel* wheel, struct timerwheel_timer* timer, uint64_t expires);
+void timerwheel_cancel(struct timerwheel* wheel, struct timerwheel_timer* timer);
+size_t timerwheel_expire(struct timerwheel* wheel, uint64_t now, void (*expired)(struct timerwheel_timer* timer, void* context),
+                         void* context);
+int timerwheel_timeout(const struct timerwheel* wheel, uint64_t now);
+
+//* Current time in milliseconds for the wheel
+//- CLOCK_MONOTONIC_COARSE is read from the vDSO without a syscall and has the resolution of the scheduler tick
+//- (1 to 4 ms), plenty for timeouts counted in seconds.
+static inline uint64_t timerwheel_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+#endif
@@ -0,0 +1,188 @@
+#define _GNU_SOURCE
+
+#include "trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+_Static_assert(sizeof(struct trace_header) == TRACE_HEADER_SIZE, "the trace header must fill TRACE_HEADER_SIZE bytes");
+_Static_assert(sizeof(struct trace_record) % TRACE_ALIGN == 0, "records must keep the payload aligned");
+
+static struct trace_header* trace;  //- Mapped trace file (NULL: no capture)
+static int trace_fd = -1;           //- Trace file, kept open to grow it
+
+static int trace_reserve(uint64_t end);
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//* Create the trace file and map it
+//- The whole TRACE_MAX_SIZE range is mapped up front (MAP_NORESERVE, it only takes address space), so growing the
+//- file never moves the mapping under a writer. Only the allocated part of it may be touched.
+int trace_init(const char* path, int append) {
+    struct trace_header* header;
+    struct stat st;
+    int fd;
+
+    if ((fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC | (append ? 0 : O_TRUNC), 0644)) == -1)
+        return -1;
+    if (fstat(fd, &st) == -1 || (st.st_size < TRACE_CHUNK && fallocate(fd, 0, 0, TRACE_CHUNK) == -1))
+        goto fail;
+    if ((header = mmap(NULL, TRACE_MAX_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, fd, 0)) == MAP_FAILED)
+        goto fail;
+
+    //- A new file, or an empty one that an append found, gets a fresh header.
+    if (st.st_size == 0 || (append && header->magic[0] == '\0')) {
+        memcpy(header->magic, TRACE_MAGIC, sizeof header->magic);
+        header->started = now_ns();
+        header->end = TRACE_HEADER_SIZE;
+        header->size = st.st_size > TRACE_CHUNK ? st.st_size : TRACE_CHUNK;
+    } else if (memcmp(header->magic, TRACE_MAGIC, sizeof header->magic) != 0) {
+        munmap(header, TRACE_MAX_SIZE);
+        errno = EINVAL;
+        goto fail;
+    }
+    trace = header;
+    trace_fd = fd;
+    return 0;
+
+fail:
+    close(fd);
+    return -1;
+}
+
+uint32_t trace_open(void) {
+    uint32_t connection;
+
+    if (trace == NULL)
+        return 0;
+    connection = __atomic_add_fetch(&trace->connections, 1, __ATOMIC_RELAXED);
+    trace_record(connection, TRACE_OPEN, NULL, 0);
+    return connection;
+}
+
+void trace_close(uint32_t connection) {
+    trace_record(connection, TRACE_CLOSE, NULL, 0);
+}
+
+void trace_record(uint32_t connection, enum trace_event event, const void* data, size_t len) {
+    struct iovec iov = {(void*)data, len};
+
+    trace_recordv(connection, event, &iov, 1, len);
+}
+
+//* Append a record
+//- The space is reserved first, the record is filled in and its size published last (release), so a reader that sees
+//- the size also sees the payload. The end offset only moves over space the file already has: a record that does not
+//- fit leaves no hole, which would stop a reader and hide every record behind it.
+void trace_recordv(uint32_t connection, enum trace_event event, const struct iovec* iov, int count, size_t len) {
+    struct trace_record* record;
+    uint64_t size = (sizeof *record + len + TRACE_ALIGN - 1) & ~(uint64_t)(TRACE_ALIGN - 1);
+    uint64_t offset;
+    char* payload;
+
+    if (trace == NULL || connection == 0)
+        return;
+    offset = __atomic_load_n(&trace->end, __ATOMIC_RELAXED);
+    do {
+        if (size > UINT32_MAX || offset + size > TRACE_MAX_SIZE || trace_reserve(offset + size) == -1) {
+            __atomic_fetch_add(&trace->dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    } while (!__atomic_compare_exchange_n(&trace->end, &offset, offset + size, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    record = (struct trace_record*)((char*)trace + offset);
+    record->connection = connection;
+    record->time = now_ns() - trace->started;
+    record->length = (uint32_t)len;
+    record->event = event;
+    payload = (char*)(record + 1);
+    for (int i = 0; i < count && len > 0; i++) {
+        size_t part = iov[i].iov_len < len ? iov[i].iov_len : len;
+
+        memcpy(payload, iov[i].iov_base, part);
+        payload += part;
+        len -= part;
+    }
+    __atomic_store_n(&record->size, (uint32_t)size, __ATOMIC_RELEASE);
+}
+
+//* Make sure the file reaches end
+//- The writer that crosses the allocated size extends the file by whole chunks. Writers that race here all extend it,
+//- fallocate() of an allocated range changes nothing, and the recorded size only ever grows.
+static int trace_reserve(uint64_t end) {
+    uint64_t size = __atomic_load_n(&trace->size, __ATOMIC_ACQUIRE);
+
+    while (end > size) {
+        uint64_t grown = (end + TRACE_CHUNK - 1) / TRACE_CHUNK * TRACE_CHUNK;
+
+        if (fallocate(trace_fd, 0, size, grown - size) == -1)
+            return -1;
+        __atomic_compare_exchange_n(&trace->size, &size, grown, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE);
+    }
+    return 0;
+}
+
+int trace_reader_open(struct trace_reader* reader, const char* path) {
+    struct stat st;
+    void* base;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+        return -1;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+    if ((size_t)st.st_size < TRACE_HEADER_SIZE) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);  //- The mapping keeps the file
+    if (base == MAP_FAILED)
+        return -1;
+    if (memcmp(base, TRACE_MAGIC, 8) != 0) {
+        munmap(base, st.st_size);
+        errno = EINVAL;
+        return -1;
+    }
+    reader->base = base;
+    reader->size = st.st_size;
+    reader->offset = TRACE_HEADER_SIZE;
+    reader->header = base;
+    return 0;
+}
+
+//* Return the next complete record
+//- The end offset bounds the walk as well as the file size: space behind it was never reserved.
+const struct trace_record* trace_reader_next(struct trace_reader* reader) {
+    const struct trace_record* record;
+    uint64_t end = __atomic_load_n(&reader->header->end, __ATOMIC_ACQUIRE);
+    uint32_t size;
+
+    if (end > reader->size)
+        end = reader->size;
+    if (reader->offset + sizeof *record > end)
+        return NULL;
+    record = (const struct trace_record*)(reader->base + reader->offset);
+    if ((size = __atomic_load_n(&record->size, __ATOMIC_ACQUIRE)) == 0 || reader->offset + size > end ||
+        sizeof *record + record->length > size)
+        return NULL;
+    reader->offset += size;
+    return record;
+}
+
+void trace_reader_close(struct trace_reader* reader) {
+    munmap((void*)reader->base, reader->size);
+    reader->base = NULL;
+}
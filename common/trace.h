@@ -0,0 +1,90 @@
+#ifndef COMMON_TRACE_H
+#define COMMON_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define TRACE_MAGIC "ECHOTRC1"        //- First bytes of a trace file, the digit is the format version
+#define TRACE_CHUNK (4 << 20)         //- Bytes the file grows by, one fallocate() per chunk
+#define TRACE_MAX_SIZE (16ULL << 30)  //- Address space mapped for the file, records behind it are dropped
+#define TRACE_HEADER_SIZE 64          //- Offset of the first record
+#define TRACE_ALIGN 8                 //- Records start at multiples of 8 bytes
+
+//* What a record describes
+enum trace_event {
+    TRACE_OPEN,   //- A connection was accepted, no payload
+    TRACE_IN,     //- Bytes a receive call returned
+    TRACE_OUT,    //- Bytes a send call handed to the kernel
+    TRACE_CLOSE,  //- The connection was closed, no payload
+};
+
+//* File header, at offset 0
+//- end, size, dropped and connections are shared by every process and thread that captures into the file and are
+//- only changed with atomic operations.
+struct trace_header {
+    char magic[8];         //- TRACE_MAGIC
+    uint64_t started;      //- CLOCK_MONOTONIC time the capture started in nanoseconds, records are relative to it
+    uint64_t end;          //- Offset behind the last reserved record (never beyond size)
+    uint64_t size;         //- Bytes allocated for the file so far
+    uint64_t dropped;      //- Records that did not fit
+    uint32_t connections;  //- Connection ids handed out, ids run from 1
+    uint32_t reserved[5];  //- Zero
+};
+
+//* Record, followed by its payload and padding up to TRACE_ALIGN
+//- size is written last: a reader stops at a record whose size is still 0, the writer of that record has not finished
+//- (or died) yet.
+struct trace_record {
+    uint32_t size;        //- Record size with payload and padding (0: incomplete)
+    uint32_t connection;  //- Connection id
+    uint64_t time;        //- Nanoseconds since the capture started
+    uint32_t length;      //- Payload bytes
+    uint16_t event;       //- enum trace_event
+    uint16_t reserved;    //- Zero
+};
+
+//* Capture trace
+//- The servers append every connection event to a binary trace file for a later replay. The file is mapped into the
+//- address space once: a record is reserved with a compare-and-swap of the end offset in the mapped header and
+//- copied into the mapping, no syscall is made per record. The file grows by TRACE_CHUNK bytes with fallocate(), which
+//- never shrinks a file, so two writers that extend it at the same time cannot cut off each other's records. The
+//- mapping is shared, forked children and prefork workers write into the same file, and a hot restart appends to
+//- it. A record that does not fit (TRACE_MAX_SIZE reached, or the file system is full) is dropped and counted.
+//-
+//- The payload is captured as the socket calls saw it: a TRACE_IN record holds the bytes of one receive, framing
+//- headers included, so a replay sends the same byte stream with the same segmentation.
+//-
+//- trace_init() creates (or truncates) the file, with append it continues a valid trace the file already holds.
+//- trace_open() hands out the id of a new connection and records its TRACE_OPEN, trace_close() its TRACE_CLOSE.
+//- trace_record() appends len bytes of data, trace_recordv() the first len bytes of an iovec array.
+//- Without trace_init(), trace_open() returns 0 and every call with connection 0 does nothing, so the engines call
+//- them unconditionally.
+//? trace_init() returns -1 if the file cannot be created, mapped or is no trace (append), errno is set.
+int trace_init(const char* path, int append);
+uint32_t trace_open(void);
+void trace_close(uint32_t connection);
+void trace_record(uint32_t connection, enum trace_event event, const void* data, size_t len);
+void trace_recordv(uint32_t connection, enum trace_event event, const struct iovec* iov, int count, size_t len);
+
+//* Trace reader
+//- trace_reader_open() maps a trace file read-only, trace_reader_next() returns its records in file order (the order
+//- their space was reserved in, the times may be slightly out of order between threads) until the end or the first
+//- incomplete record. The payload follows the record (see trace_payload()).
+//? trace_reader_open() returns -1 if the file cannot be mapped or is no trace (errno EINVAL).
+struct trace_reader {
+    const char* base;                   //- Mapped file
+    size_t size;                        //- Mapped bytes
+    size_t offset;                      //- Offset of the next record
+    const struct trace_header* header;  //- Header of the file
+};
+
+int trace_reader_open(struct trace_reader* reader, const char* path);
+const struct trace_record* trace_reader_next(struct trace_reader* reader);
+void trace_reader_close(struct trace_reader* reader);
+
+static inline const char* trace_payload(const struct trace_record* record) {
+    return (const char*)(record + 1);
+}
+
+#endif
@@ -0,0 +1,341 @@
+#include "tuning.h"
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#define TUNING_SOMAXCONN_FILE "/proc/sys/net/core/somaxconn"  //- Upper limit the kernel applies to every listen() backlog
+
+//* Built-in profile
+struct tuning_preset {
+    const char* name;
+    int backlog;
+    int rcvbuf;
+    int sndbuf;
+    int nodelay;
+    int quickack;
+    int defer_accept;
+    int busy_poll;
+    int prefer_busy_poll;
+    int spin;
+    int cork;
+    size_t buffer_size;
+    int idle_timeout;
+    int read_timeout;
+    int write_timeout;
+};
+
+//- The default profile keeps the 1 KB buffer of the original examples. Only the backlog changed: 3 pending
+//- connections made the kernel drop SYNs as soon as a few clients connected at once. The timeouts are generous
+//- enough for an interactive client and still free the slot of a peer that went away without closing.
+static const struct tuning_preset presets[] = {
+    {.name = "default", .backlog = SOMAXCONN, .buffer_size = 1024, .idle_timeout = 300, .read_timeout = 30, .write_timeout = 30},
+    {.name = "latency",
+     .backlog = SOMAXCONN,
+     .nodelay = 1,
+     .quickack = 1,
+     .busy_poll = 50,
+     .prefer_busy_poll = 1,
+     .spin = 50,
+     .buffer_size = 16 * 1024,
+     .idle_timeout = 300,
+     .read_timeout = 30,
+     .write_timeout = 30},
+    {.name = "throughput",
+     .backlog = SOMAXCONN,
+     .rcvbuf = 4 << 20,
+     .sndbuf = 4 << 20,
+     .cork = 200,
+     .buffer_size = 64 * 1024,
+     .idle_timeout = 300,
+     .read_timeout = 30,
+     .write_timeout = 30},
+    {.name = "many-connections",
+     .backlog = 65535,
+     .rcvbuf = 16 * 1024,
+     .sndbuf = 16 * 1024,
+     .nodelay = 1,
+     .defer_accept = 5,
+     .buffer_size = 1024,
+     .idle_timeout = 60,
+     .read_timeout = 10,
+     .write_timeout = 10},
+};
+
+//* Configuration key, where its value lives and how it is parsed
+enum tuning_kind { TUNING_INT, TUNING_SIZE, TUNING_SWITCH };
+
+struct tuning_key {
+    const char* name;
+    enum tuning_kind kind;
+    size_t offset;
+    long long max;
+};
+
+static const struct tuning_key keys[] = {
+    {"port", TUNING_INT, offsetof(struct tuning, port), 65535},
+    {"backlog", TUNING_INT, offsetof(struct tuning, backlog), INT_MAX},
+    {"rcvbuf", TUNING_SIZE, offsetof(struct tuning, rcvbuf), INT_MAX / 2},
+    {"sndbuf", TUNING_SIZE, offsetof(struct tuning, sndbuf), INT_MAX / 2},
+    {"nodelay", TUNING_SWITCH, offsetof(struct tuning, nodelay), 1},
+    {"quickack", TUNING_SWITCH, offsetof(struct tuning, quickack), 1},
+    {"defer_accept", TUNING_INT, offsetof(struct tuning, defer_accept), INT_MAX},
+    {"busy_poll", TUNING_INT, offsetof(struct tuning, busy_poll), INT_MAX},
+    {"prefer_busy_poll", TUNING_SWITCH, offsetof(struct tuning, prefer_busy_poll), 1},
+    {"spin", TUNING_INT, offsetof(struct tuning, spin), 1000000},
+    {"cork", TUNING_INT, offsetof(struct tuning, cork), 200000},
+    {"idle_timeout", TUNING_INT, offsetof(struct tuning, idle_timeout), 1000000},
+    {"read_timeout", TUNING_INT, offsetof(struct tuning, read_timeout), 1000000},
+    {"write_timeout", TUNING_INT, offsetof(struct tuning, write_timeout), 1000000},
+    {"rate_limit", TUNING_INT, offsetof(struct tuning, rate_limit), 1000000000},
+    {"rate_burst", TUNING_INT, offsetof(struct tuning, rate_burst), 1000000},
+    {"max_connections", TUNING_INT, offsetof(struct tuning, max_connections), INT_MAX},
+};
+
+static char* trim(char* text);
+static int parse_number(const char* value, enum tuning_kind kind, long long max, long long* result);
+static int socket_option(int fd, int level, int option);
+static void print_buffer(FILE* out, const char* name, int size, int requested);
+
+void tuning_init(struct tuning* tuning) {
+    memset(tuning, 0, sizeof *tuning);
+    strcpy(tuning->ip, TUNING_DEFAULT_IP);
+    tuning->port = TUNING_DEFAULT_PORT;
+    tuning_profile(tuning, "default");
+}
+
+//* Replace the socket settings by a built-in profile
+int tuning_profile(struct tuning* tuning, const char* name) {
+    for (size_t i = 0; i < sizeof presets / sizeof presets[0]; i++) {
+        const struct tuning_preset* preset = &presets[i];
+
+        if (strcmp(preset->name, name) != 0)
+            continue;
+        strcpy(tuning->profile, preset->name);
+        tuning->backlog = preset->backlog;
+        tuning->rcvbuf = preset->rcvbuf;
+        tuning->sndbuf = preset->sndbuf;
+        tuning->nodelay = preset->nodelay;
+        tuning->quickack = preset->quickack;
+        tuning->defer_accept = preset->defer_accept;
+        tuning->busy_poll = preset->busy_poll;
+        tuning->prefer_busy_poll = preset->prefer_busy_poll;
+        tuning->spin = preset->spin;
+        tuning->cork = preset->cork;
+        tuning->buffer_size = preset->buffer_size;
+        tuning->idle_timeout = preset->idle_timeout;
+        tuning->read_timeout = preset->read_timeout;
+        tuning->write_timeout = preset->write_timeout;
+        return 0;
+    }
+    errno = EINVAL;
+    return -1;
+}
+
+//* Change one setting by its key
+int tuning_set(struct tuning* tuning, const char* key, const char* value) {
+    long long number;
+
+    if (strcmp(key, "profile") == 0)
+        return tuning_profile(tuning, value);
+    if (strcmp(key, "ip") == 0) {
+        struct in_addr addr;
+        if (inet_pton(AF_INET, value, &addr) != 1) {
+            errno = EINVAL;
+            return -1;
+        }
+        inet_ntop(AF_INET, &addr, tuning->ip, sizeof tuning->ip);
+        return 0;
+    }
+    if (strcmp(key, "buffer_size") == 0) {
+        if (parse_number(value, TUNING_SIZE, TUNING_BUFFER_MAX, &number) == -1 || number < TUNING_BUFFER_MIN) {
+            errno = EINVAL;
+            return -1;
+        }
+        tuning->buffer_size = number;
+        return 0;
+    }
+    for (size_t i = 0; i < sizeof keys / sizeof keys[0]; i++) {
+        if (strcmp(keys[i].name, key) != 0)
+            continue;
+        if (parse_number(value, keys[i].kind, keys[i].max, &number) == -1)
+            return -1;
+        *(int*)((char*)tuning + keys[i].offset) = (int)number;
+        return 0;
+    }
+    errno = EINVAL;
+    return -1;
+}
+
+//* Change one setting given as "key=value"
+int tuning_option(struct tuning* tuning, const char* assignment) {
+    char key[TUNING_NAME_MAX];
+    const char* equals = strchr(assignment, '=');
+
+    if (equals == NULL || (size_t)(equals - assignment) >= sizeof key) {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(key, assignment, equals - assignment);
+    key[equals - assignment] = '\0';
+    return tuning_set(tuning, key, equals + 1);
+}
+
+//* Apply a configuration file
+//- Blank lines and everything after a "#" are ignored, white space around the key and the value is trimmed.
+int tuning_load(struct tuning* tuning, const char* path) {
+    char line[TUNING_LINE_MAX];
+    unsigned number = 0;
+    FILE* file;
+
+    if ((file = fopen(path, "r")) == NULL)
+        return -1;
+    while (fgets(line, sizeof line, file) != NULL) {
+        char *key = line, *value, *comment;
+
+        number++;
+        if ((comment = strchr(line, '#')) != NULL)
+            *comment = '\0';
+        if ((value = strchr(line, '=')) != NULL)
+            *value++ = '\0';
+        key = trim(key);
+        if (*key == '\0' && value == NULL)
+            continue;
+        if (value != NULL)
+            value = trim(value);
+        if (value == NULL || tuning_set(tuning, key, value) == -1) {
+            fprintf(stderr, "error: %s:%u: invalid setting '%s'\n", path, number, key);
+            fclose(file);
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    fclose(file);
+    return 0;
+}
+
+//* Set the options of the profile on a socket
+//- SO_RCVBUF must be set before listen(): the TCP window scale is negotiated in the handshake and never grows later.
+void tuning_apply(const struct tuning* tuning, int fd) {
+    int domain = socket_option(fd, SOL_SOCKET, SO_DOMAIN);
+    int tcp = domain == AF_INET && socket_option(fd, SOL_SOCKET, SO_PROTOCOL) == IPPROTO_TCP;
+
+    if (tuning->rcvbuf > 0 && setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &tuning->rcvbuf, sizeof(int)) == -1)
+        perror("error: SO_RCVBUF failed, continuing with the default");
+    if (tuning->sndbuf > 0 && setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &tuning->sndbuf, sizeof(int)) == -1)
+        perror("error: SO_SNDBUF failed, continuing with the default");
+    if (domain == AF_INET && tuning->busy_poll > 0 && setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &tuning->busy_poll, sizeof(int)) == -1)
+        perror("error: SO_BUSY_POLL failed, continuing without busy polling");
+    if (domain == AF_INET && tuning->prefer_busy_poll && setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &(int){1}, sizeof(int)) == -1)
+        perror("error: SO_PREFER_BUSY_POLL failed, continuing without it");
+    if (!tcp)
+        return;
+    if (tuning->nodelay && setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int)) == -1)
+        perror("error: TCP_NODELAY failed, continuing without it");
+    if (tuning->defer_accept > 0 && setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &tuning->defer_accept, sizeof(int)) == -1)
+        perror("error: TCP_DEFER_ACCEPT failed, continuing without it");
+}
+
+//* Print the settings as the socket has them
+void tuning_print(const struct tuning* tuning, int fd, FILE* out) {
+    int domain = socket_option(fd, SOL_SOCKET, SO_DOMAIN);
+    int listener = socket_option(fd, SOL_SOCKET, SO_TYPE) != SOCK_DGRAM;
+    int tcp = domain == AF_INET && socket_option(fd, SOL_SOCKET, SO_PROTOCOL) == IPPROTO_TCP;
+    FILE* limit;
+    int somaxconn = -1;
+
+    fprintf(out, "tuning profile: %s\n", tuning->profile);
+    if (listener) {
+        if ((limit = fopen(TUNING_SOMAXCONN_FILE, "r")) != NULL) {
+            if (fscanf(limit, "%d", &somaxconn) != 1)
+                somaxconn = -1;
+            fclose(limit);
+        }
+        if (somaxconn >= 0 && somaxconn < tuning->backlog)
+            fprintf(out, "  backlog       %d (capped by net.core.somaxconn, %d requested)\n", somaxconn, tuning->backlog);
+        else
+            fprintf(out, "  backlog       %d\n", tuning->backlog);
+    }
+    print_buffer(out, "rcvbuf", socket_option(fd, SOL_SOCKET, SO_RCVBUF), tuning->rcvbuf);
+    print_buffer(out, "sndbuf", socket_option(fd, SOL_SOCKET, SO_SNDBUF), tuning->sndbuf);
+    if (tcp) {
+        fprintf(out, "  nodelay       %s\n", socket_option(fd, IPPROTO_TCP, TCP_NODELAY) > 0 ? "on" : "off");
+        fprintf(out, "  quickack      %s\n", tuning->quickack ? "on (re-armed after every receive)" : "off");
+        //- The kernel turns the seconds into a number of SYN-ACK retransmissions and reports that back in seconds.
+        fprintf(out, "  defer_accept  %d s\n", socket_option(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT));
+        fprintf(out, "  cork          %d us\n", tuning->cork);
+    }
+    if (domain == AF_INET) {
+        fprintf(out, "  busy_poll     %d us%s\n", socket_option(fd, SOL_SOCKET, SO_BUSY_POLL),
+                socket_option(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL) > 0 ? " (preferred over interrupts)" : "");
+    }
+    fprintf(out, "  spin          %d us\n", tuning->spin);
+    fprintf(out, "  buffer_size   %zu\n", tuning->buffer_size);
+}
+
+void tuning_quickack(int fd) {
+    setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &(int){1}, sizeof(int));
+}
+
+//* Strip the white space around a string in place
+static char* trim(char* text) {
+    char* end;
+
+    while (isspace((unsigned char)*text)) text++;
+    for (end = text + strlen(text); end > text && isspace((unsigned char)end[-1]); end--) end[-1] = '\0';
+    return text;
+}
+
+//* Parse a number, a size with an optional K or M suffix, or an on/off switch
+//? Returns -1 with errno EINVAL if value is not a number of its kind between 0 and max.
+static int parse_number(const char* value, enum tuning_kind kind, long long max, long long* result) {
+    long long multiplier = 1;
+    char* end;
+
+    if (kind == TUNING_SWITCH) {
+        if (strcmp(value, "on") == 0 || strcmp(value, "1") == 0 || strcmp(value, "yes") == 0) {
+            *result = 1;
+            return 0;
+        }
+        if (strcmp(value, "off") == 0 || strcmp(value, "0") == 0 || strcmp(value, "no") == 0) {
+            *result = 0;
+            return 0;
+        }
+        errno = EINVAL;
+        return -1;
+    }
+
+    errno = 0;
+    *result = strtoll(value, &end, 10);
+    if (kind == TUNING_SIZE && (*end == 'K' || *end == 'k'))
+        multiplier = 1024, end++;
+    else if (kind == TUNING_SIZE && (*end == 'M' || *end == 'm'))
+        multiplier = 1024 * 1024, end++;
+    //- The range is checked before the suffix is applied, a multiplication that overflows is undefined.
+    if (errno != 0 || end == value || *end != '\0' || *result < 0 || *result > max / multiplier) {
+        errno = EINVAL;
+        return -1;
+    }
+    *result *= multiplier;
+    return 0;
+}
+
+//* Print a socket buffer size next to the requested one
+//- The kernel doubles the request to make room for its bookkeeping and caps it at the rmem_max/wmem_max sysctl.
+static void print_buffer(FILE* out, const char* name, int size, int requested) {
+    if (requested == 0)
+        fprintf(out, "  %-13s %d (kernel default)\n", name, size);
+    else
+        fprintf(out, "  %-13s %d (%d requested)\n", name, size, requested);
+}
+
+//* Read an int socket option, -1 if the socket does not have it
+static int socket_option(int fd, int level, int option) {
+    int value;
+    return getsockopt(fd, level, option, &value, &(socklen_t){sizeof value}) == 0 ? value : -1;
+}
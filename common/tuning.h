@@ -0,0 +1,89 @@
+#ifndef COMMON_TUNING_H
+#define COMMON_TUNING_H
+
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#define TUNING_DEFAULT_IP "127.0.0.1"  //- Address the servers bind to unless the configuration says otherwise
+#define TUNING_DEFAULT_PORT 8080       //- Port the servers bind to unless the configuration says otherwise
+#define TUNING_BUFFER_MIN 64           //- Smallest accepted receive buffer size
+#define TUNING_BUFFER_MAX (16 << 20)   //- Largest accepted receive buffer size
+#define TUNING_NAME_MAX 32             //- Longest profile name, terminator included
+#define TUNING_LINE_MAX 256            //- Longest configuration file line
+
+//* Socket tuning of a server
+//- The listening socket gets every option before bind(), and the kernel copies them to each socket accept() returns,
+//- so the connections of every engine inherit the tuning without a setsockopt() call per accepted client. TCP_QUICKACK
+//- is the exception: accept() does not copy it and the kernel clears it on its own, it is re-armed per receive (see
+//- tuning_quickack()). The options a socket type does not have (TCP options on a Unix socket, the backlog of a UDP socket) are skipped.
+//- A value of 0 leaves the kernel default in place, TCP keeps autotuning socket buffers that were left at 0.
+//- The timeouts are not socket options: only the multi-connection server enforces them (see common/timerwheel.h).
+//- Neither are the limits (see common/ratelimit.h), which belong to a deployment rather than a profile: they are off
+//- unless set and a profile keeps them.
+struct tuning {
+    char profile[TUNING_NAME_MAX];  //- Name of the profile the settings started from
+    char ip[INET_ADDRSTRLEN];       //- Address to bind to (IPv4 servers)
+    int port;                       //- Port to bind to (IPv4 servers)
+    int backlog;                    //- listen() backlog, the kernel caps it at net.core.somaxconn
+    int rcvbuf;                     //- SO_RCVBUF in bytes, the kernel doubles it and caps it at net.core.rmem_max
+    int sndbuf;                     //- SO_SNDBUF in bytes, the kernel doubles it and caps it at net.core.wmem_max
+    int nodelay;                    //- TCP_NODELAY: send small segments at once instead of waiting for an ACK (Nagle)
+    int quickack;                   //- TCP_QUICKACK, re-armed after every receive: ACK at once instead of waiting for a reply
+    int defer_accept;               //- TCP_DEFER_ACCEPT in seconds: accept() only returns a client that sent data
+    int busy_poll;                  //- SO_BUSY_POLL in microseconds: a blocking receive spins on the device queue first
+    int prefer_busy_poll;           //- SO_PREFER_BUSY_POLL: busy polling takes precedence over device interrupts
+    int spin;                       //- Microseconds a receive spins in user space before it blocks (see common/busypoll.h)
+    int cork;                       //- Microseconds TCP_CORK may hold echoes while more input waits (see common/replybatch.h)
+    size_t buffer_size;             //- Receive buffer of the engines (the initial read size of the epoll reactor)
+    int idle_timeout;               //- Seconds a connection may stay silent between messages (0: forever)
+    int read_timeout;               //- Seconds a started message may take to arrive completely (0: forever)
+    int write_timeout;              //- Seconds the peer may leave pending echoes unread (0: forever)
+    int rate_limit;                 //- Datagrams (UDP) or connections (TCP) per second and source address (0: no limit)
+    int rate_burst;                 //- Messages a source may send at once above the rate (0: as many as one second allows)
+    int max_connections;            //- Connections open at the same time over the whole server (0: no limit)
+};
+
+//* Tuning profiles
+//-   default           the settings of a plain socket, with a backlog that survives a connection burst, and
+//-                     timeouts that close a silent connection after 5 minutes and a stalled message or echo after
+//-                     30 seconds
+//-   latency           TCP_NODELAY, TCP_QUICKACK, 50 us of kernel busy polling (preferred over interrupts) and 50 us
+//-                     of user space spinning: no segment and no ACK is held back, and a receive spins for a
+//-                     moment before it sleeps
+//-   throughput        4 MB socket buffers and 64 KB reads, Nagle stays on so small writes are coalesced, and the
+//-                     echoes of a pipelining client stay corked for up to 200 us to fill whole segments
+//-   many-connections  the largest backlog, small fixed socket buffers and 1 KB reads so an idle connection costs as
+//-                     little kernel and user memory as possible, TCP_DEFER_ACCEPT so a client that connects and
+//-                     sends nothing never wakes the server, and a silent connection is closed after a minute, a
+//-                     stalled message or echo after 10 seconds
+//- tuning_init() sets up the default profile. tuning_profile() replaces every socket setting by the named profile and
+//- keeps the address and the limits. tuning_set() changes one setting by its key (the names printed by tuning_print(), sizes may
+//- have a K or M suffix, switches take on/off), tuning_option() takes the same as one "key=value" string.
+//- tuning_load() applies a configuration file of "key = value" lines, "profile = <name>" included; "#" starts a
+//- comment. Settings apply in order, so a later line or option wins.
+//? tuning_profile() and tuning_set() return -1 with errno EINVAL for an unknown name or an invalid value.
+//? tuning_load() returns -1 if the file cannot be read (errno set) or has an invalid line (reported on stderr).
+void tuning_init(struct tuning* tuning);
+int tuning_profile(struct tuning* tuning, const char* name);
+int tuning_set(struct tuning* tuning, const char* key, const char* value);
+int tuning_option(struct tuning* tuning, const char* assignment);
+int tuning_load(struct tuning* tuning, const char* path);
+
+//* Apply the socket options to a listening (or UDP) socket, before bind()
+//- An option the kernel refuses (SO_BUSY_POLL above net.core.busy_poll and SO_PREFER_BUSY_POLL need CAP_NET_ADMIN)
+//- is reported and skipped, tuning_print() shows what the socket really got.
+void tuning_apply(const struct tuning* tuning, int fd);
+
+//* Print the effective settings of a socket
+//- The socket buffers, TCP options and busy polling are read back from the socket, the backlog is capped at
+//- net.core.somaxconn the way listen() does. quickack is printed as configured, a listening socket does not have it.
+void tuning_print(const struct tuning* tuning, int fd, FILE* out);
+
+//* Re-arm TCP_QUICKACK on a connected socket
+//- Quick ACK mode is a state of the connection, not a setting: the kernel leaves it again as soon as the traffic looks
+//- interactive, which an echo is. The engines that support quickack call this after every receive that returned data.
+//- A failure is ignored, the option is only a hint.
+void tuning_quickack(int fd);
+
+#endif
@@ -0,0 +1,51 @@
+#include "udp_gso.h"
+
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <string.h>
+
+#ifndef SOL_UDP
+#define SOL_UDP IPPROTO_UDP
+#endif
+
+//* Enable UDP generic receive offload on a socket
+//- With UDP_GRO the kernel may coalesce consecutive same-sized datagrams of one flow into a single super-buffer and
+//- reports the original datagram size in a UDP_GRO control message, so one recvmsg() returns up to 64 KB.
+//? Returns -1 if the kernel does not support UDP_GRO (Linux 5.0 or newer is needed).
+int udp_gro_enable(int fd) {
+    return setsockopt(fd, SOL_UDP, UDP_GRO, &(int){1}, sizeof(int));
+}
+
+//* Disable UDP generic receive offload on a socket again
+void udp_gro_disable(int fd) {
+    setsockopt(fd, SOL_UDP, UDP_GRO, &(int){0}, sizeof(int));
+}
+
+//* Get the segment size of a received GRO super-buffer
+//? Returns the size of the coalesced datagrams, or 0 if the message holds a single datagram.
+int udp_gro_segment_size(struct msghdr* msg) {
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+            int segment_size;
+            memcpy(&segment_size, CMSG_DATA(cmsg), sizeof segment_size);
+            return segment_size;
+        }
+    }
+    return 0;
+}
+
+//* Attach a UDP_SEGMENT control message to an outgoing message
+//- The kernel (or the NIC) splits the payload into segment_size datagrams, the last one may be shorter. A single
+//- sendmsg() thereby sends up to UDP_GSO_MAX_SEGMENTS datagrams. control must hold UDP_GSO_CONTROL_SIZE bytes.
+void udp_gso_set(struct msghdr* msg, char* control, uint16_t segment_size) {
+    struct cmsghdr* cmsg;
+
+    memset(control, 0, UDP_GSO_CONTROL_SIZE);
+    msg->msg_control = control;
+    msg->msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+    cmsg = CMSG_FIRSTHDR(msg);
+    cmsg->cmsg_level = SOL_UDP;
+    cmsg->cmsg_type = UDP_SEGMENT;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    memcpy(CMSG_DATA(cmsg), &segment_size, sizeof segment_size);
+}
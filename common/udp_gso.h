@@ -0,0 +1,17 @@
+#ifndef COMMON_UDP_GSO_H
+#define COMMON_UDP_GSO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#define UDP_GSO_BUFFER_SIZE 65536  //- A GRO super-buffer or GSO send carries at most 64 KB of payload
+#define UDP_GSO_MAX_SEGMENTS 64    //- Segment limit of one GSO send (UDP_MAX_SEGMENTS on older kernels)
+#define UDP_GSO_CONTROL_SIZE 32    //- Control buffer size for one UDP_GRO/UDP_SEGMENT message (CMSG_SPACE(sizeof(int)))
+
+int udp_gro_enable(int fd);
+void udp_gro_disable(int fd);
+int udp_gro_segment_size(struct msghdr* msg);
+void udp_gso_set(struct msghdr* msg, char* control, uint16_t segment_size);
+
+#endif
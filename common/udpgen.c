@@ -0,0 +1,263 @@
+#define _GNU_SOURCE
+
+#include "udpgen.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#define UDPGEN_DUP_WINDOW (1 << 20)  //- Sequence numbers tracked for duplicate detection (128 KB bitmap)
+#define UDPGEN_RECV_TIMEOUT 100      //- Milliseconds a blocked recvmmsg() waits before checking for the stop signal
+#define UDPGEN_DRAIN_TIMEOUT 1000    //- Milliseconds to wait for late echoes after the last send
+
+//* Receive thread state
+//- Only the receive thread writes here. The sender publishes its progress in `sent`, the receive thread publishes
+//- the number of unique echoes in `received` and stops once `stop` is set; all three are accessed atomically.
+struct udpgen_receiver {
+    pthread_t thread;                      //- Thread handle
+    int fd;                                //- Connected UDP socket, shared with the sender
+    const struct udpgen_options* options;  //- Shared, read-only settings
+    struct udpgen_result* result;          //- Receive side counters and the latency histogram
+    uint64_t* window;                      //- Bitmap of received sequence numbers, indexed by seq % UDPGEN_DUP_WINDOW
+    uint64_t highest;                      //- Highest sequence number received so far
+    int any;                               //- At least one echo was received
+    uint64_t sent;                         //- Sequence numbers handed to the kernel so far (written by the sender)
+    uint64_t received;                     //- Unique echoes so far (written by the receive thread)
+    int stop;                              //- Set by the sender once the drain time is over
+};
+
+static void* udpgen_receive_main(void* arg);
+static void udpgen_account(struct udpgen_receiver* receiver, const char* data, size_t len, uint64_t now);
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//* Send paced datagrams for the configured duration and collect the echoes on a second thread
+//- With a target rate datagram n is due at start + n / rate. The sender wakes up, sends every datagram that is due
+//- (up to `batch` per sendmmsg()) and sleeps until the next one. It never waits for echoes, so a slow or lossy
+//- server cannot slow down the offered load. Datagrams are stamped with their scheduled send time, so a sender that
+//- falls behind shows up as latency instead of being hidden.
+//? Returns -1 if the settings are invalid or the socket fails.
+int udpgen_run(int fd, const struct udpgen_options* options, struct udpgen_result* result) {
+    struct udpgen_receiver receiver = {0};
+    struct mmsghdr* msgs;
+    struct iovec* iovs;
+    char* buffers;
+    uint64_t start, deadline, now, sent = 0, interval = 0;
+    int status = 0;
+
+    if (options->size < UDPGEN_HEADER_SIZE || options->batch < 1 || options->batch > UDPGEN_BATCH_MAX || options->duration <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    memset(result, 0, sizeof *result);
+    histogram_init(&result->latency);
+
+    msgs = calloc(options->batch, sizeof *msgs);
+    iovs = calloc(options->batch, sizeof *iovs);
+    buffers = malloc(options->batch * options->size);
+    receiver.window = calloc(UDPGEN_DUP_WINDOW / 64, sizeof *receiver.window);
+    if (msgs == NULL || iovs == NULL || buffers == NULL || receiver.window == NULL) {
+        status = -1;
+        goto out;
+    }
+    for (unsigned i = 0; i < options->batch; i++) {
+        char* buffer = buffers + i * options->size;
+        for (size_t j = UDPGEN_HEADER_SIZE; j < options->size; j++) buffer[j] = 'a' + j % 26;
+        iovs[i] = (struct iovec){buffer, options->size};
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    receiver.fd = fd;
+    receiver.options = options;
+    receiver.result = result;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &(struct timeval){0, UDPGEN_RECV_TIMEOUT * 1000}, sizeof(struct timeval));
+    if ((errno = pthread_create(&receiver.thread, NULL, udpgen_receive_main, &receiver)) != 0) {
+        status = -1;
+        goto out;
+    }
+
+    if (options->rate > 0)
+        interval = (uint64_t)(1e9 / options->rate);
+    now = start = now_ns();
+    deadline = start + (uint64_t)(options->duration * 1e9);
+
+    while (now < deadline) {
+        uint64_t due = options->batch;
+        int count;
+
+        if (interval > 0) {
+            due = (now - start) / interval + 1 - sent;  //- Datagram n is due at start + n * interval
+            if ((int64_t)due <= 0) {
+                uint64_t wake = start + sent * interval;
+                clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+                                &(struct timespec){(time_t)(wake / 1000000000ULL), (long)(wake % 1000000000ULL)}, NULL);
+                now = now_ns();
+                continue;
+            }
+            if (due > options->batch)
+                due = options->batch;
+        }
+
+        for (uint64_t i = 0; i < due; i++) {
+            uint64_t header[2] = {sent + i, interval > 0 ? start + (sent + i) * interval : now};
+            memcpy(iovs[i].iov_base, header, sizeof header);
+        }
+        //- Publish the sequence numbers before sending, a loopback echo can arrive before sendmmsg() returns.
+        __atomic_store_n(&receiver.sent, sent + due, __ATOMIC_RELEASE);
+        if ((count = sendmmsg(fd, msgs, due, 0)) == -1) {
+            if (errno == ENOBUFS || errno == EAGAIN || errno == ECONNREFUSED || errno == EINTR) {
+                now = now_ns();
+                continue;  //- Queue full or server not reachable yet, the same sequence numbers are sent again
+            }
+            perror("error: sendmmsg failed, aborting...");
+            status = -1;
+            break;
+        }
+        sent += count;
+        result->send_calls++;
+        now = now_ns();
+    }
+    result->sent = sent;
+    result->send_elapsed = (now - start) / 1e9;
+
+    //* Give the echoes still in flight some time to arrive, then stop the receive thread
+    deadline = now_ns() + UDPGEN_DRAIN_TIMEOUT * 1000000ULL;
+    while (__atomic_load_n(&receiver.received, __ATOMIC_ACQUIRE) < sent && now_ns() < deadline)
+        clock_nanosleep(CLOCK_MONOTONIC, 0, &(struct timespec){0, 10 * 1000000L}, NULL);
+    __atomic_store_n(&receiver.stop, 1, __ATOMIC_RELEASE);
+    pthread_join(receiver.thread, NULL);
+
+out:
+    free(receiver.window);
+    free(buffers);
+    free(iovs);
+    free(msgs);
+    return status;
+}
+
+void udpgen_report(const struct udpgen_options* options, const struct udpgen_result* result, FILE* out) {
+    uint64_t lost = result->sent > result->received ? result->sent - result->received : 0;
+
+    if (options->rate > 0)
+        fprintf(out, "flood: %.0f pps target, ", options->rate);
+    else
+        fprintf(out, "flood: unpaced, ");
+    fprintf(out, "%zu byte datagrams, %.1f s, up to %u per syscall\n", options->size, options->duration, options->batch);
+    fprintf(out, "sent     %lu datagrams in %lu syscalls (%.0f pps)\n", (unsigned long)result->sent, (unsigned long)result->send_calls,
+            result->sent / result->send_elapsed);
+    fprintf(out, "received %lu datagrams in %lu syscalls, %lu lost (%.3f%%)\n", (unsigned long)result->received,
+            (unsigned long)result->recv_calls, (unsigned long)lost, result->sent ? 100.0 * lost / result->sent : 0);
+    fprintf(out, "order    %lu duplicates, %lu reordered (max depth %lu), %lu late, %lu invalid\n", (unsigned long)result->duplicates,
+            (unsigned long)result->reordered, (unsigned long)result->max_reorder, (unsigned long)result->late, (unsigned long)result->invalid);
+    histogram_print_latency(&result->latency, out);
+}
+
+//* Print the results as one comma-separated line
+//- Echoes received, sending seconds, echoes per second, MB/s of echoed datagrams, p50/p90/p99/p99.9/max round-trip
+//- time in microseconds, lost datagrams. The columns match loadgen_report_csv().
+void udpgen_report_csv(const struct udpgen_options* options, const struct udpgen_result* result, FILE* out) {
+    uint64_t lost = result->sent > result->received ? result->sent - result->received : 0;
+
+    fprintf(out, "%lu,%.3f,%.1f,%.3f,", (unsigned long)result->received, result->send_elapsed, result->received / result->send_elapsed,
+            result->received * options->size / result->send_elapsed / 1e6);
+    histogram_print_csv(&result->latency, out);
+    fprintf(out, ",%lu\n", (unsigned long)lost);
+}
+
+//* Receive thread entry point: drain echoes in batches until the sender says stop
+static void* udpgen_receive_main(void* arg) {
+    struct udpgen_receiver* receiver = arg;
+    unsigned batch = receiver->options->batch;
+    size_t size = receiver->options->size;
+    struct mmsghdr* msgs = calloc(batch, sizeof *msgs);
+    struct iovec* iovs = calloc(batch, sizeof *iovs);
+    char* buffers = malloc(batch * size);
+    int count;
+
+    if (msgs == NULL || iovs == NULL || buffers == NULL) {
+        perror("error: receive buffer allocation failed, aborting...");
+        exit(EXIT_FAILURE);
+    }
+    for (unsigned i = 0; i < batch; i++) {
+        iovs[i] = (struct iovec){buffers + i * size, size};
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    while (!__atomic_load_n(&receiver->stop, __ATOMIC_ACQUIRE)) {
+        uint64_t now;
+
+        //- MSG_WAITFORONE blocks for the first datagram only (bounded by SO_RCVTIMEO) and then takes what is queued.
+        if ((count = recvmmsg(receiver->fd, msgs, batch, MSG_WAITFORONE, NULL)) == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNREFUSED)
+                continue;
+            perror("error: recvmmsg failed, aborting...");
+            exit(EXIT_FAILURE);
+        }
+        now = now_ns();
+        receiver->result->recv_calls++;
+        for (int i = 0; i < count; i++) udpgen_account(receiver, iovs[i].iov_base, msgs[i].msg_len, now);
+        __atomic_store_n(&receiver->received, receiver->result->received, __ATOMIC_RELEASE);
+    }
+
+    free(buffers);
+    free(iovs);
+    free(msgs);
+    return NULL;
+}
+
+//* Match one echo against the sequence space
+//- The window bitmap holds one bit per sequence number in (highest - UDPGEN_DUP_WINDOW, highest]. When highest moves
+//- forward, the bits of the sequence numbers that enter the window are cleared before they can be set. An echo older
+//- than the window cannot be checked for duplicates and is counted as received and late.
+static void udpgen_account(struct udpgen_receiver* receiver, const char* data, size_t len, uint64_t now) {
+    struct udpgen_result* result = receiver->result;
+    uint64_t header[2], seq, bit;
+
+    if (len < UDPGEN_HEADER_SIZE) {
+        result->invalid++;
+        return;
+    }
+    memcpy(header, data, sizeof header);
+    seq = header[0];
+    if (seq >= __atomic_load_n(&receiver->sent, __ATOMIC_ACQUIRE)) {
+        result->invalid++;  //- Not sent (yet), a stray or corrupted datagram
+        return;
+    }
+
+    if (!receiver->any || seq > receiver->highest) {
+        uint64_t from = receiver->any ? receiver->highest + 1 : 0;
+        if (seq - from >= UDPGEN_DUP_WINDOW)
+            from = seq - UDPGEN_DUP_WINDOW + 1;
+        for (uint64_t s = from; s <= seq; s++) receiver->window[s % UDPGEN_DUP_WINDOW / 64] &= ~(1ULL << (s % 64));
+        receiver->highest = seq;
+        receiver->any = 1;
+    } else if (receiver->highest - seq >= UDPGEN_DUP_WINDOW) {
+        result->late++;  //- Outside the window, counted as received without the duplicate check
+    }
+
+    if (receiver->highest - seq < UDPGEN_DUP_WINDOW) {
+        bit = 1ULL << (seq % 64);
+        if (receiver->window[seq % UDPGEN_DUP_WINDOW / 64] & bit) {
+            result->duplicates++;
+            return;
+        }
+        receiver->window[seq % UDPGEN_DUP_WINDOW / 64] |= bit;
+    }
+
+    if (seq < receiver->highest) {
+        result->reordered++;
+        if (receiver->highest - seq > result->max_reorder)
+            result->max_reorder = receiver->highest - seq;
+    }
+    result->received++;
+    histogram_record(&result->latency, now > header[1] ? now - header[1] : 0);
+}
@@ -0,0 +1,47 @@
+#ifndef COMMON_UDPGEN_H
+#define COMMON_UDPGEN_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "histogram.h"
+
+#define UDPGEN_HEADER_SIZE 16  //- Sequence number and send timestamp at the start of every datagram
+#define UDPGEN_BATCH_MAX 1024  //- Upper limit of datagrams per sendmmsg()/recvmmsg() call (UIO_MAXIOV)
+
+//* Open-loop UDP generator settings
+//- The generator sends `size` byte datagrams on a connected UDP socket at `rate` datagrams per second for `duration`
+//- seconds, independent of the echoes (open loop). Every datagram starts with a 64-bit sequence number and its
+//- scheduled send time, so a separate receive thread can match the echoes without any per-datagram state.
+struct udpgen_options {
+    double rate;      //- Target datagrams per second (0 means as fast as the socket accepts them)
+    double duration;  //- Sending time in seconds
+    size_t size;      //- Datagram size in bytes, at least UDPGEN_HEADER_SIZE
+    unsigned batch;   //- Maximum datagrams per sendmmsg()/recvmmsg() call
+};
+
+//* Open-loop UDP generator results
+//- A datagram counts as reordered if a higher sequence number was received before it, the reorder depth is the
+//- distance to the highest sequence number seen at that time. Duplicates are detected within a sliding window of the
+//- most recent sequence numbers (see udpgen.c), echoes older than the window are counted as received
+//- and late.
+struct udpgen_result {
+    uint64_t sent;             //- Datagrams sent
+    uint64_t send_calls;       //- sendmmsg() calls
+    uint64_t received;         //- Unique echoes received
+    uint64_t recv_calls;       //- recvmmsg() calls that returned echoes
+    uint64_t duplicates;       //- Echoes of a sequence number that was already received
+    uint64_t reordered;        //- Echoes that arrived after a higher sequence number
+    uint64_t max_reorder;      //- Largest reorder depth
+    uint64_t late;             //- Echoes too old for duplicate detection (included in received)
+    uint64_t invalid;          //- Echoes that were too short or carried an unknown sequence number
+    double send_elapsed;       //- Seconds spent sending
+    struct histogram latency;  //- Round-trip time in nanoseconds, measured from the scheduled send time
+};
+
+int udpgen_run(int fd, const struct udpgen_options* options, struct udpgen_result* result);
+void udpgen_report(const struct udpgen_options* options, const struct udpgen_result* result, FILE* out);
+void udpgen_report_csv(const struct udpgen_options* options, const struct udpgen_result* result, FILE* out);
+
+#endif
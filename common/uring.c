@@ -0,0 +1,631 @@
+#define _GNU_SOURCE
+
+#include "uring.h"
+#include "frame.h"
+#include "log.h"
+#include "metrics.h"
+#include "trace.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+#define URING_BUFFER_GROUP 0  //- Buffer group id of the provided buffer ring
+#define URING_MAX_CHAIN 64    //- Maximum number of linked send SQEs submitted for one connection at a time
+
+//- The low bits of the SQE user_data carry the operation, the remaining bits the struct uring_conn pointer
+//- (malloc() returns memory aligned to at least 8 bytes, so the 3 lowest bits of the pointer are always 0).
+#define URING_OP_ACCEPT 1
+#define URING_OP_RECV 2
+#define URING_OP_SEND 3
+#define URING_OP_CANCEL 4
+#define URING_OP_MASK 7ULL
+
+//* Raw io_uring instance
+//- The repository does not depend on liburing, so the rings are mapped and driven with the raw syscalls.
+struct uring {
+    int fd;                     //- io_uring file descriptor
+    void* ring_ptr;             //- Shared SQ/CQ ring mapping (IORING_FEAT_SINGLE_MMAP)
+    size_t ring_size;           //- Size of the ring mapping
+    struct io_uring_sqe* sqes;  //- Submission queue entries
+    size_t sqes_size;           //- Size of the SQE mapping
+    unsigned* sq_head;          //- Submission queue head (written by the kernel)
+    unsigned* sq_tail;          //- Submission queue tail (written by us)
+    unsigned sq_mask;           //- Submission queue index mask
+    unsigned sq_entries;        //- Number of submission queue entries
+    unsigned* cq_head;          //- Completion queue head (written by us)
+    unsigned* cq_tail;          //- Completion queue tail (written by the kernel)
+    unsigned cq_mask;           //- Completion queue index mask
+    struct io_uring_cqe* cqes;  //- Completion queue entries
+    unsigned pending;           //- Number of SQEs queued but not yet submitted with io_uring_enter()
+};
+
+//* One queued echo reply, a slice of a provided buffer
+struct uring_send {
+    unsigned short bid;  //- Provided buffer id
+    unsigned off;        //- Offset of the first unsent byte
+    unsigned len;        //- Number of received bytes in the buffer
+    uint64_t received;   //- Time the receive completion was handled (metrics_now()), for the service time
+};
+
+//* Per-connection state
+//- The connection is freed once it is closing and neither the multishot recv nor a send chain is in flight. A client
+//- that shuts down its side first still gets the replies queued before its FIN, the connection only starts closing once
+//- they are sent.
+struct uring_conn {
+    int fd;                           //- Client socket file descriptor
+    int recv_armed;                   //- A multishot recv is active on the socket
+    int closing;                      //- The connection failed or is done, no new sends are submitted
+    int eof;                          //- The client shut down its side, the queued replies are still sent
+    int chain_broken;                 //- A send of the current chain was short, the rest of it gets cancelled
+    int dirty;                        //- The connection is on the dirty list (has unsent replies)
+    int starved;                      //- The connection is on the starved list (recv ran out of buffers)
+    unsigned inflight;                //- Number of submitted sends whose CQE was not seen yet
+    struct sockaddr_in addr;          //- Client address, used for logging
+    struct frame_parser parser;       //- Message framing state of the input stream
+    uint32_t trace;                   //- Capture trace id (0: not captured, see common/trace.h)
+    struct uring_send* queue;         //- Replies in order, the first `inflight` ones are submitted
+    size_t queue_head;                //- Index of the oldest reply in queue
+    size_t queue_count;               //- Number of replies in queue
+    size_t queue_cap;                 //- Allocated number of queue entries
+    struct uring_conn* next_dirty;    //- Next connection on the dirty list
+    struct uring_conn* next_starved;  //- Next connection on the starved list
+};
+
+//* Engine state
+struct uring_server {
+    struct uring ring;                   //- io_uring instance
+    int listen_fd;                       //- Listening socket file descriptor
+    int accept_armed;                    //- The multishot accept is active
+    int accept_cancelling;               //- A cancel request for the multishot accept is in flight
+    size_t connections;                  //- Number of open connections
+    size_t max_connections;              //- Connection limit (0 means unlimited)
+    struct ratelimit* limit;             //- Connection rate limit per source address (NULL: none)
+    struct io_uring_buf_ring* buf_ring;  //- Provided buffer ring shared with the kernel
+    size_t buf_ring_size;                //- Size of the buffer ring mapping
+    unsigned short buf_tail;             //- Local buffer ring tail, published after each completion batch
+    char* buffers;                       //- Backing memory of the provided buffers
+    size_t buffer_size;                  //- Size of one provided buffer
+    size_t buffers_held;                 //- Number of buffers handed out by the kernel and not recycled yet
+    struct uring_conn* dirty;            //- Connections with replies to submit after the current batch
+    struct uring_conn* starved;          //- Connections whose recv stopped with ENOBUFS
+};
+
+static int uring_setup(struct uring* ring, unsigned entries);
+static void uring_teardown(struct uring* ring);
+static struct io_uring_sqe* uring_get_sqe(struct uring* ring);
+static int uring_submit(struct uring* ring, unsigned wait);
+static int uring_setup_buffers(struct uring_server* server);
+static void uring_recycle(struct uring_server* server, unsigned short bid);
+static void uring_arm_accept(struct uring_server* server);
+static void uring_arm_recv(struct uring_server* server, struct uring_conn* conn);
+static void uring_submit_chain(struct uring_server* server, struct uring_conn* conn);
+static void uring_handle_accept(struct uring_server* server, struct io_uring_cqe* cqe);
+static void uring_handle_recv(struct uring_server* server, struct uring_conn* conn, struct io_uring_cqe* cqe);
+static void uring_handle_send(struct uring_server* server, struct uring_conn* conn, struct io_uring_cqe* cqe);
+static void uring_release(struct uring_server* server, struct uring_conn* conn);
+static int uring_log_frames(struct uring_conn* conn, const char* data, size_t len);
+
+int uring_supported(void) {
+    struct uring_server server;
+    struct utsname name;
+    int major = 0, minor = 0;
+
+    if (uname(&name) == 0)
+        sscanf(name.release, "%d.%d", &major, &minor);
+    if (major < 6) {
+        fprintf(stderr, "io_uring: kernel %s lacks multishot recv (needs 6.0)\n", name.release);
+        return 0;
+    }
+
+    memset(&server, 0, sizeof server);
+    server.buffer_size = 64;
+    if (uring_setup(&server.ring, 8) == -1) {
+        perror("io_uring: io_uring_setup failed");
+        return 0;
+    }
+    if (uring_setup_buffers(&server) == -1) {
+        perror("io_uring: provided buffer ring registration failed");
+        uring_teardown(&server.ring);
+        return 0;
+    }
+    munmap(server.buf_ring, server.buf_ring_size);
+    free(server.buffers);
+    uring_teardown(&server.ring);
+    return 1;
+}
+
+int uring_serve(int listen_fd, size_t buffer_size, size_t max_connections, struct ratelimit* limit) {
+    struct uring_server server;
+
+    memset(&server, 0, sizeof server);
+    server.listen_fd = listen_fd;
+    server.buffer_size = buffer_size;
+    server.max_connections = max_connections;
+    server.limit = limit;
+
+    if (uring_setup(&server.ring, URING_QUEUE_DEPTH) == -1) {
+        perror("error: io_uring_setup failed");
+        return -1;
+    }
+    if (uring_setup_buffers(&server) == -1) {
+        perror("error: provided buffer ring registration failed");
+        uring_teardown(&server.ring);
+        return -1;
+    }
+    uring_arm_accept(&server);
+
+    while (1) {
+        struct uring* ring = &server.ring;
+        unsigned head, tail, recycled;
+
+        //* Submit the queued SQEs and wait for at least one completion in a single syscall
+        if (uring_submit(ring, 1) == -1) {
+            perror("error: io_uring_enter failed, aborting...");
+            return -1;
+        }
+
+        //* Process every available completion
+        //- The tail is read with acquire semantics so that the CQE contents written by the kernel are visible,
+        //- the head is published with release semantics once the entries are consumed.
+        recycled = server.buf_tail;
+        head = *ring->cq_head;
+        tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe* cqe = &ring->cqes[head & ring->cq_mask];
+            struct uring_conn* conn = (struct uring_conn*)(uintptr_t)(cqe->user_data & ~URING_OP_MASK);
+
+            switch (cqe->user_data & URING_OP_MASK) {
+                case URING_OP_ACCEPT:
+                    uring_handle_accept(&server, cqe);
+                    break;
+                case URING_OP_RECV:
+                    uring_handle_recv(&server, conn, cqe);
+                    break;
+                case URING_OP_SEND:
+                    uring_handle_send(&server, conn, cqe);
+                    break;
+                default:
+                    break;
+            }
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+        //* Hand the recycled buffers back to the kernel with one tail update
+        if (recycled != server.buf_tail)
+            __atomic_store_n(&server.buf_ring->tail, server.buf_tail, __ATOMIC_RELEASE);
+
+        //* Submit the replies gathered in this batch as one linked chain per connection
+        while (server.dirty != NULL) {
+            struct uring_conn* conn = server.dirty;
+            server.dirty = conn->next_dirty;
+            conn->dirty = 0;
+            if (conn->closing)
+                uring_release(&server, conn);
+            else if (conn->inflight == 0 && conn->queue_count > 0)
+                uring_submit_chain(&server, conn);
+        }
+
+        //* Restart the receives that stopped because the buffer ring ran dry
+        //- Waiting until half of the buffers are back avoids re-arming into another ENOBUFS immediately.
+        while (server.starved != NULL && server.buffers_held < URING_BUFFER_COUNT / 2) {
+            struct uring_conn* conn = server.starved;
+            server.starved = conn->next_starved;
+            conn->starved = 0;
+            if (conn->closing)
+                uring_release(&server, conn);
+            else
+                uring_arm_recv(&server, conn);
+        }
+
+        if (!server.accept_armed && (server.max_connections == 0 || server.connections < server.max_connections))
+            uring_arm_accept(&server);
+    }
+}
+
+//* Create the ring and map the shared queues
+//? Returns -1 on failure, errno is set by the failing syscall.
+static int uring_setup(struct uring* ring, unsigned entries) {
+    struct io_uring_params params;
+    size_t sq_size, cq_size;
+    char* ptr;
+
+    memset(ring, 0, sizeof *ring);
+    memset(&params, 0, sizeof params);
+    if ((ring->fd = syscall(__NR_io_uring_setup, entries, &params)) == -1)
+        return -1;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(ring->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->ring_ptr = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->ring_ptr == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        munmap(ring->ring_ptr, ring->ring_size);
+        close(ring->fd);
+        return -1;
+    }
+
+    ptr = ring->ring_ptr;
+    ring->sq_head = (unsigned*)(ptr + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(ptr + params.sq_off.tail);
+    ring->sq_mask = *(unsigned*)(ptr + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->cq_head = (unsigned*)(ptr + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(ptr + params.cq_off.tail);
+    ring->cq_mask = *(unsigned*)(ptr + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(ptr + params.cq_off.cqes);
+
+    //- SQEs are always filled in ring order, so the indirection array is an identity mapping set up once.
+    for (unsigned i = 0; i < params.sq_entries; i++) ((unsigned*)(ptr + params.sq_off.array))[i] = i;
+    return 0;
+}
+
+static void uring_teardown(struct uring* ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->ring_ptr, ring->ring_size);
+    close(ring->fd);
+}
+
+//* Get the next free SQE
+//- If the submission queue is full, the queued entries are submitted first to make room.
+static struct io_uring_sqe* uring_get_sqe(struct uring* ring) {
+    unsigned tail = *ring->sq_tail;
+    struct io_uring_sqe* sqe;
+
+    while (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+        if (uring_submit(ring, 0) == -1 && errno != EAGAIN && errno != EBUSY)
+            return NULL;
+    }
+    sqe = &ring->sqes[tail & ring->sq_mask];
+    memset(sqe, 0, sizeof *sqe);
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->pending++;
+    return sqe;
+}
+
+//* Submit the queued SQEs and optionally wait for completions
+static int uring_submit(struct uring* ring, unsigned wait) {
+    int submitted;
+
+    while ((submitted = syscall(__NR_io_uring_enter, ring->fd, ring->pending, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0)) == -1) {
+        if (errno != EINTR)
+            return -1;
+    }
+    ring->pending -= submitted;
+    return submitted;
+}
+
+//* Allocate and register the provided buffer ring
+//- The kernel picks a free buffer from this ring for every multishot recv completion and reports its id in the CQE.
+//- The ring memory must be page aligned, so it is allocated with mmap().
+static int uring_setup_buffers(struct uring_server* server) {
+    struct io_uring_buf_reg reg;
+
+    server->buf_ring_size = URING_BUFFER_COUNT * sizeof(struct io_uring_buf);
+    server->buf_ring = mmap(NULL, server->buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (server->buf_ring == MAP_FAILED)
+        return -1;
+    if ((server->buffers = malloc(URING_BUFFER_COUNT * server->buffer_size)) == NULL) {
+        munmap(server->buf_ring, server->buf_ring_size);
+        return -1;
+    }
+
+    memset(&reg, 0, sizeof reg);
+    reg.ring_addr = (unsigned long)server->buf_ring;
+    reg.ring_entries = URING_BUFFER_COUNT;
+    reg.bgid = URING_BUFFER_GROUP;
+    if (syscall(__NR_io_uring_register, server->ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        free(server->buffers);
+        munmap(server->buf_ring, server->buf_ring_size);
+        return -1;
+    }
+
+    server->buffers_held = URING_BUFFER_COUNT;
+    for (unsigned short bid = 0; bid < URING_BUFFER_COUNT; bid++) uring_recycle(server, bid);
+    __atomic_store_n(&server->buf_ring->tail, server->buf_tail, __ATOMIC_RELEASE);
+    return 0;
+}
+
+//* Put a buffer back into the provided buffer ring
+//- Only the local tail moves here, the main loop publishes it once per completion batch.
+static void uring_recycle(struct uring_server* server, unsigned short bid) {
+    struct io_uring_buf* buf = &server->buf_ring->bufs[server->buf_tail & (URING_BUFFER_COUNT - 1)];
+
+    buf->addr = (unsigned long)(server->buffers + (size_t)bid * server->buffer_size);
+    buf->len = server->buffer_size;
+    buf->bid = bid;
+    server->buf_tail++;
+    server->buffers_held--;
+}
+
+//* Arm the multishot accept
+//- One SQE keeps producing a CQE for every accepted connection until it is cancelled or fails.
+static void uring_arm_accept(struct uring_server* server) {
+    struct io_uring_sqe* sqe;
+
+    if ((sqe = uring_get_sqe(&server->ring)) == NULL)
+        return;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = server->listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = URING_OP_ACCEPT;
+    server->accept_armed = 1;
+}
+
+//* Arm the multishot recv of a connection
+//- IOSQE_BUFFER_SELECT lets the kernel pick a buffer from the provided buffer ring for every completion, so no buffer
+//- is pinned to an idle connection.
+static void uring_arm_recv(struct uring_server* server, struct uring_conn* conn) {
+    struct io_uring_sqe* sqe;
+
+    if ((sqe = uring_get_sqe(&server->ring)) == NULL)
+        return;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = (uintptr_t)conn | URING_OP_RECV;
+    conn->recv_armed = 1;
+}
+
+//* Submit the queued replies of a connection as one linked chain
+//- IOSQE_IO_LINK makes every send start only after the previous one completed, so the replies reach the client in
+//- order. MSG_WAITALL makes the kernel retry short sends itself; if one is still short, the rest of the chain is
+//- cancelled and resubmitted once every CQE of the chain was seen.
+static void uring_submit_chain(struct uring_server* server, struct uring_conn* conn) {
+    size_t chain = conn->queue_count < URING_MAX_CHAIN ? conn->queue_count : URING_MAX_CHAIN;
+
+    //- A chain must not be split over two io_uring_enter() calls, make room for all of it first.
+    if (server->ring.sq_entries - (*server->ring.sq_tail - __atomic_load_n(server->ring.sq_head, __ATOMIC_ACQUIRE)) < chain)
+        uring_submit(&server->ring, 0);
+
+    for (size_t i = 0; i < chain; i++) {
+        struct uring_send* send = &conn->queue[conn->queue_head + i];
+        struct io_uring_sqe* sqe;
+
+        if ((sqe = uring_get_sqe(&server->ring)) == NULL)
+            return;
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = conn->fd;
+        sqe->addr = (unsigned long)(server->buffers + (size_t)send->bid * server->buffer_size + send->off);
+        sqe->len = send->len - send->off;
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        sqe->flags = i + 1 < chain ? IOSQE_IO_LINK : 0;
+        sqe->user_data = (uintptr_t)conn | URING_OP_SEND;
+        conn->inflight++;
+    }
+}
+
+//* Handle a multishot accept completion
+static void uring_handle_accept(struct uring_server* server, struct io_uring_cqe* cqe) {
+    struct sockaddr_in addr;
+    struct uring_conn* conn;
+
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        server->accept_armed = 0;
+        server->accept_cancelling = 0;
+    }
+    if (cqe->res < 0) {
+        if (cqe->res != -ECANCELED) {
+            log_error("error: socket accepting failed: %e", -cqe->res);
+            metrics_add(METRICS_ERRORS, 1);
+        }
+        return;
+    }
+
+    //- The multishot accept does not return the peer address, getpeername() is needed for the log anyway. It fails
+    //- with ENOTCONN if the client already reset the connection, which is then dropped before it is admitted.
+    if (getpeername(cqe->res, (struct sockaddr*)&addr, &(socklen_t){sizeof addr}) == -1) {
+        log_error("error: peer address lookup failed: %e", errno);
+        metrics_add(METRICS_ERRORS, 1);
+        close(cqe->res);
+        return;
+    }
+    if (!admission_accept(server->limit, cqe->res, addr.sin_addr.s_addr))
+        return;
+    if ((conn = calloc(1, sizeof *conn)) == NULL) {
+        log_error("error: connection allocation failed: %e", errno);
+        metrics_add(METRICS_ERRORS, 1);
+        close(cqe->res);
+        admission_leave();
+        return;
+    }
+    conn->fd = cqe->res;
+    conn->addr = addr;
+    conn->trace = trace_open();
+    server->connections++;
+    metrics_add(METRICS_ACCEPTED, 1);
+    log_info("  new connection from %a:%u", conn->addr.sin_addr.s_addr, ntohs(conn->addr.sin_port));
+    uring_arm_recv(server, conn);
+
+    //- Stop accepting at the connection limit, the remaining clients wait in the listen backlog.
+    if (server->max_connections > 0 && server->connections >= server->max_connections && server->accept_armed &&
+        !server->accept_cancelling) {
+        struct io_uring_sqe* sqe;
+        if ((sqe = uring_get_sqe(&server->ring)) != NULL) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = URING_OP_ACCEPT;
+            sqe->user_data = URING_OP_CANCEL;
+            server->accept_cancelling = 1;
+        }
+    }
+}
+
+//* Handle a multishot recv completion
+//- The received buffer is queued as a reply, it is only recycled once the reply was sent.
+static void uring_handle_recv(struct uring_server* server, struct uring_conn* conn, struct io_uring_cqe* cqe) {
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        conn->recv_armed = 0;
+
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        server->buffers_held++;
+        if (cqe->res <= 0 || conn->closing) {
+            uring_recycle(server, bid);
+        } else if (uring_log_frames(conn, server->buffers + (size_t)bid * server->buffer_size, cqe->res) == -1) {
+            log_error("error: invalid message header from %a:%u, closing the connection", conn->addr.sin_addr.s_addr,
+                      ntohs(conn->addr.sin_port));
+            metrics_add(METRICS_ERRORS, 1);
+            uring_recycle(server, bid);
+            conn->closing = 1;
+            shutdown(conn->fd, SHUT_RDWR);
+        } else {
+
+            if (conn->queue_head + conn->queue_count == conn->queue_cap) {
+                if (conn->queue_head > 0) {
+                    memmove(conn->queue, conn->queue + conn->queue_head, conn->queue_count * sizeof *conn->queue);
+                    conn->queue_head = 0;
+                } else {
+                    size_t new_cap = conn->queue_cap ? conn->queue_cap * 2 : 8;
+                    struct uring_send* new_queue = realloc(conn->queue, new_cap * sizeof *new_queue);
+                    if (new_queue == NULL) {
+                        log_error("error: reply queue allocation failed: %e", errno);
+                        metrics_add(METRICS_ERRORS, 1);
+                        uring_recycle(server, bid);
+                        conn->closing = 1;
+                        shutdown(conn->fd, SHUT_RDWR);
+                        return;
+                    }
+                    conn->queue = new_queue;
+                    conn->queue_cap = new_cap;
+                }
+            }
+            conn->queue[conn->queue_head + conn->queue_count++] = (struct uring_send){bid, 0, cqe->res, metrics_now()};
+            if (!conn->dirty) {
+                conn->dirty = 1;
+                conn->next_dirty = server->dirty;
+                server->dirty = conn;
+            }
+        }
+    }
+
+    if (cqe->res == 0) {
+        log_info("client %a:%u disconnected", conn->addr.sin_addr.s_addr, ntohs(conn->addr.sin_port));
+        conn->eof = 1;
+        if (conn->queue_count == 0)
+            conn->closing = 1;  //- Otherwise the last send completion closes it
+    } else if (cqe->res == -ENOBUFS && !conn->recv_armed && !conn->closing) {
+        //- Every provided buffer is held by a pending reply, restart the recv once some are recycled.
+        if (!conn->starved) {
+            conn->starved = 1;
+            conn->next_starved = server->starved;
+            server->starved = conn;
+        }
+        return;
+    } else if (cqe->res < 0 && !conn->closing) {
+        log_error("error: socket receiving failed: %e", -cqe->res);
+        metrics_add(METRICS_ERRORS, 1);
+        conn->closing = 1;
+    } else if (!conn->recv_armed && !conn->closing) {
+        uring_arm_recv(server, conn);  //- The kernel may end a multishot recv at any time, re-arm it
+    }
+
+    if (conn->closing && !conn->recv_armed)
+        uring_release(server, conn);
+}
+
+//* Handle a send completion
+//- Linked sends complete in order, so the CQE always belongs to the oldest queued reply.
+static void uring_handle_send(struct uring_server* server, struct uring_conn* conn, struct io_uring_cqe* cqe) {
+    struct uring_send* send = &conn->queue[conn->queue_head];
+
+    conn->inflight--;
+    if (cqe->res == -ECANCELED) {
+        //- A previous send of the chain was short, this reply is resubmitted with the next chain.
+    } else if (cqe->res < 0) {
+        if (!conn->closing) {
+            log_error("error: socket sending failed: %e", -cqe->res);
+            metrics_add(METRICS_ERRORS, 1);
+        }
+        conn->closing = 1;
+        shutdown(conn->fd, SHUT_RDWR);  //- Terminates the multishot recv so the connection can be released
+    } else if ((unsigned)cqe->res < send->len - send->off) {
+        metrics_add(METRICS_BYTES_SENT, cqe->res);
+        trace_record(conn->trace, TRACE_OUT, server->buffers + (size_t)send->bid * server->buffer_size + send->off, cqe->res);
+        send->off += cqe->res;
+        conn->chain_broken = 1;
+    } else {
+        log_info_data(server->buffers + (size_t)send->bid * server->buffer_size, send->len, "     reply message to %a:%u (%4u byte): %s",
+                      conn->addr.sin_addr.s_addr, ntohs(conn->addr.sin_port), send->len);
+        metrics_add(METRICS_BYTES_SENT, cqe->res);
+        trace_record(conn->trace, TRACE_OUT, server->buffers + (size_t)send->bid * server->buffer_size + send->off, cqe->res);
+        metrics_record_service(send->received);
+        uring_recycle(server, send->bid);
+        conn->queue_head++;
+        conn->queue_count--;
+    }
+
+    if (conn->inflight > 0)
+        return;
+    conn->chain_broken = 0;
+    if (conn->eof && conn->queue_count == 0)
+        conn->closing = 1;  //- The last reply to a client that already disconnected went out
+    if (conn->closing) {
+        uring_release(server, conn);
+    } else if (conn->queue_count > 0 && !conn->dirty) {
+        conn->dirty = 1;
+        conn->next_dirty = server->dirty;
+        server->dirty = conn;
+    }
+}
+
+//* Free a closing connection once nothing refers to it anymore
+//- The buffers of replies that will never be sent go back to the ring.
+static void uring_release(struct uring_server* server, struct uring_conn* conn) {
+    if (conn->recv_armed || conn->inflight > 0 || conn->dirty || conn->starved)
+        return;
+
+    for (size_t i = 0; i < conn->queue_count; i++) uring_recycle(server, conn->queue[conn->queue_head + i].bid);
+    close(conn->fd);
+    trace_close(conn->trace);
+    free(conn->queue);
+    free(conn);
+    server->connections--;
+    admission_leave();
+    metrics_add(METRICS_CLOSED, 1);
+}
+
+//* Run received bytes through the connection's frame parser, log and count every new message
+//- The echo reply is the received buffer itself (a message echoed back is byte-identical to the message), the parser
+//- only validates the stream so that a client sending garbage is disconnected.
+//? Returns -1 if the stream holds an invalid frame header.
+static int uring_log_frames(struct uring_conn* conn, const char* data, size_t len) {
+    struct frame_chunk chunk;
+    unsigned messages = 0;
+    int status;
+
+    metrics_add(METRICS_BYTES_RECEIVED, len);
+    trace_record(conn->trace, TRACE_IN, data, len);
+    while ((status = frame_parse(&conn->parser, &data, &len, &chunk)) == 1) {
+        if (chunk.offset > 0)
+            continue;
+        messages++;
+        log_info_data(chunk.data, chunk.len, "received message from %a:%u (%4u byte): %s", conn->addr.sin_addr.s_addr,
+                      ntohs(conn->addr.sin_port), chunk.length);
+    }
+    metrics_add(METRICS_MESSAGES, messages);
+    return status;
+}
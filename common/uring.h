@@ -0,0 +1,28 @@
+#ifndef COMMON_URING_H
+#define COMMON_URING_H
+
+#include <stddef.h>
+
+#include "ratelimit.h"
+
+#define URING_QUEUE_DEPTH 1024   //- Number of submission queue entries (the completion queue is twice as large)
+#define URING_BUFFER_COUNT 1024  //- Number of receive buffers in the provided buffer ring (must be a power of 2)
+
+//* io_uring echo engine
+//- The listening socket is served by one multishot accept, every client socket by one multishot recv that picks its
+//- buffers from a registered provided-buffer ring. Echo replies are submitted as linked send SQEs, so the kernel keeps
+//- the replies of one connection in order without a syscall per message.
+//- max_connections limits the number of concurrently served clients (0 means unlimited). When the limit is reached
+//- the multishot accept is cancelled and further clients wait in the listen backlog.
+//- Accepted clients are checked against limit (per-source connection rate, NULL: none) and the connection limit of
+//- admission_init(), a client over either is reset (see common/ratelimit.h).
+//? Only returns if the ring fails (-1). Check uring_supported() first to fall back to another engine.
+int uring_serve(int listen_fd, size_t buffer_size, size_t max_connections, struct ratelimit* limit);
+
+//* Probe the running kernel for the io_uring features uring_serve() needs
+//- Multishot recv needs Linux 6.0, provided-buffer rings and multishot accept need 5.19. io_uring may also be disabled
+//- by the io_uring_disabled sysctl or a seccomp filter (containers), in which case io_uring_setup() fails.
+//? Returns 1 if the engine can be used, 0 otherwise (the reason is printed to stderr).
+int uring_supported(void);
+
+#endif
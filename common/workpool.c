@@ -0,0 +1,399 @@
+#define _GNU_SOURCE
+
+#include "workpool.h"
+#include "frame.h"
+#include "log.h"
+#include "metrics.h"
+#include "runqueue.h"
+#include "trace.h"
+#include "tuning.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define WORKPOOL_ACCEPT_RETRY 10000  //- Microseconds to wait before accepting again after running out of file descriptors
+
+//* Per-connection state
+//- The output buffer only holds the bytes the kernel did not accept yet. It is allocated with malloc(), because the
+//- worker that frees it may not be the one that allocated it.
+struct workpool_conn {
+    int fd;                      //- Client socket file descriptor (non-blocking)
+    int epoll_fd;                //- epoll instance of the home worker, the socket is registered there for its whole life
+    struct sockaddr_in addr;     //- Client address, used for logging
+    struct frame_parser parser;  //- Message framing state of the input stream
+    char* out_buf;               //- Pending output, NULL until a send is short
+    size_t out_off;              //- Offset of the first unsent byte in out_buf
+    size_t out_len;              //- Number of valid bytes in out_buf
+    uint32_t trace;              //- Capture trace id (0: not captured, see common/trace.h)
+};
+
+//* Worker thread state
+struct workpool_worker {
+    struct runqueue queue;  //- Connections ready to run, other workers steal from it
+    struct workpool* pool;  //- Pool the worker belongs to
+    pthread_t thread;       //- Worker thread
+    unsigned index;         //- Position in the pool, the first victim of a steal is the next worker
+    int epoll_fd;           //- epoll instance of the connections assigned to this worker
+    int wake_fd;            //- eventfd in epoll_fd, written by a worker that has work to give away
+    int sleeping;           //- Set while the worker blocks in epoll_wait() with nothing to run
+    char* buffer;           //- Receive buffer (WORKPOOL_BUFFER_SIZE)
+};
+
+struct workpool {
+    struct workpool_worker* workers;  //- Worker array (aligned for the run queues)
+    unsigned count;                   //- Number of workers
+    int quickack;                     //- Re-arm TCP_QUICKACK after every read
+};
+
+static void* workpool_main(void* arg);
+static void workpool_collect(struct workpool_worker* worker, struct epoll_event* events, int ready);
+static struct workpool_conn* workpool_steal(struct workpool_worker* worker);
+static void workpool_wake(struct workpool_worker* worker);
+static void workpool_run(struct workpool_worker* worker, struct workpool_conn* conn);
+static int workpool_flush(struct workpool_conn* conn);
+static int workpool_queue(struct workpool_conn* conn, const char* data, size_t len);
+static int workpool_arm(struct workpool_conn* conn, uint32_t events);
+static void workpool_close(struct workpool_conn* conn);
+
+//* Start the workers and accept connections on the calling thread
+//- Connections are handed to the workers in turn, whatever their traffic. A worker that falls behind is helped by the
+//- others through its run queue.
+int workpool_serve(int listen_fd, unsigned threads, struct ratelimit* limit, int quickack) {
+    struct workpool pool = {.count = threads, .quickack = quickack};
+    struct sockaddr_in client_addr;
+    struct epoll_event event;
+    struct workpool_conn* conn;
+    unsigned next = 0;
+    int client_fd;
+
+    if (posix_memalign((void**)&pool.workers, RUNQUEUE_CACHE_LINE, threads * sizeof *pool.workers) != 0)
+        return -1;
+    memset(pool.workers, 0, threads * sizeof *pool.workers);
+
+    for (unsigned i = 0; i < threads; i++) {
+        struct workpool_worker* worker = &pool.workers[i];
+
+        event.events = EPOLLIN;
+        event.data.ptr = NULL;
+        worker->pool = &pool;
+        worker->index = i;
+        if (runqueue_init(&worker->queue, WORKPOOL_QUEUE_SIZE) == -1 || (worker->buffer = malloc(WORKPOOL_BUFFER_SIZE)) == NULL ||
+            (worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1 || (worker->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1 ||
+            epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->wake_fd, &event) == -1)
+            return -1;
+        if ((errno = pthread_create(&worker->thread, NULL, workpool_main, worker)) != 0)
+            return -1;
+    }
+
+    //* Accept loop
+    //- accept4() with SOCK_NONBLOCK hands out sockets the workers can drain until EAGAIN.
+    while (1) {
+        if ((client_fd = accept4(listen_fd, (struct sockaddr*)&client_addr, &(socklen_t){sizeof client_addr}, SOCK_NONBLOCK)) == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                log_error("error: socket accepting failed: %e", errno);  //- Keep serving the open connections
+                metrics_add(METRICS_ERRORS, 1);
+                usleep(WORKPOOL_ACCEPT_RETRY);
+                continue;
+            }
+            return -1;
+        }
+        if (!admission_accept(limit, client_fd, client_addr.sin_addr.s_addr))
+            continue;
+
+        if ((conn = calloc(1, sizeof *conn)) == NULL) {
+            log_error("error: connection allocation failed: %e", errno);
+            metrics_add(METRICS_ERRORS, 1);
+            close(client_fd);
+            admission_leave();
+            continue;
+        }
+        conn->fd = client_fd;
+        conn->epoll_fd = pool.workers[next].epoll_fd;
+        conn->addr = client_addr;
+        conn->trace = trace_open();
+        frame_parser_init(&conn->parser);
+
+        //- The registration publishes the connection to the worker, nothing may touch it here once it succeeded.
+        metrics_add(METRICS_ACCEPTED, 1);
+        log_info("  new connection from %a:%u", client_addr.sin_addr.s_addr, ntohs(client_addr.sin_port));
+        event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+        event.data.ptr = conn;
+        if (epoll_ctl(pool.workers[next].epoll_fd, EPOLL_CTL_ADD, client_fd, &event) == -1) {
+            log_error("error: epoll registration failed: %e", errno);
+            metrics_add(METRICS_ERRORS, 1);
+            metrics_add(METRICS_CLOSED, 1);
+            close(client_fd);
+            trace_close(conn->trace);
+            free(conn);
+            admission_leave();
+        }
+        next = (next + 1) % threads;
+    }
+}
+
+//* Worker thread entry point
+//- Every round collects the ready connections of the own epoll instance without blocking, then runs one turn of the
+//- oldest queued connection, its own or a stolen one. A worker only blocks when there is nothing to run anywhere.
+static void* workpool_main(void* arg) {
+    struct workpool_worker* worker = arg;
+    struct epoll_event events[WORKPOOL_MAX_EVENTS];
+    struct workpool_conn* conn;
+    int ready;
+
+    while (1) {
+        if ((ready = epoll_wait(worker->epoll_fd, events, WORKPOOL_MAX_EVENTS, 0)) > 0)
+            workpool_collect(worker, events, ready);
+        if ((conn = runqueue_take(&worker->queue)) != NULL || (conn = workpool_steal(worker)) != NULL) {
+            workpool_run(worker, conn);
+            continue;
+        }
+
+        //* Sleep until the own epoll instance reports something or another worker has work to give away
+        //- The flag is published before the last look at the other queues, and a worker that queues work reads the
+        //- flags after its push (both sides with a full fence). Either this worker sees the work, or the other one sees
+        //- the flag and writes the eventfd: a wakeup cannot be lost.
+        __atomic_store_n(&worker->sleeping, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if ((conn = workpool_steal(worker)) != NULL) {
+            __atomic_store_n(&worker->sleeping, 0, __ATOMIC_RELAXED);
+            workpool_run(worker, conn);
+            continue;
+        }
+        ready = epoll_wait(worker->epoll_fd, events, WORKPOOL_MAX_EVENTS, -1);
+        __atomic_store_n(&worker->sleeping, 0, __ATOMIC_RELAXED);
+        if (ready == -1) {
+            if (errno == EINTR)
+                continue;
+            log_error("error: epoll_wait failed, worker stopped: %e", errno);
+            metrics_add(METRICS_ERRORS, 1);
+            return NULL;
+        }
+        workpool_collect(worker, events, ready);
+    }
+}
+
+//* Queue the connections epoll reported as ready
+//- A connection is only reported once per arming, so it is never queued twice. If the run queue is full the
+//- connection is served right away.
+static void workpool_collect(struct workpool_worker* worker, struct epoll_event* events, int ready) {
+    for (int i = 0; i < ready; i++) {
+        struct workpool_conn* conn = events[i].data.ptr;
+
+        if (conn == NULL) {
+            //- Wakeup from another worker, the eventfd only has to be reset.
+            while (read(worker->wake_fd, &(uint64_t){0}, sizeof(uint64_t)) == -1 && errno == EINTR) continue;
+            continue;
+        }
+        if (runqueue_push(&worker->queue, conn) == -1)
+            workpool_run(worker, conn);
+    }
+    if (runqueue_size(&worker->queue) > 1)
+        workpool_wake(worker);
+}
+
+//* Take the oldest queued connection of another worker
+//- The victims are tried in order starting after the own index, so concurrent thieves spread over different queues.
+static struct workpool_conn* workpool_steal(struct workpool_worker* worker) {
+    struct workpool* pool = worker->pool;
+    struct workpool_conn* conn;
+
+    for (unsigned i = 1; i < pool->count; i++) {
+        if ((conn = runqueue_take(&pool->workers[(worker->index + i) % pool->count].queue)) != NULL) {
+            metrics_add(METRICS_STEALS, 1);
+            return conn;
+        }
+    }
+    return NULL;
+}
+
+//* Wake one sleeping worker to steal from this one
+//- The compare-and-swap makes sure that two busy workers do not both wake the same sleeper.
+static void workpool_wake(struct workpool_worker* worker) {
+    struct workpool* pool = worker->pool;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (unsigned i = 1; i < pool->count; i++) {
+        struct workpool_worker* sleeper = &pool->workers[(worker->index + i) % pool->count];
+        int sleeping = 1;
+
+        if (__atomic_load_n(&sleeper->sleeping, __ATOMIC_RELAXED) &&
+            __atomic_compare_exchange_n(&sleeper->sleeping, &sleeping, 0, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            while (write(sleeper->wake_fd, &(uint64_t){1}, sizeof(uint64_t)) == -1 && errno == EINTR) continue;
+            return;
+        }
+    }
+}
+
+//* Serve one turn of a connection
+//- Pending output is flushed first. A connection whose client is still behind waits for EPOLLOUT and is not read,
+//- which also bounds the output buffer to about one turn of data. Otherwise up to WORKPOOL_READ_BUDGET reads are
+//- echoed. The turn ends by re-arming the socket in its epoll instance (drained, or output pending), by queueing
+//- the connection again (budget used up) or by closing it. After re-arming, the connection may already run on
+//- another worker, so nothing touches it afterwards.
+static void workpool_run(struct workpool_worker* worker, struct workpool_conn* conn) {
+    ssize_t bytes_received;
+
+    if (workpool_flush(conn) == -1) {
+        log_error("error: socket sending failed: %e", errno);
+        metrics_add(METRICS_ERRORS, 1);
+        workpool_close(conn);
+        return;
+    }
+    if (conn->out_off < conn->out_len) {
+        workpool_arm(conn, EPOLLOUT);
+        return;
+    }
+
+    for (int reads = 0; reads < WORKPOOL_READ_BUDGET;) {
+        if ((bytes_received = recv(conn->fd, worker->buffer, WORKPOOL_BUFFER_SIZE, 0)) > 0) {
+            uint64_t start = metrics_now();
+            const char* data = worker->buffer;
+            size_t len = bytes_received;
+            struct frame_chunk chunk;
+            unsigned messages = 0;
+            int status;
+
+            reads++;
+            if (worker->pool->quickack)
+                tuning_quickack(conn->fd);
+            while ((status = frame_parse(&conn->parser, &data, &len, &chunk)) == 1) {
+                if (chunk.offset > 0)
+                    continue;
+                messages++;
+                log_info_data(chunk.data, chunk.len, "received message from %a:%u (%4u byte): %s", conn->addr.sin_addr.s_addr,
+                              ntohs(conn->addr.sin_port), chunk.length);
+            }
+            metrics_add(METRICS_BYTES_RECEIVED, bytes_received);
+            metrics_add(METRICS_MESSAGES, messages);
+            trace_record(conn->trace, TRACE_IN, worker->buffer, bytes_received);
+            if (status == -1) {
+                log_error("error: invalid message header from %a:%u, closing the connection", conn->addr.sin_addr.s_addr,
+                          ntohs(conn->addr.sin_port));
+                metrics_add(METRICS_ERRORS, 1);
+                workpool_close(conn);
+                return;
+            }
+            if (workpool_queue(conn, worker->buffer, bytes_received) == -1) {
+                log_error("error: socket sending failed: %e", errno);
+                metrics_add(METRICS_ERRORS, 1);
+                workpool_close(conn);
+                return;
+            }
+            metrics_record_service(start);
+            log_info("          reply to %a:%u (%4u byte, %u new messages)", conn->addr.sin_addr.s_addr, ntohs(conn->addr.sin_port),
+                     bytes_received, messages);
+            if (conn->out_off < conn->out_len) {
+                workpool_arm(conn, EPOLLOUT);
+                return;
+            }
+        } else if (bytes_received == 0) {
+            log_info("client %a:%u disconnected", conn->addr.sin_addr.s_addr, ntohs(conn->addr.sin_port));
+            workpool_close(conn);
+            return;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            workpool_arm(conn, EPOLLIN | EPOLLRDHUP);
+            return;
+        } else if (errno != EINTR) {
+            log_error("error: socket receiving failed: %e", errno);
+            metrics_add(METRICS_ERRORS, 1);
+            workpool_close(conn);
+            return;
+        }
+    }
+
+    //- Budget used up: the connection goes behind the others in the queue of the worker that ran it.
+    if (runqueue_push(&worker->queue, conn) == -1)
+        workpool_arm(conn, EPOLLIN | EPOLLRDHUP);
+    else if (runqueue_size(&worker->queue) > 1)
+        workpool_wake(worker);
+}
+
+//* Send as much pending output as the socket accepts
+//? Returns -1 if the connection failed, 0 otherwise (even if output is still pending).
+static int workpool_flush(struct workpool_conn* conn) {
+    ssize_t bytes_sent;
+
+    while (conn->out_off < conn->out_len) {
+        if ((bytes_sent = send(conn->fd, conn->out_buf + conn->out_off, conn->out_len - conn->out_off, MSG_NOSIGNAL)) == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        metrics_add(METRICS_BYTES_SENT, bytes_sent);
+        trace_record(conn->trace, TRACE_OUT, conn->out_buf + conn->out_off, bytes_sent);
+        conn->out_off += bytes_sent;
+    }
+    free(conn->out_buf);
+    conn->out_buf = NULL;
+    conn->out_off = conn->out_len = 0;
+    return 0;
+}
+
+//* Send data and keep what the kernel refused
+//- Only called when nothing is pending (a turn stops reading as soon as output is pending), so the refused part
+//- becomes the whole output buffer.
+//? Returns -1 if the connection failed or the buffer could not be allocated.
+static int workpool_queue(struct workpool_conn* conn, const char* data, size_t len) {
+    ssize_t bytes_sent;
+
+    while (len > 0) {
+        if ((bytes_sent = send(conn->fd, data, len, MSG_NOSIGNAL)) == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        metrics_add(METRICS_BYTES_SENT, bytes_sent);
+        trace_record(conn->trace, TRACE_OUT, data, bytes_sent);
+        data += bytes_sent;
+        len -= bytes_sent;
+    }
+    if (len == 0)
+        return 0;
+
+    if ((conn->out_buf = malloc(len)) == NULL)
+        return -1;
+    memcpy(conn->out_buf, data, len);
+    conn->out_off = 0;
+    conn->out_len = len;
+    return 0;
+}
+
+//* Re-arm the one-shot registration of a connection
+//- With a level-triggered one-shot registration a socket that is already ready is reported right away, so data that
+//- arrived during the turn is not missed.
+static int workpool_arm(struct workpool_conn* conn, uint32_t events) {
+    struct epoll_event event = {.events = events | EPOLLONESHOT, .data.ptr = conn};
+
+    if (epoll_ctl(conn->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event) == -1) {
+        log_error("error: epoll re-arming failed: %e", errno);
+        metrics_add(METRICS_ERRORS, 1);
+        workpool_close(conn);
+        return -1;
+    }
+    return 0;
+}
+
+//* Close a client connection and release its state
+//- close() also removes the socket from the epoll interest list.
+static void workpool_close(struct workpool_conn* conn) {
+    close(conn->fd);
+    trace_close(conn->trace);
+    free(conn->out_buf);
+    free(conn);
+    admission_leave();
+    metrics_add(METRICS_CLOSED, 1);
+}
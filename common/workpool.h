@@ -0,0 +1,31 @@
+#ifndef COMMON_WORKPOOL_H
+#define COMMON_WORKPOOL_H
+
+#include <stddef.h>
+
+#include "ratelimit.h"
+
+#define WORKPOOL_QUEUE_SIZE 4096          //- Run queue capacity of a worker (must be a power of 2)
+#define WORKPOOL_BUFFER_SIZE (64 * 1024)  //- Receive buffer of a worker, shared by every connection it serves
+#define WORKPOOL_READ_BUDGET 4            //- Reads per turn, then a connection that still has data goes to the back
+#define WORKPOOL_MAX_EVENTS 64            //- Maximum number of events returned by one epoll_wait() call
+
+//* Pre-spawned worker pool with work stealing
+//- A fixed set of worker threads is started once. The calling thread accepts connections and registers them with
+//- the workers' epoll instances in turn (EPOLLONESHOT). Accepting a client therefore costs accept4(), one malloc() and
+//- one epoll_ctl(). The kernel does not have to fork and reap a process.
+//- A worker moves the connections its epoll instance reports into its run queue (common/runqueue.h) and serves them in
+//- turns of at most WORKPOOL_READ_BUDGET reads. A connection that still has data after its turn is queued again
+//- behind the others, so a client that sends much more than the rest only gets its share of the worker.
+//- A worker whose own queue is empty steals queued connections from the other workers, and a worker that queues more
+//- than it can run at once wakes a sleeping one. When a few clients carry most of the traffic, their turns spread over
+//- every core instead of piling up on the worker they were assigned to.
+//- EPOLLONESHOT makes a connection the property of whoever runs it: its socket reports nothing until the turn is over
+//- and it is re-armed, so two workers never serve the same connection at once.
+//- The accept loop checks every connection against limit (per-source connection rate, NULL: none) and the connection
+//- limit before it allocates anything for it (see common/ratelimit.h). With quickack the workers re-arm TCP_QUICKACK
+//- after every read (see tuning_quickack()).
+//? Only returns if the workers cannot be started or accepting fails for good (-1, errno set).
+int workpool_serve(int listen_fd, unsigned threads, struct ratelimit* limit, int quickack);
+
+#endif
@@ -0,0 +1,111 @@
+#define _GNU_SOURCE
+
+#include "zerocopy.h"
+#include "metrics.h"
+
+#include <errno.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#define ZEROCOPY_WAIT_TIMEOUT 1000  //- Milliseconds between two checks of a connection that waits for a notification
+
+//* Turn on MSG_ZEROCOPY support for a socket
+//? Returns -1 if the kernel or the socket type does not support it.
+int zerocopy_enable(int fd) {
+    return setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &(int){1}, sizeof(int));
+}
+
+//* Send with MSG_ZEROCOPY, copying if the kernel cannot track the send
+ssize_t zerocopy_send(int fd, const void* data, size_t len, int flags, int* zerocopy) {
+    ssize_t bytes_sent;
+
+    if ((bytes_sent = send(fd, data, len, flags | MSG_ZEROCOPY)) >= 0) {
+        *zerocopy = 1;
+        metrics_add(METRICS_ZEROCOPY_SENDS, 1);
+        return bytes_sent;
+    }
+    *zerocopy = 0;
+    if (errno != ENOBUFS)
+        return -1;
+    return send(fd, data, len, flags);
+}
+
+//* Read every notification waiting on the error queue
+//- A notification is a struct sock_extended_err in a control message. ee_info and ee_data hold the first and last id
+//- of the released range, consecutive sends are coalesced into one range when possible.
+int zerocopy_reap(int fd, zerocopy_release_fn release, void* context) {
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+    struct msghdr msg;
+    struct cmsghdr* cmsg;
+    int notifications = 0;
+
+    while (1) {
+        memset(&msg, 0, sizeof msg);
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof control;
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return notifications;
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            struct sock_extended_err err;
+
+            if (!((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+                  (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)))
+                continue;
+            memcpy(&err, CMSG_DATA(cmsg), sizeof err);
+            if (err.ee_origin != SO_EE_ORIGIN_ZEROCOPY || err.ee_errno != 0)
+                continue;
+            if (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                metrics_add(METRICS_ZEROCOPY_COPIED, err.ee_data - err.ee_info + 1);
+            release(context, err.ee_info, err.ee_data);
+            notifications++;
+        }
+    }
+}
+
+//* Block until the sends from a buffer are released
+//- The error queue wakes poll() with POLLERR. A connection that hung up is not waited for: its send queue is purged
+//- when the socket closes, nothing will be sent from the buffer anymore.
+int zerocopy_wait(int fd, const struct zerocopy_buffer* buffer, zerocopy_release_fn release, void* context) {
+    struct pollfd pfd = {.fd = fd, .events = 0};
+
+    while (buffer->pending > 0) {
+        if (poll(&pfd, 1, ZEROCOPY_WAIT_TIMEOUT) == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (zerocopy_reap(fd, release, context) <= 0 && (pfd.revents & (POLLHUP | POLLNVAL)))
+            break;
+    }
+    return 0;
+}
+
+//* Count down the sends of a buffer that fall into a released range
+//- The ids are compared relative to the buffer's first id, so the 32-bit counter may wrap around.
+void zerocopy_buffer_release(struct zerocopy_buffer* buffer, uint32_t lo, uint32_t hi) {
+    uint32_t span = buffer->last_id - buffer->first_id;
+    uint32_t start, end;
+
+    if (buffer->pending == 0)
+        return;
+    if (buffer->first_id - lo <= hi - lo)
+        start = buffer->first_id;
+    else if (lo - buffer->first_id <= span)
+        start = lo;
+    else
+        return;
+    end = hi - buffer->first_id <= span ? hi : buffer->last_id;
+
+    buffer->pending -= end - start + 1 < buffer->pending ? end - start + 1 : buffer->pending;
+    if (buffer->pending == 0)
+        buffer->owner = NULL;
+}
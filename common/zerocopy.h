@@ -0,0 +1,45 @@
+#ifndef COMMON_ZEROCOPY_H
+#define COMMON_ZEROCOPY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define ZEROCOPY_THRESHOLD (16 * 1024)    //- Default minimum send size for MSG_ZEROCOPY, smaller sends are copied
+#define ZEROCOPY_BUFFER_SIZE (64 * 1024)  //- Size of a receive buffer whose bytes may be sent with MSG_ZEROCOPY
+
+//* Zerocopy send buffer
+//- With MSG_ZEROCOPY the kernel pins the pages of the send buffer instead of copying them into the socket, and sends
+//- straight from user memory. The buffer must not be written again until the kernel reports that it released the
+//- pages. Every successful MSG_ZEROCOPY send on a socket gets the next notification id (counting from 0), and the
+//- kernel reports released sends as id ranges on the socket error queue (see zerocopy_reap()).
+//- A buffer remembers the ids of the sends made from it and counts down the ones still pinned, so it is writable
+//- again when pending is 0, in whatever order the ranges arrive.
+struct zerocopy_buffer {
+    char* data;         //- Buffer memory (ZEROCOPY_BUFFER_SIZE bytes)
+    void* owner;        //- Connection the pending sends went out on (NULL while the buffer is free)
+    uint32_t first_id;  //- Notification id of the first pending send from the buffer
+    uint32_t last_id;   //- Notification id of the last pending send from the buffer
+    uint32_t pending;   //- Sends from the buffer the kernel has not released yet
+};
+
+//- Called by zerocopy_reap() for every released id range [lo, hi] (inclusive).
+typedef void (*zerocopy_release_fn)(void* context, uint32_t lo, uint32_t hi);
+
+//* Zerocopy send path
+//- zerocopy_enable() sets SO_ZEROCOPY on a socket, without it MSG_ZEROCOPY is silently ignored. It fails on kernels
+//- before 4.14 and on socket types without zerocopy support, the caller should keep copying then.
+//- zerocopy_send() is send() with MSG_ZEROCOPY. If the kernel cannot allocate the notification (ENOBUFS, the
+//- optmem_max limit of the socket) it copies instead: *zerocopy tells whether the send consumed a notification id.
+//- zerocopy_reap() drains the error queue of a socket without blocking and calls release for every released range.
+//- A range the kernel had to copy anyway (loopback, a device without scatter-gather) is counted in the metrics.
+//- zerocopy_wait() is for blocking servers: it reaps until buffer has no pending sends or the connection is gone.
+//? zerocopy_send() returns the result of send(). zerocopy_reap() returns the number of notifications read, or -1 if
+//? the error queue could not be read, errno is set. zerocopy_wait() returns -1 if poll() fails.
+int zerocopy_enable(int fd);
+ssize_t zerocopy_send(int fd, const void* data, size_t len, int flags, int* zerocopy);
+int zerocopy_reap(int fd, zerocopy_release_fn release, void* context);
+int zerocopy_wait(int fd, const struct zerocopy_buffer* buffer, zerocopy_release_fn release, void* context);
+void zerocopy_buffer_release(struct zerocopy_buffer* buffer, uint32_t lo, uint32_t hi);
+
+#endif
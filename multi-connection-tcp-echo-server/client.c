@@ -1,4 +1,5 @@
 #include <arpa/inet.h>
+#include <getopt.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <stdio.h>
@@ -8,15 +9,122 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "frame.h"
+#include "loadgen.h"
+#include "pipeline.h"
+#include "replay.h"
+
 #define BUFFER_SIZE 1024       //- Message buffer size
 #define SERVER_IP "127.0.0.1"  //- Server IP address
 #define SERVER_PORT 8080       //- Server port number
 
-int main(void) {
+void usage(const char* prog);
+int run_bench_mode(struct loadgen_options* options, int csv);
+int run_pipeline_mode(int sock_fd, unsigned window);
+int run_replay_mode(const char* path, double speed);
+int parse_positive(const char* arg, const char* name, double* value);
+
+int main(int argc, char* argv[]) {
     int sock_fd;                     //- Define a file descriptor for the client socket
     struct sockaddr_in server_addr;  //- Define a struct for the server address
     char buffer[BUFFER_SIZE];        //- Define a buffer to store the received message
-    ssize_t bytes_received;          //- Define a variable to store the size of the received message
+    size_t reply_len;                //- Define a variable to store the size of the received message
+    int status;                      //- Define a variable to store the result of frame_read()
+    struct loadgen_options bench = {.connections = 1, .threads = 1, .payload = 64, .depth = 1, .duration = 10};
+    int bench_mode = 0;         //- Define a flag for the load generator mode
+    int csv = 0;                //- Define a flag for the machine-readable load generator report
+    unsigned window = 0;        //- Define the pipeline window of the interactive mode (0: lockstep)
+    int opt;                    //- Define a variable to store the current command line option
+    double value;               //- Define a variable to store a parsed numeric option
+    const char* replay = NULL;  //- Define the trace file to replay (NULL: no replay)
+    double speed = 1;           //- Define the replay timeline scale
+
+    static const struct option long_options[] = {
+        {"bench", no_argument, NULL, 'b'},
+        {"connections", required_argument, NULL, 'c'},
+        {"threads", required_argument, NULL, 't'},
+        {"size", required_argument, NULL, 's'},
+        {"depth", required_argument, NULL, 'p'},
+        {"duration", required_argument, NULL, 'd'},
+        {"rate", required_argument, NULL, 'r'},
+        {"csv", no_argument, NULL, 'C'},
+        {"replay", required_argument, NULL, 'R'},
+        {"speed", required_argument, NULL, 'x'},
+        {"window", required_argument, NULL, 'w'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+
+    //* Parse the command line options
+    //- Without options the client is an interactive prompt. -b, --bench turns it into a load generator instead, -w,
+    //- --window keeps the prompt input but sends it pipelined (see common/pipeline.h). -R, --replay sends a trace the
+    //- server captured on as many connections, at the rate -x, --speed scales (see common/replay.h).
+    while ((opt = getopt_long(argc, argv, "bc:t:s:p:d:r:w:R:x:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'b':
+                bench_mode = 1;
+                break;
+            case 'c':
+                if (parse_positive(optarg, "connection count", &value) == -1)
+                    return EXIT_FAILURE;
+                bench.connections = (int)value;
+                break;
+            case 't':
+                if (parse_positive(optarg, "thread count", &value) == -1)
+                    return EXIT_FAILURE;
+                bench.threads = (int)value;
+                break;
+            case 's':
+                if (parse_positive(optarg, "payload size", &value) == -1)
+                    return EXIT_FAILURE;
+                bench.payload = (size_t)value;
+                break;
+            case 'p':
+                if (parse_positive(optarg, "pipeline depth", &value) == -1)
+                    return EXIT_FAILURE;
+                bench.depth = (int)value;
+                break;
+            case 'd':
+                if (parse_positive(optarg, "duration", &value) == -1)
+                    return EXIT_FAILURE;
+                bench.duration = value;
+                break;
+            case 'r':
+                if (parse_positive(optarg, "request rate", &value) == -1)
+                    return EXIT_FAILURE;
+                bench.rate = value;
+                break;
+            case 'C':
+                csv = 1;
+                break;
+            case 'w':
+                if (parse_positive(optarg, "window", &value) == -1)
+                    return EXIT_FAILURE;
+                if (value > PIPELINE_WINDOW_MAX) {
+                    fprintf(stderr, "error: window %s exceeds %d\n", optarg, PIPELINE_WINDOW_MAX);
+                    return EXIT_FAILURE;
+                }
+                window = (unsigned)value;
+                break;
+            case 'R':
+                replay = optarg;
+                break;
+            case 'x':
+                if (parse_positive(optarg, "speed", &speed) == -1)
+                    return EXIT_FAILURE;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (bench_mode)
+        return run_bench_mode(&bench, csv);
+    if (replay != NULL)
+        return run_replay_mode(replay, speed);
 
     //* Create a socket for the client
     //- The socket() syscall creates a new socket and returns a file descriptor that refers to that socket.
@@ -50,6 +158,8 @@ int main(void) {
         close(sock_fd);
         return EXIT_FAILURE;
     }
+    if (window > 0)
+        return run_pipeline_mode(sock_fd, window);
 
     //* while loop to send and receive messages from the server
     while (1) {
@@ -75,30 +185,137 @@ int main(void) {
             continue;  //- Skip empty messages
 
         //* Send the message to the server
-        //- The send() syscall sends the message to the server socket.
-        //- The 1st argument, client_fd, specifies the file descriptor of the client socket.
+        //- frame_write() puts the 4-byte length header in front of the message (see common/frame.h) and sends both
+        //- with one writev() syscall.
+        //- The 1st argument, sock_fd, specifies the file descriptor of the client socket.
         //- The 2nd argument, buffer, specifies the message to be sent.
         //- The 3rd argument, strlen(buffer), specifies the size of the message.
-        //? If the send() syscall fails, it returns -1.
-        if ((send(sock_fd, buffer, strlen(buffer), 0)) == -1) {
-            perror("error: socket sending failed, aborting...");
+        //? If the writev() syscall fails, it returns -1.
+        if (frame_write(sock_fd, buffer, strlen(buffer)) == -1) {
+            perror("error: message sending failed, aborting...");
+            close(sock_fd);
             return EXIT_FAILURE;
         }
 
-        //* Receive messages from the server
-        //- The recv() syscall receives messages from the server.
-        //- The 1st argument, client_fd, specifies the file descriptor of the client socket.
-        //- The 2nd argument, buffer, specifies the buffer to store the received message.
-        //- The 3rd argument, BUFFER_SIZE, specifies the size of the buffer.
-        //- The 4th argument, 0, specifies the flags. 0 is the standard mode for the recv() syscall.
-        //? If the recv() syscall fails, it returns -1.
-        if ((bytes_received = recv(sock_fd, buffer, BUFFER_SIZE, 0)) > 0) {
-            buffer[bytes_received] = '\0';
-            printf("server> %s\n", buffer);
+        //* Receive the echoed message from the server
+        //- frame_read() reads the length header first and then exactly that many payload bytes, so the reply is
+        //- complete even if it arrives in several pieces.
+        //? It returns 0 if the server closed the connection and -1 if the reply could not be read.
+        if ((status = frame_read(sock_fd, buffer, BUFFER_SIZE, &reply_len)) <= 0) {
+            if (status == 0)
+                printf("server closed the connection\n");
+            else
+                perror("error: message receiving failed, aborting...");
+            close(sock_fd);
+            return status == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
         }
+        printf("server> %.*s\n", (int)reply_len, buffer);
     }
 
     //* Close the client socket
     close(sock_fd);
     return EXIT_SUCCESS;
 }
+
+//* Run the load generator against the server and print the report
+//- Threads are capped at the number of connections, a thread without connections would only skew the start.
+int run_bench_mode(struct loadgen_options* options, int csv) {
+    struct sockaddr_in* addr = (struct sockaddr_in*)&options->addr;
+    struct loadgen_result* result;
+
+    memset(&options->addr, 0, sizeof options->addr);
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(SERVER_PORT);
+    addr->sin_addr.s_addr = inet_addr(SERVER_IP);
+    options->addr_len = sizeof *addr;
+    if (options->threads > options->connections)
+        options->threads = options->connections;
+
+    //- The result embeds a histogram (~30 KB), keep it off the stack.
+    if ((result = malloc(sizeof *result)) == NULL || loadgen_run(options, result) == -1) {
+        perror("error: load generator failed, aborting...");
+        free(result);
+        return EXIT_FAILURE;
+    }
+    if (csv)
+        loadgen_report_csv(result, stdout);
+    else
+        loadgen_report(options, result, stdout);
+    free(result);
+    return EXIT_SUCCESS;
+}
+
+//* Send stdin pipelined and print the echoes
+//- Up to window messages are in flight at a time, see common/pipeline.h. The report goes to stderr, so the echoes can
+//- be redirected on their own.
+int run_pipeline_mode(int sock_fd, unsigned window) {
+    struct pipeline* pipeline;
+    int status;
+
+    //- The pipeline embeds its input and receive buffers (128 KB), keep it off the stack.
+    if ((pipeline = malloc(sizeof *pipeline)) == NULL || pipeline_init(pipeline, sock_fd, window) == -1) {
+        perror("error: pipeline setup failed, aborting...");
+        free(pipeline);
+        close(sock_fd);
+        return EXIT_FAILURE;
+    }
+    if ((status = pipeline_run(pipeline, STDIN_FILENO, stdout)) == -1)
+        perror("error: pipelined messaging failed, aborting...");
+    else if (status == 0)
+        printf("server closed the connection\n");
+    fflush(stdout);
+    pipeline_report(pipeline, stderr);
+    pipeline_free(pipeline);
+    free(pipeline);
+    close(sock_fd);
+    return status == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+//* Replay a captured trace against the server
+//- Every captured connection is opened again at its captured time, the report goes to stdout like the load report.
+int run_replay_mode(const char* path, double speed) {
+    struct replay_options options = {.addr_len = sizeof(struct sockaddr_in), .path = path, .speed = speed};
+    struct sockaddr_in* server_addr = (struct sockaddr_in*)&options.addr;
+    struct replay_result result;
+
+    server_addr->sin_family = AF_INET;
+    server_addr->sin_port = htons(SERVER_PORT);
+    server_addr->sin_addr.s_addr = inet_addr(SERVER_IP);
+    if (replay_run(&options, &result) == -1) {
+        perror("error: trace replay failed, aborting...");
+        return EXIT_FAILURE;
+    }
+    replay_report(&options, &result, stdout);
+    return result.errors > 0 || result.received != result.sent ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int parse_positive(const char* arg, const char* name, double* value) {
+    char* end;
+
+    *value = strtod(arg, &end);
+    if (*end != '\0' || !(*value > 0)) {
+        fprintf(stderr, "error: invalid %s '%s'\n", name, arg);
+        return -1;
+    }
+    return 0;
+}
+
+void usage(const char* prog) {
+    printf("usage: %s [-w window | -b [-c connections] [-t threads] [-s size] [-p depth] [-d seconds] [-r rate] [--csv]]\n"
+           "       %s -R trace [-x speed]\n", prog, prog);
+    printf("  without options the client reads messages from stdin and prints the echoes\n");
+    printf("  -w, --window N       keep up to N messages of stdin in flight and coalesce them into one writev(),\n");
+    printf("                       echoes are matched in order and a report goes to stderr (max %d)\n", PIPELINE_WINDOW_MAX);
+    printf("  -b, --bench          run a load test and report throughput and latency percentiles\n");
+    printf("  -c, --connections N  number of connections (default: 1)\n");
+    printf("  -t, --threads N      number of load generator threads (default: 1)\n");
+    printf("  -s, --size N         request payload size in bytes (default: 64)\n");
+    printf("  -p, --depth N        requests in flight per connection (default: 1)\n");
+    printf("  -d, --duration S     test duration in seconds (default: 10)\n");
+    printf("  -r, --rate R         target request rate over all connections, latency is measured from the scheduled\n");
+    printf("                       send time (default: closed-loop, a new request as soon as a reply arrives)\n");
+    printf("      --csv            print the results as one comma-separated line (see bench.sh for the columns)\n");
+    printf("  -R, --replay FILE    replay a trace the server captured (server -C): every connection is opened again\n");
+    printf("                       and sent its input at the captured times, then the echoed bytes are checked\n");
+    printf("  -x, --speed X        scale the replay rate, 2 replays twice as fast (default: 1)\n");
+}
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <arpa/inet.h>
 #include <asm-generic/socket.h>
 #include <netdb.h>
@@ -11,19 +13,145 @@
 #include <stdlib.h>
 #include <signal.h>
 #include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "busypoll.h"
+#include "frame.h"
+#include "log.h"
+#include "metrics.h"
+#include "ratelimit.h"
+#include "reactor.h"
+#include "replybatch.h"
+#include "supervisor.h"
+#include "trace.h"
+#include "tuning.h"
+#include "uring.h"
+#include "workpool.h"
+#include "zerocopy.h"
+
+#define METRICS_SOCKET_FILE "/tmp/multi_tcp_echo_server.metrics.sock"  //- Metrics endpoint socket path (see common/metrics.h)
 
-#define BACKLOG 3              //- If the server is busy, it will allow up to 3 pending connections (if linux, you can set it to SOMAXCONN)
-#define BUFFER_SIZE 1024       //- Message buffer size
-#define SERVER_IP "127.0.0.1"  //- Server IP address
-#define SERVER_PORT 8080       //- Server sport number
+//* Connection handling engines
+//- MODE_EPOLL serves every connection from one process with an edge-triggered epoll event loop (see common/reactor.c).
+//- MODE_URING serves every connection from one process with io_uring (see common/uring.c).
+//- MODE_REUSEPORT runs one epoll event loop per worker thread, each with its own SO_REUSEPORT listener and CPU.
+//- MODE_POOL hands the connections to a fixed pool of worker threads that steal work from each other (see common/workpool.c).
+//- MODE_PREFORK runs a supervisor with a fixed set of epoll worker processes on a shared listener (see common/supervisor.h).
+//- MODE_FORK is the legacy engine, it forks a child process for every accepted connection.
+enum server_mode { MODE_EPOLL, MODE_URING, MODE_REUSEPORT, MODE_POOL, MODE_PREFORK, MODE_FORK };
+
+//* Thread-per-core worker
+//- Each worker owns its listening socket, its event loop and its CPU, nothing on the data path is shared.
+struct worker {
+    pthread_t thread;  //- Worker thread
+    int cpu;           //- CPU the worker is pinned to
+    int listen_fd;     //- SO_REUSEPORT listening socket of the worker
+    size_t zerocopy;   //- Zerocopy threshold of the worker reactor (0: copy every send)
+};
 
 void sig_handler(int sig);
+void usage(const char* prog);
+int create_listener(int reuseport);
+int parse_tuning(int opt, const char* arg);
+int run_fork_mode(int server_fd);
+int run_epoll_mode(int server_fd, size_t zerocopy);
+int run_reuseport_mode(int server_fd, long threads, size_t zerocopy);
+int run_pool_mode(int server_fd, long threads);
+int run_prefork_mode(int server_fd, long workers, size_t zerocopy);
+int prefork_worker(int listen_fd, void* arg);
+void drain_handler(int sig);
+int start_reactor(struct reactor* reactor, int listen_fd, size_t zerocopy, int flags);
+void* worker_main(void* arg);
+long available_cpus(void);
+
+static struct reactor* draining_reactor;  //- Reactor of a prefork worker process, drained on SIGQUIT
+static struct tuning tuning;              //- Address, socket options and buffer size (see common/tuning.h)
 
-int main(void) {
-    int server_fd, client_fd;                     //- Define file descriptors for the server and client sockets
-    struct sockaddr_in source_addr, client_addr;  //- Define structs for the server and client addresses
-    char buffer[BUFFER_SIZE];                     //- Define a buffer to store the received message
-    ssize_t bytes_received;                       //- Define a variable to store the size of the received message
+int main(int argc, char* argv[]) {
+    int server_fd;                                 //- Define a file descriptor for the server socket
+    enum server_mode mode = MODE_EPOLL;            //- Define the connection handling engine
+    long threads = 0;                              //- Define the number of worker threads (0 means one per available CPU)
+    int zerocopy = 0;                              //- Define whether large echoes are sent with MSG_ZEROCOPY
+    long zerocopy_threshold = ZEROCOPY_THRESHOLD;  //- Define the minimum echo size for MSG_ZEROCOPY
+    int inherited = 0;                             //- Define whether the listener was inherited from a hot restart
+    const char* capture = NULL;                    //- Define the capture trace file (NULL: no capture)
+    int opt;                                       //- Define a variable to store the current command line option
+
+    static const struct option long_options[] = {
+        {"mode", required_argument, NULL, 'm'},
+        {"threads", required_argument, NULL, 't'},
+        {"zerocopy", no_argument, NULL, 'z'},
+        {"zerocopy-threshold", required_argument, NULL, 'Z'},
+        {"profile", required_argument, NULL, 'p'},
+        {"config", required_argument, NULL, 'c'},
+        {"option", required_argument, NULL, 'o'},
+        {"capture", required_argument, NULL, 'C'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+
+    //* Parse the command line options
+    //- -m, --mode selects the connection handling engine: "epoll" (default), "uring", "reuseport", "pool", "prefork" or "fork".
+    //- -t, --threads sets the number of reuseport, pool or prefork workers.
+    //- -z, --zerocopy sends echoes of at least --zerocopy-threshold bytes with MSG_ZEROCOPY (epoll, reuseport, prefork).
+    //- -p, --profile, -c, --config and -o, --option set the socket tuning, in the order they are given.
+    //- -C, --capture records every connection into a trace file the clients can replay (see common/trace.h).
+    tuning_init(&tuning);
+    while ((opt = getopt_long(argc, argv, "m:t:zZ:p:c:o:C:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'm':
+                if (strcmp(optarg, "epoll") == 0) {
+                    mode = MODE_EPOLL;
+                } else if (strcmp(optarg, "uring") == 0) {
+                    mode = MODE_URING;
+                } else if (strcmp(optarg, "reuseport") == 0) {
+                    mode = MODE_REUSEPORT;
+                } else if (strcmp(optarg, "pool") == 0) {
+                    mode = MODE_POOL;
+                } else if (strcmp(optarg, "prefork") == 0) {
+                    mode = MODE_PREFORK;
+                } else if (strcmp(optarg, "fork") == 0) {
+                    mode = MODE_FORK;
+                } else {
+                    fprintf(stderr, "error: unknown mode '%s'\n", optarg);
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 't':
+                if ((threads = strtol(optarg, NULL, 10)) <= 0) {
+                    fprintf(stderr, "error: invalid thread count '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'z':
+                zerocopy = 1;
+                break;
+            case 'Z':
+                if ((zerocopy_threshold = strtol(optarg, NULL, 10)) <= 0) {
+                    fprintf(stderr, "error: invalid zerocopy threshold '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'p':
+            case 'c':
+            case 'o':
+                if (parse_tuning(opt, optarg) == -1)
+                    return EXIT_FAILURE;
+                break;
+            case 'C':
+                capture = optarg;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
 
     struct sigaction sa;            //- Define a struct for the signal handler
     sa.sa_handler = sig_handler;    //- Set the signal handler function
@@ -33,6 +161,149 @@ int main(void) {
     sigaction(SIGKILL, &sa, NULL);  //- Register the signal handler for SIGKILL
     sigaction(SIGTERM, &sa, NULL);  //- Register the signal handler for SIGTERM
 
+    //* Prepare the prefork supervisor
+    //- Its signals must be blocked before the logger and metrics threads start, and the new binary of a hot restart
+    //- receives the listening socket of its predecessor here instead of binding a new one.
+    if (mode == MODE_PREFORK && (inherited = supervisor_init(argv, &server_fd)) == -1) {
+        perror("error: supervisor initialization failed, aborting...");
+        return EXIT_FAILURE;
+    }
+
+    //* Start the asynchronous logger
+    //- The per-message output of every engine goes through common/log.h: the hot path only copies a binary record into a
+    //- per-thread ring, a background thread formats and prints it. LOG_LEVEL and LOG_SAMPLE tune the output.
+    if (log_init() == -1) {
+        perror("error: log writer creation failed, aborting...");
+        return EXIT_FAILURE;
+    }
+
+    //* Start the metrics endpoint
+    //- Every engine counts connections, bytes, messages and errors and records its service time into a per-thread
+    //- shard. The totals are served on a Unix socket, e.g. socat - UNIX-CONNECT:/tmp/multi_tcp_echo_server.metrics.sock
+    if (metrics_init(METRICS_SOCKET_FILE) == -1)
+        perror("error: metrics endpoint creation failed, continuing without it");
+
+    //- An inherited listener is bound already. The tuning of the new binary still applies: accepted sockets copy the
+    //- options at accept() time, and listen() on a listening socket only updates the backlog.
+    if (inherited) {
+        tuning_apply(&tuning, server_fd);
+        listen(server_fd, tuning.backlog);
+        printf("server listening on %s:%d (listener inherited from the previous binary)\n", tuning.ip, tuning.port);
+    } else if ((server_fd = create_listener(mode == MODE_REUSEPORT)) == -1) {
+        return EXIT_FAILURE;
+    } else {
+        printf("server listening on %s:%d\n", tuning.ip, tuning.port);
+    }
+    tuning_print(&tuning, server_fd, stdout);
+
+    //* Open the capture trace
+    //- Every engine appends a record for every accept, receive, send and close to the mapped trace file, without a
+    //- syscall per record. The mapping is shared with the forked children, the worker threads and the prefork workers.
+    //- The new binary of a hot restart continues the trace of its predecessor, whose workers still drain into it.
+    if (capture != NULL) {
+        if (trace_init(capture, inherited) == -1) {
+            perror("error: capture file creation failed, aborting...");
+            close(server_fd);
+            return EXIT_FAILURE;
+        }
+        printf("capture: recording every connection into %s\n", capture);
+    }
+
+    //* Serve the connections with the selected engine
+    //- The io_uring fallback is decided first, so that the epoll loop that takes over gets every feature of its own.
+    if (mode == MODE_URING && !uring_supported()) {
+        printf("io_uring is not available, falling back to epoll\n");
+        mode = MODE_EPOLL;
+    }
+
+    //- MSG_ZEROCOPY needs buffers that outlive the send, only the reactor engines keep a pool of them.
+    if (zerocopy && (mode == MODE_FORK || mode == MODE_URING || mode == MODE_POOL)) {
+        printf("zerocopy is only supported by the epoll, reuseport and prefork modes, sending with copies\n");
+        zerocopy = 0;
+    }
+    if (!zerocopy)
+        zerocopy_threshold = 0;
+    else
+        printf("zerocopy: MSG_ZEROCOPY for echoes of at least %ld bytes\n", zerocopy_threshold);
+
+    //- Spinning needs a wait the engine makes itself: io_uring waits in the kernel, the pool workers wake each other.
+    if (tuning.spin > 0 && (mode == MODE_URING || mode == MODE_POOL)) {
+        printf("busy polling is only supported by the epoll, reuseport, prefork and fork modes, blocking at once\n");
+        tuning.spin = 0;
+    }
+    if (tuning.spin > 0)
+        printf("busy poll: spinning up to %d us before every blocking wait\n", tuning.spin);
+
+    //- Quick ACK mode has to be re-armed with a setsockopt() after every receive, io_uring receives without a syscall.
+    if (tuning.quickack && mode == MODE_URING) {
+        printf("quickack is not supported by the uring mode, ACKs are delayed as usual\n");
+        tuning.quickack = 0;
+    }
+
+    //- The event loops echo every read with one send() already, and they never block in a receive a cork could be
+    //- held over. The fork mode echoes message by message, it batches the echoes of a read (see common/replybatch.h).
+    if (tuning.cork > 0 && mode != MODE_FORK) {
+        printf("cork is only supported by the fork mode, the event loops send every read at once\n");
+        tuning.cork = 0;
+    }
+    if (tuning.cork > 0)
+        printf("cork: the echoes of reads are merged while more input is waiting, for up to %d us\n", tuning.cork);
+
+    //- The reactors keep the deadlines in a timing wheel, the fork mode in the receive and send timeouts of its socket.
+    //- io_uring and the pool workers have no wait of their own that a deadline could end.
+    if ((tuning.idle_timeout > 0 || tuning.read_timeout > 0 || tuning.write_timeout > 0) && (mode == MODE_URING || mode == MODE_POOL)) {
+        printf("timeouts are only supported by the epoll, reuseport, prefork and fork modes, connections stay open\n");
+        tuning.idle_timeout = tuning.read_timeout = tuning.write_timeout = 0;
+    }
+    printf("timeouts: idle %d s, read %d s, write %d s (0: none)\n", tuning.idle_timeout, tuning.read_timeout, tuning.write_timeout);
+
+    //* Set up the connection limits
+    //- Every engine resets a connection over the per-source rate or the connection limit as soon as it is accepted
+    //- (see common/ratelimit.h). The count is shared with the forked children and prefork workers.
+    if (admission_init(tuning.max_connections) == -1) {
+        perror("error: connection limit allocation failed, aborting...");
+        close(server_fd);
+        return EXIT_FAILURE;
+    }
+    if (tuning.rate_limit > 0)
+        printf("rate limit: %d connections per second and source, bursts of %d\n", tuning.rate_limit,
+               tuning.rate_burst > 0 ? tuning.rate_burst : tuning.rate_limit);
+    printf("connection limit: %d open connections (0: none)\n", tuning.max_connections);
+
+    if (mode == MODE_FORK) {
+        printf("mode: fork (one process per connection)\n");
+        return run_fork_mode(server_fd);
+    }
+    if (mode == MODE_REUSEPORT)
+        return run_reuseport_mode(server_fd, threads, zerocopy_threshold);
+    if (mode == MODE_POOL)
+        return run_pool_mode(server_fd, threads);
+    if (mode == MODE_PREFORK)
+        return run_prefork_mode(server_fd, threads, zerocopy_threshold);
+    if (mode == MODE_URING) {
+        struct ratelimit limit;
+
+        printf("mode: uring (multishot accept/recv, provided buffers)\n");
+        if (tuning.rate_limit > 0 && ratelimit_init(&limit, tuning.rate_limit, tuning.rate_burst) == -1) {
+            perror("error: rate limiter allocation failed, aborting...");
+            close(server_fd);
+            return EXIT_FAILURE;
+        }
+        raise_fd_limit();
+        uring_serve(server_fd, tuning.buffer_size, 0, tuning.rate_limit > 0 ? &limit : NULL);
+        close(server_fd);
+        return EXIT_FAILURE;
+    }
+    printf("mode: epoll (edge-triggered event loop)\n");
+    return run_epoll_mode(server_fd, zerocopy_threshold);
+}
+
+//* Create, bind and listen on a server socket
+//? Returns the socket file descriptor, or -1 on failure.
+int create_listener(int reuseport) {
+    int server_fd;                   //- Define a file descriptor for the server socket
+    struct sockaddr_in source_addr;  //- Define a struct for the server address
+
     //* Create a socket for the server
     //- The socket() syscall creates a new socket and returns a file descriptor that refers to that socket.
     //- The 1st argument, PF_INET, specifies the address family of the socket.
@@ -41,7 +312,7 @@ int main(void) {
     //? If the socket() syscall fails, it returns -1.
     if ((server_fd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) == -1) {
         perror("error: socket creation failed, aborting...");
-        return EXIT_FAILURE;
+        return -1;
     }
 
     //* Set the socket option
@@ -54,17 +325,32 @@ int main(void) {
     //? If the setsockopt() syscall fails, it returns -1.
     if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) == -1) {
         perror("error: socket option failed, aborting...");
-        return EXIT_FAILURE;
+        close(server_fd);
+        return -1;
+    }
+
+    //* Share the port between several listening sockets
+    //- With SO_REUSEPORT every socket that sets the option before bind() joins the same port group and the kernel
+    //- load-balances incoming connections across the group by a hash of the 4-tuple, so each socket has its own accept
+    //- queue and no lock is shared between the listeners.
+    if (reuseport && setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int)) == -1) {
+        perror("error: socket option failed, aborting...");
+        close(server_fd);
+        return -1;
     }
 
+    //* Apply the tuning profile
+    //- The socket buffers must be sized before listen(), the accepted sockets copy every option of the listener.
+    tuning_apply(&tuning, server_fd);
+
     //* Set the source server address
     //- The memset() function fills the source_addr struct with zeros.
     //- The sin_addr.s_addr field of the source_addr struct is set to the IP address of the server.
     //- The sin_port field of the source_addr struct is set to the port number of the server.
     //- The sin_family field will be set to PF_INET, which specifies the address family of the socket.
     memset(&source_addr, 0, sizeof source_addr);
-    source_addr.sin_addr.s_addr = inet_addr(SERVER_IP);
-    source_addr.sin_port = htons(SERVER_PORT);
+    source_addr.sin_addr.s_addr = inet_addr(tuning.ip);
+    source_addr.sin_port = htons(tuning.port);
     source_addr.sin_family = PF_INET;
 
     //* Bind the server address to the server socket
@@ -77,23 +363,281 @@ int main(void) {
         if (errno == EADDRINUSE) {
             printf("error: socket binding failed, address already in use, aborting...\n");
             close(server_fd);
-            return EXIT_FAILURE;
+            return -1;
         } else {
             perror("error: socket binding failed, aborting...");
             close(server_fd);
-            return EXIT_FAILURE;
+            return -1;
         }
     }
-    printf("server listening on %s:%d\n", SERVER_IP, SERVER_PORT);
-
     //* Listen for incoming connections
     //- The listen() syscall listens for incoming connections on the server socket.
     //- The 1st argument, server_fd, specifies the file descriptor of the server socket.
-    //- The 2nd argument, BACKLOG, specifies the maximum number of pending connections that the server will allow.
+    //- The 2nd argument, tuning.backlog, specifies the maximum number of pending connections that the server will allow.
     //? If the listen() syscall fails, it returns -1.
-    if ((listen(server_fd, BACKLOG)) == -1) {
+    if ((listen(server_fd, tuning.backlog)) == -1) {
         perror("error: socket listening failed, aborting...");
         close(server_fd);
+        return -1;
+    }
+
+    return server_fd;
+}
+
+//* Apply a tuning command line option: a profile (-p), a configuration file (-c) or one setting (-o)
+//? Returns -1 after printing the error.
+int parse_tuning(int opt, const char* arg) {
+    if (opt == 'c' && tuning_load(&tuning, arg) == -1) {
+        if (errno != EINVAL)
+            perror("error: reading the configuration file failed, aborting...");
+        return -1;
+    }
+    if (opt == 'p' && tuning_profile(&tuning, arg) == -1) {
+        fprintf(stderr, "error: unknown tuning profile '%s'\n", arg);
+        return -1;
+    }
+    if (opt == 'o' && tuning_option(&tuning, arg) == -1) {
+        fprintf(stderr, "error: invalid tuning option '%s'\n", arg);
+        return -1;
+    }
+    return 0;
+}
+
+//* Serve connections from a single process with the epoll reactor
+//- Every connection only costs a struct reactor_conn instead of a whole process, so the limit is the number of open files.
+int run_epoll_mode(int server_fd, size_t zerocopy) {
+    struct reactor reactor;
+
+    raise_fd_limit();
+    if (start_reactor(&reactor, server_fd, zerocopy, 0) == -1) {
+        perror("error: event loop initialization failed, aborting...");
+        close(server_fd);
+        return EXIT_FAILURE;
+    }
+    reactor_run(&reactor);
+    reactor_destroy(&reactor);
+    close(server_fd);
+    return EXIT_FAILURE;
+}
+
+//* Serve connections with one pinned epoll worker per CPU
+//- Every worker gets its own SO_REUSEPORT listener, so the kernel spreads new connections over the workers and each
+//- connection stays on the worker (and CPU) that accepted it for its whole life. server_fd becomes the listener of
+//- worker 0, the other listeners are created here so that a bind error is reported before any thread starts.
+int run_reuseport_mode(int server_fd, long threads, size_t zerocopy) {
+    cpu_set_t available;
+    int cpus[CPU_SETSIZE];
+    int cpu_count = 0;
+    struct worker* workers;
+
+    //* Collect the CPUs this process may run on
+    //- sched_getaffinity() honors taskset/cgroup restrictions, unlike the number of online CPUs.
+    CPU_ZERO(&available);
+    if (sched_getaffinity(0, sizeof available, &available) == -1) {
+        perror("error: reading the CPU affinity failed, aborting...");
+        close(server_fd);
+        return EXIT_FAILURE;
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &available))
+            cpus[cpu_count++] = cpu;
+    }
+    if (threads == 0)
+        threads = cpu_count;
+
+    if ((workers = calloc(threads, sizeof *workers)) == NULL) {
+        perror("error: worker allocation failed, aborting...");
+        close(server_fd);
+        return EXIT_FAILURE;
+    }
+
+    raise_fd_limit();
+    printf("mode: reuseport (%ld workers on %d CPUs)\n", threads, cpu_count);
+
+    for (long i = 0; i < threads; i++) {
+        workers[i].cpu = cpus[i % cpu_count];
+        workers[i].zerocopy = zerocopy;
+        if ((workers[i].listen_fd = i == 0 ? server_fd : create_listener(1)) == -1)
+            return EXIT_FAILURE;
+
+        //- SO_INCOMING_CPU lets the kernel prefer the listener of the CPU that processed the incoming packet,
+        //- it is a hint only and the port group still works without it.
+        setsockopt(workers[i].listen_fd, SOL_SOCKET, SO_INCOMING_CPU, &workers[i].cpu, sizeof(int));
+    }
+
+    //* Start the pinned workers
+    //- The affinity is set in the thread attributes, so the worker allocates its memory on its own CPU from the start.
+    for (long i = 0; i < threads; i++) {
+        pthread_attr_t attr;
+        cpu_set_t cpu_set;
+
+        CPU_ZERO(&cpu_set);
+        CPU_SET(workers[i].cpu, &cpu_set);
+        pthread_attr_init(&attr);
+        pthread_attr_setaffinity_np(&attr, sizeof cpu_set, &cpu_set);
+        if ((errno = pthread_create(&workers[i].thread, &attr, worker_main, &workers[i])) != 0) {
+            perror("error: worker creation failed, aborting...");
+            return EXIT_FAILURE;
+        }
+        pthread_attr_destroy(&attr);
+    }
+
+    for (long i = 0; i < threads; i++) pthread_join(workers[i].thread, NULL);
+    free(workers);
+    return EXIT_FAILURE;
+}
+
+//* Serve connections with a pre-spawned pool of work-stealing threads
+//- The threads exist before the first client connects, so a new connection costs an accept4() and an epoll_ctl()
+//- instead of a fork() and the exit and reaping of a process. Connections are spread over the workers in turn, and a
+//- worker with an empty run queue takes turns of the connections waiting on the others, so a few heavy clients do
+//- not pin one core while the rest idle. Unlike reuseport, connections are not pinned to a CPU.
+int run_pool_mode(int server_fd, long threads) {
+    struct ratelimit limit;
+
+    if (threads == 0)
+        threads = available_cpus();
+    if (tuning.rate_limit > 0 && ratelimit_init(&limit, tuning.rate_limit, tuning.rate_burst) == -1) {
+        perror("error: rate limiter allocation failed, aborting...");
+        close(server_fd);
+        return EXIT_FAILURE;
+    }
+    raise_fd_limit();
+    printf("mode: pool (%ld workers, work stealing)\n", threads);
+    workpool_serve(server_fd, threads, tuning.rate_limit > 0 ? &limit : NULL, tuning.quickack);
+    perror("error: worker pool failed, aborting...");
+    close(server_fd);
+    return EXIT_FAILURE;
+}
+
+//* Serve connections with a supervisor and a fixed set of worker processes
+//- Every worker runs its own epoll reactor on the inherited listening socket, registered with EPOLLEXCLUSIVE so that a
+//- new connection wakes one worker instead of all of them. The supervisor respawns workers that die and hot-restarts
+//- the server on SIGHUP without closing the listener (see common/supervisor.h).
+int run_prefork_mode(int server_fd, long workers, size_t zerocopy) {
+    if (workers == 0)
+        workers = available_cpus();
+    raise_fd_limit();
+    printf("mode: prefork (%ld worker processes, SIGHUP for a hot restart)\n", workers);
+    if (supervisor_run(server_fd, workers, prefork_worker, &zerocopy) == -1) {
+        perror("error: supervisor failed, aborting...");
+        close(server_fd);
+        return EXIT_FAILURE;
+    }
+    close(server_fd);
+    return EXIT_SUCCESS;
+}
+
+//* Prefork worker process entry point
+//- SIGQUIT (blocked by the supervisor) is only let through while the reactor waits in epoll_pwait(), it makes the
+//- worker stop accepting and exit once its last connection is closed.
+int prefork_worker(int listen_fd, void* arg) {
+    struct reactor reactor;
+    struct sigaction sa;
+    sigset_t wait_mask;
+
+    if (start_reactor(&reactor, listen_fd, *(size_t*)arg, REACTOR_EXCLUSIVE) == -1) {
+        perror("error: event loop initialization failed");
+        return EXIT_FAILURE;
+    }
+    draining_reactor = &reactor;
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = drain_handler;
+    sigaction(SIGQUIT, &sa, NULL);
+    sigprocmask(SIG_BLOCK, NULL, &wait_mask);
+    sigdelset(&wait_mask, SIGQUIT);
+    reactor.wait_mask = &wait_mask;
+
+    printf("worker %d accepting\n", getpid());
+    fflush(stdout);
+    if (reactor_run(&reactor) == -1)
+        return EXIT_FAILURE;
+    printf("worker %d drained, exiting\n", getpid());
+    reactor_destroy(&reactor);
+    return EXIT_SUCCESS;
+}
+
+void drain_handler(int sig) {
+    (void)sig;
+    draining_reactor->draining = 1;
+}
+
+//* Worker thread entry point
+//- Runs a private reactor on the worker listener. It only returns if the event loop fails.
+void* worker_main(void* arg) {
+    struct worker* worker = arg;
+    struct reactor reactor;
+
+    if (start_reactor(&reactor, worker->listen_fd, worker->zerocopy, 0) == -1) {
+        perror("error: event loop initialization failed");
+        return NULL;
+    }
+    printf("worker listening on CPU %d\n", worker->cpu);
+    reactor_run(&reactor);
+    reactor_destroy(&reactor);
+    return NULL;
+}
+
+//* Create a reactor, in zerocopy mode if zerocopy (the threshold) is not 0, with the spin budget, quick ACKs and timeouts of the tuning
+//- A rate limit gives the reactor its own table of sources.
+//? Returns -1 on failure, errno is set.
+int start_reactor(struct reactor* reactor, int listen_fd, size_t zerocopy, int flags) {
+    if (reactor_init(reactor, listen_fd, tuning.buffer_size, flags) == -1)
+        return -1;
+    reactor->spin = (uint64_t)tuning.spin * 1000;
+    reactor->quickack = tuning.quickack;
+    reactor->idle_timeout = (uint64_t)tuning.idle_timeout * 1000;
+    reactor->read_timeout = (uint64_t)tuning.read_timeout * 1000;
+    reactor->write_timeout = (uint64_t)tuning.write_timeout * 1000;
+    if ((zerocopy > 0 && reactor_enable_zerocopy(reactor, zerocopy) == -1) ||
+        (tuning.rate_limit > 0 && reactor_limit_rate(reactor, tuning.rate_limit, tuning.rate_burst) == -1)) {
+        reactor_destroy(reactor);
+        return -1;
+    }
+    return 0;
+}
+
+//* Number of CPUs the process may run on
+//- sched_getaffinity() honors taskset/cgroup restrictions, unlike the number of online CPUs.
+long available_cpus(void) {
+    cpu_set_t available;
+
+    CPU_ZERO(&available);
+    return sched_getaffinity(0, sizeof available, &available) == 0 ? CPU_COUNT(&available) : 1;
+}
+
+//* Serve connections by forking a child process for each one (legacy mode)
+int run_fork_mode(int server_fd) {
+    int client_fd;                                 //- Define a file descriptor for the client socket
+    struct sockaddr_in client_addr;                //- Define a struct for the client address
+    char* buffer;                                  //- Define a buffer to store the received message
+    ssize_t bytes_received;                        //- Define a variable to store the size of the received message
+    struct frame_parser parser;                    //- Define the message parser state of the connection
+    struct frame_chunk chunk;                      //- Define a variable to store the current message chunk
+    int status;                                    //- Define a variable to store the parser result
+    struct sigaction sa;                           //- Define a struct for the SIGCHLD disposition
+    uint64_t spin = (uint64_t)tuning.spin * 1000;  //- Define the busy-polling budget of a receive in nanoseconds
+    int receive_timeout;                           //- Define the receive timeout set on the client socket in seconds
+    struct ratelimit limit;                        //- Define the per-source connection rate limit of the accept loop
+    struct reply_batch batch;                      //- Define the echoes of the current read, sent together
+    uint32_t connection;                           //- Define the capture trace id of the connection (0: not captured)
+
+    //* Let the kernel reap the finished children
+    //- A child that exits stays a zombie until its parent collects its exit status with waitpid(). Ignoring SIGCHLD
+    //- with SA_NOCLDWAIT tells the kernel that nobody will: children are freed as soon as they exit, and no handler
+    //- interrupts accept().
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = SIG_IGN;
+    sa.sa_flags = SA_NOCLDWAIT;
+    sigaction(SIGCHLD, &sa, NULL);
+
+    //- Allocated once, every child gets its own copy with fork().
+    if ((buffer = malloc(tuning.buffer_size)) == NULL) {
+        perror("error: buffer allocation failed, aborting...");
+        return EXIT_FAILURE;
+    }
+    if (tuning.rate_limit > 0 && ratelimit_init(&limit, tuning.rate_limit, tuning.rate_burst) == -1) {
+        perror("error: rate limiter allocation failed, aborting...");
         return EXIT_FAILURE;
     }
 
@@ -111,6 +655,13 @@ int main(void) {
             return EXIT_FAILURE;
         }
 
+        //* Admit the connection
+        //- A source over its connection rate, or a client beyond the connection limit, is reset before a child is
+        //- forked for it. The parent only ever sees the accept: an admitted child gives its slot back when it exits.
+        if (!admission_accept(tuning.rate_limit > 0 ? &limit : NULL, client_fd, client_addr.sin_addr.s_addr))
+            continue;
+        metrics_add(METRICS_ACCEPTED, 1);
+
         //* Fork the process to handle multiple connections
         pid_t pid = fork();
 
@@ -120,48 +671,122 @@ int main(void) {
         if (pid == -1) {
             perror("error: fork failed, aborting...");
             close(client_fd);
+            admission_leave();
             return EXIT_FAILURE;
         } else if (pid == 0) {  //- In the child process
             //* Close the server socket in the child process
             //- If the server socket is not closed in the child process, the server will not be able to accept new connections.
+            //- Every way out of the child ends in exit(), the exit handler returns the connection slot (a child killed
+            //- by SIGKILL keeps it).
             close(server_fd);
+            atexit(admission_leave);
+            connection = trace_open();
+
+            //* Bound the blocking calls of the child
+            //- Without a deadline a client that goes silent keeps its child blocked in recv() forever. SO_SNDTIMEO
+            //- bounds every send by the write timeout, SO_RCVTIMEO every receive: by the idle timeout between
+            //- messages and by the read timeout inside one. It is only set again when the connection moves between
+            //- the two, a client that sends whole messages costs no extra syscall. A call that times out fails with
+            //- EAGAIN. The child has the only timer of its connection, so no timing wheel is needed here.
+            if (setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &(struct timeval){.tv_sec = tuning.write_timeout}, sizeof(struct timeval)) == -1)
+                perror("error: SO_SNDTIMEO failed, continuing without a write timeout");
+            receive_timeout = tuning.idle_timeout;
+            if (setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &(struct timeval){.tv_sec = receive_timeout}, sizeof(struct timeval)) == -1)
+                perror("error: SO_RCVTIMEO failed, continuing without an idle timeout");
 
             //* Receive messages from the client
-            //- The recv() syscall receives messages from the client.
+            //- The recv() syscall receives messages from the client. busypoll_recvfrom() calls it, after spinning with
+            //- non-blocking calls for the spin budget of the tuning (see common/busypoll.h).
             //- The 1st argument, client_fd, specifies the file descriptor of the client socket.
             //- The 2nd argument, buffer, specifies the buffer to store the received message.
-            //- The 3rd argument, BUFFER_SIZE, specifies the size of the buffer.
+            //- The 3rd argument, tuning.buffer_size, specifies the size of the buffer.
             //- The 4th argument, specifies the flags. 0 is standard mode for recv() syscall.
-            printf("  new connection from %s:%d\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
-            while ((bytes_received = recv(client_fd, buffer, BUFFER_SIZE, 0)) > 0) {
-                buffer[bytes_received] = '\0';  //- Add a null terminator to the end of the message.
-                printf("received message from %s:%d (%4ld byte): %s\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port), bytes_received,
-                       buffer);
-
-                //* Echo the message back to the client
-                //- The send() syscall sends the message back to the client.
-                //- The 1st argument, client_fd, specifies the file descriptor of the client socket.
-                //- The 2nd argument, buffer, specifies the buffer containing the message.
-                //- The 3rd argument, strlen(buffer), specifies the size of the message.
-                //- The 4th argument, 0, specifies the flags. 0 is standard mode for send() syscall.
-                if ((send(client_fd, buffer, strlen(buffer), 0)) == -1) {
-                    perror("error: socket sending failed, aborting...");
+            //- A recv() may return part of a message or several messages, the frame parser splits the bytes into
+            //- messages (see common/frame.h). It does not copy anything, every chunk points into buffer.
+            log_info("  new connection from %a:%u", client_addr.sin_addr.s_addr, ntohs(client_addr.sin_port));
+            frame_parser_init(&parser);
+            reply_batch_init(&batch, client_fd, tuning.cork, connection);
+            while ((bytes_received = busypoll_recvfrom(client_fd, buffer, tuning.buffer_size, NULL, NULL, spin)) > 0) {
+                uint64_t start = metrics_now();
+                const char* data = buffer;
+                size_t len = bytes_received;
+
+                if (tuning.quickack)
+                    tuning_quickack(client_fd);
+                metrics_add(METRICS_BYTES_RECEIVED, bytes_received);
+                trace_record(connection, TRACE_IN, buffer, bytes_received);
+                while ((status = frame_parse(&parser, &data, &len, &chunk)) == 1) {
+                    if (chunk.offset == 0) {
+                        metrics_add(METRICS_MESSAGES, 1);
+                        log_info_data(chunk.data, chunk.len, "received message from %a:%u (%4u byte): %s", client_addr.sin_addr.s_addr,
+                                      ntohs(client_addr.sin_port), chunk.length);
+                    }
+
+                    //* Queue the echo of the message
+                    //- reply_batch_add() collects the header and the payload chunk, the echoes of the whole read
+                    //- leave together below. The rest of a message that was split over several reads follows as it
+                    //- arrives.
+                    if (reply_batch_add(&batch, &chunk) == -1)
+                        break;
+                    if (chunk.offset == 0)
+                        log_info_data(chunk.data, chunk.len, "     reply message to %a:%u (%4u byte): %s", client_addr.sin_addr.s_addr,
+                                      ntohs(client_addr.sin_port), chunk.length);
+                }
+
+                //* Send the echoes of the read
+                //- One sendmsg() for every message of the read (see common/replybatch.h), the messages before an
+                //- invalid one included. Status 1 means a batch that filled up could not be sent.
+                if (status == 1 || reply_batch_flush(&batch) == -1) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        log_info("client %a:%u did not read its echoes in time, closing the connection", client_addr.sin_addr.s_addr,
+                                 ntohs(client_addr.sin_port));
+                        metrics_add(METRICS_WRITE_TIMEOUTS, 1);
+                    } else {
+                        log_error("error: socket sending failed, aborting...: %e", errno);
+                        metrics_add(METRICS_ERRORS, 1);
+                    }
+                    metrics_add(METRICS_CLOSED, 1);
+                    close(client_fd);
+                    trace_close(connection);
+                    return EXIT_FAILURE;
+                }
+                metrics_record_service(start);
+                if (status == -1) {
+                    log_error("error: invalid message from client, closing the connection: %e", errno);
+                    metrics_add(METRICS_ERRORS, 1);
+                    metrics_add(METRICS_CLOSED, 1);
                     close(client_fd);
+                    trace_close(connection);
                     return EXIT_FAILURE;
                 }
-                printf("     reply message to %s:%d (%4ld byte): %s\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port), bytes_received,
-                       buffer);
+                if ((parser.header_len > 0 ? tuning.read_timeout : tuning.idle_timeout) != receive_timeout) {
+                    receive_timeout = parser.header_len > 0 ? tuning.read_timeout : tuning.idle_timeout;
+                    setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &(struct timeval){.tv_sec = receive_timeout}, sizeof(struct timeval));
+                }
+
+                //- With a cork delay the tail of the echoes waits for the next read, if it comes within the delay.
+                reply_batch_hold(&batch);
             }
 
             //- If the bytes_received is 0, the client disconnected.
             if (bytes_received == 0) {
-                printf("client %s:%d disconnected\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
+                log_info("client %a:%u disconnected", client_addr.sin_addr.s_addr, ntohs(client_addr.sin_port));
+            } else if ((errno == EAGAIN || errno == EWOULDBLOCK) && parser.header_len > 0) {
+                log_info("client %a:%u did not complete its message in time, closing the connection", client_addr.sin_addr.s_addr,
+                         ntohs(client_addr.sin_port));
+                metrics_add(METRICS_READ_TIMEOUTS, 1);
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                log_info("client %a:%u idle for too long, closing the connection", client_addr.sin_addr.s_addr, ntohs(client_addr.sin_port));
+                metrics_add(METRICS_IDLE_TIMEOUTS, 1);
             } else {
-                perror("error: socket receiving failed, aborting...");
+                log_error("error: socket receiving failed, aborting...: %e", errno);
+                metrics_add(METRICS_ERRORS, 1);
             }
 
             //* Close the client socket
             close(client_fd);
+            metrics_add(METRICS_CLOSED, 1);
+            trace_close(connection);
             return EXIT_SUCCESS;
         }
 
@@ -185,4 +810,28 @@ void sig_handler(int sig) {
         default:
             break;
     }
+}
+
+void usage(const char* prog) {
+    printf("usage: %s [-m epoll|uring|reuseport|pool|prefork|fork] [-t threads] [-z [-Z bytes]] [-p profile] [-c file] [-o key=value]\n"
+           "       [-C file]\n",
+           prog);
+    printf("  -m, --mode MODE     connection handling engine (default: epoll)\n");
+    printf("                      epoll:     single process, edge-triggered epoll event loop\n");
+    printf("                      uring:     single process, io_uring (falls back to epoll if unsupported)\n");
+    printf("                      reuseport: one pinned epoll worker thread per CPU, each with its own listener\n");
+    printf("                      pool:      pre-spawned worker threads with per-worker run queues and work stealing\n");
+    printf("                      prefork:   supervisor with epoll worker processes, respawn and SIGHUP hot restart\n");
+    printf("                      fork:      one child process per connection (legacy)\n");
+    printf("  -t, --threads N     number of reuseport, pool or prefork workers (default: one per available CPU)\n");
+    printf("  -z, --zerocopy      send large echoes with MSG_ZEROCOPY (epoll, reuseport and prefork modes)\n");
+    printf("  -Z, --zerocopy-threshold N\n");
+    printf("                      minimum echo size in bytes for MSG_ZEROCOPY, smaller ones are copied (default: %d)\n",
+           ZEROCOPY_THRESHOLD);
+    printf("  -p, --profile NAME  socket tuning profile: default, latency, throughput or many-connections\n");
+    printf("  -c, --config FILE   read tuning settings from FILE, one \"key = value\" per line\n");
+    printf("  -o, --option K=V    change one tuning setting: ip, port, backlog, rcvbuf, sndbuf, nodelay, quickack,\n");
+    printf("                      defer_accept, busy_poll, prefer_busy_poll, spin, cork, buffer_size, idle_timeout,\n");
+    printf("                      read_timeout, write_timeout, rate_limit, rate_burst or max_connections\n");
+    printf("  -C, --capture FILE  record every connection into the trace FILE for a client replay\n");
 }
\ No newline at end of file
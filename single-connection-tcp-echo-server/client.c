@@ -1,4 +1,5 @@
 #include <arpa/inet.h>
+#include <getopt.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <stdio.h>
@@ -8,15 +9,71 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "frame.h"
+#include "pipeline.h"
+#include "replay.h"
+
 #define BUFFER_SIZE 1024       //- Message buffer size
 #define SERVER_IP "127.0.0.1"  //- Server IP address
 #define SERVER_PORT 8080       //- Server port number
 
-int main(void) {
+void usage(const char* prog);
+int run_pipeline_mode(int sock_fd, unsigned window);
+int run_replay_mode(const char* path, double speed);
+int parse_positive(const char* arg, const char* name, double* value);
+
+int main(int argc, char* argv[]) {
     int sock_fd;                     //- Define a file descriptor for the client socket
     struct sockaddr_in server_addr;  //- Define a struct for the server address
     char buffer[BUFFER_SIZE];        //- Define a buffer to store the received message
-    ssize_t bytes_received;          //- Define a variable to store the size of the received message
+    size_t reply_len;                //- Define a variable to store the size of the received message
+    int status;                      //- Define a variable to store the result of frame_read()
+    unsigned window = 0;             //- Define the pipeline window (0: lockstep)
+    int opt;                         //- Define a variable to store the current command line option
+    double value;                    //- Define a variable to store a parsed numeric option
+    const char* replay = NULL;       //- Define the trace file to replay (NULL: interactive)
+    double speed = 1;                //- Define the replay timeline scale
+
+    static const struct option long_options[] = {
+        {"window", required_argument, NULL, 'w'},
+        {"replay", required_argument, NULL, 'R'},
+        {"speed", required_argument, NULL, 'x'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+
+    //* Parse the command line options
+    //- Without options the client sends a line and waits for its echo before it reads the next one. -w, --window
+    //- keeps several lines in flight instead (see common/pipeline.h). -R, --replay sends a trace the server captured
+    //- instead of stdin, at the rate -x, --speed scales (see common/replay.h).
+    while ((opt = getopt_long(argc, argv, "w:R:x:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'w':
+                if (parse_positive(optarg, "window", &value) == -1)
+                    return EXIT_FAILURE;
+                if (value > PIPELINE_WINDOW_MAX) {
+                    fprintf(stderr, "error: window %s exceeds %d\n", optarg, PIPELINE_WINDOW_MAX);
+                    return EXIT_FAILURE;
+                }
+                window = (unsigned)value;
+                break;
+            case 'R':
+                replay = optarg;
+                break;
+            case 'x':
+                if (parse_positive(optarg, "speed", &speed) == -1)
+                    return EXIT_FAILURE;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (replay != NULL)
+        return run_replay_mode(replay, speed);
 
     //* Create a socket for the client
     //- The socket() syscall creates a new socket and returns a file descriptor that refers to that socket.
@@ -50,6 +107,8 @@ int main(void) {
         close(sock_fd);
         return EXIT_FAILURE;
     }
+    if (window > 0)
+        return run_pipeline_mode(sock_fd, window);
 
     //* while loop to send and receive messages from the server
     while (1) {
@@ -75,30 +134,100 @@ int main(void) {
             continue;  //- Skip empty messages
 
         //* Send the message to the server
-        //- The send() syscall sends the message to the server socket.
-        //- The 1st argument, client_fd, specifies the file descriptor of the client socket.
+        //- frame_write() puts the 4-byte length header in front of the message (see common/frame.h) and sends both
+        //- with one writev() syscall.
+        //- The 1st argument, sock_fd, specifies the file descriptor of the client socket.
         //- The 2nd argument, buffer, specifies the message to be sent.
         //- The 3rd argument, strlen(buffer), specifies the size of the message.
-        //? If the send() syscall fails, it returns -1.
-        if ((send(sock_fd, buffer, strlen(buffer), 0)) == -1) {
-            perror("error: socket sending failed, aborting...");
+        //? If the writev() syscall fails, it returns -1.
+        if (frame_write(sock_fd, buffer, strlen(buffer)) == -1) {
+            perror("error: message sending failed, aborting...");
+            close(sock_fd);
             return EXIT_FAILURE;
         }
 
-        //* Receive messages from the server
-        //- The recv() syscall receives messages from the server.
-        //- The 1st argument, client_fd, specifies the file descriptor of the client socket.
-        //- The 2nd argument, buffer, specifies the buffer to store the received message.
-        //- The 3rd argument, BUFFER_SIZE, specifies the size of the buffer.
-        //- The 4th argument, 0, specifies the flags. 0 is the standard mode for the recv() syscall.
-        //? If the recv() syscall fails, it returns -1.
-        if ((bytes_received = recv(sock_fd, buffer, BUFFER_SIZE, 0)) > 0) {
-            buffer[bytes_received] = '\0';
-            printf("server> %s\n", buffer);
+        //* Receive the echoed message from the server
+        //- frame_read() reads the length header first and then exactly that many payload bytes, so the reply is
+        //- complete even if it arrives in several pieces.
+        //? It returns 0 if the server closed the connection and -1 if the reply could not be read.
+        if ((status = frame_read(sock_fd, buffer, BUFFER_SIZE, &reply_len)) <= 0) {
+            if (status == 0)
+                printf("server closed the connection\n");
+            else
+                perror("error: message receiving failed, aborting...");
+            close(sock_fd);
+            return status == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
         }
+        printf("server> %.*s\n", (int)reply_len, buffer);
     }
 
     //* Close the client socket
     close(sock_fd);
     return EXIT_SUCCESS;
 }
+
+//* Send stdin pipelined and print the echoes
+//- Up to window messages are in flight at a time, see common/pipeline.h. The report goes to stderr, so the echoes can
+//- be redirected on their own.
+int run_pipeline_mode(int sock_fd, unsigned window) {
+    struct pipeline* pipeline;
+    int status;
+
+    //- The pipeline embeds its input and receive buffers (128 KB), keep it off the stack.
+    if ((pipeline = malloc(sizeof *pipeline)) == NULL || pipeline_init(pipeline, sock_fd, window) == -1) {
+        perror("error: pipeline setup failed, aborting...");
+        free(pipeline);
+        close(sock_fd);
+        return EXIT_FAILURE;
+    }
+    if ((status = pipeline_run(pipeline, STDIN_FILENO, stdout)) == -1)
+        perror("error: pipelined messaging failed, aborting...");
+    else if (status == 0)
+        printf("server closed the connection\n");
+    fflush(stdout);
+    pipeline_report(pipeline, stderr);
+    pipeline_free(pipeline);
+    free(pipeline);
+    close(sock_fd);
+    return status == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+//* Replay a captured trace against the server
+//- Every captured connection is opened again, the report goes to stderr like the pipeline report.
+int run_replay_mode(const char* path, double speed) {
+    struct replay_options options = {.addr_len = sizeof(struct sockaddr_in), .path = path, .speed = speed};
+    struct sockaddr_in* server_addr = (struct sockaddr_in*)&options.addr;
+    struct replay_result result;
+
+    server_addr->sin_addr.s_addr = inet_addr(SERVER_IP);
+    server_addr->sin_port = htons(SERVER_PORT);
+    server_addr->sin_family = PF_INET;
+    if (replay_run(&options, &result) == -1) {
+        perror("error: trace replay failed, aborting...");
+        return EXIT_FAILURE;
+    }
+    replay_report(&options, &result, stderr);
+    return result.errors > 0 || result.received != result.sent ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int parse_positive(const char* arg, const char* name, double* value) {
+    char* end;
+
+    *value = strtod(arg, &end);
+    if (*end != '\0' || !(*value > 0)) {
+        fprintf(stderr, "error: invalid %s '%s'\n", name, arg);
+        return -1;
+    }
+    return 0;
+}
+
+void usage(const char* prog) {
+    printf("usage: %s [-w window] [-R trace [-x speed]]\n", prog);
+    printf("  the client reads messages from stdin and prints the echoes\n");
+    printf("  -w, --window N  keep up to N messages in flight and coalesce them into one writev(), echoes are matched\n");
+    printf("                  in order and a report goes to stderr (default: one message at a time, max %d)\n", PIPELINE_WINDOW_MAX);
+    printf("  -R, --replay FILE\n");
+    printf("                  replay a trace the server captured (server -C) instead of stdin: every connection is\n");
+    printf("                  opened again and sent its input at the captured times, a report goes to stderr\n");
+    printf("  -x, --speed X   scale the replay rate, 2 replays twice as fast (default: 1)\n");
+}
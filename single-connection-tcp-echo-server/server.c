@@ -10,19 +10,108 @@
 #include <stdlib.h>
 #include <signal.h>
 #include <errno.h>
+#include <getopt.h>
 
-#define BACKLOG 3              //- If the server is busy, it will allow up to 3 pending connections (if linux, you can set it to SOMAXCONN)
-#define BUFFER_SIZE 1024       //- Message buffer size
-#define SERVER_IP "127.0.0.1"  //- Server IP address
-#define SERVER_PORT 8080       //- Server sport number
+#include "busypoll.h"
+#include "frame.h"
+#include "log.h"
+#include "metrics.h"
+#include "replybatch.h"
+#include "splice.h"
+#include "trace.h"
+#include "tuning.h"
+#include "uring.h"
+#include "zerocopy.h"
+
+#define ZEROCOPY_BUFFERS 8  //- Receive buffers the zerocopy mode rotates through (ZEROCOPY_BUFFER_SIZE each)
+
+#define METRICS_SOCKET_FILE "/tmp/single_tcp_echo_server.metrics.sock"  //- Metrics endpoint socket path (see common/metrics.h)
+
+//* Connection handling engines
+//- MODE_BLOCKING serves one client at a time with blocking recv()/send() calls.
+//- MODE_URING serves one client at a time with io_uring (see common/uring.c), replies are sent without a syscall each.
+//- MODE_SPLICE serves one client at a time with splice() through a pipe (see common/splice.h), the data stays in the kernel.
+enum server_mode { MODE_BLOCKING, MODE_URING, MODE_SPLICE };
 
 void sig_handler(int sig);
+void usage(const char* prog);
+int parse_tuning(int opt, const char* arg);
+int run_blocking_mode(int server_fd, size_t zerocopy_threshold);
+int run_splice_mode(int server_fd);
+void log_transfer(const struct sockaddr_in* client_addr, const struct transfer_stats* stats);
+int send_echo(int client_fd, struct zerocopy_buffer* buffer, size_t len, size_t threshold, uint32_t* next_id, uint32_t connection);
+void release_zerocopy(void* context, uint32_t lo, uint32_t hi);
 
-int main(void) {
-    int server_fd, client_fd;                     //- Define file descriptors for the server and client sockets
-    struct sockaddr_in source_addr, client_addr;  //- Define structs for the server and client addresses
-    char buffer[BUFFER_SIZE];                     //- Define a buffer to store the received message
-    ssize_t bytes_received;                       //- Define a variable to store the size of the received message
+static struct tuning tuning;  //- Address, socket options and buffer size (see common/tuning.h)
+
+int main(int argc, char* argv[]) {
+    int server_fd;                                 //- Define a file descriptor for the server socket
+    struct sockaddr_in source_addr;                //- Define a struct for the server address
+    enum server_mode mode = MODE_BLOCKING;         //- Define the connection handling engine
+    int zerocopy = 0;                              //- Define whether large echoes are sent with MSG_ZEROCOPY
+    long zerocopy_threshold = ZEROCOPY_THRESHOLD;  //- Define the minimum echo size for MSG_ZEROCOPY
+    const char* capture = NULL;                    //- Define the capture trace file (NULL: no capture)
+    int opt;                                       //- Define a variable to store the current command line option
+
+    static const struct option long_options[] = {
+        {"mode", required_argument, NULL, 'm'},
+        {"zerocopy", no_argument, NULL, 'z'},
+        {"zerocopy-threshold", required_argument, NULL, 'Z'},
+        {"profile", required_argument, NULL, 'p'},
+        {"config", required_argument, NULL, 'c'},
+        {"option", required_argument, NULL, 'o'},
+        {"capture", required_argument, NULL, 'C'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+
+    //* Parse the command line options
+    //- -m, --mode selects the connection handling engine: "blocking" (default), "uring" or "splice".
+    //- -z, --zerocopy sends echoes of at least --zerocopy-threshold bytes with MSG_ZEROCOPY (blocking mode).
+    //- -p, --profile, -c, --config and -o, --option set the socket tuning, in the order they are given.
+    //- -C, --capture records every connection into a trace file the client can replay (see common/trace.h).
+    tuning_init(&tuning);
+    while ((opt = getopt_long(argc, argv, "m:zZ:p:c:o:C:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'm':
+                if (strcmp(optarg, "blocking") == 0) {
+                    mode = MODE_BLOCKING;
+                } else if (strcmp(optarg, "uring") == 0) {
+                    mode = MODE_URING;
+                } else if (strcmp(optarg, "splice") == 0) {
+                    mode = MODE_SPLICE;
+                } else {
+                    fprintf(stderr, "error: unknown mode '%s'\n", optarg);
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'z':
+                zerocopy = 1;
+                break;
+            case 'Z':
+                if ((zerocopy_threshold = strtol(optarg, NULL, 10)) <= 0) {
+                    fprintf(stderr, "error: invalid zerocopy threshold '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'p':
+            case 'c':
+            case 'o':
+                if (parse_tuning(opt, optarg) == -1)
+                    return EXIT_FAILURE;
+                break;
+            case 'C':
+                capture = optarg;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
 
     struct sigaction sa;            //- Define a struct for the signal handler
     sa.sa_handler = sig_handler;    //- Set the signal handler function
@@ -31,6 +120,21 @@ int main(void) {
     sigaction(SIGINT, &sa, NULL);   //- Register the signal handler for SIGINT
     sigaction(SIGKILL, &sa, NULL);  //- Register the signal handler for SIGKILL
     sigaction(SIGTERM, &sa, NULL);  //- Register the signal handler for SIGTERM
+    sa.sa_handler = SIG_IGN;        //- writev() to a client that went away fails with EPIPE instead of killing the server
+    sigaction(SIGPIPE, &sa, NULL);  //- Ignore SIGPIPE
+
+    //* Start the asynchronous logger
+    //- Per-message output goes through common/log.h so that formatting and printing run on a background thread.
+    if (log_init() == -1) {
+        perror("error: log writer creation failed, aborting...");
+        return EXIT_FAILURE;
+    }
+
+    //* Start the metrics endpoint
+    //- Connections, bytes, messages, errors and the service time are served on a Unix socket, e.g.
+    //- socat - UNIX-CONNECT:/tmp/single_tcp_echo_server.metrics.sock
+    if (metrics_init(METRICS_SOCKET_FILE) == -1)
+        perror("error: metrics endpoint creation failed, continuing without it");
 
     //* Create a socket for the server
     //- The socket() syscall creates a new socket and returns a file descriptor that refers to that socket.
@@ -56,14 +160,18 @@ int main(void) {
         return EXIT_FAILURE;
     }
 
+    //* Apply the tuning profile
+    //- The socket buffers must be sized before listen(), the accepted sockets copy every option of the listener.
+    tuning_apply(&tuning, server_fd);
+
     //* Set the source server address
     //- The memset() function fills the source_addr struct with zeros.
     //- The sin_addr.s_addr field of the source_addr struct is set to the IP address of the server.
     //- The sin_port field of the source_addr struct is set to the port number of the server.
     //- The sin_family field will be set to PF_INET, which specifies the address family of the socket.
     memset(&source_addr, 0, sizeof source_addr);
-    source_addr.sin_addr.s_addr = inet_addr(SERVER_IP);
-    source_addr.sin_port = htons(SERVER_PORT);
+    source_addr.sin_addr.s_addr = inet_addr(tuning.ip);
+    source_addr.sin_port = htons(tuning.port);
     source_addr.sin_family = PF_INET;
 
     //* Bind the server address to the server socket
@@ -83,18 +191,106 @@ int main(void) {
             return EXIT_FAILURE;
         }
     }
-    printf("server listening on %s:%d\n", SERVER_IP, SERVER_PORT);
+    printf("server listening on %s:%d\n", tuning.ip, tuning.port);
 
     //* Listen for incoming connections
     //- The listen() syscall listens for incoming connections on the server socket.
     //- The 1st argument, server_fd, specifies the file descriptor of the server socket.
-    //- The 2nd argument, BACKLOG, specifies the maximum number of pending connections that the server will allow.
+    //- The 2nd argument, tuning.backlog, specifies the maximum number of pending connections that the server will allow.
     //? If the listen() syscall fails, it returns -1.
-    if ((listen(server_fd, BACKLOG)) == -1) {
+    if ((listen(server_fd, tuning.backlog)) == -1) {
         perror("error: socket listening failed, aborting...");
         close(server_fd);
         return EXIT_FAILURE;
     }
+    tuning_print(&tuning, server_fd, stdout);
+
+    //* Open the capture trace
+    //- The engines append a record for every accept, receive, send and close to the mapped trace file, without a
+    //- syscall per record. The splice mode moves the data inside the kernel, there is no payload to record.
+    if (capture != NULL && mode == MODE_SPLICE) {
+        printf("capture is not supported by the splice mode, the payload never reaches user space\n");
+        capture = NULL;
+    }
+    if (capture != NULL) {
+        if (trace_init(capture, 0) == -1) {
+            perror("error: capture file creation failed, aborting...");
+            close(server_fd);
+            return EXIT_FAILURE;
+        }
+        printf("capture: recording every connection into %s\n", capture);
+    }
+
+    //* Serve the connections with the selected engine
+    //- The io_uring engine is limited to one connection at a time, like the blocking loop.
+    if (tuning.spin > 0 && mode != MODE_BLOCKING)
+        printf("busy polling is only supported by the blocking mode, blocking at once\n");
+    //- Quick ACK mode has to be re-armed after every receive, io_uring and splice() receive without a call of their own.
+    if (tuning.quickack && mode != MODE_BLOCKING)
+        printf("quickack is only supported by the blocking mode, ACKs are delayed as usual\n");
+    if (mode == MODE_URING) {
+        if (uring_supported()) {
+            if (zerocopy)
+                printf("zerocopy is only supported by the blocking mode, sending with copies\n");
+            printf("mode: uring (multishot accept/recv, provided buffers)\n");
+            uring_serve(server_fd, tuning.buffer_size, 1, NULL);
+            close(server_fd);
+            return EXIT_FAILURE;
+        }
+        printf("io_uring is not available, falling back to blocking mode\n");
+    }
+    if (mode == MODE_SPLICE) {
+        if (zerocopy)
+            printf("zerocopy is only supported by the blocking mode, the splice mode does not copy anyway\n");
+        return run_splice_mode(server_fd);
+    }
+    if (zerocopy)
+        printf("zerocopy: MSG_ZEROCOPY for echoes of at least %ld bytes\n", zerocopy_threshold);
+    if (tuning.spin > 0)
+        printf("busy poll: spinning up to %d us before every blocking receive\n", tuning.spin);
+    if (tuning.cork > 0 && !zerocopy)
+        printf("cork: the echoes of reads are merged while more input is waiting, for up to %d us\n", tuning.cork);
+    return run_blocking_mode(server_fd, zerocopy ? zerocopy_threshold : 0);
+}
+
+//* Serve one connection at a time with blocking recv()/send() calls
+//- With a zerocopy_threshold the server reads into a ring of ZEROCOPY_BUFFERS larger buffers and echoes every read
+//- unchanged with send_echo(), reads of at least zerocopy_threshold bytes with MSG_ZEROCOPY. The next read goes into
+//- the next buffer of the ring, so the kernel can still send from the previous ones; a buffer is only read into again
+//- once the kernel released it.
+int run_blocking_mode(int server_fd, size_t zerocopy_threshold) {
+    int client_fd;                                 //- Define a file descriptor for the client socket
+    struct sockaddr_in client_addr;                //- Define a struct for the client address
+    char* buffer;                                  //- Define a buffer to store the received message
+    ssize_t bytes_received;                        //- Define a variable to store the size of the received message
+    struct frame_parser parser;                    //- Define the message parser state of the connection
+    struct frame_chunk chunk;                      //- Define a variable to store the current message chunk
+    int status;                                    //- Define a variable to store the parser result
+    struct zerocopy_buffer* zerocopy = NULL;       //- Define the receive buffer ring of the zerocopy mode (NULL in copy mode)
+    unsigned current = 0;                          //- Define the index of the zerocopy buffer being read into
+    uint32_t next_id;                              //- Define the notification id of the next MSG_ZEROCOPY send of the connection
+    struct transfer_stats stats;                   //- Define the throughput and CPU time statistics of the connection
+    uint64_t spin = (uint64_t)tuning.spin * 1000;  //- Define the busy-polling budget of a receive in nanoseconds
+    struct reply_batch batch;                      //- Define the echoes of the current read, sent together
+    uint32_t connection;                           //- Define the capture trace id of the connection (0: not captured)
+
+    if (zerocopy_threshold > 0 && (zerocopy = calloc(ZEROCOPY_BUFFERS, sizeof *zerocopy)) != NULL) {
+        for (unsigned i = 0; i < ZEROCOPY_BUFFERS && zerocopy != NULL; i++) {
+            if ((zerocopy[i].data = malloc(ZEROCOPY_BUFFER_SIZE)) == NULL) {
+                while (i-- > 0) free(zerocopy[i].data);
+                free(zerocopy);
+                zerocopy = NULL;
+            }
+        }
+    }
+    if (zerocopy_threshold > 0 && zerocopy == NULL) {
+        perror("error: zerocopy buffer allocation failed, aborting...");
+        return EXIT_FAILURE;
+    }
+    if ((buffer = malloc(tuning.buffer_size)) == NULL) {
+        perror("error: buffer allocation failed, aborting...");
+        return EXIT_FAILURE;
+    }
 
     //* while loop to listen for incoming connections
     while (1) {
@@ -109,39 +305,225 @@ int main(void) {
             perror("error: socket accepting failed, aborting...");
             return EXIT_FAILURE;
         }
+        metrics_add(METRICS_ACCEPTED, 1);
+        connection = trace_open();
+
+        //- Without SO_ZEROCOPY the kernel ignores MSG_ZEROCOPY and never sends a notification, so the connection
+        //- stays in copy mode if the option cannot be set.
+        if (zerocopy != NULL && zerocopy_enable(client_fd) == -1)
+            log_warn("warning: SO_ZEROCOPY is not supported, copying: %e", errno);
+        next_id = 0;
+        transfer_start(&stats);
 
         //* Receive messages from the client
-        //- The recv() syscall receives messages from the client.
+        //- The recv() syscall receives messages from the client. busypoll_recvfrom() calls it, after spinning with
+        //- non-blocking calls for the spin budget of the tuning (see common/busypoll.h).
         //- The 1st argument, client_fd, specifies the file descriptor of the client socket.
         //- The 2nd argument, buffer, specifies the buffer to store the received message.
-        //- The 3rd argument, BUFFER_SIZE, specifies the size of the buffer.
+        //- The 3rd argument, receive_size, specifies the size of the buffer.
         //- The 4th argument, specifies the flags. 0 is standard mode for recv() syscall.
-        while ((bytes_received = recv(client_fd, buffer, BUFFER_SIZE, 0)) > 0) {
-            buffer[bytes_received] = '\0';  //- Add a null terminator to the end of the message.
-            printf("received message from %s:%d (%4ld byte): %s\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port), bytes_received,
-                   buffer);
-
-            //* Echo the message back to the client
-            //- The send() syscall sends the message back to the client.
-            //- The 1st argument, client_fd, specifies the file descriptor of the client socket.
-            //- The 2nd argument, buffer, specifies the buffer containing the message.
-            //- The 3rd argument, strlen(buffer), specifies the size of the message.
-            //- The 4th argument, 0, specifies the flags. 0 is standard mode for send() syscall.
-            if ((send(client_fd, buffer, strlen(buffer), 0)) == -1) {
-                perror("error: socket sending failed, aborting...");
-                close(client_fd);
-                return EXIT_FAILURE;
+        //- A recv() may return part of a message or several messages, the frame parser splits the bytes into messages
+        //- (see common/frame.h). It does not copy anything, every chunk points into buffer.
+        frame_parser_init(&parser);
+        reply_batch_init(&batch, client_fd, tuning.cork, connection);
+        char* receive_buffer = zerocopy != NULL ? zerocopy[current].data : buffer;
+        size_t receive_size = zerocopy != NULL ? ZEROCOPY_BUFFER_SIZE : tuning.buffer_size;
+        while ((bytes_received = busypoll_recvfrom(client_fd, receive_buffer, receive_size, NULL, NULL, spin)) > 0) {
+            uint64_t start = metrics_now();
+            const char* data = receive_buffer;
+            size_t len = bytes_received;
+
+            if (tuning.quickack)
+                tuning_quickack(client_fd);
+            metrics_add(METRICS_BYTES_RECEIVED, bytes_received);
+            trace_record(connection, TRACE_IN, receive_buffer, bytes_received);
+            stats.bytes += bytes_received;
+            while ((status = frame_parse(&parser, &data, &len, &chunk)) == 1) {
+                if (chunk.offset == 0) {
+                    metrics_add(METRICS_MESSAGES, 1);
+                    log_info_data(chunk.data, chunk.len, "received message from %a:%u (%4u byte): %s", client_addr.sin_addr.s_addr,
+                                  ntohs(client_addr.sin_port), chunk.length);
+                }
+                if (zerocopy != NULL)
+                    continue;
+
+                //* Queue the echo of the message
+                //- reply_batch_add() collects the header and the payload chunk, the echoes of the whole read leave
+                //- together below. The rest of a message that was split over several reads follows as it arrives.
+                if (reply_batch_add(&batch, &chunk) == -1) {
+                    log_error("error: socket sending failed, closing the connection: %e", errno);
+                    metrics_add(METRICS_ERRORS, 1);
+                    break;
+                }
+                if (chunk.offset == 0)
+                    log_info_data(chunk.data, chunk.len, "     reply message to %a:%u (%4u byte): %s", client_addr.sin_addr.s_addr,
+                                  ntohs(client_addr.sin_port), chunk.length);
+            }
+            //* Send the echoes of the read
+            //- One sendmsg() for every message of the read (see common/replybatch.h), the messages before an invalid
+            //- one included.
+            if (zerocopy == NULL && status != 1 && reply_batch_flush(&batch) == -1) {
+                log_error("error: socket sending failed, closing the connection: %e", errno);
+                metrics_add(METRICS_ERRORS, 1);
+                status = 1;
+            }
+            //* Echo the whole read back to the client (zerocopy mode)
+            //- The echo of a frame is byte-identical to the frame, so the received bytes go back unchanged.
+            if (zerocopy != NULL && status == 0) {
+                if (send_echo(client_fd, &zerocopy[current], bytes_received, zerocopy_threshold, &next_id, connection) == -1) {
+                    log_error("error: socket sending failed, closing the connection: %e", errno);
+                    metrics_add(METRICS_ERRORS, 1);
+                    status = 1;
+                }
+                current = (current + 1) % ZEROCOPY_BUFFERS;
+                if (zerocopy[current].pending > 0 && zerocopy_wait(client_fd, &zerocopy[current], release_zerocopy, zerocopy) == -1)
+                    status = 1;
+                receive_buffer = zerocopy[current].data;
             }
-            printf("     reply message to %s:%d (%4ld byte): %s\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port), bytes_received,
-                   buffer);
+            metrics_record_service(start);
+            if (status != 0) {  //- 1: the echo failed (see above), -1: invalid message
+                if (status == -1) {
+                    log_error("error: invalid message from client, closing the connection: %e", errno);
+                    metrics_add(METRICS_ERRORS, 1);
+                }
+                break;
+            }
+
+            //- With a cork delay the tail of the echoes waits for the next read, if it comes within the delay.
+            reply_batch_hold(&batch);
+        }
+        //* Wait for the kernel to release the zerocopy buffers
+        //- Notification ids are per socket, the next connection starts over with a free ring.
+        for (unsigned i = 0; zerocopy != NULL && i < ZEROCOPY_BUFFERS; i++) {
+            zerocopy_wait(client_fd, &zerocopy[i], release_zerocopy, zerocopy);
+            zerocopy[i].pending = 0;
         }
+        current = 0;
+
         //* Close the client socket
         close(client_fd);
+        metrics_add(METRICS_CLOSED, 1);
+        trace_close(connection);
+        log_transfer(&client_addr, &stats);
     }
 
     return EXIT_SUCCESS;
 }
 
+//* Serve one connection at a time with splice()
+//- Every received byte goes from the socket into a pipe and from the pipe back into the socket, without passing
+//- through user space and without the receive buffer of the blocking mode: one splice_echo() call moves up to a pipe-full
+//- (1 MB if the kernel allows it). The bytes are not parsed, so messages are neither counted nor logged.
+int run_splice_mode(int server_fd) {
+    int client_fd;                   //- Define a file descriptor for the client socket
+    struct sockaddr_in client_addr;  //- Define a struct for the client address
+    int pipe_fds[2];                 //- Define the pipe the echoed bytes pass through
+    ssize_t pipe_size;               //- Define the capacity of the pipe
+    ssize_t bytes_echoed;            //- Define a variable to store the size of the current echo
+    struct transfer_stats stats;     //- Define the throughput and CPU time statistics of the connection
+
+    if ((pipe_size = splice_pipe(pipe_fds)) == -1) {
+        perror("error: pipe creation failed, aborting...");
+        return EXIT_FAILURE;
+    }
+    printf("mode: splice (kernel-side echo through a %zd byte pipe)\n", pipe_size);
+
+    while (1) {
+        if ((client_fd = accept(server_fd, (struct sockaddr*)&client_addr, &(socklen_t){sizeof(client_addr)})) == -1) {
+            perror("error: socket accepting failed, aborting...");
+            return EXIT_FAILURE;
+        }
+        metrics_add(METRICS_ACCEPTED, 1);
+
+        transfer_start(&stats);
+        while ((bytes_echoed = splice_echo(client_fd, pipe_fds, pipe_size)) > 0) {
+            metrics_add(METRICS_BYTES_RECEIVED, bytes_echoed);
+            metrics_add(METRICS_BYTES_SENT, bytes_echoed);
+            stats.bytes += bytes_echoed;
+        }
+
+        //- A failed echo may leave bytes in the pipe, they must not leak into the next connection.
+        if (bytes_echoed == -1) {
+            log_error("error: splice failed, closing the connection: %e", errno);
+            metrics_add(METRICS_ERRORS, 1);
+            close(pipe_fds[0]);
+            close(pipe_fds[1]);
+            if ((pipe_size = splice_pipe(pipe_fds)) == -1) {
+                perror("error: pipe creation failed, aborting...");
+                return EXIT_FAILURE;
+            }
+        }
+
+        close(client_fd);
+        metrics_add(METRICS_CLOSED, 1);
+        log_transfer(&client_addr, &stats);
+    }
+}
+
+//* Apply a tuning command line option: a profile (-p), a configuration file (-c) or one setting (-o)
+//? Returns -1 after printing the error.
+int parse_tuning(int opt, const char* arg) {
+    if (opt == 'c' && tuning_load(&tuning, arg) == -1) {
+        if (errno != EINVAL)
+            perror("error: reading the configuration file failed, aborting...");
+        return -1;
+    }
+    if (opt == 'p' && tuning_profile(&tuning, arg) == -1) {
+        fprintf(stderr, "error: unknown tuning profile '%s'\n", arg);
+        return -1;
+    }
+    if (opt == 'o' && tuning_option(&tuning, arg) == -1) {
+        fprintf(stderr, "error: invalid tuning option '%s'\n", arg);
+        return -1;
+    }
+    return 0;
+}
+
+//* Log the throughput and CPU time per GB of a finished connection
+void log_transfer(const struct sockaddr_in* client_addr, const struct transfer_stats* stats) {
+    struct transfer_result result;
+
+    transfer_finish(stats, &result);
+    log_info("client %a:%u disconnected: %u KB echoed in %u ms, %u MB/s, %u ms CPU per GB", client_addr->sin_addr.s_addr,
+             ntohs(client_addr->sin_port), stats->bytes / 1000, result.elapsed_ms, result.mb_per_s, result.cpu_ms_per_gb);
+}
+
+//* Send the bytes of one read back, with MSG_ZEROCOPY if there are at least threshold of them
+//- A blocking send() returns early if a signal arrives, every call that sent data with MSG_ZEROCOPY takes the next
+//- notification id and adds a pending send to the buffer.
+//? Returns -1 if the send() syscall fails.
+int send_echo(int client_fd, struct zerocopy_buffer* buffer, size_t len, size_t threshold, uint32_t* next_id, uint32_t connection) {
+    ssize_t bytes_sent;
+    int zerocopy = 0;
+
+    for (size_t off = 0; off < len; off += bytes_sent) {
+        if (len >= threshold)
+            bytes_sent = zerocopy_send(client_fd, buffer->data + off, len - off, MSG_NOSIGNAL, &zerocopy);
+        else
+            bytes_sent = send(client_fd, buffer->data + off, len - off, MSG_NOSIGNAL);
+        if (bytes_sent == -1) {
+            if (errno != EINTR)
+                return -1;
+            bytes_sent = 0;
+            continue;
+        }
+        if (zerocopy) {
+            if (buffer->pending++ == 0)
+                buffer->first_id = *next_id;
+            buffer->last_id = (*next_id)++;
+        }
+        metrics_add(METRICS_BYTES_SENT, bytes_sent);
+        trace_record(connection, TRACE_OUT, buffer->data + off, bytes_sent);
+    }
+    return 0;
+}
+
+//* Count a released id range against every buffer of the zerocopy ring
+void release_zerocopy(void* context, uint32_t lo, uint32_t hi) {
+    struct zerocopy_buffer* zerocopy = context;
+    for (unsigned i = 0; i < ZEROCOPY_BUFFERS; i++) zerocopy_buffer_release(&zerocopy[i], lo, hi);
+}
+
 void sig_handler(int sig) {
     switch (sig) {
         case SIGABRT:
@@ -154,4 +536,21 @@ void sig_handler(int sig) {
         default:
             break;
     }
+}
+
+void usage(const char* prog) {
+    printf("usage: %s [-m blocking|uring|splice] [-z [-Z bytes]] [-p profile] [-c file] [-o key=value] [-C file]\n", prog);
+    printf("  -m, --mode MODE     connection handling engine (default: blocking)\n");
+    printf("                      blocking: blocking recv()/send() calls\n");
+    printf("                      uring:    io_uring (falls back to blocking if unsupported)\n");
+    printf("                      splice:   kernel-side echo with splice() through a pipe, for bulk streams\n");
+    printf("  -z, --zerocopy      send large echoes with MSG_ZEROCOPY (blocking mode)\n");
+    printf("  -Z, --zerocopy-threshold N\n");
+    printf("                      minimum echo size in bytes for MSG_ZEROCOPY, smaller ones are copied (default: %d)\n",
+           ZEROCOPY_THRESHOLD);
+    printf("  -p, --profile NAME  socket tuning profile: default, latency, throughput or many-connections\n");
+    printf("  -c, --config FILE   read tuning settings from FILE, one \"key = value\" per line\n");
+    printf("  -o, --option K=V    change one tuning setting: ip, port, backlog, rcvbuf, sndbuf, nodelay, quickack,\n");
+    printf("                      defer_accept, busy_poll, prefer_busy_poll, spin, cork or buffer_size\n");
+    printf("  -C, --capture FILE  record every connection into the trace FILE for a client replay (not in splice mode)\n");
 }
\ No newline at end of file
@@ -6,27 +6,184 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <errno.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "frame.h"
+#include "loadgen.h"
+#include "pipeline.h"
+#include "replay.h"
+#include "shmring.h"
+#include "udpgen.h"
 
 #define BUFFER_SIZE 1024                            //- Message buffer size
 #define SERVER_SOCKET_FILE "/tmp/echo_server.sock"  //- Server socket file path
 
-int main(void) {
+void usage(const char* prog);
+int run_bench_mode(struct loadgen_options* options, int csv);
+int run_shm_bench_mode(struct shmring_channel* channel, const struct loadgen_options* options, int csv);
+int run_message_bench_mode(int sock_fd, const struct loadgen_options* options, int csv);
+int run_pipeline_mode(int sock_fd, unsigned window);
+int run_replay_mode(const char* path, double speed);
+int parse_positive(const char* arg, const char* name, double* value);
+uint64_t now_ns(void);
+
+int main(int argc, char* argv[]) {
     int sock_fd;                     //- Define a file descriptor for the server socket
     struct sockaddr_un server_addr;  //- Define a struct for the server address
     char buffer[BUFFER_SIZE];        //- Define a buffer to store the received message
-    ssize_t bytes_received;          //- Define a variable to store the size of the received message
+    size_t reply_len;                //- Define a variable to store the size of the received message
+    int status;                      //- Define a variable to store the result of frame_read()
+    struct loadgen_options bench = {.connections = 1, .threads = 1, .payload = 64, .depth = 1, .duration = 10};
+    int bench_mode = 0;              //- Define a flag for the load generator mode
+    int csv = 0;                     //- Define a flag for the machine-readable load generator report
+    int shm = 0;                     //- Define a flag for the shared memory transport
+    int type = SOCK_STREAM;          //- Define the socket type
+    ssize_t bytes_received;          //- Define a variable to store the size of a received message
+    double spin = 0;                 //- Define the busy-polling budget of a ring wait in microseconds
+    unsigned window = 0;             //- Define the pipeline window of the interactive mode (0: lockstep)
+    int opt;                         //- Define a variable to store the current command line option
+    double value;                    //- Define a variable to store a parsed numeric option
+    struct shmring_channel channel;  //- Define the shared memory rings of the connection
+    const void* reply;               //- Define a pointer to the echoed message in the reply ring
+    const char* replay = NULL;       //- Define the trace file to replay (NULL: no replay)
+    double speed = 1;                //- Define the replay timeline scale
+
+    static const struct option long_options[] = {
+        {"bench", no_argument, NULL, 'b'},
+        {"type", required_argument, NULL, 't'},
+        {"size", required_argument, NULL, 's'},
+        {"depth", required_argument, NULL, 'p'},
+        {"duration", required_argument, NULL, 'd'},
+        {"rate", required_argument, NULL, 'r'},
+        {"csv", no_argument, NULL, 'C'},
+        {"shm", no_argument, NULL, 'S'},
+        {"spin", required_argument, NULL, 'W'},
+        {"window", required_argument, NULL, 'w'},
+        {"replay", required_argument, NULL, 'R'},
+        {"speed", required_argument, NULL, 'x'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+
+    //* Parse the command line options
+    //- Without options the client is an interactive prompt. -b, --bench turns it into a load generator instead.
+    //- The server handles one connection at a time, so the load generator uses a single connection and -p, --depth
+    //- sets the concurrency.
+    //- --shm moves the connection to shared memory rings after it is set up (see common/shmring.h), in both modes.
+    //- -t, --type selects the socket type of the server: "stream" (default), "seqpacket" or "dgram". The load generator
+    //- of the message types is open-loop (see run_message_bench_mode()), -p, --depth sets its batch size.
+    //- -w, --window sends the interactive input of a stream socket pipelined (see common/pipeline.h).
+    //- -R, --replay sends a stream trace the server captured on as many connections, at the rate -x, --speed scales
+    //- (see common/replay.h).
+    while ((opt = getopt_long(argc, argv, "bt:s:p:d:r:w:R:x:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'b':
+                bench_mode = 1;
+                break;
+            case 't':
+                if (strcmp(optarg, "stream") == 0) {
+                    type = SOCK_STREAM;
+                } else if (strcmp(optarg, "seqpacket") == 0) {
+                    type = SOCK_SEQPACKET;
+                } else if (strcmp(optarg, "dgram") == 0) {
+                    type = SOCK_DGRAM;
+                } else {
+                    fprintf(stderr, "error: unknown socket type '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 's':
+                if (parse_positive(optarg, "payload size", &value) == -1)
+                    return EXIT_FAILURE;
+                bench.payload = (size_t)value;
+                break;
+            case 'p':
+                if (parse_positive(optarg, "pipeline depth", &value) == -1)
+                    return EXIT_FAILURE;
+                bench.depth = (int)value;
+                break;
+            case 'd':
+                if (parse_positive(optarg, "duration", &value) == -1)
+                    return EXIT_FAILURE;
+                bench.duration = value;
+                break;
+            case 'r':
+                if (parse_positive(optarg, "request rate", &value) == -1)
+                    return EXIT_FAILURE;
+                bench.rate = value;
+                break;
+            case 'C':
+                csv = 1;
+                break;
+            case 'S':
+                shm = 1;
+                break;
+            case 'W':
+                if (parse_positive(optarg, "spin budget", &spin) == -1)
+                    return EXIT_FAILURE;
+                break;
+            case 'w':
+                if (parse_positive(optarg, "window", &value) == -1)
+                    return EXIT_FAILURE;
+                if (value > PIPELINE_WINDOW_MAX) {
+                    fprintf(stderr, "error: window %s exceeds %d\n", optarg, PIPELINE_WINDOW_MAX);
+                    return EXIT_FAILURE;
+                }
+                window = (unsigned)value;
+                break;
+            case 'R':
+                replay = optarg;
+                break;
+            case 'x':
+                if (parse_positive(optarg, "speed", &speed) == -1)
+                    return EXIT_FAILURE;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (shm && type != SOCK_STREAM) {
+        fprintf(stderr, "error: the shared memory transport needs the stream socket type\n");
+        return EXIT_FAILURE;
+    }
+    if (window > 0 && !bench_mode && (shm || type != SOCK_STREAM)) {
+        fprintf(stderr, "error: the pipelined mode needs the stream socket type without --shm\n");
+        return EXIT_FAILURE;
+    }
+    if (replay != NULL && (shm || type != SOCK_STREAM)) {
+        fprintf(stderr, "error: the replay needs the stream socket type without --shm\n");
+        return EXIT_FAILURE;
+    }
+    if (replay != NULL)
+        return run_replay_mode(replay, speed);
+    if (bench_mode && !shm && type == SOCK_STREAM)
+        return run_bench_mode(&bench, csv);
 
     //* Create a socket for the server
     //- The socket() syscall creates a new socket and returns a file descriptor that refers to that socket.
     //- The 1st argument, AF_UNIX, specifies the address family of the socket.
-    //- The 2nd argument, SOCK_STREAM, specifies the type of the socket. SOCK_STREAM is used for stream-oriented sockets.
+    //- The 2nd argument, type, specifies the type of the socket, it must match the type of the server socket.
     //- The 3rd argument, 0, specifies the protocol to be used with the socket.
     //? If the socket() syscall fails, it returns -1.
-    if ((sock_fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+    if ((sock_fd = socket(AF_UNIX, type, 0)) == -1) {
         perror("error: socket creation failed, aborting...");
         return EXIT_FAILURE;
     }
 
+    //* Bind a datagram socket to an address of its own
+    //- The server sends each echo back to the address of the sender, an unbound datagram socket has none. Binding with
+    //- only the address family autobinds the socket to a unique name in the abstract namespace.
+    if (type == SOCK_DGRAM && bind(sock_fd, (struct sockaddr*)&(struct sockaddr_un){.sun_family = AF_UNIX}, sizeof(sa_family_t)) == -1) {
+        perror("error: socket binding failed, aborting...");
+        close(sock_fd);
+        return EXIT_FAILURE;
+    }
+
     //* Set the server address
     //- The memset() function fills the server_addr struct with zeros.
     //- The sun_family field will be set to AF_UNIX, which specifies the address family of the socket.
@@ -53,6 +210,30 @@ int main(void) {
         }
     }
 
+    //* Move to the shared memory transport
+    //- shmring_connect() sends the memfd of the rings and two eventfds over the socket and waits until the server
+    //- takes them. From then on the messages go through the rings, the socket stays open to signal a hang-up.
+    if (shm) {
+        if (shmring_connect(&channel, sock_fd, (uint64_t)(spin * 1000)) == -1) {
+            if (errno == ENOTSUP)
+                printf("error: the server does not support the shared memory transport, aborting...\n");
+            else
+                perror("error: shared memory transport setup failed, aborting...");
+            close(sock_fd);
+            return EXIT_FAILURE;
+        }
+        if (bench_mode) {
+            status = run_shm_bench_mode(&channel, &bench, csv);
+            shmring_close(&channel);
+            close(sock_fd);
+            return status;
+        }
+    }
+    if (bench_mode)
+        return run_message_bench_mode(sock_fd, &bench, csv);
+    if (window > 0)
+        return run_pipeline_mode(sock_fd, window);
+
     //* while loop to send and receive messages
     while (1) {
         printf("client> ");
@@ -75,31 +256,291 @@ int main(void) {
         if (strlen(buffer) == 0)
             continue;  //- Skip empty messages
 
-        //* Write messages to the server
-        //- The write() syscall sends messages to the server.
-        //- The 1st argument, server_fd, specifies the file descriptor of the client socket.
-        //- The 2nd argument, buffer, specifies the buffer that contains the message to be sent.
+        //* Exchange the message through the rings
+        //- shmring_send() copies it into the request ring, shmring_recv() returns the echo in place in the reply ring.
+        if (shm) {
+            status = -1;
+            if (shmring_send(&channel, buffer, strlen(buffer)) == -1 || (status = shmring_recv(&channel, &reply, &reply_len)) != 1) {
+                if (status == 0 || errno == EPIPE)
+                    printf("server closed the connection\n");
+                else
+                    perror("error: message exchange failed, aborting...");
+                shmring_close(&channel);
+                close(sock_fd);
+                return status == 0 || errno == EPIPE ? EXIT_SUCCESS : EXIT_FAILURE;
+            }
+            printf("server> %.*s\n", (int)reply_len, (const char*)reply);
+            shmring_release(&channel);
+            continue;
+        }
+
+        //* Exchange the message as one datagram or packet
+        //- The message socket types keep the boundaries, the message is sent and echoed as it is, without a frame header.
+        if (type != SOCK_STREAM) {
+            if (send(sock_fd, buffer, strlen(buffer), 0) == -1 || (bytes_received = recv(sock_fd, buffer, BUFFER_SIZE, 0)) == -1) {
+                perror("error: message exchange failed, aborting...");
+                close(sock_fd);
+                return EXIT_FAILURE;
+            }
+            if (bytes_received == 0 && type == SOCK_SEQPACKET) {
+                printf("server closed the connection\n");
+                close(sock_fd);
+                return EXIT_SUCCESS;
+            }
+            printf("server> %.*s\n", (int)bytes_received, buffer);
+            continue;
+        }
+
+        //* Send the message to the server
+        //- frame_write() puts the 4-byte length header in front of the message (see common/frame.h) and sends both
+        //- with one writev() syscall.
+        //- The 1st argument, sock_fd, specifies the file descriptor of the client socket.
+        //- The 2nd argument, buffer, specifies the message to be sent.
         //- The 3rd argument, strlen(buffer), specifies the size of the message.
-        //? If the write() syscall fails, it returns -1.
-        if (write(sock_fd, buffer, strlen(buffer)) == -1) {
+        //? If the writev() syscall fails, it returns -1.
+        if (frame_write(sock_fd, buffer, strlen(buffer)) == -1) {
             perror("error: message sending failed, aborting...");
             close(sock_fd);
             return EXIT_FAILURE;
         }
 
-        //* Read messages from the server
-        //- The read() syscall receives messages from the server.
-        //- The 1st argument, server_fd, specifies the file descriptor of the client socket.
-        //- The 2nd argument, buffer, specifies the buffer to store the received message.
-        //- The 3rd argument, BUFFER_SIZE, specifies the size of the buffer.
-        //? If the read() syscall fails, it returns -1.
-        if ((bytes_received = read(sock_fd, buffer, BUFFER_SIZE)) > 0) {
-            buffer[bytes_received] = '\0';  //- Add a null terminator to the end of the buffer
-            printf("server> %s\n", buffer);
+        //* Receive the echoed message from the server
+        //- frame_read() reads the length header first and then exactly that many payload bytes, so the reply is
+        //- complete even if it arrives in several pieces.
+        //? It returns 0 if the server closed the connection and -1 if the reply could not be read.
+        if ((status = frame_read(sock_fd, buffer, BUFFER_SIZE, &reply_len)) <= 0) {
+            if (status == 0)
+                printf("server closed the connection\n");
+            else
+                perror("error: message receiving failed, aborting...");
+            close(sock_fd);
+            return status == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
         }
+        printf("server> %.*s\n", (int)reply_len, buffer);
     }
 
     //* Close the client socket
     close(sock_fd);
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
+
+//* Run the load generator against the server and print the report
+int run_bench_mode(struct loadgen_options* options, int csv) {
+    struct sockaddr_un* addr = (struct sockaddr_un*)&options->addr;
+    struct loadgen_result* result;
+
+    memset(&options->addr, 0, sizeof options->addr);
+    addr->sun_family = AF_UNIX;
+    strncpy(addr->sun_path, SERVER_SOCKET_FILE, sizeof addr->sun_path - 1);
+    options->addr_len = sizeof *addr;
+
+    //- The result embeds a histogram (~30 KB), keep it off the stack.
+    if ((result = malloc(sizeof *result)) == NULL || loadgen_run(options, result) == -1) {
+        perror("error: load generator failed, aborting...");
+        free(result);
+        return EXIT_FAILURE;
+    }
+    if (csv)
+        loadgen_report_csv(result, stdout);
+    else
+        loadgen_report(options, result, stdout);
+    free(result);
+    return EXIT_SUCCESS;
+}
+
+//* Run a closed-loop load test over the shared memory rings and print the report
+//- loadgen drives sockets, so the rings get their own generator: depth requests stay in flight on the one connection
+//- and every reply is matched to the oldest request, the latency goes into the same histogram and report.
+//- Every request in flight (and one padding record) must fit into the reply ring, otherwise the server could wait
+//- for room in the reply ring while the client waits for room in the request ring.
+int run_shm_bench_mode(struct shmring_channel* channel, const struct loadgen_options* options, int csv) {
+    size_t record;                  //- Define the ring bytes of one request
+    struct loadgen_result* result;  //- Define the results, they embed a histogram (~30 KB)
+    uint64_t* sent;                 //- Define the send times of the requests in flight, oldest at index oldest
+    char* payload;                  //- Define the request payload
+    const void* reply;              //- Define a pointer to the current reply in the reply ring
+    size_t reply_len;               //- Define the size of the current reply
+    uint64_t start, now, deadline;  //- Define the timestamps of the test in nanoseconds
+    int in_flight = 0, oldest = 0;  //- Define the number of requests in flight and the index of the oldest one
+    int status = EXIT_SUCCESS;      //- Define the exit status
+
+    record = (FRAME_HEADER_SIZE + options->payload + 7) & ~(size_t)7;
+    if (options->rate > 0 || options->payload > shmring_max_message(channel) || (options->depth + 1) * record > channel->capacity) {
+        fprintf(stderr, "error: --shm runs closed-loop with up to %zu bytes in flight, aborting...\n", (size_t)channel->capacity - record);
+        return EXIT_FAILURE;
+    }
+    result = malloc(sizeof *result);
+    sent = malloc(options->depth * sizeof *sent);
+    payload = calloc(1, options->payload);
+    if (result == NULL || sent == NULL || payload == NULL) {
+        perror("error: load generator failed, aborting...");
+        free(result);
+        free(sent);
+        free(payload);
+        return EXIT_FAILURE;
+    }
+    memset(result, 0, sizeof *result);
+    histogram_init(&result->latency);
+
+    start = now = now_ns();
+    deadline = start + (uint64_t)(options->duration * 1e9);
+    for (; in_flight < options->depth; in_flight++) {
+        sent[in_flight] = now_ns();
+        if (shmring_send(channel, payload, options->payload) == -1)
+            goto fail;
+    }
+    while (in_flight > 0) {
+        if (shmring_recv(channel, &reply, &reply_len) != 1)
+            goto fail;
+        now = now_ns();
+        histogram_record(&result->latency, now - sent[oldest]);
+        shmring_release(channel);
+        result->requests++;
+        result->bytes += reply_len;
+
+        //- The freed slot takes the send time of the next request, which is the newest in flight.
+        if (now < deadline) {
+            sent[oldest] = now;
+            if (shmring_send(channel, payload, options->payload) == -1)
+                goto fail;
+        } else {
+            in_flight--;
+        }
+        oldest = (oldest + 1) % options->depth;
+    }
+    result->elapsed = (now - start) / 1e9;
+
+    if (csv) {
+        loadgen_report_csv(result, stdout);
+    } else {
+        printf("transport: shared memory, %lu KB rings\n", (unsigned long)(channel->capacity / 1024));
+        loadgen_report(options, result, stdout);
+    }
+    goto done;
+
+fail:
+    perror("error: message exchange failed, aborting...");
+    status = EXIT_FAILURE;
+done:
+    free(result);
+    free(sent);
+    free(payload);
+    return status;
+}
+
+//* Run the open-loop message generator of the UDP client over a seqpacket or datagram socket and print the report
+//- Every message carries a sequence number and its send time (see common/udpgen.h), the echoes are matched by a
+//- receive thread. The depth is the number of messages per sendmmsg()/recvmmsg(), the rate defaults to as fast as the
+//- server takes them: a Unix socket blocks the sender while the receive queue of the server is full.
+int run_message_bench_mode(int sock_fd, const struct loadgen_options* options, int csv) {
+    struct udpgen_options flood = {.rate = options->rate, .duration = options->duration, .size = options->payload};
+    struct udpgen_result* result;
+
+    flood.batch = options->depth < UDPGEN_BATCH_MAX ? options->depth : UDPGEN_BATCH_MAX;
+    if (flood.size < UDPGEN_HEADER_SIZE) {
+        fprintf(stderr, "error: messages need at least %d bytes for the sequence header\n", UDPGEN_HEADER_SIZE);
+        close(sock_fd);
+        return EXIT_FAILURE;
+    }
+
+    //- The result embeds a histogram (~30 KB), keep it off the stack.
+    if ((result = malloc(sizeof *result)) == NULL || udpgen_run(sock_fd, &flood, result) == -1) {
+        perror("error: load generator failed, aborting...");
+        free(result);
+        close(sock_fd);
+        return EXIT_FAILURE;
+    }
+    if (csv)
+        udpgen_report_csv(&flood, result, stdout);
+    else
+        udpgen_report(&flood, result, stdout);
+    free(result);
+    close(sock_fd);
+    return EXIT_SUCCESS;
+}
+
+//* Send stdin pipelined and print the echoes
+//- Up to window messages are in flight at a time, see common/pipeline.h. The report goes to stderr, so the echoes can
+//- be redirected on their own.
+int run_pipeline_mode(int sock_fd, unsigned window) {
+    struct pipeline* pipeline;
+    int status;
+
+    //- The pipeline embeds its input and receive buffers (128 KB), keep it off the stack.
+    if ((pipeline = malloc(sizeof *pipeline)) == NULL || pipeline_init(pipeline, sock_fd, window) == -1) {
+        perror("error: pipeline setup failed, aborting...");
+        free(pipeline);
+        close(sock_fd);
+        return EXIT_FAILURE;
+    }
+    if ((status = pipeline_run(pipeline, STDIN_FILENO, stdout)) == -1)
+        perror("error: pipelined messaging failed, aborting...");
+    else if (status == 0)
+        printf("server closed the connection\n");
+    fflush(stdout);
+    pipeline_report(pipeline, stderr);
+    pipeline_free(pipeline);
+    free(pipeline);
+    close(sock_fd);
+    return status == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+//* Replay a captured trace against the server
+//- Every captured connection is opened again at its captured time, the server queues the ones it does not serve yet
+//- in its backlog. The report goes to stdout like the load report.
+int run_replay_mode(const char* path, double speed) {
+    struct replay_options options = {.addr_len = sizeof(struct sockaddr_un), .path = path, .speed = speed};
+    struct sockaddr_un* server_addr = (struct sockaddr_un*)&options.addr;
+    struct replay_result result;
+
+    server_addr->sun_family = AF_UNIX;
+    strncpy(server_addr->sun_path, SERVER_SOCKET_FILE, sizeof server_addr->sun_path - 1);
+    if (replay_run(&options, &result) == -1) {
+        perror("error: trace replay failed, aborting...");
+        return EXIT_FAILURE;
+    }
+    replay_report(&options, &result, stdout);
+    return result.errors > 0 || result.received != result.sent ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int parse_positive(const char* arg, const char* name, double* value) {
+    char* end;
+
+    *value = strtod(arg, &end);
+    if (*end != '\0' || !(*value > 0)) {
+        fprintf(stderr, "error: invalid %s '%s'\n", name, arg);
+        return -1;
+    }
+    return 0;
+}
+
+//* Monotonic clock in nanoseconds
+uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void usage(const char* prog) {
+    printf("usage: %s [-t stream|seqpacket|dgram] [--shm [--spin us]] [-w window | -b [-s size] [-p depth] [-d seconds] [-r rate] [--csv]]\n"
+           "       %s -R trace [-x speed]\n",
+           prog, prog);
+    printf("  without options the client reads messages from stdin and prints the echoes\n");
+    printf("  -w, --window N    stream only: keep up to N messages of stdin in flight and coalesce them into one\n");
+    printf("                    writev(), echoes are matched in order and a report goes to stderr (max %d)\n", PIPELINE_WINDOW_MAX);
+    printf("  -t, --type TYPE   socket type of the server: stream (default), seqpacket or dgram\n");
+    printf("  -b, --bench       run a load test on one connection and report throughput and latency percentiles\n");
+    printf("  -s, --size N      request payload size in bytes (default: 64)\n");
+    printf("  -p, --depth N     requests in flight on the connection (default: 1), messages per sendmmsg() with\n");
+    printf("                    seqpacket and dgram\n");
+    printf("  -d, --duration S  test duration in seconds (default: 10)\n");
+    printf("  -r, --rate R      target request rate, latency is measured from the scheduled send time\n");
+    printf("                    (default: closed-loop, a new request as soon as a reply arrives; seqpacket and dgram:\n");
+    printf("                    open-loop, as fast as the server takes them)\n");
+    printf("      --csv         print the results as one comma-separated line (see bench.sh for the columns)\n");
+    printf("      --shm         exchange the messages through shared memory rings instead of the socket\n");
+    printf("      --spin US     with --shm, spin up to US microseconds waiting for a reply before sleeping\n");
+    printf("  -R, --replay FILE stream only: replay a trace the server captured (server -C), every connection is\n");
+    printf("                    opened again and sent its input at the captured times, then the echoed bytes are checked\n");
+    printf("  -x, --speed X     scale the replay rate, 2 replays twice as fast (default: 1)\n");
+}
@@ -1,3 +1,6 @@
+#define _GNU_SOURCE
+
+#include <getopt.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,18 +12,133 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <signal.h>
+#include <sys/epoll.h>
+
+#include "busypoll.h"
+#include "dgram_batch.h"
+#include "frame.h"
+#include "log.h"
+#include "metrics.h"
+#include "replybatch.h"
+#include "shmring.h"
+#include "splice.h"
+#include "trace.h"
+#include "tuning.h"
 
-#define BACKLOG 3                                   //- Maximum number of pending connections (if linux, you can set it to SOMAXCONN)
-#define BUFFER_SIZE 1024                            //- Message buffer size
 #define SERVER_SOCKET_FILE "/tmp/echo_server.sock"  //- Server socket file path
 
+#define METRICS_SOCKET_FILE "/tmp/unix_echo_server.metrics.sock"  //- Metrics endpoint socket path (see common/metrics.h)
+#define MESSAGE_BATCH 64                                          //- Messages per recvmmsg()/sendmmsg() of the message socket types
+#define MAX_EVENTS 64                                             //- Events per epoll_wait() of the seqpacket type
+
+//* Connection handling engines
+//- MODE_COPY reads every message into a user space buffer, parses it and writes it back.
+//- MODE_SPLICE echoes the byte stream with splice() through a pipe (see common/splice.h), the data stays in the kernel.
+//- A client of the copy mode may move its connection to shared memory rings (see common/shmring.h).
+enum server_mode { MODE_COPY, MODE_SPLICE };
+
+//* Socket types
+//- TYPE_STREAM is a byte stream: messages are framed (see common/frame.h) and one client is served at a time by the
+//- engines above. TYPE_SEQPACKET and TYPE_DGRAM keep the message boundaries, so a message is echoed as it was received,
+//- without framing, and every client is served at once: the seqpacket connections from one epoll loop, the datagrams of
+//- every client from the one bound socket. Both receive and echo up to MESSAGE_BATCH messages per recvmmsg() and
+//- sendmmsg() call (see common/dgram_batch.h).
+enum socket_type { TYPE_STREAM, TYPE_SEQPACKET, TYPE_DGRAM };
+
 void sig_handler(int sig);
+void usage(const char* prog);
+int parse_tuning(int opt, const char* arg);
+int run_splice_mode(int server_fd);
+int run_seqpacket_mode(int server_fd);
+int run_dgram_mode(int server_fd);
+int check_truncated(struct dgram_batch* batch, int count);
+void serve_shmring(struct shmring_channel* channel, struct transfer_stats* stats);
+void log_transfer(const struct transfer_stats* stats);
+
+static struct tuning tuning;  //- Socket buffers, backlog and buffer size (see common/tuning.h), the address options do not apply
 
-int main(void) {
+int main(int argc, char* argv[]) {
     int server_fd, client_fd;                     //- Define a file descriptor for the server socket
     struct sockaddr_un server_addr, client_addr;  //- Define a struct for the server address
-    char buffer[BUFFER_SIZE];                     //- Define a buffer to store the received message
+    char* buffer;                                 //- Define a buffer to store the received message
     ssize_t bytes_received;                       //- Define a variable to store the size of the received message
+    struct frame_parser parser;                   //- Define the message parser state of the connection
+    struct frame_chunk chunk;                     //- Define a variable to store the current message chunk
+    int status;                                   //- Define a variable to store the parser result
+    struct transfer_stats stats;                  //- Define the throughput and CPU time statistics of the connection
+    struct shmring_channel channel;               //- Define the shared memory rings of a connection that moved to them
+    enum server_mode mode = MODE_COPY;            //- Define the connection handling engine
+    enum socket_type type = TYPE_STREAM;          //- Define the socket type
+    int opt;                                      //- Define a variable to store the current command line option
+    uint64_t spin;                                //- Define the busy-polling budget of a receive in nanoseconds
+    struct reply_batch batch;                     //- Define the echoes of the current read, sent together
+    const char* capture = NULL;                   //- Define the capture trace file (NULL: no capture)
+    uint32_t connection;                          //- Define the capture trace id of the connection (0: not captured)
+
+    static const struct option long_options[] = {
+        {"mode", required_argument, NULL, 'm'},
+        {"type", required_argument, NULL, 't'},
+        {"profile", required_argument, NULL, 'p'},
+        {"config", required_argument, NULL, 'c'},
+        {"option", required_argument, NULL, 'o'},
+        {"capture", required_argument, NULL, 'C'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+
+    //* Parse the command line options
+    //- -m, --mode selects the connection handling engine: "copy" (default) or "splice".
+    //- -t, --type selects the socket type: "stream" (default), "seqpacket" or "dgram".
+    //- -p, --profile, -c, --config and -o, --option set the socket tuning, in the order they are given.
+    //- -C, --capture records every connection into a trace file the client can replay (see common/trace.h).
+    tuning_init(&tuning);
+    while ((opt = getopt_long(argc, argv, "m:t:p:c:o:C:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'm':
+                if (strcmp(optarg, "copy") == 0) {
+                    mode = MODE_COPY;
+                } else if (strcmp(optarg, "splice") == 0) {
+                    mode = MODE_SPLICE;
+                } else {
+                    fprintf(stderr, "error: unknown mode '%s'\n", optarg);
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 't':
+                if (strcmp(optarg, "stream") == 0) {
+                    type = TYPE_STREAM;
+                } else if (strcmp(optarg, "seqpacket") == 0) {
+                    type = TYPE_SEQPACKET;
+                } else if (strcmp(optarg, "dgram") == 0) {
+                    type = TYPE_DGRAM;
+                } else {
+                    fprintf(stderr, "error: unknown socket type '%s'\n", optarg);
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'p':
+            case 'c':
+            case 'o':
+                if (parse_tuning(opt, optarg) == -1)
+                    return EXIT_FAILURE;
+                break;
+            case 'C':
+                capture = optarg;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (mode == MODE_SPLICE && type != TYPE_STREAM) {
+        fprintf(stderr, "error: the splice mode needs the stream socket type\n");
+        return EXIT_FAILURE;
+    }
 
     struct sigaction sa;            //- Define a struct for the signal handler
     sa.sa_handler = sig_handler;    //- Set the signal handler function
@@ -29,18 +147,44 @@ int main(void) {
     sigaction(SIGINT, &sa, NULL);   //- Register the signal handler for SIGINT
     sigaction(SIGKILL, &sa, NULL);  //- Register the signal handler for SIGKILL
     sigaction(SIGTERM, &sa, NULL);  //- Register the signal handler for SIGTERM
+    sa.sa_handler = SIG_IGN;        //- writev() to a client that went away fails with EPIPE instead of killing the server
+    sigaction(SIGPIPE, &sa, NULL);  //- Ignore SIGPIPE
+
+    //* Start the asynchronous logger
+    //- Per-message output goes through common/log.h so that formatting and printing run on a background thread.
+    if (log_init() == -1) {
+        perror("error: log writer creation failed, aborting...");
+        return EXIT_FAILURE;
+    }
+
+    //* Start the metrics endpoint
+    //- Connections, bytes, messages, errors and the service time are served on a second Unix socket, e.g.
+    //- socat - UNIX-CONNECT:/tmp/unix_echo_server.metrics.sock
+    if (metrics_init(METRICS_SOCKET_FILE) == -1)
+        perror("error: metrics endpoint creation failed, continuing without it");
 
     //* Create a socket for the server
     //- The socket() syscall creates a new socket and returns a file descriptor that refers to that socket.
     //- The 1st argument, AF_UNIX, specifies the address family of the socket.
-    //- The 2nd argument, SOCK_STREAM, specifies the type of the socket. SOCK_STREAM is used for stream-oriented sockets.
+    //- The 2nd argument specifies the type of the socket. SOCK_STREAM is used for stream-oriented sockets,
+    //- SOCK_SEQPACKET for connections that keep message boundaries and SOCK_DGRAM for connectionless messages.
     //- The 3rd argument, 0, specifies the protocol to be used with the socket.
     //? If the socket() syscall fails, it returns -1.
-    if ((server_fd = socket(PF_UNIX, SOCK_STREAM, 0)) == -1) {
+    if ((server_fd = socket(PF_UNIX, type == TYPE_STREAM ? SOCK_STREAM : type == TYPE_SEQPACKET ? SOCK_SEQPACKET : SOCK_DGRAM, 0)) ==
+        -1) {
         perror("error: socket creation failed, aborting...");
         return EXIT_FAILURE;
     }
 
+    //* Apply the tuning profile
+    //- A Unix socket has no TCP options, only the socket buffers apply. The accepted sockets copy them.
+    tuning_apply(&tuning, server_fd);
+    if ((buffer = malloc(tuning.buffer_size)) == NULL) {
+        perror("error: buffer allocation failed, aborting...");
+        close(server_fd);
+        return EXIT_FAILURE;
+    }
+
     //* Set the source server address
     //- The memset() function fills the server_addr struct with zeros.
     //- The sun_family field will be set to AF_UNIX, which specifies the address family of the socket.
@@ -72,13 +216,52 @@ int main(void) {
     //* Listen for incoming connections
     //- The listen() syscall listens for incoming connections on the server socket.
     //- The 1st argument, server_fd, specifies the file descriptor of the server socket.
-    //- The 2nd argument, 5, specifies the maximum number of pending connections that can be queued.
+    //- The 2nd argument, tuning.backlog, specifies the maximum number of pending connections that can be queued.
+    //- A datagram socket has no connections, it is ready once it is bound.
     //? If the listen() syscall fails, it returns -1.
-    if (listen(server_fd, BACKLOG) == -1) {
+    if (type != TYPE_DGRAM && listen(server_fd, tuning.backlog) == -1) {
         perror("error: socket listening failed, aborting...");
         close(server_fd);
         return EXIT_FAILURE;
     }
+    tuning_print(&tuning, server_fd, stdout);
+    spin = (uint64_t)tuning.spin * 1000;
+
+    //* Open the capture trace
+    //- The copy mode appends a record for every accept, read, write and close of a stream connection to the mapped
+    //- trace file, without a syscall per record. The replay is a byte stream: the message socket types are not
+    //- captured, and neither is the splice mode, whose payload never reaches user space.
+    if (capture != NULL && (type != TYPE_STREAM || mode == MODE_SPLICE)) {
+        printf("capture is only supported by the copy mode of the stream type, not recording\n");
+        capture = NULL;
+    }
+    if (capture != NULL) {
+        if (trace_init(capture, 0) == -1) {
+            perror("error: capture file creation failed, aborting...");
+            close(server_fd);
+            unlink(SERVER_SOCKET_FILE);
+            return EXIT_FAILURE;
+        }
+        printf("capture: recording every connection into %s\n", capture);
+    }
+
+    //* Serve the message socket types
+    if (type != TYPE_STREAM) {
+        status = type == TYPE_SEQPACKET ? run_seqpacket_mode(server_fd) : run_dgram_mode(server_fd);
+        close(server_fd);
+        unlink(SERVER_SOCKET_FILE);
+        return status;
+    }
+
+    //* Serve the connections with the splice engine
+    if (mode == MODE_SPLICE) {
+        if (tuning.spin > 0)
+            printf("busy polling is only supported by the copy mode, blocking at once\n");
+        status = run_splice_mode(server_fd);
+        close(server_fd);
+        unlink(SERVER_SOCKET_FILE);
+        return status;
+    }
 
     //* while loop to accept and handle connections
     while (1) {
@@ -92,32 +275,88 @@ int main(void) {
             perror("error: connection accepting failed, aborting...");
             return EXIT_FAILURE;
         }
+        metrics_add(METRICS_ACCEPTED, 1);
+        transfer_start(&stats);
+
+        //* Offer of the shared memory transport
+        //- The first receive of a connection is a recvmsg() that takes file descriptors as well. A client that sends
+        //- the shared memory offer with its memfd and eventfds is served through the rings from then on, any other
+        //- first message is echoed like the rest.
+        if ((status = shmring_accept(&channel, client_fd, buffer, tuning.buffer_size, &bytes_received, spin)) != 0) {
+            if (status == 1)
+                serve_shmring(&channel, &stats);
+            else {
+                log_error("error: invalid shared memory offer, closing the connection: %e", errno);
+                metrics_add(METRICS_ERRORS, 1);
+            }
+            bytes_received = 0;
+        }
+        //- A connection that moved to the rings is not captured, its messages no longer pass through the socket.
+        connection = status == 0 ? trace_open() : 0;
 
         //* Receive messages from the client
         //- The read() syscall receives messages from the client.
         //- The 1st argument, client_fd, specifies the file descriptor of the client socket.
         //- The 2nd argument, buffer, specifies the buffer to store the received message.
+        //- With a spin budget in the tuning, busypoll_recvfrom() retries a non-blocking receive before it blocks
+        //- (see common/busypoll.h).
+        //- A read() may return part of a message or several messages, the frame parser splits the bytes into messages
+        //- (see common/frame.h). It does not copy anything, every chunk points into buffer.
         //? If the read() syscall fails, it returns -1.
-        while ((bytes_received = read(client_fd, buffer, BUFFER_SIZE)) > 0) {
-            buffer[bytes_received] = '\0';  //- Add a null terminator to the end of the buffer
-            printf("received message (%4ld byte): %s\n", bytes_received, buffer);
-
-            //* Write messages to the client
-            //- The write() syscall sends messages to the client.
-            //- The 1st argument, client_fd, specifies the file descriptor of the client socket.
-            //- The 2nd argument, buffer, specifies the buffer that contains the message to be sent.
-            //- The 3rd argument, strlen(buffer), specifies the size of the message.
-            //? If the write() syscall fails, it returns -1.
-            if (write(client_fd, buffer, strlen(buffer)) == -1) {
-                perror("error: message sending failed, aborting...");
-                close(client_fd);
-                continue;
+        frame_parser_init(&parser);
+        reply_batch_init(&batch, client_fd, 0, connection);  //- TCP_CORK does not apply to a Unix socket
+        while (bytes_received > 0) {
+            uint64_t start = metrics_now();
+            const char* data = buffer;
+            size_t len = bytes_received;
+
+            metrics_add(METRICS_BYTES_RECEIVED, bytes_received);
+            trace_record(connection, TRACE_IN, buffer, bytes_received);
+            stats.bytes += bytes_received;
+            while ((status = frame_parse(&parser, &data, &len, &chunk)) == 1) {
+                if (chunk.offset == 0) {
+                    metrics_add(METRICS_MESSAGES, 1);
+                    log_info_data(chunk.data, chunk.len, "received message (%4u byte): %s", chunk.length);
+                }
+
+                //* Queue the echo of the message
+                //- reply_batch_add() collects the header and the payload chunk, the echoes of the whole read are
+                //- written together below. The rest of a message that was split over several reads follows as it arrives.
+                //? It returns -1 if a batch that filled up could not be written.
+                if (reply_batch_add(&batch, &chunk) == -1) {
+                    log_error("error: message sending failed: %e", errno);
+                    metrics_add(METRICS_ERRORS, 1);
+                    break;
+                }
+                if (chunk.offset == 0)
+                    log_info_data(chunk.data, chunk.len, "   reply message (%4u byte): %s", chunk.length);
             }
-            printf("   reply message (%4ld byte): %s\n", bytes_received, buffer);
+
+            //* Write the echoes of the read
+            //- One sendmsg() for every message of the read (see common/replybatch.h), the messages before an invalid
+            //- one included.
+            if (status != 1 && reply_batch_flush(&batch) == -1) {
+                log_error("error: message sending failed: %e", errno);
+                metrics_add(METRICS_ERRORS, 1);
+                status = 1;
+            }
+            metrics_record_service(start);
+            if (status != 0) {
+                if (status == -1 && errno == EMSGSIZE) {
+                    log_error("error: invalid message from client, closing the connection: %e", errno);
+                    metrics_add(METRICS_ERRORS, 1);
+                }
+                break;
+            }
+            bytes_received = spin > 0 ? busypoll_recvfrom(client_fd, buffer, tuning.buffer_size, NULL, NULL, spin)
+                                      : read(client_fd, buffer, tuning.buffer_size);
         }
 
         //* Close the client socket
         close(client_fd);
+        metrics_add(METRICS_CLOSED, 1);
+        trace_close(connection);
+        log_transfer(&stats);
     }
 
     //* Close the server socket
@@ -126,6 +365,281 @@ int main(void) {
     return EXIT_SUCCESS;
 }
 
+//* Serve one connection at a time with splice()
+//- Every received byte goes from the socket into a pipe and from the pipe back into the socket, without passing
+//- through user space and without the receive buffer of the copy mode: one splice_echo() call moves up to a pipe-full
+//- (1 MB if the kernel allows it). The bytes are not parsed, so messages are neither counted nor logged.
+int run_splice_mode(int server_fd) {
+    int client_fd;                //- Define a file descriptor for the client socket
+    int pipe_fds[2];              //- Define the pipe the echoed bytes pass through
+    ssize_t pipe_size;            //- Define the capacity of the pipe
+    ssize_t bytes_echoed;         //- Define a variable to store the size of the current echo
+    struct transfer_stats stats;  //- Define the throughput and CPU time statistics of the connection
+
+    if ((pipe_size = splice_pipe(pipe_fds)) == -1) {
+        perror("error: pipe creation failed, aborting...");
+        return EXIT_FAILURE;
+    }
+    printf("mode: splice (kernel-side echo through a %zd byte pipe)\n", pipe_size);
+
+    while (1) {
+        if ((client_fd = accept(server_fd, NULL, NULL)) == -1) {
+            perror("error: connection accepting failed, aborting...");
+            return EXIT_FAILURE;
+        }
+        metrics_add(METRICS_ACCEPTED, 1);
+
+        transfer_start(&stats);
+        while ((bytes_echoed = splice_echo(client_fd, pipe_fds, pipe_size)) > 0) {
+            metrics_add(METRICS_BYTES_RECEIVED, bytes_echoed);
+            metrics_add(METRICS_BYTES_SENT, bytes_echoed);
+            stats.bytes += bytes_echoed;
+        }
+
+        //- A failed echo may leave bytes in the pipe, they must not leak into the next connection.
+        if (bytes_echoed == -1) {
+            log_error("error: splice failed, closing the connection: %e", errno);
+            metrics_add(METRICS_ERRORS, 1);
+            close(pipe_fds[0]);
+            close(pipe_fds[1]);
+            if ((pipe_size = splice_pipe(pipe_fds)) == -1) {
+                perror("error: pipe creation failed, aborting...");
+                return EXIT_FAILURE;
+            }
+        }
+
+        close(client_fd);
+        metrics_add(METRICS_CLOSED, 1);
+        log_transfer(&stats);
+    }
+}
+
+//* Serve every seqpacket connection at once from an epoll loop
+//- The listening socket and the connections are registered level-triggered, so a connection that still has messages
+//- queued after one batch is reported again by the next epoll_wait() and no client can starve the others. A readable
+//- connection is drained by one recvmmsg() (it returns as soon as the first message is there) and its batch echoed by
+//- one sendmmsg(). A message keeps its boundaries, so it goes back as it came, without a frame header.
+//? recvmmsg() cannot tell an empty message from the end of the connection, so like read() a zero-length message ends
+//? the connection.
+int run_seqpacket_mode(int server_fd) {
+    struct epoll_event events[MAX_EVENTS];  //- Define the events of one epoll_wait() call
+    struct dgram_batch batch;               //- Define the message batch shared by every connection
+    int epoll_fd;                           //- Define the epoll instance
+    int ready, count, end;                  //- Define the number of events, received messages and messages to echo
+    size_t connections = 0;                 //- Define the number of open connections
+
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1 ||
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &(struct epoll_event){.events = EPOLLIN, .data.fd = server_fd}) == -1) {
+        perror("error: epoll instance creation failed, aborting...");
+        return EXIT_FAILURE;
+    }
+    if (dgram_batch_init(&batch, MESSAGE_BATCH, tuning.buffer_size) == -1) {
+        perror("error: batch allocation failed, aborting...");
+        close(epoll_fd);
+        return EXIT_FAILURE;
+    }
+    printf("mode: seqpacket (every connection from one epoll loop, up to %d messages per recvmmsg())\n", MESSAGE_BATCH);
+
+    while (1) {
+        if ((ready = epoll_wait(epoll_fd, events, MAX_EVENTS, -1)) == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("error: epoll_wait failed, aborting...");
+            break;
+        }
+        for (int i = 0; i < ready; i++) {
+            int fd = events[i].data.fd;
+
+            //* Accept a new connection and watch it along with the others
+            if (fd == server_fd) {
+                int client_fd;
+
+                if ((client_fd = accept4(server_fd, NULL, NULL, SOCK_CLOEXEC)) == -1) {
+                    log_error("error: connection accepting failed: %e", errno);
+                    metrics_add(METRICS_ERRORS, 1);
+                    continue;
+                }
+                if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &(struct epoll_event){.events = EPOLLIN, .data.fd = client_fd}) == -1) {
+                    log_error("error: connection registration failed: %e", errno);
+                    metrics_add(METRICS_ERRORS, 1);
+                    close(client_fd);
+                    continue;
+                }
+                metrics_add(METRICS_ACCEPTED, 1);
+                log_info("client connected, %u connections open", ++connections);
+                continue;
+            }
+
+            //* Echo the queued messages of a connection
+            //- Messages up to the first empty one are echoed. The empty one, a truncated message or a failure closes
+            //- the connection.
+            uint64_t start = metrics_now();
+            int open = 1;
+
+            if ((count = dgram_batch_recv(&batch, fd)) == -1) {
+                if (errno != ECONNRESET) {
+                    log_error("error: message receiving failed: %e", errno);
+                    metrics_add(METRICS_ERRORS, 1);
+                }
+                count = 0;
+                open = 0;
+            }
+            for (end = 0; end < count && batch.msgs[end].msg_len > 0; end++)
+                ;
+            if (end < count)
+                open = 0;
+            if (check_truncated(&batch, end) == -1) {
+                end = 0;
+                open = 0;
+            }
+            if (end > 0) {
+                for (int j = 0; j < end; j++) {
+                    metrics_add(METRICS_BYTES_RECEIVED, batch.msgs[j].msg_len);
+                    log_info_data(batch.iovs[j].iov_base, batch.msgs[j].msg_len, "received message (%4u byte): %s", batch.msgs[j].msg_len);
+                }
+                metrics_add(METRICS_MESSAGES, end);
+                if (dgram_batch_echo(&batch, fd, end) == -1) {
+                    log_error("error: message sending failed: %e", errno);
+                    metrics_add(METRICS_ERRORS, 1);
+                    open = 0;
+                } else {
+                    for (int j = 0; j < end; j++) metrics_add(METRICS_BYTES_SENT, batch.msgs[j].msg_len);
+                }
+                metrics_record_service(start);
+            }
+            if (open)
+                continue;
+
+            //- close() also removes the socket from the epoll instance.
+            close(fd);
+            metrics_add(METRICS_CLOSED, 1);
+            log_info("client disconnected, %u connections open", --connections);
+        }
+    }
+    dgram_batch_free(&batch);
+    close(epoll_fd);
+    return EXIT_FAILURE;
+}
+
+//* Echo the datagrams of every client from the bound socket
+//- Each recvmmsg() takes up to MESSAGE_BATCH queued datagrams, whoever sent them, and one sendmmsg() returns each to
+//- the address it came from. A client has to bind its socket to receive the echoes (an autobind address will do).
+//- The spin budget of the tuning makes the receive busy-poll before it blocks (see common/busypoll.h).
+int run_dgram_mode(int server_fd) {
+    struct dgram_batch batch;  //- Define the datagram batch
+    int count;                 //- Define the number of received datagrams
+
+    if (dgram_batch_init(&batch, MESSAGE_BATCH, tuning.buffer_size) == -1) {
+        perror("error: batch allocation failed, aborting...");
+        return EXIT_FAILURE;
+    }
+    batch.spin = (uint64_t)tuning.spin * 1000;
+    printf("mode: dgram (every client on one socket, up to %d datagrams per recvmmsg())\n", MESSAGE_BATCH);
+
+    while ((count = dgram_batch_recv(&batch, server_fd)) != -1) {
+        uint64_t start = metrics_now();
+
+        //- A truncated datagram is echoed truncated: the sender learns that its message did not fit.
+        check_truncated(&batch, count);
+        for (int i = 0; i < count; i++) {
+            metrics_add(METRICS_BYTES_RECEIVED, batch.msgs[i].msg_len);
+            log_info_data(batch.iovs[i].iov_base, batch.msgs[i].msg_len, "received message (%4u byte): %s", batch.msgs[i].msg_len);
+        }
+        metrics_add(METRICS_MESSAGES, count);
+
+        //- An unbound client cannot get an echo. The failed send only costs that batch its replies.
+        if (dgram_batch_echo(&batch, server_fd, count) == -1) {
+            log_error("error: message sending failed: %e", errno);
+            metrics_add(METRICS_ERRORS, 1);
+        } else {
+            for (int i = 0; i < count; i++) metrics_add(METRICS_BYTES_SENT, batch.msgs[i].msg_len);
+        }
+        metrics_record_service(start);
+    }
+    perror("error: message receiving failed, aborting...");
+    dgram_batch_free(&batch);
+    return EXIT_FAILURE;
+}
+
+//* Count and log the messages of a batch that did not fit into a buffer (buffer_size of the tuning)
+//? Returns -1 if a message was truncated.
+int check_truncated(struct dgram_batch* batch, int count) {
+    int truncated = 0;
+
+    for (int i = 0; i < count; i++) {
+        if (batch->msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+            log_error("error: message larger than the %u byte buffer truncated", batch->buffer_size);
+            metrics_add(METRICS_ERRORS, 1);
+            truncated = 1;
+        }
+    }
+    return truncated ? -1 : 0;
+}
+
+//* Serve a connection through the shared memory rings until the client hangs up
+//- Every message is read in place from the request ring and copied once into the reply ring, no syscall is made
+//- while the client keeps the rings busy. The spin budget of the tuning applies to the wait for the next message.
+void serve_shmring(struct shmring_channel* channel, struct transfer_stats* stats) {
+    const void* data;  //- Define a pointer to the current message in the request ring
+    size_t len;        //- Define the size of the current message
+    int status;        //- Define a variable to store the result of shmring_recv()
+
+    log_info("client moved to the shared memory transport (%u KB rings)", channel->capacity / 1024);
+    while ((status = shmring_recv(channel, &data, &len)) == 1) {
+        uint64_t start = metrics_now();
+
+        metrics_add(METRICS_BYTES_RECEIVED, len + FRAME_HEADER_SIZE);
+        metrics_add(METRICS_MESSAGES, 1);
+        log_info_data(data, len, "received message (%4u byte): %s", len);
+        if (shmring_send(channel, data, len) == -1) {
+            log_error("error: message sending failed: %e", errno);
+            metrics_add(METRICS_ERRORS, 1);
+            break;
+        }
+        log_info_data(data, len, "   reply message (%4u byte): %s", len);
+        shmring_release(channel);
+        metrics_add(METRICS_BYTES_SENT, len + FRAME_HEADER_SIZE);
+        metrics_add(METRICS_BUSY_POLL_HITS, channel->spin_hits);
+        metrics_add(METRICS_BUSY_POLL_SLEEPS, channel->spin_sleeps);
+        channel->spin_hits = channel->spin_sleeps = 0;
+        stats->bytes += len;
+        metrics_record_service(start);
+    }
+    if (status == -1) {
+        log_error("error: message receiving failed, closing the connection: %e", errno);
+        metrics_add(METRICS_ERRORS, 1);
+    }
+    shmring_close(channel);
+}
+
+//* Apply a tuning command line option: a profile (-p), a configuration file (-c) or one setting (-o)
+//? Returns -1 after printing the error.
+int parse_tuning(int opt, const char* arg) {
+    if (opt == 'c' && tuning_load(&tuning, arg) == -1) {
+        if (errno != EINVAL)
+            perror("error: reading the configuration file failed, aborting...");
+        return -1;
+    }
+    if (opt == 'p' && tuning_profile(&tuning, arg) == -1) {
+        fprintf(stderr, "error: unknown tuning profile '%s'\n", arg);
+        return -1;
+    }
+    if (opt == 'o' && tuning_option(&tuning, arg) == -1) {
+        fprintf(stderr, "error: invalid tuning option '%s'\n", arg);
+        return -1;
+    }
+    return 0;
+}
+
+//* Log the throughput and CPU time per GB of a finished connection
+void log_transfer(const struct transfer_stats* stats) {
+    struct transfer_result result;
+
+    transfer_finish(stats, &result);
+    log_info("client disconnected: %u KB echoed in %u ms, %u MB/s, %u ms CPU per GB", stats->bytes / 1000, result.elapsed_ms,
+             result.mb_per_s, result.cpu_ms_per_gb);
+}
+
 //* Signal handler function
 void sig_handler(int sig) {
     switch (sig) {
@@ -135,7 +649,26 @@ void sig_handler(int sig) {
         case SIGTERM:
             printf("\nSignal received, exiting...\n");
             unlink(SERVER_SOCKET_FILE);  //- Remove the server socket file
+            exit(EXIT_SUCCESS);
         default:
             break;
     }
-}
\ No newline at end of file
+}
+
+void usage(const char* prog) {
+    printf("usage: %s [-t stream|seqpacket|dgram] [-m copy|splice] [-p profile] [-c file] [-o key=value] [-C file]\n", prog);
+    printf("  -t, --type TYPE     socket type (default: stream)\n");
+    printf("                      stream:    byte stream with framed messages, one client at a time\n");
+    printf("                      seqpacket: connections that keep message boundaries, every client at once\n");
+    printf("                      dgram:     connectionless messages from every client on one socket\n");
+    printf("                      seqpacket and dgram echo up to %d messages per recvmmsg()/sendmmsg()\n", MESSAGE_BATCH);
+    printf("  -m, --mode MODE     connection handling engine of the stream type (default: copy)\n");
+    printf("                      copy:   read()/writev() through a user space buffer, messages are parsed and logged,\n");
+    printf("                              a client may move to shared memory rings (client --shm)\n");
+    printf("                      splice: kernel-side echo with splice() through a pipe, for bulk streams\n");
+    printf("  -p, --profile NAME  socket tuning profile: default, latency, throughput or many-connections\n");
+    printf("  -c, --config FILE   read tuning settings from FILE, one \"key = value\" per line\n");
+    printf("  -o, --option K=V    change one tuning setting: backlog, rcvbuf, sndbuf, spin or buffer_size (the TCP and\n");
+    printf("                      busy_poll settings are accepted and ignored)\n");
+    printf("  -C, --capture FILE  record every connection into the trace FILE for a client replay (stream type, copy mode)\n");
+}
@@ -7,16 +7,114 @@
 #include <netdb.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <time.h>
 
-#define BUFFER_SIZE 1024       //- Message buffer size
-#define SERVER_IP "127.0.0.1"  //- Server IP address
-#define SERVER_PORT 8080       //- Server port number
+#include "udp_gso.h"
+#include "udpgen.h"
 
-int main(void) {
-    int sock_fd;                                  //- Define a file descriptor for the server socket
-    struct sockaddr_in server_addr, client_addr;  //- Define structs for the server and client addresses
-    char buffer[BUFFER_SIZE];                     //- Define a buffer to store the received message
-    ssize_t bytes_received;                       //- Define a variable to store the size of the received message
+#define BUFFER_SIZE 1024                      //- Message buffer size
+#define SERVER_IP "127.0.0.1"                 //- Server IP address
+#define SERVER_PORT 8080                      //- Server port number
+#define BULK_DRAIN_TIMEOUT 1000               //- Milliseconds to wait for late echoes after the last bulk send
+#define BULK_SOCKET_BUFFER (8 * 1024 * 1024)  //- Socket buffer size requested in bulk mode
+
+//* Bulk mode settings
+struct bulk_options {
+    long count;  //- Number of datagrams to send
+    long size;   //- Payload size of one datagram
+    int gso;     //- Send up to UDP_GSO_MAX_SEGMENTS datagrams per sendmsg() with UDP_SEGMENT
+    int gro;     //- Receive coalesced echoes with UDP_GRO
+};
+
+void usage(const char* prog);
+int run_flood_mode(int sock_fd, struct udpgen_options* options, int csv);
+int run_bulk_mode(int sock_fd, const struct bulk_options* options);
+long bulk_receive(int sock_fd, char* buffer, int gro, long* recv_calls);
+double elapsed_seconds(const struct timespec* start, const struct timespec* end);
+
+int main(int argc, char* argv[]) {
+    int sock_fd;                                   //- Define a file descriptor for the server socket
+    struct sockaddr_in server_addr, client_addr;   //- Define structs for the server and client addresses
+    char buffer[BUFFER_SIZE];                      //- Define a buffer to store the received message
+    ssize_t bytes_received;                        //- Define a variable to store the size of the received message
+    struct bulk_options bulk = {0, 64, 0, 0};      //- Define the bulk mode settings (count 0 means interactive mode)
+    struct udpgen_options flood = {0, 5, 64, 64};  //- Define the flood mode settings (rate, duration, size, batch)
+    int flood_mode = 0;                            //- Define a flag for the open-loop flood mode
+    int csv = 0;                                   //- Define a flag for the machine-readable flood report
+    int opt;                                       //- Define a variable to store the current command line option
+
+    static const struct option long_options[] = {
+        {"bulk", required_argument, NULL, 'n'},
+        {"size", required_argument, NULL, 's'},
+        {"gso", no_argument, NULL, 'G'},
+        {"gro", no_argument, NULL, 'g'},
+        {"flood", no_argument, NULL, 'f'},
+        {"rate", required_argument, NULL, 'r'},
+        {"duration", required_argument, NULL, 'd'},
+        {"batch", required_argument, NULL, 'B'},
+        {"csv", no_argument, NULL, 'C'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+
+    //* Parse the command line options
+    //- Without options the client is an interactive prompt. -n, --bulk N sends N datagrams as fast as possible instead,
+    //- -f, --flood sends sequenced datagrams at a fixed rate and accounts for every echo.
+    while ((opt = getopt_long(argc, argv, "n:s:Ggfr:d:B:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'n':
+                if ((bulk.count = strtol(optarg, NULL, 10)) <= 0) {
+                    fprintf(stderr, "error: invalid datagram count '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 's':
+                if ((bulk.size = strtol(optarg, NULL, 10)) <= 0 || bulk.size > UDP_GSO_BUFFER_SIZE / 2) {
+                    fprintf(stderr, "error: payload size must be between 1 and %d\n", UDP_GSO_BUFFER_SIZE / 2);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'G':
+                bulk.gso = 1;
+                break;
+            case 'g':
+                bulk.gro = 1;
+                break;
+            case 'f':
+                flood_mode = 1;
+                break;
+            case 'r':
+                if ((flood.rate = strtod(optarg, NULL)) < 0) {
+                    fprintf(stderr, "error: invalid rate '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'd':
+                if ((flood.duration = strtod(optarg, NULL)) <= 0) {
+                    fprintf(stderr, "error: invalid duration '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'B':
+                if ((flood.batch = strtol(optarg, NULL, 10)) < 1 || flood.batch > UDPGEN_BATCH_MAX) {
+                    fprintf(stderr, "error: batch size must be between 1 and %d\n", UDPGEN_BATCH_MAX);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'C':
+                csv = 1;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
 
     //* Create a socket for the server
     //- The socket() syscall creates a new socket and returns a file descriptor that refers to that socket.
@@ -51,6 +149,13 @@ int main(void) {
         return EXIT_FAILURE;
     }
 
+    if (flood_mode) {
+        flood.size = bulk.size;
+        return run_flood_mode(sock_fd, &flood, csv);
+    }
+    if (bulk.count > 0)
+        return run_bulk_mode(sock_fd, &bulk);
+
     //* while loop to send and receive messages
     while (1) {
         printf("client> ");
@@ -106,4 +211,143 @@ int main(void) {
     //* Close the client socket
     close(sock_fd);
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
+
+//* Send sequenced datagrams at a fixed rate and report loss, duplicates, reordering and round-trip times
+//- The socket buffers are enlarged like in bulk mode, so short bursts of the receive thread are absorbed by the kernel
+//- instead of being counted as loss.
+int run_flood_mode(int sock_fd, struct udpgen_options* options, int csv) {
+    struct udpgen_result* result;
+
+    if (options->size < UDPGEN_HEADER_SIZE) {
+        fprintf(stderr, "error: flood datagrams need at least %d bytes for the sequence header\n", UDPGEN_HEADER_SIZE);
+        close(sock_fd);
+        return EXIT_FAILURE;
+    }
+    setsockopt(sock_fd, SOL_SOCKET, SO_RCVBUF, &(int){BULK_SOCKET_BUFFER}, sizeof(int));
+    setsockopt(sock_fd, SOL_SOCKET, SO_SNDBUF, &(int){BULK_SOCKET_BUFFER}, sizeof(int));
+
+    //- The result embeds a histogram (~30 KB), keep it off the stack.
+    if ((result = malloc(sizeof *result)) == NULL || udpgen_run(sock_fd, options, result) == -1) {
+        perror("error: flood mode failed, aborting...");
+        free(result);
+        close(sock_fd);
+        return EXIT_FAILURE;
+    }
+    if (csv)
+        udpgen_report_csv(options, result, stdout);
+    else
+        udpgen_report(options, result, stdout);
+    free(result);
+    close(sock_fd);
+    return EXIT_SUCCESS;
+}
+
+//* Send a burst of same-sized datagrams and count the echoes
+//- Without --gso every datagram costs one send() syscall. With --gso up to UDP_GSO_MAX_SEGMENTS datagrams (at most
+//- 64 KB) leave in one sendmsg() with a UDP_SEGMENT control message, the kernel splits them into separate datagrams.
+//- Echoes are drained without blocking between sends, and for BULK_DRAIN_TIMEOUT ms after the last one.
+int run_bulk_mode(int sock_fd, const struct bulk_options* options) {
+    static char payload[UDP_GSO_BUFFER_SIZE], buffer[UDP_GSO_BUFFER_SIZE];
+    char control[UDP_GSO_CONTROL_SIZE];
+    long per_send = 1, sent = 0, received = 0, send_calls = 0, recv_calls = 0;
+    struct timespec start, send_end, last_echo;
+
+    if (options->gso) {
+        per_send = (UDP_GSO_BUFFER_SIZE - 1024) / options->size;
+        if (per_send > UDP_GSO_MAX_SEGMENTS)
+            per_send = UDP_GSO_MAX_SEGMENTS;
+    }
+    if (options->gro && udp_gro_enable(sock_fd) == -1) {
+        perror("error: UDP_GRO is not available, aborting...");
+        close(sock_fd);
+        return EXIT_FAILURE;
+    }
+    setsockopt(sock_fd, SOL_SOCKET, SO_RCVBUF, &(int){BULK_SOCKET_BUFFER}, sizeof(int));
+    setsockopt(sock_fd, SOL_SOCKET, SO_SNDBUF, &(int){BULK_SOCKET_BUFFER}, sizeof(int));
+    for (long i = 0; i < options->size * per_send; i++) payload[i] = 'a' + i % 26;
+
+    printf("bulk: %ld datagrams of %ld byte, %ld per send%s%s\n", options->count, options->size, per_send, options->gso ? " (GSO)" : "",
+           options->gro ? ", GRO receive" : "");
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (sent < options->count) {
+        long segments = options->count - sent < per_send ? options->count - sent : per_send;
+        struct iovec iov = {payload, segments * options->size};
+        struct msghdr msg = {0};
+
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        if (segments > 1)
+            udp_gso_set(&msg, control, options->size);
+
+        if (sendmsg(sock_fd, &msg, 0) == -1) {
+            if (errno == ENOBUFS || errno == EAGAIN || errno == ECONNREFUSED || errno == EINTR)
+                continue;  //- Queue full or server not reachable yet, try again
+            perror("error: message sending failed, aborting...");
+            close(sock_fd);
+            return EXIT_FAILURE;
+        }
+        send_calls++;
+        sent += segments;
+        received += bulk_receive(sock_fd, buffer, options->gro, &recv_calls);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &send_end);
+    last_echo = send_end;
+
+    //* Collect the echoes still in flight
+    //- The receive rate is measured up to the last echo, not up to the end of the drain timeout.
+    while (received < sent && poll(&(struct pollfd){sock_fd, POLLIN, 0}, 1, BULK_DRAIN_TIMEOUT) > 0) {
+        received += bulk_receive(sock_fd, buffer, options->gro, &recv_calls);
+        clock_gettime(CLOCK_MONOTONIC, &last_echo);
+    }
+
+    printf("sent     %ld datagrams in %ld syscalls (%.0f pps)\n", sent, send_calls, sent / elapsed_seconds(&start, &send_end));
+    printf("received %ld datagrams in %ld syscalls (%.0f pps), %.2f%% lost\n", received, recv_calls,
+           received / elapsed_seconds(&start, &last_echo), 100.0 * (sent - received) / sent);
+    close(sock_fd);
+    return EXIT_SUCCESS;
+}
+
+//* Drain the echoes that are already queued on the socket
+//? Returns the number of received datagrams (a GRO super-buffer counts as all of its segments).
+long bulk_receive(int sock_fd, char* buffer, int gro, long* recv_calls) {
+    char control[UDP_GSO_CONTROL_SIZE];
+    long received = 0;
+    ssize_t len;
+
+    while (1) {
+        struct iovec iov = {buffer, UDP_GSO_BUFFER_SIZE};
+        struct msghdr msg = {0};
+        int segment_size;
+
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof control;
+        if ((len = recvmsg(sock_fd, &msg, MSG_DONTWAIT)) == -1)
+            return received;
+        (*recv_calls)++;
+
+        segment_size = gro ? udp_gro_segment_size(&msg) : 0;
+        received += segment_size > 0 ? (len + segment_size - 1) / segment_size : 1;
+    }
+}
+
+double elapsed_seconds(const struct timespec* start, const struct timespec* end) {
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+void usage(const char* prog) {
+    printf("usage: %s [-n count [-s size] [--gso] [--gro]] [-f [-r rate] [-d seconds] [-s size] [-B batch] [--csv]]\n", prog);
+    printf("  without options the client reads messages from stdin and prints the echoes\n");
+    printf("  -n, --bulk N      send N datagrams as fast as possible and report the packet rate\n");
+    printf("  -s, --size S      payload size of one bulk or flood datagram (default: 64)\n");
+    printf("      --gso         send up to %d datagrams per sendmsg() with UDP_SEGMENT\n", UDP_GSO_MAX_SEGMENTS);
+    printf("      --gro         receive the echoes with UDP_GRO\n");
+    printf("  -f, --flood       send sequenced datagrams open-loop and report loss, duplicates, reordering and RTT\n");
+    printf("  -r, --rate R      flood rate in datagrams per second (default: 0, as fast as possible)\n");
+    printf("  -d, --duration S  flood duration in seconds (default: 5)\n");
+    printf("  -B, --batch N     datagrams per sendmmsg()/recvmmsg() in flood mode (default: 64)\n");
+    printf("      --csv         print the flood results as one comma-separated line (see bench.sh for the columns)\n");
+}
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -8,18 +10,81 @@
 #include <netinet/in.h>
 #include <signal.h>
 #include <errno.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "busypoll.h"
+#include "dgram_batch.h"
+#include "log.h"
+#include "metrics.h"
+#include "ratelimit.h"
+#include "tuning.h"
+#include "udp_gso.h"
+
+#define STATS_INTERVAL 5                       //- Seconds between two batch statistics reports
+#define BATCH_SOCKET_BUFFER (4 * 1024 * 1024)  //- Socket buffer size requested in batch mode (capped by net.core.rmem_max)
+
+#define METRICS_SOCKET_FILE "/tmp/udp_echo_server.metrics.sock"  //- Metrics endpoint socket path (see common/metrics.h)
 
-#define BUFFER_SIZE 1024       //- Buffer size
-#define SERVER_IP "127.0.0.1"  //- Server ip address
-#define SERVER_PORT 8080       //- Server port number
+static struct dgram_batch batch;  //- recvmmsg()/sendmmsg() batch, global so that the exit handler can report it
+static struct tuning tuning;      //- Address, socket buffers, busy polling and buffer size (see common/tuning.h)
+static struct ratelimit limit;    //- Per-source token buckets, used if tuning.rate_limit is set (see common/ratelimit.h)
 
 void sig_handler(int sig);
+void usage(const char* prog);
+int parse_tuning(int opt, const char* arg);
+void report_batch_stats(void);
+int run_simple_mode(int client_fd);
+int run_batch_mode(int client_fd, unsigned batch_size, int gro);
+int within_rate(const struct mmsghdr* msg, unsigned datagrams, void* context);
 
-int main(void) {
-    int client_fd;                                //- Define a file descriptor for the server socket
-    struct sockaddr_in server_addr, client_addr;  //- Define structs for the server and client addresses
-    char buffer[BUFFER_SIZE];                     //- Define a buffer to store the received message
-    ssize_t bytes_received;                       //- Define a variable to store the size of the received message
+int main(int argc, char* argv[]) {
+    int client_fd;                   //- Define a file descriptor for the server socket
+    struct sockaddr_in server_addr;  //- Define a struct for the server address
+    long batch_size = 1;             //- Define the number of datagrams per recvmmsg() call (1 disables batching)
+    int gro = 0;                     //- Define whether UDP_GRO/UDP_SEGMENT segmentation offload is used
+    int opt;                         //- Define a variable to store the current command line option
+
+    static const struct option long_options[] = {
+        {"batch", required_argument, NULL, 'b'},
+        {"gro", no_argument, NULL, 'g'},
+        {"profile", required_argument, NULL, 'p'},
+        {"config", required_argument, NULL, 'c'},
+        {"option", required_argument, NULL, 'o'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+
+    //* Parse the command line options
+    //- -b, --batch N receives up to N datagrams per recvmmsg() call and replies with one sendmmsg() call.
+    //- -g, --gro receives coalesced GRO super-buffers and echoes them back as one GSO send each.
+    //- -p, --profile, -c, --config and -o, --option set the socket tuning, in the order they are given.
+    tuning_init(&tuning);
+    while ((opt = getopt_long(argc, argv, "b:gp:c:o:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'b':
+                if ((batch_size = strtol(optarg, NULL, 10)) < 1 || batch_size > DGRAM_BATCH_MAX) {
+                    fprintf(stderr, "error: batch size must be between 1 and %d\n", DGRAM_BATCH_MAX);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'g':
+                gro = 1;
+                break;
+            case 'p':
+            case 'c':
+            case 'o':
+                if (parse_tuning(opt, optarg) == -1)
+                    return EXIT_FAILURE;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
 
     struct sigaction sa;            //- Define a struct for the signal handler
     sa.sa_handler = sig_handler;    //- Set the signal handler function
@@ -29,6 +94,19 @@ int main(void) {
     sigaction(SIGKILL, &sa, NULL);  //- Register the signal handler for SIGKILL
     sigaction(SIGTERM, &sa, NULL);  //- Register the signal handler for SIGTERM
 
+    //* Start the asynchronous logger
+    //- Per-datagram output goes through common/log.h so that formatting and printing run on a background thread.
+    if (log_init() == -1) {
+        perror("error: log writer creation failed, aborting...");
+        return EXIT_FAILURE;
+    }
+
+    //* Start the metrics endpoint
+    //- Bytes, datagrams, errors and the service time are served on a Unix socket, e.g.
+    //- socat - UNIX-CONNECT:/tmp/udp_echo_server.metrics.sock
+    if (metrics_init(METRICS_SOCKET_FILE) == -1)
+        perror("error: metrics endpoint creation failed, continuing without it");
+
     //* Create a socket for the server
     //- The socket() syscall creates a new socket and returns a file descriptor that refers to that socket.
     //- The 1st argument, PF_INET, specifies the address family of the socket.
@@ -40,6 +118,15 @@ int main(void) {
         return EXIT_FAILURE;
     }
 
+    //* Apply the tuning profile
+    //- A burst of datagrams (or a few 64 KB GRO super-buffers) overflows the default receive buffer long before a
+    //- batch is drained, so the batch mode enlarges the socket buffers unless the profile sized them.
+    if (batch_size > 1 || gro) {
+        tuning.rcvbuf = tuning.rcvbuf > 0 ? tuning.rcvbuf : BATCH_SOCKET_BUFFER;
+        tuning.sndbuf = tuning.sndbuf > 0 ? tuning.sndbuf : BATCH_SOCKET_BUFFER;
+    }
+    tuning_apply(&tuning, client_fd);
+
     //* Set the server address
     //- The memset() function fills the server_addr struct with zeros.
     //- The sin_addr.s_addr field of the server_addr struct is set to the IP address of the server.
@@ -47,8 +134,8 @@ int main(void) {
     //- The sin_family field will be set to PF_INET, which specifies the address family of the socket.
     memset(&server_addr, 0, sizeof server_addr);
     server_addr.sin_family = PF_INET;                    // IPv4
-    server_addr.sin_port = htons(SERVER_PORT);           // port number
-    server_addr.sin_addr.s_addr = inet_addr(SERVER_IP);  // Host address
+    server_addr.sin_port = htons(tuning.port);           // port number
+    server_addr.sin_addr.s_addr = inet_addr(tuning.ip);  // Host address
 
     //* Bind the server address to the server socket
     //- The bind() syscall binds the server address to the server socket.
@@ -67,24 +154,64 @@ int main(void) {
             return EXIT_FAILURE;
         }
     }
-    printf("server listening on %s:%d\n", SERVER_IP, SERVER_PORT);
+    printf("server listening on %s:%d\n", tuning.ip, tuning.port);
+    tuning_print(&tuning, client_fd, stdout);
+    if (tuning.spin > 0)
+        printf("busy poll: spinning up to %d us before every blocking receive\n", tuning.spin);
+
+    //* Set up the rate limit
+    //- Every source address gets a token bucket of rate_limit datagrams per second. A datagram over the limit is
+    //- dropped right after the receive: it is neither logged nor echoed, only counted in echo_rate_limited_total.
+    if (tuning.rate_limit > 0) {
+        if (ratelimit_init(&limit, tuning.rate_limit, tuning.rate_burst) == -1) {
+            perror("error: rate limiter allocation failed, aborting...");
+            close(client_fd);
+            return EXIT_FAILURE;
+        }
+        printf("rate limit: %d datagrams per second and source, bursts of %d\n", tuning.rate_limit,
+               tuning.rate_burst > 0 ? tuning.rate_burst : tuning.rate_limit);
+    }
+
+    if (batch_size > 1 || gro)
+        return run_batch_mode(client_fd, batch_size, gro);
+    return run_simple_mode(client_fd);
+}
+
+//* Receive and echo one datagram per recvfrom()/sendto() pair
+int run_simple_mode(int client_fd) {
+    struct sockaddr_in client_addr;                //- Define a struct for the client address
+    char* buffer;                                  //- Define a buffer to store the received message
+    ssize_t bytes_received;                        //- Define a variable to store the size of the received message
+    uint64_t spin = (uint64_t)tuning.spin * 1000;  //- Define the busy-polling budget of a receive in nanoseconds
+
+    if ((buffer = malloc(tuning.buffer_size)) == NULL) {
+        perror("error: buffer allocation failed, aborting...");
+        close(client_fd);
+        return EXIT_FAILURE;
+    }
 
     //* while loop to receive and send messages
     while (1) {
         //* Receive messages from the client
-        //- The recvfrom() syscall receives messages from the client.
+        //- The recvfrom() syscall receives messages from the client. busypoll_recvfrom() calls it, after spinning with
+        //- non-blocking calls for the spin budget of the tuning (see common/busypoll.h).
         //- The 1st argument, server_fd, specifies the file descriptor of the server socket.
         //- The 2nd argument, buffer, specifies the buffer to store the received message.
-        //- The 3rd argument, BUFFER_SIZE, specifies the size of the buffer.
+        //- The 3rd argument, tuning.buffer_size, specifies the size of the buffer.
         //- The 4th argument, 0, specifies the flags.
         //- The 5th argument, (struct sockaddr*)&client_addr, specifies the client address.
         //- The 6th argument, &addr_len, specifies the size of the client address.
         //? If the recvfrom() syscall fails, it returns -1.
-        while ((bytes_received = recvfrom(client_fd, buffer, BUFFER_SIZE - 1, 0, (struct sockaddr*)&client_addr, &(socklen_t){sizeof client_addr})) >
-               0) {
-            buffer[bytes_received] = '\0';  //- Add a null terminator to the end of the buffer
-            printf("received message from %s:%d (%4ld byte): %s\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port), bytes_received,
-                   buffer);
+        while ((bytes_received = busypoll_recvfrom(client_fd, buffer, tuning.buffer_size, (struct sockaddr*)&client_addr,
+                                                   &(socklen_t){sizeof client_addr}, spin)) > 0) {
+            uint64_t start = metrics_now();
+
+            if (limit.slots != NULL && !ratelimit_allow(&limit, client_addr.sin_addr.s_addr, start, 1))
+                continue;
+            metrics_add(METRICS_BYTES_RECEIVED, bytes_received);
+            metrics_add(METRICS_MESSAGES, 1);
+            log_info_data(buffer, bytes_received, "received message from %a:%u (%4u byte): %s", client_addr.sin_addr.s_addr,
+                          ntohs(client_addr.sin_port), bytes_received);
 
             //* Send the message back to the client
             //- The sendto() syscall sends the message back to the client.
@@ -96,11 +223,14 @@ int main(void) {
             //- The 6th argument, addr_len, specifies the size of the client address.
             //? If the sendto() syscall fails, it returns -1.
             if (sendto(client_fd, buffer, bytes_received, 0, (struct sockaddr*)&client_addr, sizeof(client_addr)) == -1) {
-                perror("error: message sending failed, aborting...");
+                log_error("error: message sending failed: %e", errno);
+                metrics_add(METRICS_ERRORS, 1);
                 continue;
             }
-            printf("     reply message to %s:%d (%4ld byte): %s\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port), bytes_received,
-                   buffer);
+            metrics_add(METRICS_BYTES_SENT, bytes_received);
+            metrics_record_service(start);
+            log_info_data(buffer, bytes_received, "     reply message to %a:%u (%4u byte): %s", client_addr.sin_addr.s_addr,
+                          ntohs(client_addr.sin_port), bytes_received);
         }
     }
 
@@ -109,6 +239,109 @@ int main(void) {
     return EXIT_SUCCESS;
 }
 
+//* Receive and echo up to batch_size datagrams per recvmmsg()/sendmmsg() pair
+//- All message headers, iovecs, sender addresses and buffers are allocated once before the loop (see common/dgram_batch.c).
+//- Fill statistics are printed every STATS_INTERVAL seconds while traffic flows and once more on exit.
+//- With gro set, every slot is a 64 KB super-buffer and the replies keep the received segment size (UDP_SEGMENT).
+int run_batch_mode(int client_fd, unsigned batch_size, int gro) {
+    struct timespec now;
+    time_t next_report;
+    uint64_t start, bytes, datagrams;
+    int count;
+
+    if (dgram_batch_init(&batch, batch_size, gro ? UDP_GSO_BUFFER_SIZE : tuning.buffer_size) == -1) {
+        perror("error: batch allocation failed, aborting...");
+        close(client_fd);
+        return EXIT_FAILURE;
+    }
+    if (gro && dgram_batch_enable_gro(&batch, client_fd) == -1) {
+        perror("error: UDP_GRO is not available, continuing without segmentation offload");
+        gro = 0;
+    }
+    batch.spin = (uint64_t)tuning.spin * 1000;
+    atexit(report_batch_stats);
+    printf("batch mode: up to %u messages per recvmmsg()/sendmmsg()%s\n", batch_size, gro ? ", UDP GRO/GSO enabled" : "");
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    next_report = now.tv_sec + STATS_INTERVAL;
+
+    while (1) {
+        //* Receive a batch of datagrams
+        //? If the recvmmsg() syscall fails, it returns -1.
+        if ((count = dgram_batch_recv(&batch, client_fd)) == -1) {
+            perror("error: message receiving failed, aborting...");
+            close(client_fd);
+            return EXIT_FAILURE;
+        }
+        start = metrics_now();
+        if (limit.slots != NULL && (count = dgram_batch_filter(&batch, count, within_rate, &start)) == 0)
+            continue;
+        bytes = datagrams = 0;
+        for (int i = 0; i < count; i++) {
+            struct sockaddr_in* addr = batch.msgs[i].msg_hdr.msg_name;
+            bytes += batch.msgs[i].msg_len;
+            datagrams += gro && batch.segment_sizes[i] > 0 ? (batch.msgs[i].msg_len + batch.segment_sizes[i] - 1) / batch.segment_sizes[i] : 1;
+            if (gro && batch.segment_sizes[i] > 0) {
+                log_info("received super-buffer from %a:%u (%4u byte, %u datagrams of %d byte)", addr->sin_addr.s_addr,
+                         ntohs(addr->sin_port), batch.msgs[i].msg_len, (batch.msgs[i].msg_len + batch.segment_sizes[i] - 1) / batch.segment_sizes[i],
+                         batch.segment_sizes[i]);
+                continue;
+            }
+            log_info_data(batch.msgs[i].msg_hdr.msg_iov->iov_base, batch.msgs[i].msg_len, "received message from %a:%u (%4u byte): %s",
+                          addr->sin_addr.s_addr, ntohs(addr->sin_port), batch.msgs[i].msg_len);
+        }
+
+        //* Send every datagram of the batch back to its sender
+        //? If the sendmmsg() syscall fails, it returns -1.
+        metrics_add(METRICS_BYTES_RECEIVED, bytes);
+        metrics_add(METRICS_MESSAGES, datagrams);
+        if (dgram_batch_echo(&batch, client_fd, count) == -1) {
+            log_error("error: message sending failed: %e", errno);
+            metrics_add(METRICS_ERRORS, 1);
+            continue;
+        }
+        metrics_add(METRICS_BYTES_SENT, bytes);
+        metrics_record_service(start);
+
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+        if (now.tv_sec >= next_report) {
+            dgram_batch_report(&batch, stdout);
+            next_report = now.tv_sec + STATS_INTERVAL;
+        }
+    }
+}
+
+//* Take a token for a received datagram, the batch filter of the rate limit
+//- context points to the receive time of the batch, one clock read covers every datagram of it. A GRO super-buffer
+//- takes one token per coalesced datagram, and is dropped whole if the bucket does not hold them all.
+int within_rate(const struct mmsghdr* msg, unsigned datagrams, void* context) {
+    const struct sockaddr_in* addr = msg->msg_hdr.msg_name;
+    return ratelimit_allow(&limit, addr->sin_addr.s_addr, *(const uint64_t*)context, datagrams);
+}
+
+//* Apply a tuning command line option: a profile (-p), a configuration file (-c) or one setting (-o)
+//? Returns -1 after printing the error.
+int parse_tuning(int opt, const char* arg) {
+    if (opt == 'c' && tuning_load(&tuning, arg) == -1) {
+        if (errno != EINVAL)
+            perror("error: reading the configuration file failed, aborting...");
+        return -1;
+    }
+    if (opt == 'p' && tuning_profile(&tuning, arg) == -1) {
+        fprintf(stderr, "error: unknown tuning profile '%s'\n", arg);
+        return -1;
+    }
+    if (opt == 'o' && tuning_option(&tuning, arg) == -1) {
+        fprintf(stderr, "error: invalid tuning option '%s'\n", arg);
+        return -1;
+    }
+    return 0;
+}
+
+void report_batch_stats(void) {
+    dgram_batch_report(&batch, stdout);
+}
+
 void sig_handler(int sig) {
     switch (sig) {
         case SIGABRT:
@@ -121,4 +354,14 @@ void sig_handler(int sig) {
         default:
             break;
     }
+}
+
+void usage(const char* prog) {
+    printf("usage: %s [-b batch] [-g] [-p profile] [-c file] [-o key=value]\n", prog);
+    printf("  -b, --batch N       receive up to N datagrams per recvmmsg() and reply with one sendmmsg() (default: 1, no batching)\n");
+    printf("  -g, --gro           receive coalesced UDP GRO super-buffers and echo them back as one UDP GSO send\n");
+    printf("  -p, --profile NAME  socket tuning profile: default, latency, throughput or many-connections\n");
+    printf("  -c, --config FILE   read tuning settings from FILE, one \"key = value\" per line\n");
+    printf("  -o, --option K=V    change one tuning setting: ip, port, rcvbuf, sndbuf, busy_poll, prefer_busy_poll, spin,\n");
+    printf("                      buffer_size, rate_limit or rate_burst (the TCP settings and the backlog are accepted and ignored)\n");
 }
\ No newline at end of file